@@ -11,7 +11,7 @@ echo - Build started...
 REM Setup the compiler and linker flags
 
 set CompilerFlags=/nologo /std:c++latest /permissive- /Zc:inline /Zc:threadSafeInit- /Zc:forScope /Zc:__cplusplus /O1 /Oi /GR- /GS- /Gs9999999 /EHa- /MD /W4 /WX /Zl /arch:SSE2 /I"include/" /D"WIN32" /D"_HAS_EXCEPTIONS=0"
-set LinkerFlags=/nologo /nodefaultlib /entry:_main /machine:x86 /stack:0x100000,0x100000 /largeaddressaware /incremental:no /opt:ref /opt:icf /manifest:no /dynamicbase:no /fixed /safeseh:no
+set LinkerFlags=/nologo /nodefaultlib /machine:x86 /stack:0x100000,0x100000 /largeaddressaware /incremental:no /opt:ref /opt:icf /manifest:no /dynamicbase:no /fixed /safeseh:no
 
 REM Setup temporary directory and output directory if needed
 
@@ -39,17 +39,31 @@ cl.exe %CompilerFlags% /D"_DEBUG" /Zi /Fo"tmp/obj/game_d.obj" /Fd"tmp/obj/game_d
 
 if %errorlevel% neq 0 exit /b %errorlevel%
 
+REM Compile the benchmarks
+
+echo - Compiling the benchmarks
+
+cl.exe %CompilerFlags% /D"NDEBUG" /D"G21_BENCHMARK=1" /Fo"tmp/obj/benchmark.obj" /c src/main.cpp
+
+if %errorlevel% neq 0 exit /b %errorlevel%
+
 REM Link the game
 
 echo - Linking the game (Release)
 
-link.exe %LinkerFlags% /subsystem:windows /out:tmp/exe/game.exe tmp/obj/game.obj kernel32.lib user32.lib gdi32.lib opengl32.lib 1>nul
+link.exe %LinkerFlags% /entry:_main /subsystem:windows /out:tmp/exe/game.exe tmp/obj/game.obj kernel32.lib user32.lib gdi32.lib opengl32.lib 1>nul
 
 if %errorlevel% neq 0 exit /b %errorlevel%
 
 echo - Linking the game (Debug)
 
-link.exe /debug:full %LinkerFlags% /subsystem:console /out:tmp/exe/game_d.exe /pdb:tmp/exe/game_d.pdb tmp/obj/game_d.obj kernel32.lib user32.lib gdi32.lib opengl32.lib 1>nul
+link.exe /debug:full %LinkerFlags% /entry:_main /subsystem:console /out:tmp/exe/game_d.exe /pdb:tmp/exe/game_d.pdb tmp/obj/game_d.obj kernel32.lib user32.lib gdi32.lib opengl32.lib 1>nul
+
+if %errorlevel% neq 0 exit /b %errorlevel%
+
+echo - Linking the benchmarks
+
+link.exe %LinkerFlags% /entry:_benchmark_main /subsystem:console /out:tmp/exe/benchmark.exe tmp/obj/benchmark.obj kernel32.lib user32.lib gdi32.lib opengl32.lib 1>nul
 
 if %errorlevel% neq 0 exit /b %errorlevel%
 
@@ -58,5 +72,6 @@ REM Move executable to the out directory
 move /Y "tmp\exe\game.exe" "out\game.exe" >nul
 move /Y "tmp\exe\game_d.exe" "out\game_d.exe" >nul
 move /Y "tmp\exe\game_d.pdb" "out\game_d.pdb" >nul
+move /Y "tmp\exe\benchmark.exe" "out\benchmark.exe" >nul
 
 echo - Done -^> %~dp0out\game.exe
@@ -66,6 +66,34 @@
 #define G21_STRINGIFY_IMPL(x) #x
 #define G21_STRINGIFY(x) G21_STRINGIFY_IMPL(x)
 
+#define G21_CONCAT_IMPL(a, b) a##b
+#define G21_CONCAT(a, b) G21_CONCAT_IMPL(a, b)
+
+// The particle system is still a work in progress, so it is compiled out unless explicitly requested.
+#if !defined(G21_ENABLE_PARTICLES)
+    #define G21_ENABLE_PARTICLES 0
+#endif
+
+// Times every render pass on the GPU and writes the statistics to gpu_profile.csv on exit.
+#if !defined(G21_ENABLE_GPU_PROFILER)
+    #define G21_ENABLE_GPU_PROFILER 0
+#endif
+
+// Records the CPU time spent in trace zones and writes them to trace.json on exit. Works in release builds too.
+#if !defined(G21_ENABLE_TRACE)
+    #define G21_ENABLE_TRACE 0
+#endif
+
+// Builds a console program that times the precompute and per-tick functions instead of running the game.
+#if !defined(G21_BENCHMARK)
+    #define G21_BENCHMARK 0
+#endif
+
+// Drives the player through a rollback session over a loopback socket, to test the rollback with network latency.
+#if !defined(G21_ENABLE_ROLLBACK)
+    #define G21_ENABLE_ROLLBACK 0
+#endif
+
 //────────────────────────────────────────────────────────────────────────────────────────────────────────────────────┐
 // Including required headers.                                                                                        │
 //────────────────────────────────────────────────────────────────────────────────────────────────────────────────────┘
@@ -80,6 +108,10 @@
 #define NOMINMAX
 #include <Windows.h>
 
+#if G21_ENABLE_ROLLBACK
+#include <winsock2.h>
+#endif
+
 #include <intrin.h>
 
 #include <gl/gl.h>
@@ -136,6 +168,20 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
             WriteConsoleA(_g21_debug_out, str, DWORD{ N - 1 }, nullptr, nullptr);
         }
 
+        void _g21_debug_print_impl(u32 value)
+        {
+            // Write the digits backwards into a small buffer, since we have no printf.
+            char buffer[10];
+            char* p{ buffer + sizeof(buffer) };
+            do
+            {
+                *(--p) = static_cast<char>('0' + (value % 10));
+                value /= 10;
+            } while (value != 0);
+
+            WriteConsoleA(_g21_debug_out, p, static_cast<DWORD>((buffer + sizeof(buffer)) - p), nullptr, nullptr);
+        }
+
         #define G21_DEBUG_INIT do { _g21_debug_out = GetStdHandle(STD_OUTPUT_HANDLE);  } while(0)
         #define G21_DEBUG_PRINT _g21_debug_print_impl 
     #else
@@ -143,6 +189,16 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
         #define G21_DEBUG_PRINT __noop
     #endif
 
+    // Reports a failed self-check on the standard output and exits with an error, for the checks of the benchmark
+    // builds and the checks debug builds run against the GPU.
+    template<usize N>
+    __declspec(noreturn) void fail_self_check(char const(&message)[N])
+    {
+        DWORD written;
+        WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), message, DWORD{ N - 1 }, &written, nullptr);
+        ExitProcess(1);
+    }
+
     // Setup some helper functions.
 
     // In a native 64-bit build, we just get a multiply by 60. Easy.
@@ -178,6 +234,27 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
     }
     #endif
 
+    // Converts a short span of performance counter ticks into microseconds. Like above, the 64-bit multiplication and
+    // division would pull in the CRT in a 32-bit build, so we use the intrinsics that map directly to 'mul' and 'div'.
+    // The result must fit in 32 bits, which is a little over an hour.
+    u32 ticks_to_microseconds(u32 ticks, u32 frequency)
+    {
+        u32 remainder;
+        return _udiv64(__emulu(ticks, 1'000'000Ui32), frequency, &remainder);
+    }
+
+#if G21_BENCHMARK
+    // Same as above in nanoseconds, where only a little over 4 seconds fits. Longer spans saturate instead of letting
+    // 'div' fault on the overflow.
+    u32 ticks_to_nanoseconds(u32 ticks, u32 frequency)
+    {
+        if ((ticks / frequency) >= 4) return 0xFFFFFFFFUi32;
+
+        u32 remainder;
+        return _udiv64(__emulu(ticks, 1'000'000'000Ui32), frequency, &remainder);
+    }
+#endif
+
     template<typename T, usize N>
     consteval usize countof(T const(&)[N])
     {
@@ -190,6 +267,12 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
         return (a > b) ? a : b;
     }
 
+    template<typename T>
+    constexpr T min(T a, T b)
+    {
+        return (a < b) ? a : b;
+    }
+
     template<u32 X, u32 Multiple>
     struct round_up
     {
@@ -201,6 +284,210 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
     template<u32 X, u32 Multiple>
     constexpr u32 round_up_v{ round_up<X, Multiple>::value };
 
+    // Helpers for writing out text reports, since we have no printf.
+
+    char* append_text(char* p, char const* str)
+    {
+        for (; *str != '\0'; ++str) *(p++) = *str;
+        return p;
+    }
+
+    char* append_u32(char* p, u32 value)
+    {
+        // Write the digits backwards into a small buffer first.
+        char buffer[10];
+        char* q{ buffer + sizeof(buffer) };
+        do
+        {
+            *(--q) = static_cast<char>('0' + (value % 10));
+            value /= 10;
+        } while (value != 0);
+
+        for (; q != (buffer + sizeof(buffer)); ++q) *(p++) = *q;
+        return p;
+    }
+
+    enum class report_mode : u8
+    {
+        replace, // Start the file over.
+        append   // Add to the end of the file, creating it if needed.
+    };
+
+    // Writes the text between begin and end to the named file in the working directory. Reports are best-effort, so
+    // failures are ignored.
+    void write_report_file(char const* name, char const* begin, char const* end, report_mode mode = report_mode::replace)
+    {
+        HANDLE const file{ (mode == report_mode::append)
+            ? CreateFileA(name, FILE_APPEND_DATA, 0, nullptr, OPEN_ALWAYS,   FILE_ATTRIBUTE_NORMAL, nullptr)
+            : CreateFileA(name, GENERIC_WRITE,    0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr) };
+        if (file == INVALID_HANDLE_VALUE) return;
+
+        DWORD written;
+        WriteFile(file, begin, static_cast<DWORD>(end - begin), &written, nullptr);
+        CloseHandle(file);
+    }
+
+#if G21_ENABLE_TRACE
+    // Setup the trace recorder.
+    // A trace zone records the TSC when it is entered and left into a fixed ring owned by the current thread, which is
+    // found through a TLS slot. Nothing is allocated or formatted while recording, so a zone costs two rdtsc and a
+    // store. The rings are turned into Chrome trace JSON, which Perfetto reads as well, on exit, so only the latest
+    // k_trace_event_count zones of every thread are kept.
+
+    constexpr u32 k_trace_max_thread_count{ 16 };
+    constexpr u32 k_trace_event_count     { 1U << 14 };
+    static_assert((k_trace_event_count & (k_trace_event_count - 1)) == 0);
+
+    struct trace_event
+    {
+        char const* name;
+        u64         begin;
+        u64         end;
+    };
+
+    struct trace_thread
+    {
+        trace_event events[k_trace_event_count];
+        u32         event_count; // Every event ever recorded, the ring holds the latest ones.
+        char const* name;
+    };
+
+    trace_thread   g_trace_threads[k_trace_max_thread_count];
+    volatile long  g_trace_thread_count;
+    constinit DWORD g_trace_tls_index{ TLS_OUT_OF_INDEXES };
+    u64            g_trace_tsc_origin;
+    u32            g_trace_tsc_per_us;
+
+    // Threads that never register are not traced.
+    void register_trace_thread(char const* name)
+    {
+        long const index{ InterlockedIncrement(&g_trace_thread_count) - 1 };
+        if (index >= static_cast<long>(k_trace_max_thread_count)) return;
+
+        g_trace_threads[index].name = name;
+        TlsSetValue(g_trace_tls_index, &g_trace_threads[index]);
+    }
+
+    void init_trace()
+    {
+        g_trace_tls_index = TlsAlloc();
+        register_trace_thread("main");
+
+        // Measure the TSC frequency against the performance counter over a few milliseconds.
+        LARGE_INTEGER frequency, start, now;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&start);
+        u64 const tsc_start{ __rdtsc() };
+
+        u32 const ticks{ static_cast<u32>(frequency.QuadPart) / 200 };
+        do
+        {
+            QueryPerformanceCounter(&now);
+        } while (static_cast<u32>(now.QuadPart - start.QuadPart) < ticks);
+
+        u32 const elapsed{ ticks_to_microseconds(static_cast<u32>(now.QuadPart - start.QuadPart), static_cast<u32>(frequency.QuadPart)) };
+
+        g_trace_tsc_per_us = max(1U, static_cast<u32>(__rdtsc() - tsc_start) / elapsed);
+        g_trace_tsc_origin = tsc_start;
+    }
+
+    struct trace_zone
+    {
+        char const* name;
+        u64         begin;
+
+        __forceinline explicit trace_zone(char const* zone_name)
+            : name{ zone_name }, begin{ __rdtsc() }
+        {}
+
+        __forceinline ~trace_zone()
+        {
+            u64 const end{ __rdtsc() };
+
+            auto* const thread{ static_cast<trace_thread*>(TlsGetValue(g_trace_tls_index)) };
+            if (thread == nullptr) return;
+
+            thread->events[(thread->event_count++) & (k_trace_event_count - 1)] = trace_event{ name, begin, end };
+        }
+
+        trace_zone(trace_zone const&) = delete;
+        trace_zone& operator = (trace_zone const&) = delete;
+    };
+
+    // Writes a span of TSC ticks as microseconds with three decimals. Spans past an hour or so are clamped, which keeps
+    // the division within 32 bits.
+    char* append_trace_time(char* p, u64 ticks)
+    {
+        u64 const limit{ __emulu(g_trace_tsc_per_us, 0xFFFFFFFFUi32) };
+        if (ticks >= limit) ticks = limit - 1;
+
+        u32 remainder;
+        u32 const us  { _udiv64(ticks, g_trace_tsc_per_us, &remainder) };
+        u32 const frac{ (remainder * 1000) / g_trace_tsc_per_us };
+
+        p = append_u32(p, us);
+        *(p++) = '.';
+        *(p++) = static_cast<char>('0' + (frac / 100));
+        *(p++) = static_cast<char>('0' + ((frac / 10) % 10));
+        *(p++) = static_cast<char>('0' + (frac % 10));
+        return p;
+    }
+
+    void write_trace()
+    {
+        // The output is written in pieces, flushing whenever there might not be room for another event. The first
+        // piece starts the file over, and the rest are added to it.
+        static char buffer[1 << 16];
+        char* p{ append_text(buffer, "{\"traceEvents\":[\n") };
+
+        report_mode mode{ report_mode::replace };
+        u32 const thread_count{ min(static_cast<u32>(g_trace_thread_count), k_trace_max_thread_count) };
+        for (u32 t{ 0 }; t < thread_count; ++t)
+        {
+            trace_thread const& thread{ g_trace_threads[t] };
+
+            p = append_text(p, (t == 0) ? "" : ",\n");
+            p = append_text(p, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":");
+            p = append_u32 (p, t);
+            p = append_text(p, ",\"args\":{\"name\":\"");
+            p = append_text(p, thread.name);
+            p = append_text(p, "\"}}");
+
+            u32 const count{ thread.event_count };
+            for (u32 i{ count - min(count, k_trace_event_count) }; i != count; ++i)
+            {
+                trace_event const& event{ thread.events[i & (k_trace_event_count - 1)] };
+
+                if ((p - buffer) > static_cast<isize>(sizeof(buffer) - 256))
+                {
+                    write_report_file("trace.json", buffer, p, mode);
+                    mode = report_mode::append;
+                    p    = buffer;
+                }
+
+                p = append_text      (p, ",\n{\"name\":\"");
+                p = append_text      (p, event.name);
+                p = append_text      (p, "\",\"ph\":\"X\",\"pid\":1,\"tid\":");
+                p = append_u32       (p, t);
+                p = append_text      (p, ",\"ts\":");
+                p = append_trace_time(p, event.begin - g_trace_tsc_origin);
+                p = append_text      (p, ",\"dur\":");
+                p = append_trace_time(p, event.end - event.begin);
+                *(p++) = '}';
+            }
+        }
+
+        p = append_text(p, "\n]}\n");
+        write_report_file("trace.json", buffer, p, mode);
+    }
+
+    #define G21_TRACE_THREAD(name) register_trace_thread(name)
+    #define G21_TRACE_ZONE(name)   trace_zone const G21_CONCAT(_trace_zone_, __LINE__){ name }
+#else
+    #define G21_TRACE_THREAD(name) ((void)0)
+    #define G21_TRACE_ZONE(name)   ((void)0)
+#endif
+
     // Setup our templated vector types.
 
     template<typename T>
@@ -239,6 +526,30 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
         {
             return vec2{ -value.x, -value.y };
         }
+
+        template<typename S>
+        friend constexpr vec2 operator * (vec2 lhs, S rhs)
+        {
+            return vec2{ lhs.x * rhs, lhs.y * rhs };
+        }
+
+        template<typename S>
+        friend constexpr vec2 operator / (vec2 lhs, S rhs)
+        {
+            return vec2{ lhs.x / rhs, lhs.y / rhs };
+        }
+
+        constexpr vec2& operator += (vec2 rhs)
+        {
+            this->x += rhs.x;
+            this->y += rhs.y;
+            return *this;
+        }
+
+        friend constexpr T dot(vec2 lhs, vec2 rhs)
+        {
+            return (lhs.x * rhs.x) + (lhs.y * rhs.y);
+        }
     };
     static_assert(__is_trivially_constructible(vec2<u8>));
 
@@ -260,6 +571,33 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
         explicit constexpr vec3(T x, T y, T z)
             : x{ x }, y{ y }, z{ z }
         {}
+
+        friend constexpr vec3 operator + (vec3 lhs, vec3 rhs)
+        {
+            return vec3{ lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z };
+        }
+
+        friend constexpr vec3 operator - (vec3 lhs, vec3 rhs)
+        {
+            return vec3{ lhs.x - rhs.x, lhs.y - rhs.y, lhs.z - rhs.z };
+        }
+
+        template<typename S>
+        friend constexpr vec3 operator * (vec3 lhs, S rhs)
+        {
+            return vec3{ lhs.x * rhs, lhs.y * rhs, lhs.z * rhs };
+        }
+
+        template<typename S>
+        friend constexpr vec3 operator / (vec3 lhs, S rhs)
+        {
+            return vec3{ lhs.x / rhs, lhs.y / rhs, lhs.z / rhs };
+        }
+
+        friend constexpr T dot(vec3 lhs, vec3 rhs)
+        {
+            return (lhs.x * rhs.x) + (lhs.y * rhs.y) + (lhs.z * rhs.z);
+        }
     };
     static_assert(__is_trivially_constructible(vec3<u8>));
 
@@ -333,6 +671,16 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
     // This is fairly simple implementation which only implements the operations that are used in the game. It uses 1
     // bit for the sign, 15 bits for the integral part and 16 bits for the fractional part, and can trivially be copied
     // to the GPU.
+    // Products and quotients of two fixed-point values go through a 64-bit intermediate with the intrinsics that map
+    // directly to 'imul' and 'idiv', since the plain 64-bit operators would pull in the CRT in a 32-bit build. Like
+    // the other operators they wrap around on overflow, except the division which faults like 'idiv' does.
+
+    enum class fixed_rounding : u8
+    {
+        floor,   // Towards negative infinity, the cheapest for multiplication.
+        nearest, // Ties away from zero.
+        zero     // Towards zero, the cheapest for division.
+    };
 
     class fixed16_16
     {
@@ -355,6 +703,22 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
             : _value{ static_cast<i32>(static_cast<u32>(static_cast<i32>(integer_value)) << shift) }
         {}
 
+        static constexpr fixed16_16 from_raw(i32 value)
+        {
+            fixed16_16 result;
+            result._value = value;
+            return result;
+        }
+
+        // Rounds 'numerator / denominator' to the nearest value, for constants that are not a whole number.
+        static consteval fixed16_16 from_ratio(i32 numerator, i32 denominator)
+        {
+            i64 const scaled{ static_cast<i64>(numerator) * (1i64 << shift) };
+            i64 const half  { ((scaled < 0) != (denominator < 0)) ? -(denominator / 2) : (denominator / 2) };
+
+            return from_raw(static_cast<i32>((scaled + half) / denominator));
+        }
+
         constexpr i32& raw()&
         {
             return _value;
@@ -468,113 +832,375 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
             return result;
         }
 
+        template<fixed_rounding Rounding = fixed_rounding::floor>
+        friend fixed16_16 mul(fixed16_16 lhs, fixed16_16 rhs)
+        {
+            i64 product{ __emul(lhs._value, rhs._value) };
+
+            if constexpr (Rounding == fixed_rounding::nearest)
+            {
+                product += (product < 0) ? ((1i64 << (shift - 1)) - 1) : (1i64 << (shift - 1));
+            }
+            else if constexpr (Rounding == fixed_rounding::zero)
+            {
+                if (product < 0) product += (1i64 << shift) - 1;
+            }
+
+            fixed16_16 result;
+            result._value = static_cast<i32>(__ll_rshift(product, shift));
+            return result;
+        }
+
+        template<fixed_rounding Rounding = fixed_rounding::zero>
+        friend fixed16_16 div(fixed16_16 lhs, fixed16_16 rhs)
+        {
+            // The quotient must fit in 32 bits, that is |lhs / rhs| must be below 32768.
+            i32 remainder;
+            i32 quotient{ _div64(__ll_lshift(lhs._value, shift), rhs._value, &remainder) };
+
+            if constexpr (Rounding == fixed_rounding::floor)
+            {
+                if ((remainder != 0) && ((remainder ^ rhs._value) < 0)) --quotient;
+            }
+            else if constexpr (Rounding == fixed_rounding::nearest)
+            {
+                // Compare twice the remainder against the divisor, both as magnitudes.
+                u32 const r{ (remainder   < 0) ? (0Ui32 - static_cast<u32>(remainder))   : static_cast<u32>(remainder) };
+                u32 const d{ (rhs._value < 0) ? (0Ui32 - static_cast<u32>(rhs._value)) : static_cast<u32>(rhs._value) };
+                if (r >= (d - r))
+                {
+                    quotient += ((lhs._value ^ rhs._value) < 0) ? -1 : 1;
+                }
+            }
+
+            fixed16_16 result;
+            result._value = quotient;
+            return result;
+        }
+
+        friend fixed16_16 operator * (fixed16_16 lhs, fixed16_16 rhs)
+        {
+            return mul(lhs, rhs);
+        }
+
+        friend fixed16_16 operator / (fixed16_16 lhs, fixed16_16 rhs)
+        {
+            return div(lhs, rhs);
+        }
+
+        friend fixed16_16 lerp(fixed16_16 a, fixed16_16 b, fixed16_16 t)
+        {
+            return a + mul<fixed_rounding::nearest>(b - a, t);
+        }
+
         friend constexpr bool operator > (fixed16_16 lhs, fixed16_16 rhs)
         {
             return (lhs._value > rhs._value);
         }
 
+        friend constexpr bool operator < (fixed16_16 lhs, fixed16_16 rhs)
+        {
+            return (lhs._value < rhs._value);
+        }
+
+        friend constexpr bool operator == (fixed16_16 lhs, fixed16_16 rhs)
+        {
+            return (lhs._value == rhs._value);
+        }
+
         friend constexpr bool operator != (fixed16_16 lhs, fixed16_16 rhs)
         {
             return (lhs._value != rhs._value);
         }
 
+        // The square root, rounded down. Being exact, it also matches floor(sqrt()) of whole numbers on the GPU.
         static fixed16_16 sqrt(u16 value)
         {
-            // This is a fairly classic software implementation of the square root using the Newton-Raphson method,
-            // modified for fixed-point rather than floating-point numbers.
-
-            // Rather than using 1 or (value / 2) as our initial guess for the algorithm, we instead first compute the
-            // square root of two raised to the power of the integer binary logarithm of the input value. This gets us
-            // very close to the square root of the input value, allowing the Newton-Raphson method to converge far
-            // quicker. The beauty here is that this calculation simplifies into just computing two raised to the power
-            // of half of the integer binary logarithm of the input value. The integer binary logarithm of the input
-            // value is trivial to compute, as we only need to find the position of the most significant bit in the
-            // binary representation of the number. Additionally, computing two raised to an integer power is as simple
-            // as performing a logical left shift, eg two raised to the power of X is just 1 << X.
-            // The formula looks something like this:
-            //     initial guess = sqrt(pow(2, floor(log₂(value)))
-            //                   = pow(2, floor(log₂(value)) / 2)
-            //                   = 1 << (floor(log₂(value)) / 2)
-            // For the division by 2 we round to the nearest integer by adding 1 before dividing.
-            //
-            // Because we do not care too much about precision, we only use two iterations of Newton-Raphson.
-
-            // Early exit if the input value is 0
-            if (value == 0) return fixed16_16{ 0 };
-
-            // Calculate the integer logarithm of the input value by emitting the 'bsr' instruction. We could also use
-            // the 'lzcnt' instruction, which is faster, however the size of the resulting assembly code is marginally
-            // larger. Micro-optimizing the wrong things is what I love.
-            u32 msb; (void)_BitScanReverse(reinterpret_cast<DWORD*>(&msb), value);
-
-            // Calculate the initial guess
-            u32 x{ (1Ui32 << ((msb + 1Ui32) >> 1)) << shift };
-
-            // Perform two iterations of Newton-Raphson
-            u32 const y{ static_cast<u32>(value) << shift };
-            x = (x + (y / (x >> shift))) >> 1;
-            x = (x + (y / (x >> shift))) >> 1;
-
-            // Return the final result
+            // The root of a 16.16 value is the integer root of the raw value shifted up by another 16 bits.
             fixed16_16 result;
-            result._value = x;
+            result._value = static_cast<i32>(isqrt(static_cast<u64>(value) << (2 * shift)));
             return result;
         }
+
+        // The square root of a fixed-point value, rounded down, and zero for negative values.
+        friend fixed16_16 sqrt(fixed16_16 x)
+        {
+            if (x._value <= 0) return from_raw(0);
+
+            return from_raw(static_cast<i32>(isqrt(static_cast<u64>(x._value) << shift)));
+        }
+
+        // The reciprocal of the square root, rounded down. Saturates for zero and negative values.
+        friend fixed16_16 rsqrt(fixed16_16 x)
+        {
+            if (x._value <= 0) return from_raw(0x7FFFFFFF);
+
+            // The raw result is the integer root of 2⁴⁸ divided by the raw value, which is at most 2²⁴. The root of the
+            // rounded down quotient rounds down to the same integer as the root of the exact one. The quotient needs
+            // up to 48 bits, so it takes two 'div's of 32 bits each.
+            u32 const divisor{ static_cast<u32>(x._value) };
+
+            u32 remainder;
+            u32 const high{ _udiv64(1Ui64 << shift, divisor, &remainder) };
+            u32 const low { _udiv64(static_cast<u64>(remainder) << 32, divisor, &remainder) };
+
+            return from_raw(static_cast<i32>(isqrt((static_cast<u64>(high) << 32) | low)));
+        }
+
+    private:
+        static u32 isqrt(u64 value)
+        {
+            // This is a fairly classic software implementation of the square root using the Newton-Raphson method.
+            // Rather than using 1 or (value / 2) as our initial guess, we start from two raised to the power of half of
+            // the integer binary logarithm of the input value, which is just a shift by half the position of the most
+            // significant bit. We round that half up, so the guess is never below the root. Newton-Raphson then falls
+            // monotonically towards the root, and we stop as soon as it stops falling, which gives the exact integer
+            // root in a handful of iterations. The guess being at least the root also keeps every quotient within 32
+            // bits, as '_udiv64' requires.
+            u32 const high{ static_cast<u32>(value >> 32) };
+            u32 const low { static_cast<u32>(value) };
+
+            u32 msb;
+            if      (high != 0) { (void)_BitScanReverse(reinterpret_cast<DWORD*>(&msb), high); msb += 32; }
+            else if (low  != 0) { (void)_BitScanReverse(reinterpret_cast<DWORD*>(&msb), low); }
+            else return 0;
+
+            u32 x{ 1Ui32 << ((msb + 2Ui32) >> 1) };
+            for (;;)
+            {
+                u32 remainder;
+                u32 const y{ (x + _udiv64(value, x, &remainder)) >> 1 };
+                if (y >= x) return x;
+                x = y;
+            }
+        }
     };
     static_assert(__is_trivially_constructible(fixed16_16));
 
-    // Setup our sprite vertex type.
-    // This type wraps the data we send to the GPU during sprite rendering.
+#if G21_BENCHMARK
+    // Setup the batch operations over arrays of fixed-point vectors.
+    // Each operation has a scalar version, which is the reference, an SSE2 version, which is what every CPU we run on
+    // has, and an AVX2 version. The components are independent, so an array of vectors is treated as a flat array of
+    // values. SSE2 only has an unsigned 32-bit multiply, so the signed product is recovered by subtracting the other
+    // operand wherever one is negative, which only affects the upper half of the 64-bit product. All versions round
+    // down like 'mul' and give the same results. The game has a single player and no arrays of vectors to run them
+    // over, so they are only built into the benchmarks, which check and measure them. init_fixed_math finds out
+    // whether the AVX2 versions can be used.
 
-    struct sprite_vertex
+    using vec2_scale_fn      = void(*)(vec2<fixed16_16>* values, u32 count, fixed16_16 scale);
+    using vec2_add_scaled_fn = void(*)(vec2<fixed16_16>* values, vec2<fixed16_16> const* deltas, u32 count, fixed16_16 scale);
+
+    void scale_vec2_array_scalar(vec2<fixed16_16>* values, u32 count, fixed16_16 scale)
     {
-        vec2<fixed16_16> pos;
-        u32 sprite_texture_index;
-        u32 : 1; // Padding.
-    };
+        for (u32 i{ 0 }; i < count; ++i) values[i] = values[i] * scale;
+    }
 
-    // Setup various configurable constants
+    void add_scaled_vec2_array_scalar(vec2<fixed16_16>* values, vec2<fixed16_16> const* deltas, u32 count, fixed16_16 scale)
+    {
+        for (u32 i{ 0 }; i < count; ++i) values[i] += deltas[i] * scale;
+    }
 
-    // The size in pixels of sprites. This metric is a bit weird since we render first to an internal buffer with a
-    // fixed resolution and then we upscale that to the target display. So this does not represent the number of pixels
-    // occupied on the target display. This value is mostly determined by how detailed the player's sprite is.
-    constexpr u32 k_sprite_size{ 32 };
+    __forceinline __m128i mul_fixed_sse2(__m128i a, __m128i scale)
+    {
+        // The scale is the same in every lane, so the odd lanes only need 'a' shifted down.
+        __m128i const even{ _mm_mul_epu32(a, scale) };
+        __m128i const odd { _mm_mul_epu32(_mm_srli_epi64(a, 32), scale) };
+
+        // Take bits 16-47 of each product back into their lane.
+        __m128i const low_mask{ _mm_set_epi32(0, -1, 0, -1) };
+        __m128i const product {
+            _mm_or_si128(_mm_and_si128(_mm_srli_epi64(even, 16), low_mask), _mm_andnot_si128(low_mask, _mm_slli_epi64(odd, 16)))
+        };
 
-    // The per-frame acceleration due to gravity.
-    constexpr fixed16_16 k_gravity{ fixed16_16{ 1020 } / (60*60) };
+        // Go from the unsigned to the signed product.
+        __m128i const correction{
+            _mm_add_epi32(_mm_and_si128(_mm_srai_epi32(a, 31), scale), _mm_and_si128(_mm_srai_epi32(scale, 31), a))
+        };
+        return _mm_sub_epi32(product, _mm_slli_epi32(correction, 16));
+    }
 
-    // The maximum number of particles that may be active during a frame.
-    constexpr u32 k_max_particle_count{ 1'000'000 };
+    __forceinline __m256i mul_fixed_avx2(__m256i a, __m256i scale)
+    {
+        // AVX2 has a signed multiply, so we only need to take bits 16-47 of each product back into their lane.
+        __m256i const even{ _mm256_mul_epi32(a, scale) };
+        __m256i const odd { _mm256_mul_epi32(_mm256_srli_epi64(a, 32), scale) };
 
-    constexpr u32 k_sprites_vertices_per_quad{ 4 };
-    constexpr u32 k_sprites_max_quad_count   { 128 }; // Maximum number of quads (sprites) drawn during a frame.
-    constexpr u32 k_sprites_max_vertex_count { k_sprites_max_quad_count * k_sprites_vertices_per_quad };
-    constexpr u32 k_sprites_indices_per_quad { 6 };
-    constexpr u32 k_sprites_max_index_count  { k_sprites_max_quad_count * k_sprites_indices_per_quad };
+        return _mm256_blend_epi32(_mm256_srli_epi64(even, 16), _mm256_slli_epi64(odd, 16), 0b10101010);
+    }
 
-    constexpr vec4<u8> k_sprite_palette[16]
+    void scale_vec2_array_sse2(vec2<fixed16_16>* values, u32 count, fixed16_16 scale)
     {
-    /*0*/ vec4<u8>{   0,   0,   0,   0 }, // Transparent.
-    /*1*/ vec4<u8>{   0,   0,   0, 255 }, // Solid black.
-    /*2*/ vec4<u8>{ 230, 209, 188, 255 }, // Skin.
-    /*3*/ vec4<u8>{ 228, 218, 153, 255 }, // Blonde hair.
-    /*4*/ vec4<u8>{ 217, 200, 104, 255 }, // Blonde hair accent.
-    /*5*/ vec4<u8>{ 208,  70,  72, 255 }, // Red coat.
-    /*6*/ vec4<u8>{ 170,  51,  51, 255 }, // Red coat accent.
-    /*7*/ vec4<u8>{  50, 101,  36, 255 }, // Green eyes.
-    /*8*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
-    /*9*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
-    /*A*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
-    /*B*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
-    /*C*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
-    /*D*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
-    /*E*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
-    /*F*/ vec4<u8>{   0,   0,   0,   0 }  // Unused.
-    };
+        __m128i const s{ _mm_set1_epi32(scale.raw()) };
 
-    constexpr u8 k_player_sprite[4][16][8]
+        u32 i{ 0 };
+        for (; (i + 2) <= count; i += 2)
+        {
+            __m128i* const p{ reinterpret_cast<__m128i*>(values + i) };
+            _mm_storeu_si128(p, mul_fixed_sse2(_mm_loadu_si128(p), s));
+        }
+        scale_vec2_array_scalar(values + i, count - i, scale);
+    }
+
+    void add_scaled_vec2_array_sse2(vec2<fixed16_16>* values, vec2<fixed16_16> const* deltas, u32 count, fixed16_16 scale)
     {
+        __m128i const s{ _mm_set1_epi32(scale.raw()) };
+
+        u32 i{ 0 };
+        for (; (i + 2) <= count; i += 2)
         {
+            __m128i* const p{ reinterpret_cast<__m128i*>(values + i) };
+            __m128i  const d{ _mm_loadu_si128(reinterpret_cast<__m128i const*>(deltas + i)) };
+            _mm_storeu_si128(p, _mm_add_epi32(_mm_loadu_si128(p), mul_fixed_sse2(d, s)));
+        }
+        add_scaled_vec2_array_scalar(values + i, deltas + i, count - i, scale);
+    }
+
+    void scale_vec2_array_avx2(vec2<fixed16_16>* values, u32 count, fixed16_16 scale)
+    {
+        __m256i const s{ _mm256_set1_epi32(scale.raw()) };
+
+        u32 i{ 0 };
+        for (; (i + 4) <= count; i += 4)
+        {
+            __m256i* const p{ reinterpret_cast<__m256i*>(values + i) };
+            _mm256_storeu_si256(p, mul_fixed_avx2(_mm256_loadu_si256(p), s));
+        }
+        _mm256_zeroupper();
+        scale_vec2_array_scalar(values + i, count - i, scale);
+    }
+
+    void add_scaled_vec2_array_avx2(vec2<fixed16_16>* values, vec2<fixed16_16> const* deltas, u32 count, fixed16_16 scale)
+    {
+        __m256i const s{ _mm256_set1_epi32(scale.raw()) };
+
+        u32 i{ 0 };
+        for (; (i + 4) <= count; i += 4)
+        {
+            __m256i* const p{ reinterpret_cast<__m256i*>(values + i) };
+            __m256i  const d{ _mm256_loadu_si256(reinterpret_cast<__m256i const*>(deltas + i)) };
+            _mm256_storeu_si256(p, _mm256_add_epi32(_mm256_loadu_si256(p), mul_fixed_avx2(d, s)));
+        }
+        _mm256_zeroupper();
+        add_scaled_vec2_array_scalar(values + i, deltas + i, count - i, scale);
+    }
+#endif
+
+    constinit bool g_cpu_has_avx2{ false };
+
+    void init_fixed_math()
+    {
+        // AVX2 needs both the CPU and the OS, which has to save the upper halves of the registers.
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) return;
+
+        __cpuid(info, 1);
+        constexpr int k_osxsave_and_avx{ (1 << 27) | (1 << 28) };
+        if ((info[2] & k_osxsave_and_avx) != k_osxsave_and_avx) return;
+        if ((_xgetbv(0) & 0x6) != 0x6) return;
+
+        __cpuidex(info, 7, 0);
+        if ((info[1] & (1 << 5)) == 0) return;
+
+        G21_DEBUG_PRINT("#DEBUG: AVX2 is available.\n");
+
+        g_cpu_has_avx2 = true;
+    }
+
+    // Setup our sprite vertex type.
+    // This type wraps the data we send to the GPU during sprite rendering.
+
+    struct sprite_vertex
+    {
+        vec2<fixed16_16> pos;
+        u32 sprite_texture_index;
+        u32 : 1; // Padding.
+    };
+
+    // Setup our sprite batching types.
+    // Sprites are recorded as they are pushed, then sorted by their key before the vertices are built.
+
+    enum class sprite_layer : u8
+    {
+        background,
+        world,
+        player,
+        foreground
+    };
+
+    struct sprite_entry
+    {
+        vec2<fixed16_16> pos;
+        vec2<u8>         size;
+        u16              sprite_texture_index;
+    };
+
+    struct sprite_sort_item
+    {
+        u32 key;   // The layer in bits 16-23, the depth within the layer in bits 0-15.
+        u32 index; // Into the sprite entries.
+    };
+
+    // Setup various configurable constants
+
+    // The size in pixels of sprites. This metric is a bit weird since we render first to an internal buffer with a
+    // fixed resolution and then we upscale that to the target display. So this does not represent the number of pixels
+    // occupied on the target display. This value is mostly determined by how detailed the player's sprite is.
+    constexpr u32 k_sprite_size{ 32 };
+
+    // The per-frame acceleration due to gravity.
+    constexpr fixed16_16 k_gravity{ fixed16_16{ 1020 } / (60*60) };
+
+    // The jump. The speed grows with the ticks the jump was charged for, and is split into the two axes by factors
+    // that go from steep to flat as the charge grows.
+    constexpr fixed16_16 k_jump_speed           { 6 };
+    constexpr fixed16_16 k_jump_speed_per_charge{ fixed16_16{ 4045i16 } / 32767 };
+    constexpr fixed16_16 k_jump_x               { fixed16_16{ 21063i16 } / 32767 };
+    constexpr fixed16_16 k_jump_x_per_charge    { fixed16_16{ 375i16 } / 32767 };
+    constexpr fixed16_16 k_jump_y               { fixed16_16{ 25101i16 } / 32767 };
+    constexpr fixed16_16 k_jump_y_per_charge    { fixed16_16{ 191i16 } / 32767 };
+
+    // The maximum number of particles that may be active during a frame.
+    constexpr u32 k_max_particle_count{ 1'000'000 };
+
+    constexpr u32 k_sprites_vertices_per_quad{ 4 };
+    constexpr u32 k_sprites_indices_per_quad { 6 };
+    constexpr u32 k_sprites_max_quad_count   { 1U << 19 }; // Maximum number of quads (sprites) drawn during a frame.
+    constexpr u32 k_sprites_chunk_quad_count { 4096 };     // The sprite storage is committed this many quads at a time.
+    constexpr u32 k_sprites_batch_quad_count { 16384 };    // Maximum number of quads per draw call.
+    constexpr u32 k_sprites_batch_index_count{ k_sprites_batch_quad_count * k_sprites_indices_per_quad };
+    static_assert((k_sprites_max_quad_count % k_sprites_chunk_quad_count) == 0);
+
+    constexpr vec4<u8> k_sprite_palette[16]
+    {
+    /*0*/ vec4<u8>{   0,   0,   0,   0 }, // Transparent.
+    /*1*/ vec4<u8>{   0,   0,   0, 255 }, // Solid black.
+    /*2*/ vec4<u8>{ 230, 209, 188, 255 }, // Skin.
+    /*3*/ vec4<u8>{ 228, 218, 153, 255 }, // Blonde hair.
+    /*4*/ vec4<u8>{ 217, 200, 104, 255 }, // Blonde hair accent.
+    /*5*/ vec4<u8>{ 208,  70,  72, 255 }, // Red coat.
+    /*6*/ vec4<u8>{ 170,  51,  51, 255 }, // Red coat accent.
+    /*7*/ vec4<u8>{  50, 101,  36, 255 }, // Green eyes.
+    /*8*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
+    /*9*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
+    /*A*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
+    /*B*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
+    /*C*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
+    /*D*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
+    /*E*/ vec4<u8>{   0,   0,   0,   0 }, // Unused.
+    /*F*/ vec4<u8>{   0,   0,   0,   0 }  // Unused.
+    };
+
+    constexpr u8 k_player_sprite[4][16][8]
+    {
+        {
+            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
+            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
             { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
             { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
             { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
@@ -583,13 +1209,6 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
             { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
             { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
             { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
-            { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },
             { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }
         },
         {
@@ -832,15 +1451,147 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
         u16 x, y;
     };
 
+    // Setup the input struct.
+
+    // How finely the time a key is held for gets measured, in steps per tick.
+    constexpr u16 k_input_subticks{ 256 };
+
+    struct input_state
+    {
+        bool W     : 1;
+        bool A     : 1;
+        bool S     : 1;
+        bool D     : 1;
+        bool Space : 1;
+        bool LMB   : 1; // Unlike the other inputs, this is true on RELEASE, and gets cleared after being processed.
+        u16  W_held;    // How much of the tick the jump key was held for, in k_input_subticks.
+
+        friend constexpr bool operator == (input_state, input_state) = default;
+    };
+
+    // Setup the simulation state struct.
+    // Everything a tick of the game reads and writes is kept in here, so that the whole simulation can be saved and
+    // restored with a single small copy (see save_sim_state and restore_sim_state).
+
+    struct sim_state
+    {
+        struct player player;
+        struct camera camera;
+        input_state   input; // The input the current tick is simulated with.
+        i16           jump_charge;
+    };
+
     // Setup some global state.
 
-    constinit player g_player{ 
-        .pos = k_player_start_location,
-        .vel = vec2<fixed16_16>{ fixed16_16{ 0 }, fixed16_16{ 0 } },
-        .flying = true
+    constinit sim_state g_sim{
+        .player = player{
+            .pos = k_player_start_location,
+            .vel = vec2<fixed16_16>{ fixed16_16{ 0 }, fixed16_16{ 0 } },
+            .flying = true
+        }
+    };
+
+    __forceinline void save_sim_state(sim_state& snapshot)
+    {
+        __movsb(reinterpret_cast<u8*>(&snapshot), reinterpret_cast<u8 const*>(&g_sim), sizeof(sim_state));
+    }
+
+    __forceinline void restore_sim_state(sim_state const& snapshot)
+    {
+        __movsb(reinterpret_cast<u8*>(&g_sim), reinterpret_cast<u8 const*>(&snapshot), sizeof(sim_state));
+    }
+
+#if G21_ENABLE_ROLLBACK
+    // Setup the rollback state, see update_rollback().
+
+    constexpr u32 k_rollback_max_ticks{ 8 };  // How far back a correction may reach.
+    constexpr u32 k_rollback_history  { 16 }; // The number of ticks of snapshots and inputs kept.
+    static_assert(((k_rollback_history & (k_rollback_history - 1)) == 0) && (k_rollback_history > k_rollback_max_ticks));
+
+    struct rollback_packet
+    {
+        u32         tick;
+        input_state input;
     };
 
-    camera    g_camera;
+    constinit SOCKET g_rollback_socket{ INVALID_SOCKET };       // Stays invalid if the socket could not be set up.
+    sockaddr_in     g_rollback_address;
+    constinit u32   g_rollback_latency{ 4 };                    // In ticks, below k_rollback_max_ticks.
+    u32             g_rollback_tick;                            // The next tick to simulate.
+    sim_state       g_rollback_snapshots  [k_rollback_history]; // The state at the start of each tick.
+    input_state     g_rollback_inputs     [k_rollback_history]; // The input each tick was simulated with.
+    u32             g_rollback_input_ticks[k_rollback_history]; // One past the tick whose input is confirmed, or 0.
+    rollback_packet g_rollback_outbox     [k_rollback_history]; // Packets held back to fake the latency.
+    input_state     g_rollback_prediction;                      // The latest confirmed input.
+    u32             g_rollback_prediction_tick;                 // One past the tick it was confirmed for.
+
+    // Winsock is loaded at runtime rather than linked, so that only the builds with rollback depend on it.
+    #define WSFUNCS      \
+        X(WSAStartup)    \
+        X(socket)        \
+        X(bind)          \
+        X(getsockname)   \
+        X(ioctlsocket)   \
+        X(sendto)        \
+        X(recv)          \
+        X(closesocket)
+
+    struct
+    {
+        #define X(n) decltype(&::n) n;
+        WSFUNCS
+        #undef X
+    } g_winsock;
+
+    bool load_winsock()
+    {
+        HMODULE const ws2_32_dll{ LoadLibraryA("ws2_32.dll") };
+        if (ws2_32_dll == nullptr) return false;
+
+        #define X(n) if ((g_winsock.n = reinterpret_cast<decltype(&::n)>(GetProcAddress(ws2_32_dll, #n))) == nullptr) return false;
+        WSFUNCS
+        #undef X
+
+        return true;
+    }
+
+    void init_rollback()
+    {
+        g_rollback_latency = min(g_rollback_latency, k_rollback_max_ticks - 1);
+
+        WSADATA wsa_data;
+        if (!load_winsock() || (g_winsock.WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0))
+        {
+            G21_DEBUG_PRINT("#DEBUG: Winsock is unavailable, running without rollback.\n");
+            return;
+        }
+
+        SOCKET const rollback_socket{ g_winsock.socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP) };
+        if (rollback_socket == INVALID_SOCKET)
+        {
+            G21_DEBUG_PRINT("#DEBUG: Could not create the rollback socket.\n");
+            return;
+        }
+
+        // Bind to any free port on the loopback interface, then find out which one it was to send to ourselves.
+        g_rollback_address.sin_family      = AF_INET;
+        g_rollback_address.sin_addr.s_addr = _byteswap_ulong(INADDR_LOOPBACK);
+        g_rollback_address.sin_port        = 0;
+
+        int address_size{ sizeof(g_rollback_address) };
+        u_long non_blocking{ 1 };
+        if ((g_winsock.bind(rollback_socket, reinterpret_cast<sockaddr const*>(&g_rollback_address), sizeof(g_rollback_address)) != 0) ||
+            (g_winsock.getsockname(rollback_socket, reinterpret_cast<sockaddr*>(&g_rollback_address), &address_size) != 0)         ||
+            (g_winsock.ioctlsocket(rollback_socket, FIONBIO, &non_blocking) != 0))
+        {
+            G21_DEBUG_PRINT("#DEBUG: Could not set up the rollback socket.\n");
+            g_winsock.closesocket(rollback_socket);
+            return;
+        }
+
+        g_rollback_socket = rollback_socket;
+    }
+#endif
 
     HWND      g_hWnd;
     HDC       g_hDC;
@@ -849,18 +1600,39 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
     constinit vec2<u16> g_client_area{ vec2<u16>{ camera::k_width * 2, camera::k_height * 2 } };
     vec4<u16>           g_viewport;
 
-    struct
+    // The internal render target, see init_render_target().
+    enum class render_target_format : u8
     {
-        bool W     : 1;
-        bool A     : 1;
-        bool S     : 1;
-        bool D     : 1;
-        bool Space : 1;
-        bool LMB   : 1; // Unlike the other inputs, this is true on RELEASE, and gets cleared after being processed.
-    } g_input;
+        rgba8,
+        srgb8_alpha8,
+        rgba16f
+    };
+
+    render_target_format g_render_target_format;
+    constinit u8         g_render_target_scale_option{ 1 }; // 0 means it follows the viewport.
+    u8                   g_render_target_scale;
+    bool                 g_render_target_dirty;
+
+    input_state g_window_input; // Kept up to date by the window procedure, which queues every change.
+    input_state g_input;        // Built from the queued changes every tick, and copied into the simulation.
+
+    constinit bool g_frame_dirty{ true }; // Forces the next frame to be drawn, see begin_frame().
+    constinit bool g_idle_skip  { true }; // Skip drawing and presenting frames where nothing changed.
+
+    constinit bool g_vsync{ true };
+    bool           g_late_latch; // Hold every tick back until just before the vblank, see latch_tick().
+
+    bool g_startup_report; // Write the startup times to startup.json once loaded, see update_loading().
+    bool g_idle_benchmark; // Sit idle for a while once interactive and write the cost to idle_benchmark.json.
+    bool g_latency_report; // Measure the input to present latency and add it to latency.csv on exit.
+    bool g_message_stress; // Flood the window with messages for a while once interactive, and measure the ticks.
+    bool g_tick_jitter;    // Measure the time between ticks for a while once interactive, then exit.
+    u32  g_render_load;    // Milliseconds of busy work added to every frame, see render().
+
+    bool g_split_simulation; // Run the simulation on a thread of its own, see start_sim_thread().
 
     GLuint g_particle_buffer_id;
-    u32    g_particle_count;
+    u32    g_particle_count{ k_max_particle_count };
     bool   g_particle_init;
 
     GLuint g_vao;
@@ -869,18 +1641,56 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
     GLuint g_render_program_id;
     GLuint g_sprite_render_program_id;
     GLuint g_background_renderer_program_id;
+    GLuint g_loading_screen_program_id;
+    GLuint g_background_generator_program_id;
     GLuint g_upscaler_program_id;
     GLuint g_sprites_vertex_buffer_id;
     GLuint g_sprites_index_buffer_id;
     GLuint g_sprites_texture_array_id;
+    GLuint g_sprites_palette_texture_id;
+    GLuint g_sprites_rect_texture_id;
     GLuint g_index_buffer_id;
-    GLuint g_atomic_counter_buffer_id;
+    GLuint g_atomic_counter_buffer_id; // Holds a particle_draw_command, whose count the update counts the particles in.
     GLuint g_gradient_map_texture_id;
-    sprite_vertex   g_sprites_vertex_buffer_storage[k_sprites_max_vertex_count];
-    constinit auto* g_sprites_vertex_buffer_storage_ptr{ g_sprites_vertex_buffer_storage };
+    GLuint g_gradient_map_pbo_id;
+    GLuint g_flow_agent_buffer_id;
+
+    // The live particles are drawn straight from the count the update leaves on the GPU, so the count always belongs
+    // to the indices it draws.
+    struct particle_draw_command
+    {
+        GLuint count;
+        GLuint instance_count;
+        GLuint first_index;
+        GLint  base_vertex;
+        GLuint base_instance;
+    };
+
+    // The live particle count and the tiles with particles in them are copied into one of two buffers after every
+    // update, and read back from there a tick later, see update_particles().
+    struct particle_readback
+    {
+        GLuint buffer;
+        GLsync fence; // Set while the copy is waiting to be read back.
+    };
+
+    particle_readback g_particle_readbacks[2];
+    u32               g_particle_readback_next;
+
+    // The sprite storage. Address space for k_sprites_max_quad_count sprites is reserved up front, but only the first
+    // g_sprites_capacity are committed.
+    sprite_entry*     g_sprites;
+    sprite_sort_item* g_sprites_sort_items;
+    sprite_sort_item* g_sprites_sort_scratch;
+    sprite_vertex*    g_sprites_vertices;
+    u32               g_sprites_count;
+    u32               g_sprites_capacity;
+
     GLuint g_framebuffer_texture_id;
     GLuint g_framebuffer_id;
     GLuint g_background_texture_id;
+    GLuint g_light_distance_texture_id;
+    GLuint g_light_buffer_id;
     GLuint g_active_particles;
 
     bool g_game_world_collision_map[k_world_height][k_world_width];
@@ -968,6 +1778,8 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
 
     void compute_game_world_collision_map()
     {
+        G21_TRACE_ZONE("compute_game_world_collision_map");
+
         // Draw the top and bottom borders
         for (u8 x{ 0 }; x < k_game_world_design_width; ++x)
         {
@@ -1029,6 +1841,8 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
 
     void compute_player_collision_map()
     {
+        G21_TRACE_ZONE("compute_player_collision_map");
+
         for (u32 y{ 0 }; y < k_player_collision_map_height; ++y)
         {
             for (u32 x{ 0 }; x < k_player_collision_map_width; ++x)
@@ -1051,6 +1865,144 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
         }
     }
 
+    // Setup the command line options.
+
+    // Checks if 'str' starts with 'prefix', and returns the rest of it if so.
+    char const* match_prefix(char const* str, char const* prefix)
+    {
+        for (; *prefix != '\0'; ++str, ++prefix)
+        {
+            if (*str != *prefix) return nullptr;
+        }
+        return str;
+    }
+
+    // Checks if 'str' is exactly 'value', up to the end of the current option.
+    bool match_option_value(char const* str, char const* value)
+    {
+        char const* const rest{ match_prefix(str, value) };
+        return (rest != nullptr) && ((*rest == '\0') || (*rest == ' '));
+    }
+
+    void parse_command_line()
+    {
+        G21_TRACE_ZONE("parse_command_line");
+
+        // Recognized options:
+        //   --render-format=rgba8|srgb8|rgba16f   The format of the internal render target (default rgba8).
+        //   --render-scale=auto|1-8               The internal resolution as a multiple of the camera size (default 1).
+        //   --rollback-latency=0-7                Ticks of latency added to the loopback session (default 4).
+        //   --startup-report                      Write the time to the first frame and to interactive to a file.
+        //   --no-idle-skip                        Draw and present every tick, even if nothing changed.
+        //   --idle-benchmark                      Measure the CPU time used while idle for a few seconds, then exit.
+        //   --vsync=on|off                        Wait for the vblank when presenting (default on).
+        //   --late-latch                          Sample the input and simulate just before the vblank (not with
+        //                                         --sim-thread).
+        //   --latency-report                      Add the input to present latency to latency.csv on exit.
+        //   --message-stress                      Measure the tick jitter under a flood of messages, then exit.
+        //   --tick-jitter                         Measure the tick jitter for a few seconds, then exit.
+        //   --render-load=0-99                    Milliseconds of busy work added to every frame (default 0).
+        //   --sim-thread                          Run the simulation on a thread of its own (not with particles).
+
+        for (char const* p{ GetCommandLineA() }; *p != '\0'; ++p)
+        {
+            // Only look at the start of each argument.
+            if ((p[0] != '-') || (p[1] != '-')) continue;
+
+            if (char const* const value{ match_prefix(p, "--render-format=") }; value != nullptr)
+            {
+                if      (match_option_value(value, "rgba8"  )) g_render_target_format = render_target_format::rgba8;
+                else if (match_option_value(value, "srgb8"  )) g_render_target_format = render_target_format::srgb8_alpha8;
+                else if (match_option_value(value, "rgba16f")) g_render_target_format = render_target_format::rgba16f;
+            }
+            else if (char const* const scale{ match_prefix(p, "--render-scale=") }; scale != nullptr)
+            {
+                if ((scale[0] >= '1') && (scale[0] <= '8') && match_option_value(scale + 1, ""))
+                {
+                    g_render_target_scale_option = static_cast<u8>(scale[0] - '0');
+                }
+                else if (match_option_value(scale, "auto"))
+                {
+                    g_render_target_scale_option = 0;
+                }
+            }
+            else if (match_option_value(p, "--startup-report"))
+            {
+                g_startup_report = true;
+            }
+            else if (match_option_value(p, "--no-idle-skip"))
+            {
+                g_idle_skip = false;
+            }
+            else if (match_option_value(p, "--idle-benchmark"))
+            {
+                g_idle_benchmark = true;
+            }
+            else if (char const* const vsync{ match_prefix(p, "--vsync=") }; vsync != nullptr)
+            {
+                if      (match_option_value(vsync, "on" )) g_vsync = true;
+                else if (match_option_value(vsync, "off")) g_vsync = false;
+            }
+            else if (match_option_value(p, "--late-latch"))
+            {
+                g_late_latch = true;
+            }
+            else if (match_option_value(p, "--latency-report"))
+            {
+                g_latency_report = true;
+            }
+            else if (match_option_value(p, "--message-stress"))
+            {
+                g_message_stress = true;
+            }
+            else if (match_option_value(p, "--tick-jitter"))
+            {
+                // Every frame has to be drawn for the render load to hold anything back.
+                g_tick_jitter = true;
+                g_idle_skip   = false;
+            }
+            else if (char const* const load{ match_prefix(p, "--render-load=") }; load != nullptr)
+            {
+                if ((load[0] >= '0') && (load[0] <= '9'))
+                {
+                    if (match_option_value(load + 1, ""))
+                    {
+                        g_render_load = static_cast<u32>(load[0] - '0');
+                    }
+                    else if ((load[1] >= '0') && (load[1] <= '9') && match_option_value(load + 2, ""))
+                    {
+                        g_render_load = (static_cast<u32>(load[0] - '0') * 10) + static_cast<u32>(load[1] - '0');
+                    }
+                }
+            }
+#if !G21_ENABLE_PARTICLES
+            else if (match_option_value(p, "--sim-thread"))
+            {
+                g_split_simulation = true;
+            }
+#endif
+#if G21_ENABLE_ROLLBACK
+            else if (char const* const latency{ match_prefix(p, "--rollback-latency=") }; latency != nullptr)
+            {
+                if ((latency[0] >= '0') && (latency[0] <= '7') && match_option_value(latency + 1, ""))
+                {
+                    g_rollback_latency = static_cast<u32>(latency[0] - '0');
+                }
+            }
+#endif
+
+            // Skip the rest of the argument.
+            while ((p[1] != '\0') && (p[1] != ' ')) ++p;
+        }
+
+        // The latch holds back the ticks of the GL thread, which no longer runs them with a thread of its own.
+        if (g_late_latch && g_split_simulation)
+        {
+            G21_DEBUG_PRINT("#DEBUG: --late-latch does not work with --sim-thread and is ignored.\n");
+            g_late_latch = false;
+        }
+    }
+
     // Setup the window and input handling.
 
     void adjust_viewport()
@@ -1084,66 +2036,192 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
 		}
     }
 
-    void handle_key(u8 virtual_key, bool key_down)
+    // Writes out whatever the enabled instrumentation has collected. Defined after the GPU profiler.
+    void write_exit_reports();
+
+    // Input events, with the times they were queued at, for the latency measurement. They are recorded by the
+    // simulation as it takes them in and measured by the renderer, see complete_frames(). The counters only ever
+    // grow, and index the ring modulo its size.
+    constexpr u32 k_max_input_events{ 64 };
+
+    u64          g_input_event_times[k_max_input_events];
+    volatile u32 g_input_events_recorded; // Taken in by the simulation.
+    volatile u32 g_input_events_measured; // Covered by a frame that has finished.
+
+    void record_input_event(u64 time)
     {
-        switch (virtual_key)
-        {
-            case 'W':
-                g_input.W = key_down;
-                break;
+        // The ring only fills up if nothing gets presented, and then there is nothing to measure anyway.
+        u32 const recorded{ g_input_events_recorded };
+        if (!g_latency_report || ((recorded - g_input_events_measured) == k_max_input_events)) return;
 
-            case 'A':
-                g_input.A = key_down;
-                break;
+        g_input_event_times[recorded % k_max_input_events] = time;
+        g_input_events_recorded = recorded + 1;
+    }
 
-            case 'S':
-                g_input.S = key_down;
-                break;
+    // Key events.
+    // The window procedure queues every change to the keys, stamped with the time it saw it, and every tick takes in the
+    // ones that happened since the last tick in order. This way a key that goes down and up again between two ticks is
+    // still seen, and the time the jump key was held for is known to a fraction of a tick. The queue is a ring with a
+    // single producer and a single consumer, which only need the ordering of the volatile counters between them.
 
-            case 'D':
-                g_input.D = key_down;
-                break;
+    constexpr u32 k_key_event_queue_size{ 256 };
+    static_assert((k_key_event_queue_size & (k_key_event_queue_size - 1)) == 0);
 
-            case VK_SPACE:
-                g_input.Space = key_down;
-                break;
+    struct key_event
+    {
+        u64         time;
+        input_state keys; // The keys down after the change.
+    };
 
-            case VK_ESCAPE:
-                // Imagine being nice and cleaning up our resources lmao.
-                ExitProcess(0);
+    key_event    g_key_events[k_key_event_queue_size];
+    volatile u32 g_key_events_written; // Only written by the producer.
+    volatile u32 g_key_events_read;    // Only written by the consumer.
 
-            // Ignore everything else.
-            default:
-                break;
-        }
-    }
+    input_state g_input_keys;     // The keys down as of the last event taken in.
+    u64         g_input_time;     // When the last tick took in the events.
+    u64         g_jump_down_time; // When the jump key last went down.
 
-    LRESULT WINAPI window_proc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+    void queue_key_event(input_state keys)
     {
-        switch (uMsg)
+        u32 const written{ g_key_events_written };
+
+        // Drop the change if the queue is full. It only fills up if the ticks stop taking events in.
+        if ((written - g_key_events_read) == k_key_event_queue_size) return;
+
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+
+        g_key_events[written % k_key_event_queue_size] = key_event{ static_cast<u64>(now.QuadPart), keys };
+        g_key_events_written = written + 1;
+    }
+
+    // Takes in the key events up to now. A key counts as down for the tick if it was down at any point since the last
+    // one, except for the jump key, whose release matters and which instead reports how long it was held for.
+    void update_input()
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+
+        u64 const tick_end  { static_cast<u64>(now.QuadPart) };
+        u64 const tick_begin{ (g_input_time != 0) ? g_input_time : tick_end };
+        g_input_time = tick_end;
+
+        input_state input{ g_input_keys };
+        u64         held { 0 };
+
+        for (u32 read{ g_key_events_read }; read != g_key_events_written; ++read)
+        {
+            key_event const& event{ g_key_events[read % k_key_event_queue_size] };
+            if (event.time > tick_end) break;
+
+            // The clock is read before the event is queued, so an event can arrive just after the tick before it took
+            // the others in. It counts as happening at the start of this tick.
+            u64 const event_time{ max(event.time, tick_begin) };
+
+            if (event.keys.W && !g_input_keys.W)
+            {
+                g_jump_down_time = event.time;
+            }
+            else if (!event.keys.W && g_input_keys.W)
+            {
+                held += event_time - max(g_jump_down_time, tick_begin);
+            }
+
+            input.A     = input.A     || event.keys.A;
+            input.S     = input.S     || event.keys.S;
+            input.D     = input.D     || event.keys.D;
+            input.Space = input.Space || event.keys.Space;
+            input.LMB   = input.LMB   || event.keys.LMB;
+
+            g_input_keys     = event.keys;
+            g_input_keys.LMB = false;
+
+            record_input_event(event.time);
+
+            g_key_events_read = read + 1;
+        }
+
+        if (g_input_keys.W)
+        {
+            held += tick_end - max(g_jump_down_time, tick_begin);
+        }
+
+        u32 const tick_length{ static_cast<u32>(tick_end - tick_begin) };
+        u32       remainder;
+
+        input.W      = g_input_keys.W;
+        input.W_held = 0;
+
+        // Saturate at the whole tick, which also keeps the quotient within 32 bits for the division. Catch-up ticks
+        // run back to back, so a tick can be only a few counts of the clock long.
+        if (tick_length != 0)
+        {
+            input.W_held = (held >= tick_length) ? k_input_subticks : static_cast<u16>(_udiv64(__emulu(static_cast<u32>(held), k_input_subticks), tick_length, &remainder));
+        }
+
+        g_input = input;
+    }
+
+    void handle_key(u8 virtual_key, bool key_down)
+    {
+        input_state const old_input{ g_window_input };
+
+        switch (virtual_key)
+        {
+            case 'W':
+                g_window_input.W = key_down;
+                break;
+
+            case 'A':
+                g_window_input.A = key_down;
+                break;
+
+            case 'S':
+                g_window_input.S = key_down;
+                break;
+
+            case 'D':
+                g_window_input.D = key_down;
+                break;
+
+            case VK_SPACE:
+                g_window_input.Space = key_down;
+                break;
+
+            case VK_ESCAPE:
+                // Imagine being nice and cleaning up our resources lmao.
+                write_exit_reports();
+                ExitProcess(0);
+
+            // Ignore everything else.
+            default:
+                break;
+        }
+
+        // Key repeats change nothing, and are not queued.
+        if (!(g_window_input == old_input))
+        {
+            queue_key_event(g_window_input);
+        }
+    }
+
+    LRESULT WINAPI window_proc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
+    {
+        switch (uMsg)
         {
             case WM_CLOSE:
                 // Imagine being nice and cleaning up our resources lmao.
+                write_exit_reports();
                 ExitProcess(0);
 
             case WM_PAINT:
             {
-                // This paint occurs once after window creation and before the first draw with OpenGL.
-                // It simply clears the screen and writes the text "Loading. . .".
+                // Everything is drawn with OpenGL on the next tick, including the loading screen, so there is nothing
+                // to do but make sure that tick draws and validate the window.
+                g_frame_dirty = true;
 
                 PAINTSTRUCT ps;
                 BeginPaint(hWnd, &ps);
-                BitBlt(
-                    g_hDC,
-                    ps.rcPaint.left,
-                    ps.rcPaint.top,
-                    (ps.rcPaint.right  - ps.rcPaint.left),
-                    (ps.rcPaint.bottom - ps.rcPaint.top),
-                    nullptr,
-                    0, 0,
-                    WHITENESS
-                );
-                DrawTextA(g_hDC, "Loading. . .", 12, &ps.rcPaint, DT_CENTER | DT_VCENTER  | DT_SINGLELINE | DT_NOCLIP);
                 EndPaint(hWnd, &ps);
             } break;
 
@@ -1179,9 +2257,12 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
                 break;
 
             case WM_LBUTTONUP:
-                // Left mouse button released.
-                g_input.LMB = true;
-                break;
+            {
+                // Left mouse button released, which is only seen by the next tick.
+                input_state keys{ g_window_input };
+                keys.LMB = true;
+                queue_key_event(keys);
+            } break;
 
             case WM_SYSCOMMAND:
                 // Check for maximize / restore command.
@@ -1227,6 +2308,7 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
 
                                 // Adjust the viewport for rendering.
                                 adjust_viewport();
+                                g_render_target_dirty = true;
 
                                 // Mark as fullscreen.
                                 is_fullscreen = true;
@@ -1248,6 +2330,7 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
                         );
                         g_client_area = old_client_area;
                         g_viewport    = vec4<u16>{ 0, 0, g_client_area.x, g_client_area.y };
+                        g_render_target_dirty = true;
 
                         // Mark as no longer fullscreen.
                         is_fullscreen = false;
@@ -1265,6 +2348,8 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
 
     void init_window()
     {
+        G21_TRACE_ZONE("init_window");
+
         G21_DEBUG_PRINT("#DEBUG: Initializing window.\n");
 
         static WNDCLASSEX wc{};
@@ -1309,16 +2394,22 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
     X(PFNGLBINDBUFFERPROC, glBindBuffer) \
     X(PFNGLBINDBUFFERBASEPROC, glBindBufferBase) \
     X(PFNGLBINDFRAMEBUFFERPROC, glBindFramebuffer) \
+    X(PFNGLBINDIMAGETEXTUREPROC, glBindImageTexture) \
     X(PFNGLBINDVERTEXARRAYPROC, glBindVertexArray) \
     X(PFNGLBUFFERDATAPROC, glBufferData) \
     X(PFNGLBUFFERSUBDATAPROC, glBufferSubData) \
     X(PFNGLCLEARBUFFERDATAPROC, glClearBufferData) \
     X(PFNGLCLEARBUFFERUIVPROC, glClearBufferuiv) \
+    X(PFNGLCLIENTWAITSYNCPROC, glClientWaitSync) \
     X(PFNGLCREATEPROGRAMPROC, glCreateProgram) \
     X(PFNGLCREATESHADERPROC, glCreateShader) \
     X(PFNGLCOMPILESHADERPROC, glCompileShader) \
+    X(PFNGLCOPYBUFFERSUBDATAPROC, glCopyBufferSubData) \
+    X(PFNGLDELETEBUFFERSPROC, glDeleteBuffers) \
+    X(PFNGLDELETESYNCPROC, glDeleteSync) \
     X(PFNGLDISPATCHCOMPUTEPROC, glDispatchCompute) \
     X(PFNGLENABLEVERTEXATTRIBARRAYPROC, glEnableVertexAttribArray) \
+    X(PFNGLFENCESYNCPROC, glFenceSync) \
     X(PFNGLFRAMEBUFFERTEXTUREPROC, glFramebufferTexture) \
     X(PFNGLGENBUFFERSPROC, glGenBuffers) \
     X(PFNGLGENFRAMEBUFFERSPROC, glGenFramebuffers) \
@@ -1341,44 +2432,63 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
     X(PFNGLVERTEXATTRIBIPOINTERPROC, glVertexAttribIPointer) \
     X(PFNWGLSWAPINTERVALEXTPROC, wglSwapIntervalEXT)
 
-    PROC _gl_fnptrs[36];
+    PROC _gl_fnptrs[42];
 
     #define glActiveTexture ((PFNGLACTIVETEXTUREPROC)_gl_fnptrs[0])
     #define glAttachShader ((PFNGLATTACHSHADERPROC)_gl_fnptrs[1])
     #define glBindBuffer ((PFNGLBINDBUFFERPROC)_gl_fnptrs[2])
     #define glBindBufferBase ((PFNGLBINDBUFFERBASEPROC)_gl_fnptrs[3])
     #define glBindFramebuffer ((PFNGLBINDFRAMEBUFFERPROC)_gl_fnptrs[4])
-    #define glBindVertexArray ((PFNGLBINDVERTEXARRAYPROC)_gl_fnptrs[5])
-    #define glBufferData ((PFNGLBUFFERDATAPROC)_gl_fnptrs[6])
-    #define glBufferSubData ((PFNGLBUFFERSUBDATAPROC)_gl_fnptrs[7])
-    #define glClearBufferData ((PFNGLCLEARBUFFERDATAPROC)_gl_fnptrs[8])
-    #define glClearBufferuiv ((PFNGLCLEARBUFFERUIVPROC)_gl_fnptrs[9])
-    #define glCreateProgram ((PFNGLCREATEPROGRAMPROC)_gl_fnptrs[10])
-    #define glCreateShader ((PFNGLCREATESHADERPROC)_gl_fnptrs[11])
-    #define glCompileShader ((PFNGLCOMPILESHADERPROC)_gl_fnptrs[12])
-    #define glDispatchCompute ((PFNGLDISPATCHCOMPUTEPROC)_gl_fnptrs[13])
-    #define glEnableVertexAttribArray ((PFNGLENABLEVERTEXATTRIBARRAYPROC)_gl_fnptrs[14])
-    #define glFramebufferTexture ((PFNGLFRAMEBUFFERTEXTUREPROC)_gl_fnptrs[15])
-    #define glGenBuffers ((PFNGLGENBUFFERSPROC)_gl_fnptrs[16])
-    #define glGenFramebuffers ((PFNGLGENFRAMEBUFFERSPROC)_gl_fnptrs[17])
-    #define glGenVertexArrays ((PFNGLGENVERTEXARRAYSPROC)_gl_fnptrs[18])
-    #define glGetBufferSubData ((PFNGLGETBUFFERSUBDATAPROC)_gl_fnptrs[19])
-    #define glGetUniformLocation ((PFNGLGETUNIFORMLOCATIONPROC)_gl_fnptrs[20])
-    #define glInvalidateBufferData ((PFNGLINVALIDATEBUFFERDATAPROC)_gl_fnptrs[21])
-    #define glLinkProgram ((PFNGLLINKPROGRAMPROC)_gl_fnptrs[22])
-    #define glMapBuffer ((PFNGLMAPBUFFERPROC)_gl_fnptrs[23])
-    #define glMemoryBarrier ((PFNGLMEMORYBARRIERPROC)_gl_fnptrs[24])
-    #define glShaderSource ((PFNGLSHADERSOURCEPROC)_gl_fnptrs[25])
-    #define glTexImage3D ((PFNGLTEXIMAGE3DPROC)_gl_fnptrs[26])
-    #define glTexSubImage3D ((PFNGLTEXSUBIMAGE3DPROC)_gl_fnptrs[27])
-    #define glTexStorage3D ((PFNGLTEXSTORAGE3DPROC)_gl_fnptrs[28])
-    #define glUniform1i ((PFNGLUNIFORM1IPROC)_gl_fnptrs[29])
-    #define glUniform2i ((PFNGLUNIFORM2IPROC)_gl_fnptrs[30])
-    #define glUniform4i ((PFNGLUNIFORM4IPROC)_gl_fnptrs[31])
-    #define glUnmapBuffer ((PFNGLUNMAPBUFFERPROC)_gl_fnptrs[32])
-    #define glUseProgram ((PFNGLUSEPROGRAMPROC)_gl_fnptrs[33])
-    #define glVertexAttribIPointer ((PFNGLVERTEXATTRIBIPOINTERPROC)_gl_fnptrs[34])
-    #define wglSwapIntervalEXT ((PFNWGLSWAPINTERVALEXTPROC)_gl_fnptrs[35])
+    #define glBindImageTexture ((PFNGLBINDIMAGETEXTUREPROC)_gl_fnptrs[5])
+    #define glBindVertexArray ((PFNGLBINDVERTEXARRAYPROC)_gl_fnptrs[6])
+    #define glBufferData ((PFNGLBUFFERDATAPROC)_gl_fnptrs[7])
+    #define glBufferSubData ((PFNGLBUFFERSUBDATAPROC)_gl_fnptrs[8])
+    #define glClearBufferData ((PFNGLCLEARBUFFERDATAPROC)_gl_fnptrs[9])
+    #define glClearBufferuiv ((PFNGLCLEARBUFFERUIVPROC)_gl_fnptrs[10])
+    #define glClientWaitSync ((PFNGLCLIENTWAITSYNCPROC)_gl_fnptrs[11])
+    #define glCreateProgram ((PFNGLCREATEPROGRAMPROC)_gl_fnptrs[12])
+    #define glCreateShader ((PFNGLCREATESHADERPROC)_gl_fnptrs[13])
+    #define glCompileShader ((PFNGLCOMPILESHADERPROC)_gl_fnptrs[14])
+    #define glCopyBufferSubData ((PFNGLCOPYBUFFERSUBDATAPROC)_gl_fnptrs[15])
+    #define glDeleteBuffers ((PFNGLDELETEBUFFERSPROC)_gl_fnptrs[16])
+    #define glDeleteSync ((PFNGLDELETESYNCPROC)_gl_fnptrs[17])
+    #define glDispatchCompute ((PFNGLDISPATCHCOMPUTEPROC)_gl_fnptrs[18])
+    #define glEnableVertexAttribArray ((PFNGLENABLEVERTEXATTRIBARRAYPROC)_gl_fnptrs[19])
+    #define glFenceSync ((PFNGLFENCESYNCPROC)_gl_fnptrs[20])
+    #define glFramebufferTexture ((PFNGLFRAMEBUFFERTEXTUREPROC)_gl_fnptrs[21])
+    #define glGenBuffers ((PFNGLGENBUFFERSPROC)_gl_fnptrs[22])
+    #define glGenFramebuffers ((PFNGLGENFRAMEBUFFERSPROC)_gl_fnptrs[23])
+    #define glGenVertexArrays ((PFNGLGENVERTEXARRAYSPROC)_gl_fnptrs[24])
+    #define glGetBufferSubData ((PFNGLGETBUFFERSUBDATAPROC)_gl_fnptrs[25])
+    #define glGetUniformLocation ((PFNGLGETUNIFORMLOCATIONPROC)_gl_fnptrs[26])
+    #define glInvalidateBufferData ((PFNGLINVALIDATEBUFFERDATAPROC)_gl_fnptrs[27])
+    #define glLinkProgram ((PFNGLLINKPROGRAMPROC)_gl_fnptrs[28])
+    #define glMapBuffer ((PFNGLMAPBUFFERPROC)_gl_fnptrs[29])
+    #define glMemoryBarrier ((PFNGLMEMORYBARRIERPROC)_gl_fnptrs[30])
+    #define glShaderSource ((PFNGLSHADERSOURCEPROC)_gl_fnptrs[31])
+    #define glTexImage3D ((PFNGLTEXIMAGE3DPROC)_gl_fnptrs[32])
+    #define glTexSubImage3D ((PFNGLTEXSUBIMAGE3DPROC)_gl_fnptrs[33])
+    #define glTexStorage3D ((PFNGLTEXSTORAGE3DPROC)_gl_fnptrs[34])
+    #define glUniform1i ((PFNGLUNIFORM1IPROC)_gl_fnptrs[35])
+    #define glUniform2i ((PFNGLUNIFORM2IPROC)_gl_fnptrs[36])
+    #define glUniform4i ((PFNGLUNIFORM4IPROC)_gl_fnptrs[37])
+    #define glUnmapBuffer ((PFNGLUNMAPBUFFERPROC)_gl_fnptrs[38])
+    #define glUseProgram ((PFNGLUSEPROGRAMPROC)_gl_fnptrs[39])
+    #define glVertexAttribIPointer ((PFNGLVERTEXATTRIBIPOINTERPROC)_gl_fnptrs[40])
+    #define wglSwapIntervalEXT ((PFNWGLSWAPINTERVALEXTPROC)_gl_fnptrs[41])
+
+    #if G21_ENABLE_GPU_PROFILER
+    PFNGLGENQUERIESPROC          glGenQueries;
+    PFNGLQUERYCOUNTERPROC        glQueryCounter;
+    PFNGLGETQUERYOBJECTIVPROC    glGetQueryObjectiv;
+    PFNGLGETQUERYOBJECTUI64VPROC glGetQueryObjectui64v;
+    PFNGLPUSHDEBUGGROUPPROC      glPushDebugGroup;
+    PFNGLPOPDEBUGGROUPPROC       glPopDebugGroup;
+    #endif
+
+    #if G21_ENABLE_PARTICLES
+    PFNGLDRAWELEMENTSINDIRECTPROC glDrawElementsIndirect;
+    #endif
 
     #ifdef _DEBUG
     PFNGLGETSHADERIVPROC      glGetShaderiv;
@@ -1428,1620 +2538,7040 @@ namespace // Wrap all our functions and globals in an anonymous namespace for in
                 for (; *p != '\0'; ++p);
             }
         #endif
+
+        #if G21_ENABLE_PARTICLES
+            // Only used along with the compute shaders, which need a newer OpenGL, so it is always there when they are.
+            glDrawElementsIndirect = reinterpret_cast<PFNGLDRAWELEMENTSINDIRECTPROC>(wglGetProcAddress("glDrawElementsIndirect"));
+        #endif
+
+        #if G21_ENABLE_GPU_PROFILER
+            glGenQueries          = reinterpret_cast<PFNGLGENQUERIESPROC>         (wglGetProcAddress("glGenQueries"));
+            glQueryCounter        = reinterpret_cast<PFNGLQUERYCOUNTERPROC>       (wglGetProcAddress("glQueryCounter"));
+            glGetQueryObjectiv    = reinterpret_cast<PFNGLGETQUERYOBJECTIVPROC>   (wglGetProcAddress("glGetQueryObjectiv"));
+            glGetQueryObjectui64v = reinterpret_cast<PFNGLGETQUERYOBJECTUI64VPROC>(wglGetProcAddress("glGetQueryObjectui64v"));
+            glPushDebugGroup      = reinterpret_cast<PFNGLPUSHDEBUGGROUPPROC>     (wglGetProcAddress("glPushDebugGroup"));
+            glPopDebugGroup       = reinterpret_cast<PFNGLPOPDEBUGGROUPPROC>      (wglGetProcAddress("glPopDebugGroup"));
+        #endif
     }
 
     #undef GLFUNCS
 
-    // TODO: This could be compressed
+#if G21_ENABLE_GPU_PROFILER
+    // Setup the GPU profiler.
+    // Every pass is bracketed by a pair of timestamp queries and labelled with a debug group for external tools. The
+    // queries of a frame are read back k_gpu_profiler_latency frames later, by which time the GPU is long done with
+    // them, so the read never stalls. Should they still be pending, the sample is dropped rather than waited for.
+    // Timestamp queries need OpenGL 3.3 and debug groups 4.3, so the profiler turns itself off without the former and
+    // leaves out the labels without the latter.
 
-    constexpr char k_fullscreen_quad_vs_source[]
+    enum class gpu_pass : u8
     {
-        "#version 430 core\n"
-
-        "out vec2 uv;"
+        background,
+        sprites,
+        framebuffer,
+        particles,
+        count
+    };
 
-        "void main()"
-        "{"
-            "float x=-1+float((gl_VertexID&1)<<2);"
-            "float y=-1+float((gl_VertexID&2)<<1);"
-            "uv.x=(x+1)*0.5;"
-            "uv.y=(y+1)*0.5;"
-            "gl_Position=vec4(x,y,0,1);"
-        "}"
+    constexpr char const* k_gpu_pass_names[]
+    {
+        "background",
+        "sprites",
+        "framebuffer",
+        "particles"
     };
 
-    constexpr char k_background_render_fs_source[]
+    constexpr u32 k_gpu_pass_count      { static_cast<u32>(gpu_pass::count) };
+    constexpr u32 k_gpu_profiler_latency{ 4 };   // Frames between recording the queries and reading them back.
+    constexpr u32 k_gpu_profiler_window { 256 }; // Number of samples the statistics are computed over.
+    static_assert(countof(k_gpu_pass_names) == k_gpu_pass_count);
+
+    struct gpu_pass_stats
     {
-        "#version 430 core\n"
+        u32 min, avg, p99; // Nanoseconds.
+        u32 sample_count;
+    };
 
-        "layout(location = 0) uniform ivec4 camera;"
+    GLuint g_gpu_profiler_queries[k_gpu_profiler_latency][k_gpu_pass_count][2];
+    bool   g_gpu_profiler_pending[k_gpu_profiler_latency][k_gpu_pass_count];
+    u32    g_gpu_profiler_frame;
+    u32    g_gpu_profiler_samples[k_gpu_pass_count][k_gpu_profiler_window]; // A ring of the latest samples.
+    u32    g_gpu_profiler_sample_count[k_gpu_pass_count];
+    bool   g_gpu_profiler_enabled;
 
-        "layout(binding = 0) uniform usampler2DRect tex;"
+    void init_gpu_profiler()
+    {
+        g_gpu_profiler_enabled =
+            (glGenQueries != nullptr) && (glQueryCounter != nullptr) &&
+            (glGetQueryObjectiv != nullptr) && (glGetQueryObjectui64v != nullptr);
 
-        "in vec2 uv;"
+        if (!g_gpu_profiler_enabled)
+        {
+            G21_DEBUG_PRINT("#DEBUG: No timestamp queries, the GPU profiler is disabled.\n");
+            return;
+        }
 
-        "void main(){"
-            "gl_FragColor=vec4(texelFetch(tex, camera.xy + ivec2(vec2(uv.x,1-uv.y)*camera.zw)).rgb/255.,1);"
-        "}"
-    };
+        glGenQueries(sizeof(g_gpu_profiler_queries) / sizeof(GLuint), &g_gpu_profiler_queries[0][0][0]);
+    }
 
-    constexpr char k_texture_blit_fs_source[]
+    void begin_gpu_pass(gpu_pass pass)
     {
-        "#version 430 core\n"
-
-        "layout(binding = 0) uniform sampler2D tex;"
+        if (!g_gpu_profiler_enabled) return;
 
-        "in vec2 uv;"
+        u32 const slot{ g_gpu_profiler_frame % k_gpu_profiler_latency };
+        u32 const p   { static_cast<u32>(pass) };
 
-        "void main(){"
-            "gl_FragColor=vec4(texture(tex, uv).rgb,1);"
-        "}"
-    };
+        if (glPushDebugGroup != nullptr) glPushDebugGroup(GL_DEBUG_SOURCE_APPLICATION, p, -1, k_gpu_pass_names[p]);
+        glQueryCounter(g_gpu_profiler_queries[slot][p][0], GL_TIMESTAMP);
+    }
 
-    constexpr char k_sprite_render_vs_source[]
+    void end_gpu_pass(gpu_pass pass)
     {
-        "#version 430 core\n"
-
-        "layout(location = 0) in ivec3 vertexPosition;"
+        if (!g_gpu_profiler_enabled) return;
 
-        "layout(location = 0) uniform ivec4 camera;"
+        u32 const slot{ g_gpu_profiler_frame % k_gpu_profiler_latency };
+        u32 const p   { static_cast<u32>(pass) };
 
-        "out vec2 uv;"
-        "flat out uint index;"
+        glQueryCounter(g_gpu_profiler_queries[slot][p][1], GL_TIMESTAMP);
+        if (glPopDebugGroup != nullptr) glPopDebugGroup();
 
-        "void main(){"
-            "uv = vec2(float((gl_VertexID & 2) >> 1), float(gl_VertexID & 1));"
-            "index = vertexPosition.z;"
-            "ivec2 p = vertexPosition.xy >> 16;"
-            "gl_Position=vec4((2.0 * vec2(p - camera.xy) / camera.zw) - 1.0, 0, 1);"
-            "gl_Position.y *= -1.0;"
-        "}"
-    };
+        g_gpu_profiler_pending[slot][p] = true;
+    }
 
-    constexpr char k_sprite_render_fs_source[]
+    gpu_pass_stats get_gpu_pass_stats(gpu_pass pass)
     {
-        "#version 430 core\n"
+        static u32 sorted[k_gpu_profiler_window];
 
-        "layout(binding = 0) uniform usampler2DArray tex;"
+        u32 const p    { static_cast<u32>(pass) };
+        u32 const count{ min(g_gpu_profiler_sample_count[p], k_gpu_profiler_window) };
+        if (count == 0) return gpu_pass_stats{};
 
-        "in vec2 uv;"
-        "flat in uint index;"
+        __movsb(reinterpret_cast<u8*>(sorted), reinterpret_cast<u8 const*>(g_gpu_profiler_samples[p]), count * sizeof(u32));
 
-        "void main(){"
-            "gl_FragColor=vec4(texture(tex, vec3(uv, index)))/255.0;"
-        "}"
-    };
-    
-#if 0
-    constexpr char k_particle_render_vs_source[]
+        // Insertion sort, the window is small.
+        u64 sum{ 0 };
+        for (u32 i{ 0 }; i < count; ++i)
+        {
+            u32 const value{ sorted[i] };
+            sum += value;
+
+            u32 j{ i };
+            for (; (j > 0) && (sorted[j - 1] > value); --j)
+            {
+                sorted[j] = sorted[j - 1];
+            }
+            sorted[j] = value;
+        }
+
+        u32 remainder;
+        return gpu_pass_stats{
+            sorted[0],
+            _udiv64(sum, count, &remainder),
+            sorted[(((count * 99) + 99) / 100) - 1],
+            count
+        };
+    }
+
+    // Moves on to the next frame, reading back the queries recorded the last time its slot was used.
+    void collect_gpu_profiler_frame()
     {
-        "#version 430 core\n"
+        if (!g_gpu_profiler_enabled) return;
 
-        "layout(location = 0) in ivec2 vertexPosition;"
+        u32 const slot{ (++g_gpu_profiler_frame) % k_gpu_profiler_latency };
 
-        "layout(location = 0) uniform ivec4 camera;"
+        for (u32 p{ 0 }; p < k_gpu_pass_count; ++p)
+        {
+            if (!g_gpu_profiler_pending[slot][p]) continue;
+            g_gpu_profiler_pending[slot][p] = false;
 
-        "out vec2 c;"
+            GLint available;
+            glGetQueryObjectiv(g_gpu_profiler_queries[slot][p][1], GL_QUERY_RESULT_AVAILABLE, &available);
+            if (!available) continue;
 
-        "void main(){"
-#if 0
-            "float x=-1+float((gl_VertexID&1)<<2);"
-            "float y=-1+float((gl_VertexID&2)<<1);"
-            "gl_Position=vec4(x,y,0,1);"
-#else
-            "vec2 p = vertexPosition/65536.;"
-            "c=vec2((cos(gl_VertexID) + 1.0)/2.0,(sin(gl_VertexID) + 1.0)/2.0);"
+            GLuint64 begin, end;
+            glGetQueryObjectui64v(g_gpu_profiler_queries[slot][p][0], GL_QUERY_RESULT, &begin);
+            glGetQueryObjectui64v(g_gpu_profiler_queries[slot][p][1], GL_QUERY_RESULT, &end  );
 
-            "gl_Position=vec4((2.0 * vec2(p - camera.xy) / camera.zw) - 1.0, 0, 1);"
-            "gl_Position.y *= -1.0;"
-#endif
-        "}"
-    };
+            GLuint64 const elapsed{ end - begin };
+            g_gpu_profiler_samples[p][g_gpu_profiler_sample_count[p]++ % k_gpu_profiler_window] =
+                (elapsed > 0xFFFFFFFFUi64) ? 0xFFFFFFFFUi32 : static_cast<u32>(elapsed);
+        }
 
-    constexpr char k_particle_render_fs_source[]
+        #ifdef _DEBUG
+        // Report the statistics once a second.
+        if ((g_gpu_profiler_frame % 60) == 0)
+        {
+            for (u32 p{ 0 }; p < k_gpu_pass_count; ++p)
+            {
+                gpu_pass_stats const stats{ get_gpu_pass_stats(static_cast<gpu_pass>(p)) };
+                if (stats.sample_count == 0) continue;
+
+                G21_DEBUG_PRINT("#DEBUG: GPU pass ");
+                WriteConsoleA(_g21_debug_out, k_gpu_pass_names[p], static_cast<DWORD>(lstrlenA(k_gpu_pass_names[p])), nullptr, nullptr);
+                G21_DEBUG_PRINT(" min/avg/p99: ");
+                G21_DEBUG_PRINT(stats.min / 1000);
+                G21_DEBUG_PRINT("/");
+                G21_DEBUG_PRINT(stats.avg / 1000);
+                G21_DEBUG_PRINT("/");
+                G21_DEBUG_PRINT(stats.p99 / 1000);
+                G21_DEBUG_PRINT("us\n");
+            }
+        }
+        #endif
+    }
+
+    void write_gpu_profiler_report()
     {
-        "#version 430 core\n"
+        static char csv[64 * (k_gpu_pass_count + 1)];
 
-        "layout(location = 0) uniform ivec4 camera;"
-        "layout(location = 1) uniform ivec2 res;"
+        if (!g_gpu_profiler_enabled) return;
 
-        "layout(binding = 0) uniform isampler2DRect tex;"
+        char* p{ append_text(csv, "pass,samples,min_ns,avg_ns,p99_ns\n") };
+        for (u32 i{ 0 }; i < k_gpu_pass_count; ++i)
+        {
+            gpu_pass_stats const stats{ get_gpu_pass_stats(static_cast<gpu_pass>(i)) };
+
+            p = append_text(p, k_gpu_pass_names[i]);
+            *(p++) = ',';
+            p = append_u32(p, stats.sample_count);
+            *(p++) = ',';
+            p = append_u32(p, stats.min);
+            *(p++) = ',';
+            p = append_u32(p, stats.avg);
+            *(p++) = ',';
+            p = append_u32(p, stats.p99);
+            *(p++) = '\n';
+        }
 
-        "in vec2 c;"
+        write_report_file("gpu_profile.csv", csv, p);
+    }
 
-        "void main(){"
-#if 0
-            "int x = int(camera.x + (gl_FragCoord.x/float(res.x))*camera.z);"
-            "int y = int(camera.y + ((float(res.y) - gl_FragCoord.y)/float(res.y))*camera.w);"
-            "vec2 value = vec2(texelFetch(tex, ivec2(x, y)).xy / 65536.) / 40.;"
-            "gl_FragColor=vec4(0.5 + value.x/2., 0.5 + value.y/2., 0, 1);"
+    #define G21_GPU_PASS_BEGIN(pass) begin_gpu_pass(gpu_pass::pass)
+    #define G21_GPU_PASS_END(pass)   end_gpu_pass(gpu_pass::pass)
 #else
-            "gl_FragColor=vec4(0.2, 0.2, 0.2, 0.0495);"
+    #define G21_GPU_PASS_BEGIN(pass) ((void)0)
+    #define G21_GPU_PASS_END(pass)   ((void)0)
 #endif
-        "}"
-    };
 
-#   define PARTICLE_DRAG 0.94
-#   define LOCAL_SIZE_X 32
-#   define PARTICLE_STRUCT                                  \
-        "struct particle{"                                  \
-            "ivec2 cur_pos;"                                \
-            "ivec2 old_pos;" /*TODO: switch to velocity?*/  \
-            "uint life;"                                    \
-          /*"uint _pad;"*/                                  \
-        "};"
+    // Input latency.
+    // Every key event is stamped when the window procedure sees it, and every presented frame gets a fence. When the
+    // fence signals, the GPU has finished the frame and its swap, and each event the frame was the first to cover gets
+    // its latency measured against that. Normally a tick runs as soon as it is due, wherever that falls between two
+    // vblanks, and the driver may queue up a few frames. With --late-latch, a due tick is held back until just before
+    // the predicted vblank and every frame is waited for, so that nothing queues up. The vblanks are predicted from
+    // when the latched frames finish, since with vsync the swap makes them wait for one.
 
-    // This merely mimics the definition above.
-    struct cs_particle
+    constexpr u32 k_max_frames_in_flight{ 8 };
+    constexpr u32 k_max_latency_samples { 4096 };
+
+    struct frame_in_flight
     {
-        alignas(8) vec2<fixed16_16> cur_pos;
-        alignas(8) vec2<fixed16_16> old_pos;
-        u32                         life;
-        u32 : 1; // Padding.
+        GLsync fence;
+        u32    input_events_end; // The events sampled before this frame.
     };
-    static_assert(sizeof(cs_particle) == 24);
 
-    constexpr char k_particle_emit_cs_source[]
+    frame_in_flight g_frames_in_flight[k_max_frames_in_flight];
+    u32             g_frames_submitted;
+    u32             g_frames_finished;
+    u64             g_last_frame_finish; // 0 if the wait for the last frame failed.
+
+    u32 g_latency_samples[k_max_latency_samples]; // In microseconds.
+    u32 g_latency_sample_count;
+
+    // All in counter ticks.
+    u32 g_counter_frequency;
+    u32 g_vblank_period;
+    u32 g_latch_margin;      // How long before the vblank to latch.
+    u32 g_latch_on_time;     // Latched frames in a row that made their vblank.
+    u64 g_last_vblank;       // 0 if not known.
+    u64 g_predicted_vblank;  // The vblank the pending tick aims for.
+    u64 g_latch_time;        // When the pending tick runs, 0 if none is pending.
+
+    void init_latency()
     {
-        "#version 430\n"
-        "#extension GL_ARB_compute_shader : enable\n"
-        "#extension GL_ARB_shader_storage_buffer_object : enable\n"
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        g_counter_frequency = static_cast<u32>(frequency.QuadPart);
 
-        PARTICLE_STRUCT
+        // A refresh rate of 0 or 1 means the hardware default.
+        i32 refresh_rate{ GetDeviceCaps(g_hDC, VREFRESH) };
+        if (refresh_rate <= 1) refresh_rate = 60;
 
-        "layout(std430,binding=0) buffer _0{"
-            "particle particles[];"
-        "};"
+        g_vblank_period = g_counter_frequency / static_cast<u32>(refresh_rate);
+        g_latch_margin  = g_vblank_period / 4;
+    }
 
-        "layout(location = 0) uniform int particle_count;"
-        "layout(location = 1) uniform ivec2 emit_location;"
+    // Measures the input events covered by the frames that have finished. With wait, waits for every frame to finish.
+    // A frame whose wait failed has no finish time, so its events are dropped rather than measured against the time
+    // the failure came back.
+    void complete_frames(bool wait)
+    {
+        while (g_frames_finished != g_frames_submitted)
+        {
+            frame_in_flight const& frame{ g_frames_in_flight[g_frames_finished % k_max_frames_in_flight] };
 
-        "layout (local_size_x = " G21_STRINGIFY(LOCAL_SIZE_X) ", local_size_y = 1, local_size_z = 1) in; "
-        "void main(){"
-            "uint gid = gl_GlobalInvocationID.x;"
+            GLenum const status{ glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? GL_TIMEOUT_IGNORED : 0) };
+            if (status == GL_TIMEOUT_EXPIRED) return;
 
-            "if (gid < particle_count){"
-                "particle p;"
+            if (status == GL_WAIT_FAILED)
+            {
+                glDeleteSync(frame.fence);
+                ++g_frames_finished;
+                g_last_frame_finish     = 0;
+                g_input_events_measured = frame.input_events_end;
+                continue;
+            }
 
-                "p.old_pos = emit_location;"
-                "float f = float(gid) / float(particle_count);"
-                "float c = cos(f * 6.28318)*sin(gid) + float(1 - int((gid & 1) << 1))/2.0;"
-                "float s = sin(f * 6.28318)*sin(gid) + float(1 - int(gid & 2))/2.0;"
-                "p.cur_pos = p.old_pos + ivec2(int(c * 200000.0), int(s * 200000.0));"
-                "p.life = gid/20 + 50;"
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
 
-                "particles[gid] = p;"
-            "}"
-        "}"
-    };
+            glDeleteSync(frame.fence);
+            ++g_frames_finished;
+            g_last_frame_finish = static_cast<u64>(now.QuadPart);
 
-    constexpr char k_particle_update_cs_source[]
-    {
-        "#version 430\n"
-        "#extension GL_ARB_compute_shader : enable\n"
-        "#extension GL_ARB_shader_storage_buffer_object : enable\n"
+            u32 measured{ g_input_events_measured };
+            for (; measured != frame.input_events_end; ++measured)
+            {
+                if (g_latency_sample_count == k_max_latency_samples) continue;
 
-        PARTICLE_STRUCT
+                u64 const event{ g_input_event_times[measured % k_max_input_events] };
+                g_latency_samples[g_latency_sample_count++] = ticks_to_microseconds(static_cast<u32>(g_last_frame_finish - event), g_counter_frequency);
+            }
+            g_input_events_measured = measured;
+        }
+    }
 
-        "layout(std430,binding=0) buffer _0{"
-            "particle particles[];"
-        "};"
-        "layout(std430,binding=1) writeonly buffer _1{"
-            "uint indices[];"
-        "};"
-        "layout(std430,binding=2) buffer _2{"
-            "uint alive_counter;"
-        "};"
+    // Called after every present, with how many input events the simulation had taken in for the frame.
+    void submit_frame(u32 input_events_end)
+    {
+        if (!g_latency_report && !g_late_latch) return;
 
-        "layout(location = 0) uniform int particle_count;"
-        "layout(binding = 0) uniform isampler2DRect tex;"
+        if ((g_frames_submitted - g_frames_finished) == k_max_frames_in_flight)
+        {
+            complete_frames(true);
+        }
 
-        "layout (local_size_x=" G21_STRINGIFY(LOCAL_SIZE_X) ", local_size_y=1, local_size_z=1) in; "
-        "void main(){"
-            "uint gid = gl_GlobalInvocationID.x;"
+        g_frames_in_flight[g_frames_submitted++ % k_max_frames_in_flight] = frame_in_flight{
+            glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0),
+            input_events_end
+        };
 
-            "if (gid < particle_count){"
-                "particle p = particles[gid];"
+        if (!g_late_latch)
+        {
+            complete_frames(false);
+            return;
+        }
 
-                "if (p.life != 0){"
-                    "indices[atomicAdd(alive_counter,1)] = gid;"
-                    "p.life--;"
-                        
-                    "ivec2 b = texelFetch(tex, p.cur_pos >> 16).xy >> 8;"
+        complete_frames(true);
+        if (!g_vsync) return;
 
-                    "ivec2 d = p.cur_pos - p.old_pos;"
-                    "p.old_pos = p.cur_pos;"
-                    "p.cur_pos += ivec2(((vec2(d)/32768.) * " G21_STRINGIFY(PARTICLE_DRAG) ") * 32768.) + b * 2;"
+        // Latch earlier if the frame missed the vblank it aimed for, and a little later again after a while of making it.
+        // Without a finish time there is nothing to go from, and the next tick does not wait.
+        if ((g_predicted_vblank != 0) && (g_last_frame_finish != 0))
+        {
+            if (g_last_frame_finish > (g_predicted_vblank + (g_vblank_period / 2)))
+            {
+                g_latch_margin  = min(g_latch_margin + (g_vblank_period / 8), (g_vblank_period * 3) / 4);
+                g_latch_on_time = 0;
+            }
+            else if (++g_latch_on_time == 120)
+            {
+                g_latch_margin  = max(g_latch_margin - (g_vblank_period / 32), g_vblank_period / 16);
+                g_latch_on_time = 0;
+            }
+        }
 
-                    "particles[gid] = p;"
-                "}"
-            "}"
-        "}"
-    };
-#endif
+        g_last_vblank = g_last_frame_finish;
+    }
 
-    GLuint compile_shader(GLenum shader_type, GLchar const* source)
+    // Called once a tick is due. Returns true if it can run now, or false to hold it back until g_latch_time.
+    bool latch_tick(u64 now)
     {
-        // Create and compile the shader.
-        GLuint const shader_id{ glCreateShader(shader_type) };
-        glShaderSource (shader_id, 1, &source, nullptr);
-        glCompileShader(shader_id);
+        if (!g_late_latch) return true;
 
-        #ifdef _DEBUG
-        // Check for problems.
+        if (g_latch_time == 0)
         {
-            GLint result{ GL_FALSE }, log_length{ 0 };
-            glGetShaderiv(shader_id, GL_COMPILE_STATUS, &result);
-            glGetShaderiv(shader_id, GL_INFO_LOG_LENGTH, &log_length);
-            if (log_length > 0 && !result)
+            // Without vsync, or a recent vblank to go from, there is nothing to wait for.
+            if (!g_vsync || (g_last_vblank == 0) || ((now - g_last_vblank) >= 0x80000000Ui64))
             {
-                static GLchar buffer[1024];
-                if (log_length > sizeof(buffer))
-                {
-                    log_length = sizeof(buffer);
-                }
-                glGetShaderInfoLog(shader_id, log_length, nullptr, buffer);
-                WriteConsoleA(_g21_debug_out, buffer, log_length, nullptr, nullptr);
-                __fastfail(FAST_FAIL_FATAL_APP_EXIT);
+                g_predicted_vblank = 0;
+                return true;
             }
+
+            // The first vblank we can still latch for.
+            u32 const periods{ ((static_cast<u32>(now - g_last_vblank) + g_latch_margin) / g_vblank_period) + 1 };
+            g_predicted_vblank = g_last_vblank + __emulu(periods, g_vblank_period);
+            g_latch_time       = g_predicted_vblank - g_latch_margin;
         }
-        #endif
 
-        // Return the id.
-        return shader_id;
+        if (now < g_latch_time) return false;
+
+        g_latch_time = 0;
+        return true;
     }
 
-    __forceinline void load_shaders()
+    // Insertion sort, for reports that only run once.
+    void sort_samples(u32* values, u32 count)
     {
-        G21_DEBUG_PRINT("#DEBUG: Loading shaders.\n");
+        for (u32 i{ 1 }; i < count; ++i)
+        {
+            u32 const value{ values[i] };
 
-        /*
-        // Load the compute shader for the particle emitter.
-        g_compute_particle_emitter_program_id = glCreateProgram();
-        glAttachShader(
-            g_compute_particle_emitter_program_id,
-            compile_shader(GL_COMPUTE_SHADER, k_particle_emit_cs_source)
-        );
-        glLinkProgram(g_compute_particle_emitter_program_id);
+            u32 j{ i };
+            for (; (j > 0) && (values[j - 1] > value); --j)
+            {
+                values[j] = values[j - 1];
+            }
+            values[j] = value;
+        }
+    }
 
-        // Load the compute shader for the particle updater.
-        g_compute_particle_updater_program_id = glCreateProgram();
-        glAttachShader(
-            g_compute_particle_updater_program_id,
-            compile_shader(GL_COMPUTE_SHADER, k_particle_update_cs_source)
-        );
-        glLinkProgram(g_compute_particle_updater_program_id);
+    // The nearest rank percentile of sorted values, 0 giving the smallest and 100 the largest.
+    u32 get_percentile(u32 const* sorted, u32 count, u32 percent)
+    {
+        return (count == 0) ? 0 : sorted[max(((count * percent) + 99) / 100, 1U) - 1];
+    }
 
-        // Load the vertex and fragment shaders for particle rendering.
-        g_render_program_id = glCreateProgram();
-        glAttachShader(
-            g_render_program_id,
-            compile_shader(GL_VERTEX_SHADER,   k_particle_render_vs_source)
-        );
-        glAttachShader(
-            g_render_program_id,
-            compile_shader(GL_FRAGMENT_SHADER, k_particle_render_fs_source)
-        );
-        glLinkProgram(g_render_program_id);
-        */
+    void write_latency_report()
+    {
+        if (!g_latency_report) return;
+
+        // Whatever is still in flight has been presented.
+        complete_frames(true);
+
+        u32 const count{ g_latency_sample_count };
+        sort_samples(g_latency_samples, count);
+
+        auto const percentile{ [count](u32 p) { return get_percentile(g_latency_samples, count, p); } };
+
+        G21_DEBUG_PRINT("#DEBUG: Input to present latency p50/p90/p99: ");
+        G21_DEBUG_PRINT(percentile(50));
+        G21_DEBUG_PRINT("/");
+        G21_DEBUG_PRINT(percentile(90));
+        G21_DEBUG_PRINT("/");
+        G21_DEBUG_PRINT(percentile(99));
+        G21_DEBUG_PRINT("us over ");
+        G21_DEBUG_PRINT(count);
+        G21_DEBUG_PRINT(" events.\n");
+
+        // Every run adds a line, so that the configurations can be compared side by side.
+        char line[192];
+        char* p{ line };
+        if (GetFileAttributesA("latency.csv") == INVALID_FILE_ATTRIBUTES)
+        {
+            p = append_text(p, "vsync,late_latch,samples,min_us,p50_us,p90_us,p99_us,max_us\n");
+        }
 
-        // Load the vertex and fragment shaders for background rendering.
-        g_background_renderer_program_id = glCreateProgram();
-        glAttachShader(
-            g_background_renderer_program_id,
-            compile_shader(GL_VERTEX_SHADER, k_fullscreen_quad_vs_source)
-        );
-        glAttachShader(
-            g_background_renderer_program_id,
-            compile_shader(GL_FRAGMENT_SHADER, k_background_render_fs_source)
-        );
-        glLinkProgram(g_background_renderer_program_id);
+        p = append_text(p, g_vsync      ? "on," : "off,");
+        p = append_text(p, g_late_latch ? "on," : "off,");
+        p = append_u32 (p, count);
+        *(p++) = ',';
+        p = append_u32 (p, percentile(0));
+        *(p++) = ',';
+        p = append_u32 (p, percentile(50));
+        *(p++) = ',';
+        p = append_u32 (p, percentile(90));
+        *(p++) = ',';
+        p = append_u32 (p, percentile(99));
+        *(p++) = ',';
+        p = append_u32 (p, percentile(100));
+        *(p++) = '\n';
+
+        write_report_file("latency.csv", line, p, report_mode::append);
+    }
 
-        // Load the vertex and fragment shaders for texture blitting.
-        g_upscaler_program_id = glCreateProgram();
-        glAttachShader(
-            g_upscaler_program_id,
-            compile_shader(GL_VERTEX_SHADER, k_fullscreen_quad_vs_source)
-        );
-        glAttachShader(
-            g_upscaler_program_id,
-            compile_shader(GL_FRAGMENT_SHADER, k_texture_blit_fs_source)
-        );
-        glLinkProgram(g_upscaler_program_id);
+    void write_exit_reports()
+    {
+        write_latency_report();
 
-        // Load the vertex and fragment shaders for sprite rendering.
-        g_sprite_render_program_id = glCreateProgram();
-        glAttachShader(
-            g_sprite_render_program_id,
-            compile_shader(GL_VERTEX_SHADER,   k_sprite_render_vs_source)
-        );
-        glAttachShader(
-            g_sprite_render_program_id,
-            compile_shader(GL_FRAGMENT_SHADER, k_sprite_render_fs_source)
-        );
-        glLinkProgram(g_sprite_render_program_id);
+        #if G21_ENABLE_GPU_PROFILER
+        write_gpu_profiler_report();
+        #endif
+
+        #if G21_ENABLE_TRACE
+        write_trace();
+        #endif
     }
 
-    __forceinline void init_gl_context()
+    // TODO: This could be compressed
+
+    constexpr char k_fullscreen_quad_vs_source[]
     {
-        G21_DEBUG_PRINT("#DEBUG: Initializing OpenGL context.\n");
+        "#version 430 core\n"
 
-        // Describe the pixel format we want.
-        static PIXELFORMATDESCRIPTOR pfd{};
-        pfd.nSize      = sizeof(PIXELFORMATDESCRIPTOR);
-        pfd.nVersion   = 1;
-        pfd.dwFlags    = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
-        pfd.iPixelType = PFD_TYPE_RGBA;
-        pfd.cColorBits = 32;
-        pfd.iLayerType = PFD_MAIN_PLANE;
+        "out vec2 uv;"
 
-        // Set the pixel format.
-        SetPixelFormat(g_hDC, ChoosePixelFormat(g_hDC, &pfd), &pfd);
+        "void main()"
+        "{"
+            "float x=-1+float((gl_VertexID&1)<<2);"
+            "float y=-1+float((gl_VertexID&2)<<1);"
+            "uv.x=(x+1)*0.5;"
+            "uv.y=(y+1)*0.5;"
+            "gl_Position=vec4(x,y,0,1);"
+        "}"
+    };
 
-        // Create the (maybe temporary) OpenGL context.
-        HGLRC const hGLRC = wglCreateContext(g_hDC);
-        wglMakeCurrent(g_hDC, hGLRC);
+    // Lights the background with the visible point lights, see shade_light_pixel(). Every value is computed with the
+    // same integer operations as on the CPU, so the two match exactly.
+    constexpr char k_background_render_fs_source[]
+    {
+        "#version 430 core\n"
 
-        #ifdef _DEBUG
-        // Load wglCreateContextAttribsARB so that we can create a debug context.
-        auto const wglCreateContextAttribsARB = 
-            reinterpret_cast<PFNWGLCREATECONTEXTATTRIBSARBPROC>(wglGetProcAddress("wglCreateContextAttribsARB"));
+        "layout(location = 0) uniform ivec4 camera;"
+
+        "layout(binding = 0) uniform usampler2DRect tex;"
+        "layout(binding = 1) uniform isampler2DRect sdf;"
+
+        // See light_buffer.
+        "layout(std430,binding=0) readonly buffer _0{"
+            "uint tile_masks[112];"
+            "uvec4 lights[];"
+        "};"
+
+        "in vec2 uv;"
+
+        // See light_shadow().
+        "int shadow(ivec2 p,ivec2 d,int len){"
+            "ivec2 a=abs(d),s=sign(d);"
+            "int k=256;"
+            "for(int t=1,i=0;(t<len)&&(i<48);++i){"
+                "int h=texelFetch(sdf,p+s*(a*t/len)).r;"
+                "if(h<=0)return 0;"
+                "k=min(k,h*64/t);"
+                "t+=max(h>>4,1);"
+            "}"
+            "return k;"
+        "}"
+
+        "void main(){"
+            "ivec2 o=ivec2(vec2(uv.x,1-uv.y)*camera.zw);"
+            "ivec2 p=camera.xy+o;"
+            "uint c=texelFetch(tex,p).r;"
+            "ivec3 l=ivec3(80);"
+            "if(c!=0u){"
+                "uint m=tile_masks[((o.y>>5)*14)+(o.x>>5)];"
+                "while(m!=0u){"
+                    "uvec4 L=lights[findLSB(m)];"
+                    "m&=m-1u;"
+                    "ivec2 d=ivec2(L.x&0xFFFF,L.x>>16)-p;"
+                    "int d2=(d.x*d.x)+(d.y*d.y);"
+                    "int r2=int(L.y*L.y);"
+                    "if(d2>=r2)continue;"
+
+                    // The float root is only close, so round it to the integer one.
+                    "int len=int(sqrt(float(d2)));"
+                    "if((len*len)>d2)--len;"
+                    "else if(((len+1)*(len+1))<=d2)++len;"
+
+                    "int w=((r2-d2)<<8)/r2;"
+                    "if(len>0)w=(w*shadow(p,d,len))>>8;"
+                    "l+=(ivec3(L.z&255,(L.z>>8)&255,L.z>>16)*w)>>8;"
+                "}"
+            "}"
+            "gl_FragColor=vec4(vec3(min((uvec3(l)*c)>>8,255u))/255.,1);"
+        "}"
+    };
+
+    // Generates the same background as compute_background_texture(), including the fractal noise it is made from. The
+    // white noise comes from a sequential generator, so it is made on the CPU and passed in. Every value is computed
+    // with the same integer operations as on the CPU, so the two match exactly.
+    constexpr char k_background_generate_cs_source[]
+    {
+        "#version 430\n"
+        "#extension GL_ARB_compute_shader : enable\n"
+        "#extension GL_ARB_shader_storage_buffer_object : enable\n"
+
+        "layout(std430,binding=0) readonly buffer _0{"
+            "uint solid[];"
+        "};"
+
+        // g_white_noise_texture, four pixels to a word.
+        "layout(std430,binding=1) readonly buffer _1{"
+            "uint noise[];"
+        "};"
+
+        "layout(location = 0) uniform int width;"
+        "layout(binding = 0, r8ui) writeonly uniform uimage2DRect img;"
+
+        "uint white(uint x, uint y){"
+            "uint n = y * uint(width) + x;"
+            "return (noise[n >> 2] >> ((n & 3u) << 3)) & 255u;"
+        "}"
+
+        // See compute_fractal_noise_texture().
+        "uint fractal(uint x, uint y){"
+            "uint sum = 0u;"
+            "for (uint i = 0u; i < 4u; ++i){"
+                "uint s = 4u - i, f = 1u << s;"
+                "uint yi = y >> s, yf = y & (f - 1u);"
+                "uint xi = x >> s, xf = x & (f - 1u);"
+                "uint t = white(xi, yi) * (f - yf) * (f - xf) + white(xi + 1u, yi) * (f - yf) * xf"
+                     " + white(xi, yi + 1u) * yf * (f - xf) + white(xi + 1u, yi + 1u) * yf * xf;"
+                "sum += ((t >> (s * 2u)) & 255u) >> (i + 1u);"
+            "}"
+            "return sum & 255u;"
+        "}"
+
+        "layout (local_size_x = 8, local_size_y = 8, local_size_z = 1) in; "
+        "void main(){"
+            "uvec2 p = gl_GlobalInvocationID.xy;"
+            "uint n = p.y * uint(width) + p.x;"
+            "uint c = 0u;"
+
+            "if ((solid[n >> 5] & (1u << (n & 31u))) == 0u){"
+                "uint by = p.y / 8u, fy = p.y % 8u;"
+                "uint ox = ((by & 1u) == 1u) ? 8u : 0u;"
+                "uint bx = (p.x + ox) / 16u, fx = (p.x + ox) % 16u;"
+
+                "if (fx < 1u || fy < 1u){"
+                    "c = white(p.x, p.y) / 16u;"
+                "}else{"
+                    "c = 40u + white(bx, by) / 3u;"
+                    "c = ((c << 2) - c + fractal(p.x, p.y)) / 6u;"
+                    "c = (c & ~3u) | (white(p.x, p.y) & 1u);"
+                "}"
+            "}"
+
+            "imageStore(img, ivec2(p), uvec4(c));"
+        "}"
+    };
+
+    constexpr char k_texture_blit_fs_source[]
+    {
+        "#version 430 core\n"
+
+        "layout(binding = 0) uniform sampler2D tex;"
+
+        "in vec2 uv;"
+
+        "void main(){"
+            "gl_FragColor=vec4(texture(tex, uv).rgb,1);"
+        "}"
+    };
+
+    // Draws a progress bar across the middle of the viewport, 'progress' being the steps done and the step count.
+    constexpr char k_loading_screen_fs_source[]
+    {
+        "#version 430 core\n"
+
+        "layout(location = 0) uniform ivec2 progress;"
+
+        "in vec2 uv;"
+
+        "void main(){"
+            "vec2 p=(uv-vec2(.25,.48))/vec2(.5,.04);"
+            "float c=0;"
+            "if(all(greaterThanEqual(p,vec2(0)))&&all(lessThan(p,vec2(1))))c=((p.x*progress.y)<progress.x)?.8:.25;"
+            "gl_FragColor=vec4(c,c,c,1);"
+        "}"
+    };
+
+    constexpr char k_sprite_render_vs_source[]
+    {
+        "#version 430 core\n"
+
+        "layout(location = 0) in ivec3 vertexPosition;"
+
+        "layout(location = 0) uniform ivec4 camera;"
+
+        // See sprite_atlas_rect.
+        "layout(binding = 2) uniform usampler2DRect rects;"
+
+        "out vec2 texel;"
+        "flat out uvec2 page;"
+
+        "void main(){"
+            "vec2 uv = vec2(float((gl_VertexID & 2) >> 1), float(gl_VertexID & 1));"
+            "uvec2 r = texelFetch(rects, ivec2(vertexPosition.z, 0)).xy;"
+            "texel = vec2(r.x & 0xFFFFu, r.x >> 16) + uv * vec2(r.y & 0xFFu, (r.y >> 8) & 0xFFu);"
+            "page = uvec2((r.y >> 16) & 0xFFu, r.y >> 24);"
+            "ivec2 p = vertexPosition.xy >> 16;"
+            "gl_Position=vec4((2.0 * vec2(p - camera.xy) / camera.zw) - 1.0, 0, 1);"
+            "gl_Position.y *= -1.0;"
+        "}"
+    };
+
+    constexpr char k_sprite_render_fs_source[]
+    {
+        "#version 430 core\n"
+
+        // Two 4-bit palette indices per texel, the left pixel in the low bits.
+        "layout(binding = 0) uniform usampler2DArray atlas;"
+        "layout(binding = 1) uniform usampler2D palette;"
+
+        "in vec2 texel;"
+        "flat in uvec2 page;"
+
+        "void main(){"
+            "ivec2 t = ivec2(texel);"
+            "uint b = texelFetch(atlas, ivec3(t.x >> 1, t.y, page.x), 0).r;"
+            "uint i = (b >> ((t.x & 1) << 2)) & 15u;"
+            "gl_FragColor=vec4(texelFetch(palette, ivec2(i, page.y), 0))/255.0;"
+        "}"
+    };
+    
+#if G21_ENABLE_PARTICLES
+    constexpr char k_particle_render_vs_source[]
+    {
+        "#version 430 core\n"
+
+        "layout(location = 0) in ivec2 vertexPosition;"
+
+        "layout(location = 0) uniform ivec4 camera;"
+
+        "out vec2 c;"
+
+        "void main(){"
+#if 0
+            "float x=-1+float((gl_VertexID&1)<<2);"
+            "float y=-1+float((gl_VertexID&2)<<1);"
+            "gl_Position=vec4(x,y,0,1);"
+#else
+            "vec2 p = vertexPosition/65536.;"
+            "c=vec2((cos(gl_VertexID) + 1.0)/2.0,(sin(gl_VertexID) + 1.0)/2.0);"
+
+            "gl_Position=vec4((2.0 * vec2(p - camera.xy) / camera.zw) - 1.0, 0, 1);"
+            "gl_Position.y *= -1.0;"
+#endif
+        "}"
+    };
+
+    constexpr char k_particle_render_fs_source[]
+    {
+        "#version 430 core\n"
+
+        "layout(location = 0) uniform ivec4 camera;"
+        "layout(location = 1) uniform ivec2 res;"
+
+        "layout(binding = 0) uniform isampler2DRect tex;"
+
+        "in vec2 c;"
+
+        "void main(){"
+#if 0
+            "int x = int(camera.x + (gl_FragCoord.x/float(res.x))*camera.z);"
+            "int y = int(camera.y + ((float(res.y) - gl_FragCoord.y)/float(res.y))*camera.w);"
+            "vec2 value = vec2(texelFetch(tex, ivec2(x, y)).xy / 65536.) / 40.;"
+            "gl_FragColor=vec4(0.5 + value.x/2., 0.5 + value.y/2., 0, 1);"
+#else
+            "gl_FragColor=vec4(0.2, 0.2, 0.2, 0.0495);"
+#endif
+        "}"
+    };
+
+#   define PARTICLE_DRAG 0.94
+#   define PARTICLE_RESTITUTION 0.5
+#   define LOCAL_SIZE_X 32
+#   define FLOW_TILE_COLUMNS 18
+#   define FLOW_TILE_ROWS 35
+#   define PARTICLE_STRUCT                                  \
+        "struct particle{"                                  \
+            "ivec2 cur_pos;"                                \
+            "ivec2 old_pos;" /*TODO: switch to velocity?*/  \
+            "uint life;"                                    \
+          /*"uint _pad;"*/                                  \
+        "};"
+
+    // This merely mimics the definition above.
+    struct cs_particle
+    {
+        alignas(8) vec2<fixed16_16> cur_pos;
+        alignas(8) vec2<fixed16_16> old_pos;
+        u32                         life;
+        u32 : 1; // Padding.
+    };
+    static_assert(sizeof(cs_particle) == 24);
+
+    constexpr char k_particle_emit_cs_source[]
+    {
+        "#version 430\n"
+        "#extension GL_ARB_compute_shader : enable\n"
+        "#extension GL_ARB_shader_storage_buffer_object : enable\n"
+
+        PARTICLE_STRUCT
+
+        "layout(std430,binding=0) buffer _0{"
+            "particle particles[];"
+        "};"
+
+        "layout(location = 0) uniform int particle_count;"
+        "layout(location = 1) uniform ivec2 emit_location;"
+
+        "layout (local_size_x = " G21_STRINGIFY(LOCAL_SIZE_X) ", local_size_y = 1, local_size_z = 1) in; "
+        "void main(){"
+            "uint gid = gl_GlobalInvocationID.x;"
+
+            "if (gid < particle_count){"
+                "particle p;"
+
+                "p.old_pos = emit_location;"
+                "float f = float(gid) / float(particle_count);"
+                "float c = cos(f * 6.28318)*sin(gid) + float(1 - int((gid & 1) << 1))/2.0;"
+                "float s = sin(f * 6.28318)*sin(gid) + float(1 - int(gid & 2))/2.0;"
+                "p.cur_pos = p.old_pos + ivec2(int(c * 200000.0), int(s * 200000.0));"
+                "p.life = gid/20 + 50;"
+
+                "particles[gid] = p;"
+            "}"
+        "}"
+    };
+
+    constexpr char k_particle_update_cs_source[]
+    {
+        "#version 430\n"
+        "#extension GL_ARB_compute_shader : enable\n"
+        "#extension GL_ARB_shader_storage_buffer_object : enable\n"
+
+        PARTICLE_STRUCT
+
+        "layout(std430,binding=0) buffer _0{"
+            "particle particles[];"
+        "};"
+        "layout(std430,binding=1) writeonly buffer _1{"
+            "uint indices[];"
+        "};"
+        "layout(std430,binding=2) buffer _2{"
+            "uint alive_counter;"
+        "};"
+        "layout(std430,binding=3) buffer _3{"
+            "uint agent_tiles[];"
+        "};"
+
+        "layout(location = 0) uniform int particle_count;"
+        "layout(binding = 0) uniform isampler2DRect tex;"
+
+        "layout (local_size_x=" G21_STRINGIFY(LOCAL_SIZE_X) ", local_size_y=1, local_size_z=1) in; "
+        "void main(){"
+            "uint gid = gl_GlobalInvocationID.x;"
+
+            "if (gid < particle_count){"
+                "particle p = particles[gid];"
+
+                "if (p.life != 0){"
+                    "indices[atomicAdd(alive_counter,1)] = gid;"
+                    "p.life--;"
+                        
+                    // This is the only texel fetch: the force, the signed distance and the surface normal.
+                    "ivec4 t = texelFetch(tex, p.cur_pos >> 16);"
+
+                    "ivec2 d = p.cur_pos - p.old_pos;"
+                    "p.old_pos = p.cur_pos;"
+                    "vec2 v = vec2(d) * " G21_STRINGIFY(PARTICLE_DRAG) " + vec2((t.xy << 2) * 2);"
+
+                    // A step shorter than the distance to the nearest surface can never hit anything. Otherwise we
+                    // reflect the part of the step going into the surface, and push the particle out if inside.
+                    "float r = float(t.z << 8);"
+                    "if (r < 0. || dot(v, v) > r * r){"
+                        "vec2 n = vec2((t.w << 24) >> 24, t.w >> 8) / 64.;"
+                        "float vn = dot(v, n);"
+                        "if (vn < 0.) v -= n * (vn * (1. + " G21_STRINGIFY(PARTICLE_RESTITUTION) "));"
+                        "if (r < 0.) v -= n * r;"
+                    "}"
+
+                    "p.cur_pos += ivec2(v);"
+
+                    // Tell the pathfinder which tile we are in. Most particles share a tile with many others, so only
+                    // the first to arrive needs the atomic.
+                    "uvec2 c = uvec2(p.cur_pos >> 21);"
+                    "if (c.x < " G21_STRINGIFY(FLOW_TILE_COLUMNS) "u && c.y < " G21_STRINGIFY(FLOW_TILE_ROWS) "u){"
+                        "uint i = c.y * " G21_STRINGIFY(FLOW_TILE_COLUMNS) "u + c.x;"
+                        "if ((agent_tiles[i >> 5] & (1u << (i & 31u))) == 0u) atomicOr(agent_tiles[i >> 5], 1u << (i & 31u));"
+                    "}"
+
+                    "particles[gid] = p;"
+                "}"
+            "}"
+        "}"
+    };
+#endif
+
+    GLuint compile_shader(GLenum shader_type, GLchar const* source)
+    {
+        // Create and compile the shader.
+        GLuint const shader_id{ glCreateShader(shader_type) };
+        glShaderSource (shader_id, 1, &source, nullptr);
+        glCompileShader(shader_id);
+
+        #ifdef _DEBUG
+        // Check for problems.
+        {
+            GLint result{ GL_FALSE }, log_length{ 0 };
+            glGetShaderiv(shader_id, GL_COMPILE_STATUS, &result);
+            glGetShaderiv(shader_id, GL_INFO_LOG_LENGTH, &log_length);
+            if (log_length > 0 && !result)
+            {
+                static GLchar buffer[1024];
+                if (log_length > sizeof(buffer))
+                {
+                    log_length = sizeof(buffer);
+                }
+                glGetShaderInfoLog(shader_id, log_length, nullptr, buffer);
+                WriteConsoleA(_g21_debug_out, buffer, log_length, nullptr, nullptr);
+                __fastfail(FAST_FAIL_FATAL_APP_EXIT);
+            }
+        }
+        #endif
+
+        // Return the id.
+        return shader_id;
+    }
+
+    __forceinline void load_shaders()
+    {
+        G21_DEBUG_PRINT("#DEBUG: Loading shaders.\n");
+
+#if G21_ENABLE_PARTICLES
+        // The compute shaders are only loaded if the driver supports them, otherwise the particles are simulated on
+        // the CPU instead.
+        if (glDispatchCompute != nullptr)
+        {
+            // Load the compute shader for the particle emitter.
+            g_compute_particle_emitter_program_id = glCreateProgram();
+            glAttachShader(
+                g_compute_particle_emitter_program_id,
+                compile_shader(GL_COMPUTE_SHADER, k_particle_emit_cs_source)
+            );
+            glLinkProgram(g_compute_particle_emitter_program_id);
+
+            // Load the compute shader for the particle updater.
+            g_compute_particle_updater_program_id = glCreateProgram();
+            glAttachShader(
+                g_compute_particle_updater_program_id,
+                compile_shader(GL_COMPUTE_SHADER, k_particle_update_cs_source)
+            );
+            glLinkProgram(g_compute_particle_updater_program_id);
+        }
+
+        // Load the vertex and fragment shaders for particle rendering.
+        g_render_program_id = glCreateProgram();
+        glAttachShader(
+            g_render_program_id,
+            compile_shader(GL_VERTEX_SHADER,   k_particle_render_vs_source)
+        );
+        glAttachShader(
+            g_render_program_id,
+            compile_shader(GL_FRAGMENT_SHADER, k_particle_render_fs_source)
+        );
+        glLinkProgram(g_render_program_id);
+#endif
+
+        // Load the compute shader for generating the background, if supported.
+        if (glDispatchCompute != nullptr)
+        {
+            g_background_generator_program_id = glCreateProgram();
+            glAttachShader(
+                g_background_generator_program_id,
+                compile_shader(GL_COMPUTE_SHADER, k_background_generate_cs_source)
+            );
+            glLinkProgram(g_background_generator_program_id);
+        }
+
+        // Load the vertex and fragment shaders for background rendering.
+        g_background_renderer_program_id = glCreateProgram();
+        glAttachShader(
+            g_background_renderer_program_id,
+            compile_shader(GL_VERTEX_SHADER, k_fullscreen_quad_vs_source)
+        );
+        glAttachShader(
+            g_background_renderer_program_id,
+            compile_shader(GL_FRAGMENT_SHADER, k_background_render_fs_source)
+        );
+        glLinkProgram(g_background_renderer_program_id);
+
+        // Load the vertex and fragment shaders for the loading screen.
+        g_loading_screen_program_id = glCreateProgram();
+        glAttachShader(
+            g_loading_screen_program_id,
+            compile_shader(GL_VERTEX_SHADER, k_fullscreen_quad_vs_source)
+        );
+        glAttachShader(
+            g_loading_screen_program_id,
+            compile_shader(GL_FRAGMENT_SHADER, k_loading_screen_fs_source)
+        );
+        glLinkProgram(g_loading_screen_program_id);
+
+        // Load the vertex and fragment shaders for texture blitting.
+        g_upscaler_program_id = glCreateProgram();
+        glAttachShader(
+            g_upscaler_program_id,
+            compile_shader(GL_VERTEX_SHADER, k_fullscreen_quad_vs_source)
+        );
+        glAttachShader(
+            g_upscaler_program_id,
+            compile_shader(GL_FRAGMENT_SHADER, k_texture_blit_fs_source)
+        );
+        glLinkProgram(g_upscaler_program_id);
+
+        // Load the vertex and fragment shaders for sprite rendering.
+        g_sprite_render_program_id = glCreateProgram();
+        glAttachShader(
+            g_sprite_render_program_id,
+            compile_shader(GL_VERTEX_SHADER,   k_sprite_render_vs_source)
+        );
+        glAttachShader(
+            g_sprite_render_program_id,
+            compile_shader(GL_FRAGMENT_SHADER, k_sprite_render_fs_source)
+        );
+        glLinkProgram(g_sprite_render_program_id);
+    }
+
+    __forceinline void init_gl_context()
+    {
+        G21_DEBUG_PRINT("#DEBUG: Initializing OpenGL context.\n");
+
+        // Describe the pixel format we want.
+        static PIXELFORMATDESCRIPTOR pfd{};
+        pfd.nSize      = sizeof(PIXELFORMATDESCRIPTOR);
+        pfd.nVersion   = 1;
+        pfd.dwFlags    = PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER;
+        pfd.iPixelType = PFD_TYPE_RGBA;
+        pfd.cColorBits = 32;
+        pfd.iLayerType = PFD_MAIN_PLANE;
+
+        // Set the pixel format.
+        SetPixelFormat(g_hDC, ChoosePixelFormat(g_hDC, &pfd), &pfd);
+
+        // Create the (maybe temporary) OpenGL context.
+        HGLRC const hGLRC = wglCreateContext(g_hDC);
+        wglMakeCurrent(g_hDC, hGLRC);
+
+        #ifdef _DEBUG
+        // Load wglCreateContextAttribsARB so that we can create a debug context.
+        auto const wglCreateContextAttribsARB = 
+            reinterpret_cast<PFNWGLCREATECONTEXTATTRIBSARBPROC>(wglGetProcAddress("wglCreateContextAttribsARB"));
+
+        // Delete the old context.
+        wglMakeCurrent(g_hDC, 0);
+        wglDeleteContext(hGLRC);
+
+        // Prepare the attributes for our debug context.
+        constexpr int attribs[]
+        {
+            WGL_CONTEXT_MAJOR_VERSION_ARB, 4,
+            WGL_CONTEXT_MINOR_VERSION_ARB, 3,
+            WGL_CONTEXT_PROFILE_MASK_ARB,  WGL_CONTEXT_CORE_PROFILE_BIT_ARB,
+            WGL_CONTEXT_FLAGS_ARB, WGL_CONTEXT_DEBUG_BIT_ARB,
+            0
+        };
+
+        // Create the debug OpenGL context.
+        wglMakeCurrent(g_hDC, wglCreateContextAttribsARB(g_hDC, 0, attribs));
+        #endif
+    }
+
+    // Setup the sprite atlas.
+    // Sprites of any size up to 255x255 are packed into pages with a skyline packer, which keeps track of the height of
+    // the packed area along the width of the page and places each sprite in the lowest spot it fits. The pages keep the
+    // sprites as 4-bit palette indices, two per byte of an R8UI texture array, and the fragment shader looks the colour
+    // up in a palette texture. This is an eighth of the memory of expanding them to RGBA8 up front.
+
+    constexpr u32 k_sprite_atlas_page_size      { 256 };
+    constexpr u32 k_sprite_atlas_max_page_count { 8 };
+    constexpr u32 k_sprite_atlas_max_sprite_count{ 4096 };
+
+    // A sprite to be packed. The pixels are 4-bit palette indices in rows of whole bytes, the left pixel in the low bits.
+    struct sprite_atlas_source
+    {
+        u8 const* pixels;
+        u8        width, height;
+        u8        palette;
+    };
+
+    // The sprites, indexed by the sprite_texture_index of the vertices.
+    constexpr sprite_atlas_source k_sprite_atlas_sources[]
+    {
+        sprite_atlas_source{ &k_player_sprite[0][0][0], 16, 16, 0 },
+        sprite_atlas_source{ &k_player_sprite[1][0][0], 16, 16, 0 },
+        sprite_atlas_source{ &k_player_sprite[2][0][0], 16, 16, 0 },
+        sprite_atlas_source{ &k_player_sprite[3][0][0], 16, 16, 0 }
+    };
+    static_assert(countof(k_sprite_atlas_sources) <= k_sprite_atlas_max_sprite_count);
+
+    // Where a sprite ended up, as read by k_sprite_render_vs_source.
+    struct sprite_atlas_rect
+    {
+        u32 position; // x in the low 16 bits, y in the high 16 bits.
+        u32 size;     // Width, height, page and palette, from the low byte to the high byte.
+    };
+
+    struct skyline_segment
+    {
+        u16 x, y, width;
+    };
+
+    struct skyline_packer
+    {
+        skyline_segment segments[k_sprite_atlas_page_size + 1];
+        u32             segment_count;
+    };
+
+    void remove_skyline_segment(skyline_packer& packer, u32 index)
+    {
+        for (u32 i{ index }; (i + 1) < packer.segment_count; ++i)
+        {
+            packer.segments[i] = packer.segments[i + 1];
+        }
+        --packer.segment_count;
+    }
+
+    bool pack_skyline(skyline_packer& packer, u32 width, u32 height, vec2<u16>& position)
+    {
+        skyline_segment* const segments{ packer.segments };
+
+        // Find the lowest spot, going from left to right so ties go to the leftmost one.
+        u32 best_index{ packer.segment_count };
+        u32 best_y    { k_sprite_atlas_page_size };
+
+        for (u32 i{ 0 }; i < packer.segment_count; ++i)
+        {
+            if ((segments[i].x + width) > k_sprite_atlas_page_size) break;
+
+            // The sprite rests on the highest segment under it.
+            u32 y{ 0 };
+            for (u32 j{ i }, covered{ 0 }; covered < width; covered += segments[j].width, ++j)
+            {
+                y = max(y, static_cast<u32>(segments[j].y));
+            }
+
+            if (((y + height) <= k_sprite_atlas_page_size) && (y < best_y))
+            {
+                best_index = i;
+                best_y     = y;
+            }
+        }
+
+        if (best_index == packer.segment_count) return false;
+
+        u32 const x{ segments[best_index].x };
+        position = vec2<u16>{ static_cast<u16>(x), static_cast<u16>(best_y) };
+
+        // Insert a segment for the top of the sprite.
+        for (u32 i{ packer.segment_count }; i > best_index; --i)
+        {
+            segments[i] = segments[i - 1];
+        }
+        segments[best_index] = skyline_segment{ static_cast<u16>(x), static_cast<u16>(best_y + height), static_cast<u16>(width) };
+        ++packer.segment_count;
+
+        // Remove or shorten the segments it covers.
+        u32 const end{ x + width };
+        while ((best_index + 1) < packer.segment_count)
+        {
+            skyline_segment& next{ segments[best_index + 1] };
+            if (next.x >= end) break;
+
+            u32 const next_end{ static_cast<u32>(next.x + next.width) };
+            if (next_end <= end)
+            {
+                remove_skyline_segment(packer, best_index + 1);
+                continue;
+            }
+
+            next.width = static_cast<u16>(next_end - end);
+            next.x     = static_cast<u16>(end);
+            break;
+        }
+
+        // Merge neighbours of the same height.
+        for (u32 i{ 0 }; (i + 1) < packer.segment_count;)
+        {
+            if (segments[i].y == segments[i + 1].y)
+            {
+                segments[i].width = static_cast<u16>(segments[i].width + segments[i + 1].width);
+                remove_skyline_segment(packer, i + 1);
+            }
+            else
+            {
+                ++i;
+            }
+        }
+
+        return true;
+    }
+
+    void render_sprite_atlas()
+    {
+        static u8                pages[k_sprite_atlas_max_page_count][k_sprite_atlas_page_size][k_sprite_atlas_page_size / 2];
+        static skyline_packer    packers[k_sprite_atlas_max_page_count];
+        static sprite_atlas_rect rects[countof(k_sprite_atlas_sources)];
+        u32 page_count{ 0 };
+
+        // Pack the tallest sprites first, which wastes the least space.
+        static u16 order[countof(k_sprite_atlas_sources)];
+        for (u32 i{ 0 }; i < countof(k_sprite_atlas_sources); ++i)
+        {
+            u32 j{ i };
+            for (; (j > 0) && (k_sprite_atlas_sources[order[j - 1]].height < k_sprite_atlas_sources[i].height); --j)
+            {
+                order[j] = order[j - 1];
+            }
+            order[j] = static_cast<u16>(i);
+        }
+
+        for (u16 const index : order)
+        {
+            sprite_atlas_source const& sprite{ k_sprite_atlas_sources[index] };
+
+            // Try every open page before starting a new one.
+            vec2<u16> position;
+            u32 page{ 0 };
+            for (; page < page_count; ++page)
+            {
+                if (pack_skyline(packers[page], sprite.width, sprite.height, position)) break;
+            }
+
+            if (page == page_count)
+            {
+                if (page_count == k_sprite_atlas_max_page_count)
+                {
+                    G21_DEBUG_PRINT("#DEBUG: Out of sprite atlas pages.\n");
+                    continue;
+                }
+
+                packers[page].segments[0]   = skyline_segment{ 0, 0, static_cast<u16>(k_sprite_atlas_page_size) };
+                packers[page].segment_count = 1;
+                ++page_count;
+
+                (void)pack_skyline(packers[page], sprite.width, sprite.height, position);
+            }
+
+            // Copy the pixels over one at a time, since the sprite may start halfway into a byte.
+            u32 const row_size{ (sprite.width + 1U) / 2U };
+            for (u32 y{ 0 }; y < sprite.height; ++y)
+            {
+                for (u32 x{ 0 }; x < sprite.width; ++x)
+                {
+                    u8 const value{ static_cast<u8>((sprite.pixels[(y * row_size) + (x / 2)] >> ((x & 1) * 4)) & 0x0F) };
+
+                    u32 const atlas_x{ position.x + x };
+                    u8& texel{ pages[page][position.y + y][atlas_x / 2] };
+                    texel = static_cast<u8>(texel | (value << ((atlas_x & 1) * 4)));
+                }
+            }
+
+            rects[index] = sprite_atlas_rect{
+                static_cast<u32>(position.x) | (static_cast<u32>(position.y) << 16),
+                static_cast<u32>(sprite.width) | (static_cast<u32>(sprite.height) << 8) | (page << 16) | (static_cast<u32>(sprite.palette) << 24)
+            };
+        }
+
+        G21_DEBUG_PRINT("#DEBUG: Sprite atlas pages: ");
+        G21_DEBUG_PRINT(page_count);
+        G21_DEBUG_PRINT("\n");
+
+        glActiveTexture(GL_TEXTURE0);
+
+        // Upload the pages.
+        glGenTextures(1, &g_sprites_texture_array_id);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, g_sprites_texture_array_id);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_R8UI, k_sprite_atlas_page_size / 2, k_sprite_atlas_page_size, page_count, 0,
+            GL_RED_INTEGER, GL_UNSIGNED_BYTE, pages);
+
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+
+        // Upload the palette, one palette per row.
+        glGenTextures(1, &g_sprites_palette_texture_id);
+        glBindTexture(GL_TEXTURE_2D, g_sprites_palette_texture_id);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8UI, 16, 1, 0, GL_RGBA_INTEGER, GL_UNSIGNED_BYTE, k_sprite_palette);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        // Upload the rects.
+        glGenTextures(1, &g_sprites_rect_texture_id);
+        glBindTexture(GL_TEXTURE_RECTANGLE, g_sprites_rect_texture_id);
+        glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RG32UI, countof(k_sprite_atlas_sources), 1, 0, GL_RG_INTEGER, GL_UNSIGNED_INT, rects);
+        glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_RECTANGLE, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+    }
+
+    // Sprite storage.
+
+    template<typename T>
+    T* reserve_sprite_storage(u32 elements_per_quad)
+    {
+        usize const size{ static_cast<usize>(k_sprites_max_quad_count) * elements_per_quad * sizeof(T) };
+        return static_cast<T*>(VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_READWRITE));
+    }
+
+    template<typename T>
+    bool commit_sprite_storage(T* storage, u32 elements_per_quad)
+    {
+        if (storage == nullptr) return false;
+
+        usize const offset{ static_cast<usize>(g_sprites_capacity)   * elements_per_quad };
+        usize const size  { static_cast<usize>(k_sprites_chunk_quad_count) * elements_per_quad * sizeof(T) };
+        return VirtualAlloc(storage + offset, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+    }
+
+    // Commits the next chunk of every sprite array.
+    bool grow_sprite_storage()
+    {
+        if (g_sprites_capacity == k_sprites_max_quad_count) return false;
+
+        if (!commit_sprite_storage(g_sprites,              1)                           ||
+            !commit_sprite_storage(g_sprites_sort_items,   1)                           ||
+            !commit_sprite_storage(g_sprites_sort_scratch, 1)                           ||
+            !commit_sprite_storage(g_sprites_vertices,     k_sprites_vertices_per_quad))
+        {
+            return false;
+        }
+
+        g_sprites_capacity += k_sprites_chunk_quad_count;
+        return true;
+    }
+
+    // Reserves the sprite storage and commits the first chunk.
+    void init_sprite_storage()
+    {
+        g_sprites              = reserve_sprite_storage<sprite_entry>(1);
+        g_sprites_sort_items   = reserve_sprite_storage<sprite_sort_item>(1);
+        g_sprites_sort_scratch = reserve_sprite_storage<sprite_sort_item>(1);
+        g_sprites_vertices     = reserve_sprite_storage<sprite_vertex>(k_sprites_vertices_per_quad);
+        (void)grow_sprite_storage();
+    }
+
+    __forceinline void init_sprite_atlas()
+    {
+        render_sprite_atlas();
+
+        init_sprite_storage();
+
+        // The vertex buffer is sized every frame to fit the sprites.
+        glGenBuffers(1, &g_sprites_vertex_buffer_id);
+
+        glGenBuffers(1, &g_sprites_index_buffer_id);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_sprites_index_buffer_id);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, k_sprites_batch_index_count * sizeof(GLuint), nullptr, GL_STATIC_DRAW);
+            
+        void* const sprites_index_buffer_map{ glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY) };
+
+        // Since we only render squares, we can already fill out the index buffer so we never need to touch it again.
+        // It covers a single batch, every batch starts from the first vertex.
+
+        // Alias the pointer so that we can easily write out the values.
+        GLuint* p{ static_cast<GLuint*>(sprites_index_buffer_map) };
+        for (usize i{ 0 }; i < k_sprites_batch_quad_count; ++i)
+        {
+            // Tell OpenGL how four vertices combine to form two triangles.
+            p[i * 6 + 0] = static_cast<GLuint>(i * 4 + 0); // Triangle one.
+            p[i * 6 + 1] = static_cast<GLuint>(i * 4 + 1); //
+            p[i * 6 + 2] = static_cast<GLuint>(i * 4 + 2); //
+            p[i * 6 + 3] = static_cast<GLuint>(i * 4 + 1); // Triangle two.
+            p[i * 6 + 4] = static_cast<GLuint>(i * 4 + 3); //
+            p[i * 6 + 5] = static_cast<GLuint>(i * 4 + 2); //
+        }
+
+        // Release the map so that OpenGL can transfer the data to the GPU.
+        glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+
+    // Setup the render target.
+    // The scene is rendered into an offscreen target at a multiple of the camera resolution, and then upscaled into the
+    // viewport. When the multiple follows the viewport, the upscale is a plain copy and everything in the scene gets
+    // the full resolution of the screen. RGBA8 holds our pixel art exactly. SRGB8_ALPHA8 blends in linear space at the
+    // same size, at the cost of rounding the brightest values. RGBA16F is exact as well, but twice the size.
+
+    constexpr u8 k_render_target_max_scale{ 8 };
+
+    void init_render_target()
+    {
+        // Pick the multiple of the camera resolution.
+        u8 scale{ g_render_target_scale_option };
+        if (scale == 0)
+        {
+            scale = static_cast<u8>(max(1, min(g_viewport.z / camera::k_width, static_cast<i32>(k_render_target_max_scale))));
+        }
+
+        // Nothing to do if the target already has the right size.
+        if ((g_framebuffer_texture_id != 0) && (scale == g_render_target_scale))
+        {
+            return;
+        }
+
+        g_render_target_scale = scale;
+
+        GLenum internal_format{ GL_RGBA8 };
+        switch (g_render_target_format)
+        {
+            case render_target_format::rgba8:
+                break;
+
+            case render_target_format::srgb8_alpha8:
+                internal_format = GL_SRGB8_ALPHA8;
+                break;
+
+            case render_target_format::rgba16f:
+                internal_format = GL_RGBA16F;
+                break;
+        }
+
+        u32 const width { static_cast<u32>(camera::k_width ) * scale };
+        u32 const height{ static_cast<u32>(camera::k_height) * scale };
+
+        // Generate a texture object which will be bound to the framebuffer, replacing the old one.
+        if (g_framebuffer_texture_id != 0)
+        {
+            glDeleteTextures(1, &g_framebuffer_texture_id);
+        }
+        glGenTextures(1, &g_framebuffer_texture_id);
+        glBindTexture(GL_TEXTURE_2D, g_framebuffer_texture_id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        // Generate the framebuffer object the first time, and attach the texture.
+        if (g_framebuffer_id == 0)
+        {
+            glGenFramebuffers(1, &g_framebuffer_id);
+        }
+        glBindFramebuffer(GL_FRAMEBUFFER, g_framebuffer_id);
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, g_framebuffer_texture_id, 0);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        // Report the cost. Every frame the background pass writes the whole target and the upscale reads all of it,
+        // so it moves at least twice its size (the sprites add a little blending on top of that).
+        G21_DEBUG_PRINT("#DEBUG: Render target is ");
+        G21_DEBUG_PRINT(width);
+        G21_DEBUG_PRINT("x");
+        G21_DEBUG_PRINT(height);
+        switch (g_render_target_format)
+        {
+            case render_target_format::rgba8:        G21_DEBUG_PRINT(" RGBA8");        break;
+            case render_target_format::srgb8_alpha8: G21_DEBUG_PRINT(" SRGB8_ALPHA8"); break;
+            case render_target_format::rgba16f:      G21_DEBUG_PRINT(" RGBA16F");      break;
+        }
+        G21_DEBUG_PRINT(", at least ");
+        G21_DEBUG_PRINT(width * height * ((g_render_target_format == render_target_format::rgba16f) ? 8 : 4) * 2);
+        G21_DEBUG_PRINT(" bytes per frame.\n");
+    }
+
+    void init_gl()
+    {
+        G21_TRACE_ZONE("init_gl");
+
+        G21_DEBUG_PRINT("#DEBUG: Initializing OpenGL.\n");
+
+        // Initialize the OpenGL context.
+        init_gl_context();
+
+        // Load just the functions we need.
+        load_gl_functions();
+
+        #if G21_ENABLE_GPU_PROFILER
+        init_gpu_profiler();
+        #endif
+
+        // Enable V-Sync, unless asked not to.
+        wglSwapIntervalEXT(g_vsync ? 1 : 0);
+
+        #ifdef _DEBUG
+        // If in debug mode, activate debug output from the OpenGL driver.
+        glEnable(GL_DEBUG_OUTPUT);
+        glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+        reinterpret_cast<PFNGLDEBUGMESSAGECALLBACKPROC>(
+            wglGetProcAddress("glDebugMessageCallback")
+        )(gl_debug_callback, nullptr);
+        reinterpret_cast<PFNGLDEBUGMESSAGECONTROLPROC>(
+            wglGetProcAddress("glDebugMessageControl")
+        )(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr, true);
+        #endif
+
+        G21_DEBUG_PRINT("#DEBUG: Creating OpenGL buffers.\n");
+
+        // Generate the framebuffer used for rendering at the internal resolution.
+        init_render_target();
+
+#if G21_ENABLE_PARTICLES
+        // Generate the buffers used for the particles. These are bound as shader storage buffers by the compute
+        // shaders, but are created through the array buffer target so that the CPU fallback works without them.
+
+        glGenBuffers(1, &g_particle_buffer_id);
+        glBindBuffer(GL_ARRAY_BUFFER, g_particle_buffer_id);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(cs_particle) * k_max_particle_count, nullptr, GL_STATIC_DRAW);
+
+        glGenBuffers(1, &g_index_buffer_id);
+        glBindBuffer(GL_ARRAY_BUFFER, g_index_buffer_id);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLuint) * k_max_particle_count, nullptr, GL_STATIC_DRAW);
+
+        glGenBuffers(1, &g_atomic_counter_buffer_id);
+        glBindBuffer(GL_ARRAY_BUFFER, g_atomic_counter_buffer_id);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(particle_draw_command), nullptr, GL_DYNAMIC_DRAW);
+
+        // One bit per tile of the world, set by the update for every tile that has a particle in it.
+        static constexpr GLuint agent_tiles[(k_game_world_design_width * k_game_world_design_height + 31) / 32]{};
+        glGenBuffers(1, &g_flow_agent_buffer_id);
+        glBindBuffer(GL_ARRAY_BUFFER, g_flow_agent_buffer_id);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(agent_tiles), agent_tiles, GL_DYNAMIC_DRAW);
+
+        // The counter, followed by the tiles.
+        for (particle_readback& readback : g_particle_readbacks)
+        {
+            glGenBuffers(1, &readback.buffer);
+            glBindBuffer(GL_ARRAY_BUFFER, readback.buffer);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(GLuint) + sizeof(agent_tiles), nullptr, GL_STREAM_READ);
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+#endif
+
+        // Generate and bind the Vertex Array Object.
+        glGenVertexArrays(1, &g_vao);
+        glBindVertexArray(g_vao);
+
+        // Enable the vertex position attribute.
+        glEnableVertexAttribArray(0);
+
+        // Initialize the sprite atlas.
+        init_sprite_atlas();
+
+#if G21_ENABLE_PARTICLES
+        // Bind the particle buffer SSBO as the vertex array buffer.
+        glBindBuffer(GL_ARRAY_BUFFER, g_particle_buffer_id);
+        glVertexAttribIPointer(0, 2, GL_INT, sizeof(cs_particle), nullptr);
+
+        // Bind the "alive" particle index array.
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer_id);
+
+        // Generate the texture used for particle pathfinding and collision (see particle_force_texel).
+        glGenTextures(1, &g_gradient_map_texture_id);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_RECTANGLE, g_gradient_map_texture_id);
+        glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGBA16I, k_world_width, k_world_height, 0, GL_RGBA_INTEGER, GL_SHORT, nullptr);
+        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+
+        // Generate the pixel buffer used to stream changes into it.
+        glGenBuffers(1, &g_gradient_map_pbo_id);
+#endif
+
+        // Load the shaders.
+        load_shaders();
+
+        // Enable blending.
+        glEnable(GL_BLEND);
+    }
+
+    // Sprites within a layer are drawn by increasing depth, and in the order they were pushed when the depth is equal.
+    void push_sprite(vec2<fixed16_16> pos, vec2<u8> size, u16 sprite_texture_index, sprite_layer layer, u16 depth = 0)
+    {
+        if ((g_sprites_count == g_sprites_capacity) && !grow_sprite_storage())
+        {
+            G21_DEBUG_PRINT("#DEBUG: Out of sprite storage.\n");
+            return;
+        }
+
+        u32 const index{ g_sprites_count++ };
+
+        g_sprites[index]            = sprite_entry{ pos, size, sprite_texture_index };
+        g_sprites_sort_items[index] = sprite_sort_item{ (static_cast<u32>(layer) << 16) | depth, index };
+    }
+
+    // A stable LSD radix sort of the sprites by their key, one byte at a time. Bytes every key agrees on are skipped,
+    // which for the usual handful of layers leaves two passes. Returns the sorted items.
+    sprite_sort_item const* sort_sprites()
+    {
+        static u32 offsets[256];
+
+        u32 const count{ g_sprites_count };
+        sprite_sort_item* src{ g_sprites_sort_items };
+        sprite_sort_item* dst{ g_sprites_sort_scratch };
+
+        for (u32 shift{ 0 }; shift < 32; shift += 8)
+        {
+            __stosb(reinterpret_cast<u8*>(offsets), 0, sizeof(offsets));
+
+            for (u32 i{ 0 }; i < count; ++i)
+            {
+                ++offsets[(src[i].key >> shift) & 0xFF];
+            }
+
+            if (offsets[(src[0].key >> shift) & 0xFF] == count) continue;
+
+            // Turn the histogram into the starting offset of each bucket.
+            for (u32 i{ 0 }, sum{ 0 }; i < countof(offsets); ++i)
+            {
+                u32 const n{ offsets[i] };
+                offsets[i] = sum;
+                sum       += n;
+            }
+
+            for (u32 i{ 0 }; i < count; ++i)
+            {
+                dst[offsets[(src[i].key >> shift) & 0xFF]++] = src[i];
+            }
+
+            sprite_sort_item* const tmp{ src };
+            src = dst;
+            dst = tmp;
+        }
+
+        return src;
+    }
+
+    // Sorts the pushed sprites and writes out their vertices in draw order.
+    void build_sprite_vertices()
+    {
+        u32 const count{ g_sprites_count };
+        sprite_sort_item const* const order{ sort_sprites() };
+
+        // Build the vertices in draw order.
+        sprite_vertex* vertex{ g_sprites_vertices };
+        for (u32 i{ 0 }; i < count; ++i)
+        {
+            sprite_entry const& sprite{ g_sprites[order[i].index] };
+
+            vec2<fixed16_16> const pos { sprite.pos };
+            vec2<u8>         const size{ sprite.size };
+            u32              const sprite_texture_index{ sprite.sprite_texture_index };
+
+            // Top left corner.
+            *(vertex++) =
+            {
+                pos, sprite_texture_index
+            };
+
+            // Bottom left corner.
+            *(vertex++) =
+            {
+                pos + vec2<fixed16_16>{ {}, fixed16_16{ size.y } }, sprite_texture_index
+            };
+
+            // Top right corner.
+            *(vertex++) =
+            {
+                pos + vec2<fixed16_16>{ fixed16_16{ size.x }, {} }, sprite_texture_index
+            };
+
+            // Bottom right corner.
+            *(vertex++) =
+            {
+                pos + vec2<fixed16_16>{ fixed16_16{ size.x }, fixed16_16{ size.y } }, sprite_texture_index
+            };
+        }
+    }
+
+    void render_sprites(camera const& cam)
+    {
+        u32 const count{ g_sprites_count };
+        if (count == 0) return;
+
+        build_sprite_vertices();
+
+        glUseProgram(g_sprite_render_program_id);
+
+        glUniform4i(0, cam.x, cam.y, camera::k_width, camera::k_height);
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, g_sprites_texture_array_id);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_2D, g_sprites_palette_texture_id);
+        glActiveTexture(GL_TEXTURE2);
+        glBindTexture(GL_TEXTURE_RECTANGLE, g_sprites_rect_texture_id);
+        glActiveTexture(GL_TEXTURE0);
+
+        // Orphan the old vertex buffer and transfer the new vertices in one go.
+        glBindBuffer(GL_ARRAY_BUFFER, g_sprites_vertex_buffer_id);
+        glBufferData(GL_ARRAY_BUFFER, static_cast<GLsizeiptr>(count) * k_sprites_vertices_per_quad * sizeof(sprite_vertex),
+            g_sprites_vertices, GL_STREAM_DRAW);
+
+        // Draw the quads. Every sprite lives in the same atlas, so the batches only need to be split where they run out of
+        // indices.
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_sprites_index_buffer_id);
+        for (u32 first{ 0 }; first < count; first += k_sprites_batch_quad_count)
+        {
+            u32 const batch_count{ min(count - first, k_sprites_batch_quad_count) };
+            usize const offset{ static_cast<usize>(first) * k_sprites_vertices_per_quad * sizeof(sprite_vertex) };
+
+            glVertexAttribIPointer(0, 3, GL_INT, sizeof(sprite_vertex), reinterpret_cast<void const*>(offset));
+            glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(batch_count * k_sprites_indices_per_quad), GL_UNSIGNED_INT, nullptr);
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        glUseProgram(0);
+
+        // Reset the count.
+        g_sprites_count = 0;
+    }
+
+    // Setup the sprite spatial index.
+    // Sprites are bucketed by the k_sprite_size cell their top-left corner falls in, which is the grid of the level
+    // design. They are added every frame and chained together per cell. Gathering only visits the cells overlapping the
+    // camera, so the cost follows the view rather than the size of the world.
+
+    constexpr u32 k_sprite_grid_width       { k_game_world_design_width  };
+    constexpr u32 k_sprite_grid_height      { k_game_world_design_height };
+    constexpr u32 k_sprite_grid_cell_count  { k_sprite_grid_width * k_sprite_grid_height };
+    constexpr u32 k_max_dynamic_sprite_count{ 16384 };
+    constexpr i32 k_sprite_grid_cell_size   { k_sprite_size }; // The cells of the level design.
+    constexpr u16 k_sprite_grid_end         { 0xFFFF };      // Ends a chain of dynamic sprites.
+    constexpr i32 k_sprite_cull_margin      { k_sprite_size }; // How far outside the camera sprites are still gathered.
+
+    struct indexed_sprite
+    {
+        sprite_entry entry;
+        sprite_layer layer;
+        u16          depth;
+    };
+
+    indexed_sprite g_dynamic_sprites[k_max_dynamic_sprite_count];
+    u16            g_dynamic_sprite_next[k_max_dynamic_sprite_count];
+    u16            g_dynamic_sprite_head[k_sprite_grid_cell_count];
+    u32            g_dynamic_sprite_count;
+
+    u32 g_sprite_grid_reach; // How many cells past its own the largest sprite may cover.
+    u32 g_sprites_submitted;
+    u32 g_sprites_culled;
+
+    u32 get_sprite_grid_cell(vec2<fixed16_16> pos)
+    {
+        i32 const x{ max(0, min(static_cast<i32>(ifloor(pos.x)) / k_sprite_grid_cell_size, static_cast<i32>(k_sprite_grid_width  - 1))) };
+        i32 const y{ max(0, min(static_cast<i32>(ifloor(pos.y)) / k_sprite_grid_cell_size, static_cast<i32>(k_sprite_grid_height - 1))) };
+
+        return (static_cast<u32>(y) * k_sprite_grid_width) + static_cast<u32>(x);
+    }
+
+    void update_sprite_grid_reach(vec2<u8> size)
+    {
+        g_sprite_grid_reach = max(g_sprite_grid_reach, (max(size.x, size.y) + k_sprite_size - 1) / k_sprite_size);
+    }
+
+    // The sprites only last until the next call to gather_visible_sprites, so everything is added again every frame.
+    void add_dynamic_sprite(vec2<fixed16_16> pos, vec2<u8> size, u16 sprite_texture_index, sprite_layer layer, u16 depth = 0)
+    {
+        if (g_dynamic_sprite_count == k_max_dynamic_sprite_count)
+        {
+            G21_DEBUG_PRINT("#DEBUG: Out of dynamic sprites.\n");
+            return;
+        }
+
+        u32 const index{ g_dynamic_sprite_count++ };
+        u32 const cell { get_sprite_grid_cell(pos) };
+
+        g_dynamic_sprites[index]     = indexed_sprite{ sprite_entry{ pos, size, sprite_texture_index }, layer, depth };
+        g_dynamic_sprite_next[index] = g_dynamic_sprite_head[cell];
+        g_dynamic_sprite_head[cell]  = static_cast<u16>(index);
+
+        update_sprite_grid_reach(size);
+    }
+
+    // Pushes the sprite if it overlaps the view (left, top, right, bottom; right and bottom exclusive).
+    bool submit_sprite_if_visible(indexed_sprite const& sprite, vec4<i32> const& view)
+    {
+        i32 const x{ ifloor(sprite.entry.pos.x) };
+        i32 const y{ ifloor(sprite.entry.pos.y) };
+
+        if (((x + sprite.entry.size.x) <= view.x) || (x >= view.z) || ((y + sprite.entry.size.y) <= view.y) || (y >= view.w))
+        {
+            return false;
+        }
+
+        push_sprite(sprite.entry.pos, sprite.entry.size, sprite.entry.sprite_texture_index, sprite.layer, sprite.depth);
+        return true;
+    }
+
+    // Pushes the sprites near the camera, and clears them.
+    void gather_visible_sprites(camera const& cam)
+    {
+        vec4<i32> const view{
+            static_cast<i32>(cam.x) - k_sprite_cull_margin,
+            static_cast<i32>(cam.y) - k_sprite_cull_margin,
+            static_cast<i32>(cam.x) + camera::k_width  + k_sprite_cull_margin,
+            static_cast<i32>(cam.y) + camera::k_height + k_sprite_cull_margin
+        };
+
+        // Sprites are filed under their top-left corner, so look further up and to the left for any that reach in.
+        i32 const reach{ static_cast<i32>(g_sprite_grid_reach) };
+        i32 const cell_left  { max(0, (max(0, view.x) / k_sprite_grid_cell_size) - reach) };
+        i32 const cell_top   { max(0, (max(0, view.y) / k_sprite_grid_cell_size) - reach) };
+        i32 const cell_right { min((view.z - 1) / k_sprite_grid_cell_size, static_cast<i32>(k_sprite_grid_width  - 1)) };
+        i32 const cell_bottom{ min((view.w - 1) / k_sprite_grid_cell_size, static_cast<i32>(k_sprite_grid_height - 1)) };
+
+        u32 submitted{ 0 };
+        for (i32 y{ cell_top }; y <= cell_bottom; ++y)
+        {
+            for (i32 x{ cell_left }; x <= cell_right; ++x)
+            {
+                u32 const cell{ (static_cast<u32>(y) * k_sprite_grid_width) + static_cast<u32>(x) };
+
+                for (u16 i{ g_dynamic_sprite_head[cell] }; i != k_sprite_grid_end; i = g_dynamic_sprite_next[i])
+                {
+                    submitted += submit_sprite_if_visible(g_dynamic_sprites[i], view);
+                }
+            }
+        }
+
+        g_sprites_submitted = submitted;
+        g_sprites_culled    = g_dynamic_sprite_count - submitted;
+
+        // Clear the dynamic sprites.
+        g_dynamic_sprite_count = 0;
+        __stosb(reinterpret_cast<u8*>(g_dynamic_sprite_head), 0xFF, sizeof(g_dynamic_sprite_head));
+
+        #ifdef _DEBUG
+        // Report the counters once a second.
+        static u32 tick;
+        if (++tick == 60)
+        {
+            tick = 0;
+
+            G21_DEBUG_PRINT("#DEBUG: Sprites submitted: ");
+            G21_DEBUG_PRINT(g_sprites_submitted);
+            G21_DEBUG_PRINT(", culled: ");
+            G21_DEBUG_PRINT(g_sprites_culled);
+            G21_DEBUG_PRINT("\n");
+        }
+        #endif
+    }
+
+    void init_sprite_grid()
+    {
+        __stosb(reinterpret_cast<u8*>(g_dynamic_sprite_head), 0xFF, sizeof(g_dynamic_sprite_head));
+    }
+
+    // Setup the simulation snapshots.
+    // Everything the renderer needs from a tick is copied into a snapshot when the tick is done, and the renderer only
+    // ever reads snapshots, never g_sim, so the ticks can run on a thread of their own. The snapshots are passed on in
+    // a triple buffer: the simulation fills its back slot and swaps it with the middle one, marking it as fresh, and
+    // the renderer swaps its front slot with the middle one when that is fresh. Both sides are a single exchange, so
+    // neither ever waits on the other.
+
+    constexpr u32  k_max_snapshot_sprites{ 8 };
+    constexpr long k_snapshot_fresh      { 4 }; // Set in g_snapshot_middle on top of the slot index.
+
+    struct sim_snapshot
+    {
+        struct player  player;
+        struct camera  camera;
+        u32            input_events; // How many input events the simulation had taken in.
+        u32            sprite_count;
+        indexed_sprite sprites[k_max_snapshot_sprites];
+    };
+
+    sim_snapshot                  g_snapshots[3];
+    constinit volatile long       g_snapshot_middle{ 1 };
+    constinit u32                 g_snapshot_back  { 0 }; // Only used by the simulation.
+    constinit u32                 g_snapshot_front { 2 }; // Only used by the renderer.
+    bool                          g_snapshot_seen;
+    constinit sim_snapshot const* g_snapshot       { &g_snapshots[2] }; // The snapshot being drawn.
+
+    void add_snapshot_sprite(sim_snapshot& snapshot, vec2<fixed16_16> pos, vec2<u8> size, u16 sprite_texture_index, sprite_layer layer)
+    {
+        if (snapshot.sprite_count == k_max_snapshot_sprites) return;
+
+        snapshot.sprites[snapshot.sprite_count++] = indexed_sprite{ sprite_entry{ pos, size, sprite_texture_index }, layer, 0 };
+    }
+
+    // Called by the simulation after every tick.
+    void publish_snapshot()
+    {
+        sim_snapshot& snapshot{ g_snapshots[g_snapshot_back] };
+
+        snapshot.player       = g_sim.player;
+        snapshot.camera       = g_sim.camera;
+        snapshot.input_events = g_input_events_recorded;
+        snapshot.sprite_count = 0;
+
+        // The player is drawn as a head and a body.
+        add_snapshot_sprite(snapshot, vec2<fixed16_16>{ g_sim.player.pos.x - 2, g_sim.player.pos.y - 15 }, vec2<u8>{ 16, 16 }, 1, sprite_layer::player);
+        add_snapshot_sprite(snapshot, vec2<fixed16_16>{ g_sim.player.pos.x - 2, g_sim.player.pos.y +  1 }, vec2<u8>{ 16, 16 }, (g_sim.player.facing ? 3 : 2), sprite_layer::player);
+
+        long const old_middle{ InterlockedExchange(&g_snapshot_middle, static_cast<long>(g_snapshot_back) | k_snapshot_fresh) };
+        g_snapshot_back = static_cast<u32>(old_middle & (k_snapshot_fresh - 1));
+    }
+
+    // Called by the renderer to move on to the newest snapshot. Returns false until the first one is published.
+    bool acquire_snapshot()
+    {
+        if ((g_snapshot_middle & k_snapshot_fresh) != 0)
+        {
+            long const old_middle{ InterlockedExchange(&g_snapshot_middle, static_cast<long>(g_snapshot_front)) };
+            g_snapshot_front = static_cast<u32>(old_middle & (k_snapshot_fresh - 1));
+            g_snapshot       = &g_snapshots[g_snapshot_front];
+            g_snapshot_seen  = true;
+        }
+
+        return g_snapshot_seen;
+    }
+
+    // Setup the game world distance field.
+    // The field is found in two passes: the horizontal pass finds the squared distance to the nearest solid pixel on
+    // the same row, and the vertical pass combines the rows above and below into the squared distance in 2D. The
+    // distances are capped at 255 pixels, so pixels further away than that can never be the nearest one and are not
+    // looked at. This also means the vertical pass over a band of rows only needs the horizontal pass of the rows
+    // within 255 pixels of it, which lets the field be streamed in a band at a time, see the startup loader.
+    // The horizontal pass of both fields is kept for the streaming. Squared distances within reach fit in 16 bits, and
+    // anything further is capped at 65535 like the result, which keeps the result the same at half the memory.
+
+    constexpr u32 k_distance_field_reach{ 255 };
+
+    u16 g_distance_field_sedt_x[2][k_world_height][k_world_width];
+
+    void compute_distance_field_rows_x(bool inverse, u32 y_begin, u32 y_end)
+    {
+        u16 (&sedt_x)[k_world_height][k_world_width]{ g_distance_field_sedt_x[inverse] };
+
+        for (u32 y{ y_begin }; y < y_end; ++y)
+        {
+            for (u32 x{ 0 }; x < k_world_width; ++x)
+            {
+                u32 const i_begin{ (x > k_distance_field_reach) ? (x - k_distance_field_reach) : 0 };
+                u32 const i_end  { min(x + k_distance_field_reach + 1, k_world_width) };
+
+                // Check for solid block.
+                if (g_game_world_collision_map[y][x] != inverse)
+                {
+                    // Store a distance of 0.
+                    sedt_x[y][x] = 0;
+                }
+                else
+                {
+                    // Start with an initial squared minimum distance equal to the squared width of the world.
+                    u32 min{ k_world_width * k_world_width };
+
+                    // Go through the columns within reach.
+                    for (u32 i{ i_begin }; i < i_end; ++i)
+                    {
+                        // Check for solid block.
+                        if (g_game_world_collision_map[y][i] != inverse)
+                        {
+                            // Calculate the squared distance.
+                            i32 const dx { static_cast<i32>(x) - static_cast<i32>(i) };
+                            u32 const dx2{ static_cast<u32>(dx * dx) };
+
+                            // Keep the smallest distance.
+                            if (dx2 < min) min = dx2;
+                        }
+                    }
+
+                    // Store the smallest distance.
+                    sedt_x[y][x] = static_cast<u16>((min < 65535) ? min : 65535);
+                }
+            }
+        }
+    }
+
+    void compute_distance_field_rows_y(bool inverse, u32 y_begin, u32 y_end)
+    {
+        u16 const (&sedt_x)[k_world_height][k_world_width]{ g_distance_field_sedt_x[inverse] };
+
+        for (u32 y{ y_begin }; y < y_end; ++y)
+        {
+            u32 const i_begin{ (y > k_distance_field_reach) ? (y - k_distance_field_reach) : 0 };
+            u32 const i_end  { min(y + k_distance_field_reach + 1, k_world_height) };
+
+            for (u32 x{ 0 }; x < k_world_width; ++x)
+            {
+                // Get the minimum on the x axis.
+                u32 min{ sedt_x[y][x] };
+
+                // Check for solid block.
+                if (min == 0)
+                {
+                    // The map is default initialized to 0, so we don't need to store 0 here.
+                }
+                else
+                {
+                    // Go through the rows within reach.
+                    for (u32 i{ i_begin }; i < i_end; ++i)
+                    {
+                        // Calculate the squared distance.
+                        i32 const dy { static_cast<i32>(y) - static_cast<i32>(i) };
+                        u32 const dx2{ sedt_x[i][x] };
+
+                        // Calculate the squared length of the hypotenuse.
+                        u32 const hyp{ dx2 + static_cast<u32>(dy * dy) };
+
+                        // Keep the smallest hypotenuse.
+                        if (hyp < min) min = hyp;
+                    }
+
+                    // Calculate the distance (we cap the squared distance at 65535, as higher numbers are not
+                    // supported).
+                    fixed16_16 const dist{
+                        fixed16_16::sqrt(static_cast<u16>((min < 65535) ? min : 65535))
+                    };
+
+                    // Store the signed distance.
+                    g_game_world_distance_field[y][x] = (inverse ? -dist : dist);
+                }
+            }
+        }
+    }
+
+#if G21_BENCHMARK
+    // The whole field at once, which the benchmarks time. The game streams it in instead, see the startup loader.
+    void compute_game_world_distance_field(bool inverse)
+    {
+        G21_TRACE_ZONE("compute_game_world_distance_field");
+
+        compute_distance_field_rows_x(inverse, 0, k_world_height);
+        compute_distance_field_rows_y(inverse, 0, k_world_height);
+    }
+
+    // Setup the distance field pyramid.
+    // Level 0 is the distance field itself, and every level above holds the smallest distance within each 2x2 block of
+    // the level below, rounded down to whole pixels. A cell at level L thus bounds the distance of every pixel in its
+    // 2^L by 2^L block from below. Open pixels have a distance of at least 1 and solid pixels a negative distance, so a
+    // cell with a positive value contains no solid pixels at all. The queries below use this to skip over large open
+    // areas, and to find the solid parts, while touching a few hundred kilobytes rather than the full field. Nothing in
+    // the game queries the field yet, so like the raycasts below they are only built into the benchmarks, which check
+    // and measure them.
+
+    constexpr u32 k_sdf_pyramid_level_count{ 7 };
+
+    // Whole pixels we keep away from the distance, since the field measures from pixel to pixel while the queries
+    // work with any point inside a pixel. Two half diagonals, rounded up.
+    constexpr i32 k_sdf_pyramid_slack{ 3 };
+
+    constexpr u32 sdf_pyramid_width(u32 level)
+    {
+        return (k_world_width + (1Ui32 << level) - 1Ui32) >> level;
+    }
+
+    constexpr u32 sdf_pyramid_height(u32 level)
+    {
+        return (k_world_height + (1Ui32 << level) - 1Ui32) >> level;
+    }
+
+    constexpr u32 sdf_pyramid_offset(u32 level)
+    {
+        // Level 0 is not stored in the pyramid.
+        u32 offset{ 0 };
+        for (u32 i{ 1 }; i < level; ++i) offset += sdf_pyramid_width(i) * sdf_pyramid_height(i);
+        return offset;
+    }
+
+    // The offset and row width of each level, so that finding a cell does not loop over the levels below it.
+    constexpr array<vec2<u32>, k_sdf_pyramid_level_count> k_sdf_pyramid_layout = []()
+    {
+        array<vec2<u32>, k_sdf_pyramid_level_count> layout;
+        for (u32 level{ 0 }; level < k_sdf_pyramid_level_count; ++level)
+        {
+            layout.data[level] = vec2<u32>{ sdf_pyramid_offset(level), sdf_pyramid_width(level) };
+        }
+        return layout;
+    }();
+
+    i16 g_sdf_pyramid[sdf_pyramid_offset(k_sdf_pyramid_level_count)];
+
+    __forceinline i32 get_sdf_pyramid_cell(u32 level, u32 x, u32 y)
+    {
+        if (level == 0) return ifloor(g_game_world_distance_field[y][x]);
+
+        vec2<u32> const layout{ k_sdf_pyramid_layout.data[level] };
+        return g_sdf_pyramid[layout.x + (y * layout.y) + x];
+    }
+
+    void build_distance_field_pyramid()
+    {
+        G21_TRACE_ZONE("build_distance_field_pyramid");
+
+        for (u32 level{ 1 }; level < k_sdf_pyramid_level_count; ++level)
+        {
+            u32 const w{ sdf_pyramid_width (level) };
+            u32 const h{ sdf_pyramid_height(level) };
+
+            // The last row and column may only have one child along that axis.
+            u32 const child_w{ sdf_pyramid_width (level - 1) };
+            u32 const child_h{ sdf_pyramid_height(level - 1) };
+
+            i16* const cells{ g_sdf_pyramid + sdf_pyramid_offset(level) };
+            for (u32 y{ 0 }; y < h; ++y)
+            {
+                u32 const y0{ y * 2 };
+                u32 const y1{ min(y0 + 1, child_h - 1) };
+
+                for (u32 x{ 0 }; x < w; ++x)
+                {
+                    u32 const x0{ x * 2 };
+                    u32 const x1{ min(x0 + 1, child_w - 1) };
+
+                    i32 const value{ min(
+                        min(get_sdf_pyramid_cell(level - 1, x0, y0), get_sdf_pyramid_cell(level - 1, x1, y0)),
+                        min(get_sdf_pyramid_cell(level - 1, x0, y1), get_sdf_pyramid_cell(level - 1, x1, y1))
+                    ) };
+
+                    cells[(y * w) + x] = static_cast<i16>(value);
+                }
+            }
+        }
+    }
+
+    struct sdf_ray_hit
+    {
+        vec2<fixed16_16> pos;      // The first point found inside a solid pixel.
+        fixed16_16       distance; // Along the ray.
+    };
+
+    // The reciprocal of one component of a ray direction, saturated for rays (nearly) along the other axis.
+    i32 ray_axis_reciprocal(fixed16_16 d)
+    {
+        i32 const magnitude{ (d.raw() < 0) ? -d.raw() : d.raw() };
+        return (magnitude < 4) ? 0x7FFFFFFF : div(fixed16_16{ 1 }, fixed16_16::from_raw(magnitude)).raw();
+    }
+
+    // The distance along a ray to cover 'd' along one axis, saturated rather than wrapping around. An axis the ray does
+    // not move along is never left.
+    i32 ray_axis_distance(i32 d, i32 reciprocal)
+    {
+        if (reciprocal == 0x7FFFFFFF) return 0x7FFFFFFF;
+
+        i64 const t{ __ll_rshift(__emul(max(d, 0), reciprocal), 16) };
+        return (t > 0x7FFFFFFF) ? 0x7FFFFFFF : static_cast<i32>(t);
+    }
+
+    // Marches a ray from 'origin' along the normalized direction 'dir', returning the first point inside a solid pixel.
+    // Every step descends from the level of the previous step to a cell without solid pixels around the current point,
+    // and steps to where the ray leaves the cell plus the cell's bound, since everything that close to the edge of the
+    // cell is open as well. Near surfaces this visits every pixel the ray passes through, so unlike a
+    // plain sphere march it never misses a solid pixel that the ray only clips a corner of, while in the open it can
+    // skip a whole cell along a wall. With 'TopLevel' at 0 only the full resolution field is used, which the benchmark
+    // compares against.
+    template<u32 TopLevel = k_sdf_pyramid_level_count - 1>
+    bool sdf_raycast(vec2<fixed16_16> origin, vec2<fixed16_16> dir, fixed16_16 max_distance, sdf_ray_hit& hit)
+    {
+        i32 const inverse_x{ ray_axis_reciprocal(dir.x) };
+        i32 const inverse_y{ ray_axis_reciprocal(dir.y) };
+
+        fixed16_16 t    { 0 };
+        u32        level{ TopLevel };
+        for (;;)
+        {
+            vec2<fixed16_16> const p{ origin + (dir * t) };
+
+            u32 const x{ static_cast<u32>(static_cast<i32>(ifloor(p.x))) };
+            u32 const y{ static_cast<u32>(static_cast<i32>(ifloor(p.y))) };
+            if ((x >= k_world_width) || (y >= k_world_height)) return false;
+
+            // Descend until we are in a cell without solid pixels, or in a solid pixel.
+            i32 value;
+            for (;;)
+            {
+                value = get_sdf_pyramid_cell(level, x >> level, y >> level);
+                if (value > 0) break;
+
+                if (level == 0)
+                {
+                    hit = sdf_ray_hit{ p, t };
+                    return true;
+                }
+                --level;
+            }
+
+            // Find where the ray leaves the cell.
+            i32 const size{ static_cast<i32>(1Ui32 << level) };
+            i32 const x0  { static_cast<i32>((x >> level) << level) };
+            i32 const y0  { static_cast<i32>((y >> level) << level) };
+
+            fixed16_16 const dx{ (dir.x > fixed16_16{ 0 }) ? (fixed16_16{ static_cast<i16>(x0 + size) } - p.x) : (p.x - fixed16_16{ static_cast<i16>(x0) }) };
+            fixed16_16 const dy{ (dir.y > fixed16_16{ 0 }) ? (fixed16_16{ static_cast<i16>(y0 + size) } - p.y) : (p.y - fixed16_16{ static_cast<i16>(y0) }) };
+            i32 const exit{ min(ray_axis_distance(dx.raw(), inverse_x), ray_axis_distance(dy.raw(), inverse_y)) };
+
+            // Step just past it, plus the bound. Stop once we would go past the end of the ray.
+            i32 const remaining{ (max_distance - t).raw() };
+            i32 const bound    { max(value - k_sdf_pyramid_slack, 0) << 16 };
+            if (exit >= (remaining - bound)) return false;
+
+            t.raw() += exit + bound + 1;
+
+            // Only look for a larger cell again when we are clear of surfaces.
+            if ((level < TopLevel) && (bound > 0)) ++level;
+        }
+    }
+
+    struct sdf_nearest_search
+    {
+        i32 x, y;        // The pixel we search from.
+        u32 best_d2;     // The squared distance to the nearest solid pixel found so far.
+        vec2<u16> best;
+    };
+
+    void search_nearest_surface(sdf_nearest_search& search, u32 level, u32 cell_x, u32 cell_y)
+    {
+        // Skip cells without solid pixels, and cells that are no closer than what we have already found.
+        if (get_sdf_pyramid_cell(level, cell_x, cell_y) > 0) return;
+
+        i32 const x0{ static_cast<i32>(cell_x << level) };
+        i32 const y0{ static_cast<i32>(cell_y << level) };
+        i32 const x1{ x0 + static_cast<i32>(1Ui32 << level) - 1 };
+        i32 const y1{ y0 + static_cast<i32>(1Ui32 << level) - 1 };
+
+        i32 const dx{ (search.x < x0) ? (x0 - search.x) : ((search.x > x1) ? (search.x - x1) : 0) };
+        i32 const dy{ (search.y < y0) ? (y0 - search.y) : ((search.y > y1) ? (search.y - y1) : 0) };
+        u32 const d2{ static_cast<u32>((dx * dx) + (dy * dy)) };
+        if (d2 >= search.best_d2) return;
+
+        if (level == 0)
+        {
+            search.best_d2 = d2;
+            search.best    = vec2<u16>{ static_cast<u16>(cell_x), static_cast<u16>(cell_y) };
+            return;
+        }
+
+        // Visit the children, the one holding the pixel we search from first, as it is the most likely to be closest.
+        u32 const child_w{ sdf_pyramid_width (level - 1) };
+        u32 const child_h{ sdf_pyramid_height(level - 1) };
+        u32 const near_x { (search.x >= (x0 + static_cast<i32>(1Ui32 << (level - 1)))) ? 1Ui32 : 0Ui32 };
+        u32 const near_y { (search.y >= (y0 + static_cast<i32>(1Ui32 << (level - 1)))) ? 1Ui32 : 0Ui32 };
+
+        for (u32 i{ 0 }; i < 4; ++i)
+        {
+            u32 const child_x{ (cell_x * 2) + ((i & 1) ^ near_x) };
+            u32 const child_y{ (cell_y * 2) + ((i >> 1) ^ near_y) };
+            if ((child_x < child_w) && (child_y < child_h))
+            {
+                search_nearest_surface(search, level - 1, child_x, child_y);
+            }
+        }
+    }
+
+    // Finds the solid pixel nearest to 'pos' within 'max_radius' pixels. A position inside a solid pixel finds itself.
+    bool sdf_nearest_surface(vec2<fixed16_16> pos, u32 max_radius, vec2<u16>& surface)
+    {
+        constexpr u32 top{ k_sdf_pyramid_level_count - 1 };
+
+        sdf_nearest_search search;
+        search.x       = ifloor(pos.x);
+        search.y       = ifloor(pos.y);
+        search.best_d2 = (max_radius * max_radius) + 1;
+
+        // Go through the top level cells overlapping the search square.
+        i32 const r{ static_cast<i32>(max_radius) };
+        i32 const cell_left  { max(search.x - r, 0) >> top };
+        i32 const cell_top   { max(search.y - r, 0) >> top };
+        i32 const cell_right { min(max(search.x + r, 0) >> top, static_cast<i32>(sdf_pyramid_width (top) - 1)) };
+        i32 const cell_bottom{ min(max(search.y + r, 0) >> top, static_cast<i32>(sdf_pyramid_height(top) - 1)) };
+
+        for (i32 y{ cell_top }; y <= cell_bottom; ++y)
+        {
+            for (i32 x{ cell_left }; x <= cell_right; ++x)
+            {
+                search_nearest_surface(search, top, static_cast<u32>(x), static_cast<u32>(y));
+            }
+        }
+
+        if (search.best_d2 > (max_radius * max_radius)) return false;
+
+        surface = search.best;
+        return true;
+    }
+
+    i32 search_region_clearance(vec4<i32> const& region, i32 best, u32 level, u32 cell_x, u32 cell_y)
+    {
+        // Skip cells that cannot lower what we have already found.
+        i32 const value{ get_sdf_pyramid_cell(level, cell_x, cell_y) };
+        if (value >= best) return best;
+
+        i32 const x0{ static_cast<i32>(cell_x << level) };
+        i32 const y0{ static_cast<i32>(cell_y << level) };
+        i32 const x1{ x0 + static_cast<i32>(1Ui32 << level) };
+        i32 const y1{ y0 + static_cast<i32>(1Ui32 << level) };
+
+        if ((x1 <= region.x) || (x0 >= region.z) || (y1 <= region.y) || (y0 >= region.w)) return best;
+
+        // A cell entirely inside the region gives its value as is.
+        if ((level == 0) || ((x0 >= region.x) && (x1 <= region.z) && (y0 >= region.y) && (y1 <= region.w))) return value;
+
+        u32 const child_w{ sdf_pyramid_width (level - 1) };
+        u32 const child_h{ sdf_pyramid_height(level - 1) };
+        for (u32 i{ 0 }; i < 4; ++i)
+        {
+            u32 const child_x{ (cell_x * 2) + (i & 1) };
+            u32 const child_y{ (cell_y * 2) + (i >> 1) };
+            if ((child_x < child_w) && (child_y < child_h))
+            {
+                best = search_region_clearance(region, best, level - 1, child_x, child_y);
+            }
+        }
+
+        return best;
+    }
+
+    // Gives the smallest distance in whole pixels within the region (left, top, right, bottom), with the right and
+    // bottom edges excluded. This is at least the clearance of anything placed in the region, and negative if the
+    // region overlaps a solid pixel.
+    i32 sdf_region_clearance(vec4<i32> const& region)
+    {
+        constexpr u32 top{ k_sdf_pyramid_level_count - 1 };
+
+        i32 const cell_left  { max(region.x, 0) >> top };
+        i32 const cell_top   { max(region.y, 0) >> top };
+        i32 const cell_right { min(max(region.z - 1, 0) >> top, static_cast<i32>(sdf_pyramid_width (top) - 1)) };
+        i32 const cell_bottom{ min(max(region.w - 1, 0) >> top, static_cast<i32>(sdf_pyramid_height(top) - 1)) };
+
+        i32 best{ 0x7FFF };
+        for (i32 y{ cell_top }; y <= cell_bottom; ++y)
+        {
+            for (i32 x{ cell_left }; x <= cell_right; ++x)
+            {
+                best = search_region_clearance(region, best, top, static_cast<u32>(x), static_cast<u32>(y));
+            }
+        }
+
+        return best;
+    }
+
+    // Setup the collision raycasts.
+    // Rays walk the collision map with a DDA, crossing one cell boundary per step. Tiles of the design grid without any
+    // solid pixels are crossed in a single step, fully solid tiles end the ray where it enters them, and only within
+    // partially solid tiles does the ray go from pixel to pixel. Every step works out the next boundary from the origin
+    // rather than adding up increments, so the 8-wide version takes exactly the same steps as the scalar one.
+
+    enum class collision_tile : u8
+    {
+        empty,
+        partial,
+        solid
+    };
+
+    constexpr u32 k_collision_tile_shift{ 5 };
+    static_assert((1Ui32 << k_collision_tile_shift) == k_sprite_size);
+
+    // Padded, since the AVX2 version reads 32 bits for every tile it looks up.
+    u8 g_collision_tile_map[(k_game_world_design_width * k_game_world_design_height) + 3];
+
+    void compute_collision_tile_map()
+    {
+        G21_TRACE_ZONE("compute_collision_tile_map");
+
+        for (u32 y{ 0 }; y < k_game_world_design_height; ++y)
+        {
+            for (u32 x{ 0 }; x < k_game_world_design_width; ++x)
+            {
+                u32 solid{ 0 };
+                for (u32 i{ 0 }; i < k_sprite_size; ++i)
+                {
+                    for (u32 j{ 0 }; j < k_sprite_size; ++j)
+                    {
+                        solid += g_game_world_collision_map[(y * k_sprite_size) + i][(x * k_sprite_size) + j];
+                    }
+                }
+
+                collision_tile const tile{
+                    (solid == 0) ? collision_tile::empty : ((solid == (k_sprite_size * k_sprite_size)) ? collision_tile::solid : collision_tile::partial)
+                };
+                g_collision_tile_map[(y * k_game_world_design_width) + x] = static_cast<u8>(tile);
+            }
+        }
+    }
+
+    struct ray
+    {
+        vec2<fixed16_16> origin;
+        vec2<fixed16_16> dir;          // Normalized.
+        fixed16_16       max_distance;
+    };
+
+    struct ray_hit
+    {
+        vec2<fixed16_16> pos;
+        fixed16_16       distance;
+        vec2<i8>         normal;   // Of the pixel face the ray entered through, or zero if it started inside.
+    };
+
+    bool raycast(ray const& r, ray_hit& hit)
+    {
+        i32 const ox{ r.origin.x.raw() };
+        i32 const oy{ r.origin.y.raw() };
+
+        i32 px{ ox >> 16 };
+        i32 py{ oy >> 16 };
+        if ((static_cast<u32>(px) >= k_world_width) || (static_cast<u32>(py) >= k_world_height)) return false;
+
+        bool const positive_x{ r.dir.x > fixed16_16{ 0 } };
+        bool const positive_y{ r.dir.y > fixed16_16{ 0 } };
+        i32  const inverse_x { ray_axis_reciprocal(r.dir.x) };
+        i32  const inverse_y { ray_axis_reciprocal(r.dir.y) };
+
+        i32      t{ 0 };
+        vec2<i8> normal{ 0, 0 };
+        for (;;)
+        {
+            u32 const tile_index{ ((static_cast<u32>(py) >> k_collision_tile_shift) * k_game_world_design_width) + (static_cast<u32>(px) >> k_collision_tile_shift) };
+            collision_tile const tile{ static_cast<collision_tile>(g_collision_tile_map[tile_index]) };
+
+            if ((tile == collision_tile::solid) || ((tile == collision_tile::partial) && g_game_world_collision_map[py][px]))
+            {
+                fixed16_16 const distance{ fixed16_16::from_raw(t) };
+                hit = ray_hit{ r.origin + (r.dir * distance), distance, normal };
+                return true;
+            }
+
+            // Find the next boundary of the tile, or of the pixel, along each axis.
+            u32 const shift{ (tile == collision_tile::empty) ? k_collision_tile_shift : 0Ui32 };
+            i32 const size  { static_cast<i32>(1Ui32 << shift) };
+            i32 const cell_x{ (px >> shift) << shift };
+            i32 const cell_y{ (py >> shift) << shift };
+
+            i32 const boundary_x{ positive_x ? (cell_x + size) : cell_x };
+            i32 const boundary_y{ positive_y ? (cell_y + size) : cell_y };
+
+            i32 const t_x{ ray_axis_distance(positive_x ? ((boundary_x << 16) - ox) : (ox - (boundary_x << 16)), inverse_x) };
+            i32 const t_y{ ray_axis_distance(positive_y ? ((boundary_y << 16) - oy) : (oy - (boundary_y << 16)), inverse_y) };
+
+            t = min(t_x, t_y);
+            if (t > r.max_distance.raw()) return false;
+
+            // Cross the nearest boundary. The other coordinate is found from the distance, but kept within the cell we
+            // are leaving, as it can only round out of it.
+            if (t_x <= t_y)
+            {
+                px     = positive_x ? boundary_x : (boundary_x - 1);
+                py     = min(max((oy + static_cast<i32>(__ll_rshift(__emul(r.dir.y.raw(), t), 16))) >> 16, cell_y), cell_y + size - 1);
+                normal = vec2<i8>{ static_cast<i8>(positive_x ? -1 : 1), 0 };
+            }
+            else
+            {
+                px     = min(max((ox + static_cast<i32>(__ll_rshift(__emul(r.dir.x.raw(), t), 16))) >> 16, cell_x), cell_x + size - 1);
+                py     = positive_y ? boundary_y : (boundary_y - 1);
+                normal = vec2<i8>{ 0, static_cast<i8>(positive_y ? -1 : 1) };
+            }
+
+            if ((static_cast<u32>(px) >= k_world_width) || (static_cast<u32>(py) >= k_world_height)) return false;
+        }
+    }
+
+    // The same as ray_axis_distance for eight lanes.
+    __forceinline __m256i ray_axis_distance_avx2(__m256i d, __m256i reciprocal)
+    {
+        __m256i const saturated{ _mm256_set1_epi32(0x7FFFFFFF) };
+        __m256i const limit    { _mm256_set1_epi64x(0x7FFFFFFF) };
+
+        d = _mm256_max_epi32(d, _mm256_setzero_si256());
+
+        // Both are positive, so the unsigned products are the signed ones.
+        __m256i even{ _mm256_srli_epi64(_mm256_mul_epu32(d, reciprocal), 16) };
+        __m256i odd { _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(d, 32), _mm256_srli_epi64(reciprocal, 32)), 16) };
+        even = _mm256_blendv_epi8(even, limit, _mm256_cmpgt_epi64(even, limit));
+        odd  = _mm256_blendv_epi8(odd,  limit, _mm256_cmpgt_epi64(odd,  limit));
+
+        __m256i const t{ _mm256_blend_epi32(even, _mm256_slli_epi64(odd, 32), 0b10101010) };
+        return _mm256_blendv_epi8(t, saturated, _mm256_cmpeq_epi32(reciprocal, saturated));
+    }
+
+    // Rounds 'o + d * t' down to whole pixels in eight lanes, like the scalar version does.
+    __forceinline __m256i ray_axis_pixel_avx2(__m256i o, __m256i d, __m256i t)
+    {
+        __m256i const even{ _mm256_mul_epi32(d, t) };
+        __m256i const odd { _mm256_mul_epi32(_mm256_srli_epi64(d, 32), _mm256_srli_epi64(t, 32)) };
+
+        __m256i const product{ _mm256_blend_epi32(_mm256_srli_epi64(even, 16), _mm256_slli_epi64(odd, 16), 0b10101010) };
+        return _mm256_srai_epi32(_mm256_add_epi32(o, product), 16);
+    }
+
+    u32 raycast_8_avx2(ray const* rays, ray_hit* hits)
+    {
+        // Go from an array of rays to one register per member.
+        alignas(32) i32 lanes[7][8];
+        for (u32 i{ 0 }; i < 8; ++i)
+        {
+            lanes[0][i] = rays[i].origin.x.raw();
+            lanes[1][i] = rays[i].origin.y.raw();
+            lanes[2][i] = rays[i].dir.x.raw();
+            lanes[3][i] = rays[i].dir.y.raw();
+            lanes[4][i] = ray_axis_reciprocal(rays[i].dir.x);
+            lanes[5][i] = ray_axis_reciprocal(rays[i].dir.y);
+            lanes[6][i] = rays[i].max_distance.raw();
+        }
+
+        __m256i const ox          { _mm256_load_si256(reinterpret_cast<__m256i const*>(lanes[0])) };
+        __m256i const oy          { _mm256_load_si256(reinterpret_cast<__m256i const*>(lanes[1])) };
+        __m256i const dx          { _mm256_load_si256(reinterpret_cast<__m256i const*>(lanes[2])) };
+        __m256i const dy          { _mm256_load_si256(reinterpret_cast<__m256i const*>(lanes[3])) };
+        __m256i const inverse_x   { _mm256_load_si256(reinterpret_cast<__m256i const*>(lanes[4])) };
+        __m256i const inverse_y   { _mm256_load_si256(reinterpret_cast<__m256i const*>(lanes[5])) };
+        __m256i const max_distance{ _mm256_load_si256(reinterpret_cast<__m256i const*>(lanes[6])) };
+
+        __m256i const zero      { _mm256_setzero_si256() };
+        __m256i const one       { _mm256_set1_epi32(1) };
+        __m256i const byte_mask { _mm256_set1_epi32(0xFF) };
+        __m256i const positive_x{ _mm256_cmpgt_epi32(dx, zero) };
+        __m256i const positive_y{ _mm256_cmpgt_epi32(dy, zero) };
+
+        // Lanes outside the world, as unsigned compares of the pixel coordinates.
+        auto const outside = [](__m256i x, __m256i y)
+        {
+            __m256i const lx{ _mm256_cmpgt_epi32(_mm256_setzero_si256(), x) };
+            __m256i const ly{ _mm256_cmpgt_epi32(_mm256_setzero_si256(), y) };
+            __m256i const hx{ _mm256_cmpgt_epi32(x, _mm256_set1_epi32(static_cast<i32>(k_world_width  - 1))) };
+            __m256i const hy{ _mm256_cmpgt_epi32(y, _mm256_set1_epi32(static_cast<i32>(k_world_height - 1))) };
+            return _mm256_or_si256(_mm256_or_si256(lx, ly), _mm256_or_si256(hx, hy));
+        };
+
+        __m256i px{ _mm256_srai_epi32(ox, 16) };
+        __m256i py{ _mm256_srai_epi32(oy, 16) };
+        __m256i t { zero };
+        __m256i nx{ zero };
+        __m256i ny{ zero };
+        __m256i hit{ zero };
+        __m256i active{ _mm256_andnot_si256(outside(px, py), _mm256_cmpeq_epi32(zero, zero)) };
+
+        while (!_mm256_testz_si256(active, active))
+        {
+            // Look up the tiles, and the pixels within the partially solid ones.
+            __m256i const tile_index{ _mm256_add_epi32(
+                _mm256_mullo_epi32(_mm256_srli_epi32(py, k_collision_tile_shift), _mm256_set1_epi32(k_game_world_design_width)),
+                _mm256_srli_epi32(px, k_collision_tile_shift)
+            ) };
+            __m256i const tiles{ _mm256_and_si256(
+                _mm256_mask_i32gather_epi32(zero, reinterpret_cast<int const*>(g_collision_tile_map), tile_index, active, 1), byte_mask
+            ) };
+
+            __m256i const partial{ _mm256_and_si256(_mm256_cmpeq_epi32(tiles, _mm256_set1_epi32(static_cast<i32>(collision_tile::partial))), active) };
+            // The collision map is not padded like the tile map, so read the aligned 32 bits holding the pixel, which
+            // never go past the end, and shift the pixel down.
+            static_assert(((k_world_width * k_world_height) % 4) == 0);
+            __m256i const pixel_index{ _mm256_add_epi32(_mm256_mullo_epi32(py, _mm256_set1_epi32(k_world_width)), px) };
+            __m256i const pixel_shift{ _mm256_slli_epi32(_mm256_and_si256(pixel_index, _mm256_set1_epi32(3)), 3) };
+            __m256i const pixels{ _mm256_and_si256(_mm256_srlv_epi32(
+                _mm256_mask_i32gather_epi32(zero, reinterpret_cast<int const*>(&g_game_world_collision_map[0][0]),
+                    _mm256_andnot_si256(_mm256_set1_epi32(3), pixel_index), partial, 1),
+                pixel_shift
+            ), byte_mask) };
+
+            __m256i const new_hits{ _mm256_and_si256(active, _mm256_or_si256(
+                _mm256_cmpeq_epi32(tiles, _mm256_set1_epi32(static_cast<i32>(collision_tile::solid))),
+                _mm256_and_si256(partial, _mm256_cmpgt_epi32(pixels, zero))
+            )) };
+            hit    = _mm256_or_si256(hit, new_hits);
+            active = _mm256_andnot_si256(new_hits, active);
+
+            // Find the next boundary of the tile, or of the pixel, along each axis.
+            __m256i const shift { _mm256_and_si256(_mm256_cmpeq_epi32(tiles, zero), _mm256_set1_epi32(k_collision_tile_shift)) };
+            __m256i const size  { _mm256_sllv_epi32(one, shift) };
+            __m256i const cell_x{ _mm256_sllv_epi32(_mm256_srlv_epi32(px, shift), shift) };
+            __m256i const cell_y{ _mm256_sllv_epi32(_mm256_srlv_epi32(py, shift), shift) };
+
+            __m256i const boundary_x{ _mm256_add_epi32(cell_x, _mm256_and_si256(positive_x, size)) };
+            __m256i const boundary_y{ _mm256_add_epi32(cell_y, _mm256_and_si256(positive_y, size)) };
+
+            __m256i const offset_x{ _mm256_sub_epi32(_mm256_slli_epi32(boundary_x, 16), ox) };
+            __m256i const offset_y{ _mm256_sub_epi32(_mm256_slli_epi32(boundary_y, 16), oy) };
+            __m256i const t_x{ ray_axis_distance_avx2(_mm256_blendv_epi8(_mm256_sub_epi32(zero, offset_x), offset_x, positive_x), inverse_x) };
+            __m256i const t_y{ ray_axis_distance_avx2(_mm256_blendv_epi8(_mm256_sub_epi32(zero, offset_y), offset_y, positive_y), inverse_y) };
+
+            __m256i const t_next{ _mm256_min_epi32(t_x, t_y) };
+            active = _mm256_andnot_si256(_mm256_cmpgt_epi32(t_next, max_distance), active);
+
+            // Cross the nearest boundary, in the lanes still going.
+            __m256i const step_y{ _mm256_cmpgt_epi32(t_x, t_y) };
+            __m256i const last_x{ _mm256_sub_epi32(_mm256_add_epi32(cell_x, size), one) };
+            __m256i const last_y{ _mm256_sub_epi32(_mm256_add_epi32(cell_y, size), one) };
+
+            __m256i const cross_x{ _mm256_blendv_epi8(_mm256_sub_epi32(boundary_x, one), boundary_x, positive_x) };
+            __m256i const cross_y{ _mm256_blendv_epi8(_mm256_sub_epi32(boundary_y, one), boundary_y, positive_y) };
+            __m256i const along_x{ _mm256_min_epi32(_mm256_max_epi32(ray_axis_pixel_avx2(ox, dx, t_next), cell_x), last_x) };
+            __m256i const along_y{ _mm256_min_epi32(_mm256_max_epi32(ray_axis_pixel_avx2(oy, dy, t_next), cell_y), last_y) };
+
+            __m256i const normal_x{ _mm256_andnot_si256(step_y, _mm256_or_si256(positive_x, one)) };
+            __m256i const normal_y{ _mm256_and_si256   (step_y, _mm256_or_si256(positive_y, one)) };
+
+            t  = _mm256_blendv_epi8(t,  t_next,                                    active);
+            px = _mm256_blendv_epi8(px, _mm256_blendv_epi8(cross_x, along_x, step_y), active);
+            py = _mm256_blendv_epi8(py, _mm256_blendv_epi8(along_y, cross_y, step_y), active);
+            nx = _mm256_blendv_epi8(nx, normal_x,                                  active);
+            ny = _mm256_blendv_epi8(ny, normal_y,                                  active);
+
+            active = _mm256_andnot_si256(outside(px, py), active);
+        }
+
+        alignas(32) i32 results[4][8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(results[0]), t);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(results[1]), nx);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(results[2]), ny);
+        u32 const mask{ static_cast<u32>(_mm256_movemask_ps(_mm256_castsi256_ps(hit))) };
+        _mm256_zeroupper();
+
+        for (u32 i{ 0 }; i < 8; ++i)
+        {
+            if ((mask & (1Ui32 << i)) == 0) continue;
+
+            fixed16_16 const distance{ fixed16_16::from_raw(results[0][i]) };
+            hits[i] = ray_hit{
+                rays[i].origin + (rays[i].dir * distance), distance,
+                vec2<i8>{ static_cast<i8>(results[1][i]), static_cast<i8>(results[2][i]) }
+            };
+        }
+
+        return mask;
+    }
+
+    // Casts eight rays at once, for fans of rays such as visibility checks. Returns a mask of the rays that hit.
+    u32 raycast_8(ray const* rays, ray_hit* hits)
+    {
+        if (g_cpu_has_avx2) return raycast_8_avx2(rays, hits);
+
+        u32 mask{ 0 };
+        for (u32 i{ 0 }; i < 8; ++i)
+        {
+            if (raycast(rays[i], hits[i])) mask |= (1Ui32 << i);
+        }
+        return mask;
+    }
+#endif
+
+    // Setup noise textures.
+
+    // A counter-based hash (lowbias32, https://nullprogram.com/blog/2018/07/31/), for random values that have to be
+    // found on their own rather than in sequence.
+    constexpr u32 hash_u32(u32 x)
+    {
+        x ^= x >> 16; x *= 0x7FEB352DUi32;
+        x ^= x >> 15; x *= 0x846CA68BUi32;
+        return x ^ (x >> 16);
+    }
+
+    void compute_white_noise_texture()
+    {
+        G21_TRACE_ZONE("compute_white_noise_texture");
+
+        // This noise is probably far higher quality than it needs to be, but whatever, now it's written.
+
+        // Initialize our state. These constants represent the first 128 bits in the initial hash value of SHA256.
+        u32 state[4]
+        {
+            0x6A09E667Ui32,
+            0xBB67AE85Ui32,
+            0x3C6EF372Ui32,
+            0xA54FF53AUi32
+        };
+
+        // Setup a pointer so we can write 4 bytes at a time.
+        static_assert(k_white_noise_texture_width % 4 == 0);
+        u32* ptr{ reinterpret_cast<u32*>(&g_white_noise_texture[0][0]) };
+
+        // Go through every pixel and generate a value using xoshiro128** 1.1 (Written this way for optimal code size).
+        // (https://xoshiro.di.unimi.it/xoshiro128starstar.c)
+        for (u32 n{ 0 }; n != (k_white_noise_texture_width * k_white_noise_texture_height); n += 4, ++ptr)
+        {
+            u32 const rand{ _rotl(state[1] * 5, 7) * 9 };
+
+            u32 const t{ state[1] << 9 };
+            state[2] ^= state[0];
+            state[3] ^= state[1];
+            state[1] ^= state[2];
+            state[0] ^= state[3];
+            state[2] ^= t;
+            state[3]  = _rotl(state[3], 11);
+
+            *ptr = rand;
+        }
+    }
+
+    void compute_fractal_noise_texture()
+    {
+        G21_TRACE_ZONE("compute_fractal_noise_texture");
+
+        // Sample the white noise texture multiple times at various scales and blend together.
+
+        for (u32 y{ 0 }; y < k_fractal_noise_texture_height; ++y)
+        {
+            for (u32 x{ 0 }; x < k_fractal_noise_texture_width; ++x)
+            {
+                u8 sum{ 0 };
+
+                for (u8 i{ 0 }; i < 4U; ++i)
+                {
+                    u8 const scale{ 4U - i };
+                    u8 const f{ 1U << scale };
+
+                    u32 const y_i{ y >> scale };
+                    u32 const y_f{ y & (f - 1) };
+
+                    u32 const x_i{ x >> scale };
+                    u32 const x_f{ x & (f - 1) };
+
+                    u32 const tmp_sum
+                        = (g_white_noise_texture[y_i + 0Ui32][x_i + 0Ui32] * (f - y_f) * (f - x_f))
+                        + (g_white_noise_texture[y_i + 0Ui32][x_i + 1Ui32] * (f - y_f) * (    x_f))
+                        + (g_white_noise_texture[y_i + 1Ui32][x_i + 0Ui32] * (    y_f) * (f - x_f))
+                        + (g_white_noise_texture[y_i + 1Ui32][x_i + 1Ui32] * (    y_f) * (    x_f));
+
+                    sum += static_cast<u8>(tmp_sum >> (scale * 2U)) >> (i + 1U);
+                }
+                
+                g_fractal_noise_texture[y][x] = sum;
+            }
+        }
+    }
+
+    // Setup a small work-stealing job system.
+    // Every thread has a Chase-Lev deque of jobs, where a job is a range of indices for a function to work through.
+    // The thread running a job keeps splitting off the back half of its range onto its own deque until it is down to
+    // the grain, so that the idle threads have something to steal. Threads pop from the bottom of their own deque and
+    // steal from the top of the others'. The deques are fixed rings, and a thread whose deque is full just runs the
+    // rest of the range itself. Deque 0 belongs to the thread handing out the work, which takes part in it, and only
+    // one thread may do so at a time. Every call only returns once the workers it woke have left it, so that no worker
+    // can carry on into the next call unless it was woken for it too.
+
+    constexpr u32 k_max_worker_count{ 8 };
+    constexpr u32 k_job_queue_size  { 64 }; // Must be a power of two. A range only takes up a slot per halving.
+
+    using job_function = void(*)(void* context, u32 begin, u32 end);
+
+    struct job
+    {
+        job_function   function;
+        void*          context;
+        volatile long* remaining; // Indices of the whole parallel_for that are not done yet.
+        u32            begin;
+        u32            end;
+        u32            grain;
+    };
+
+    struct job_queue
+    {
+        volatile long top;         // Where the thieves take from.
+        u8            padding[60]; // Keeps the two ends on separate cache lines.
+        volatile long bottom;      // Where the owner pushes and pops.
+        job           jobs[k_job_queue_size];
+    };
+
+    u32            g_worker_count;
+    constinit u32  g_job_thread_limit{ k_max_worker_count }; // Lowered by the benchmarks to measure the scaling.
+    HANDLE         g_worker_wake_events[k_max_worker_count];
+    volatile long  g_job_participants; // The threads taking part in the current parallel_for, or 0 if none is running.
+    volatile long  g_job_workers_left; // The woken workers that are done with the current parallel_for.
+    job_queue      g_job_queues[k_max_worker_count];
+
+    // Only called by the owner of the deque. Returns false if it is full.
+    bool push_job(job_queue& queue, job const& new_job)
+    {
+        long const bottom{ queue.bottom };
+        if ((bottom - queue.top) >= static_cast<long>(k_job_queue_size)) return false;
+
+        queue.jobs[bottom & (k_job_queue_size - 1)] = new_job;
+        queue.bottom = bottom + 1;
+        return true;
+    }
+
+    // Only called by the owner of the deque.
+    bool pop_job(job_queue& queue, job& out)
+    {
+        // The exchange keeps the read of 'top' from moving ahead of the claim on the bottom slot.
+        long const bottom{ queue.bottom - 1 };
+        InterlockedExchange(&queue.bottom, bottom);
+
+        long const top{ queue.top };
+        if (top > bottom)
+        {
+            queue.bottom = bottom + 1;
+            return false;
+        }
+
+        out = queue.jobs[bottom & (k_job_queue_size - 1)];
+        if (top != bottom) return true;
+
+        // This is the last job, so a thief may be after it too.
+        bool const won{ InterlockedCompareExchange(&queue.top, top + 1, top) == top };
+        queue.bottom = bottom + 1;
+        return won;
+    }
+
+    bool steal_job(job_queue& queue, job& out)
+    {
+        long const top   { queue.top };
+        long const bottom{ queue.bottom };
+        if (top >= bottom) return false;
+
+        // The slot may be overwritten once another thread takes it, but then the exchange fails and the copy is dropped.
+        out = queue.jobs[top & (k_job_queue_size - 1)];
+        return InterlockedCompareExchange(&queue.top, top + 1, top) == top;
+    }
+
+    void run_job(job_queue& queue, job current)
+    {
+        while ((current.end - current.begin) > current.grain)
+        {
+            u32 const middle{ current.begin + ((current.end - current.begin) / 2) };
+
+            job back{ current };
+            back.begin = middle;
+            if (!push_job(queue, back)) break;
+
+            current.end = middle;
+        }
+
+        current.function(current.context, current.begin, current.end);
+        InterlockedExchangeAdd(current.remaining, -static_cast<long>(current.end - current.begin));
+    }
+
+    // Runs a job from our own deque, or failing that, one stolen from another. Returns false if there were none.
+    bool run_next_job(u32 queue_index)
+    {
+        job_queue& own{ g_job_queues[queue_index] };
+
+        job next;
+        if (pop_job(own, next))
+        {
+            run_job(own, next);
+            return true;
+        }
+
+        for (u32 i{ 1 }; i < g_worker_count; ++i)
+        {
+            u32 const victim{ (queue_index + i) % g_worker_count };
+            if (steal_job(g_job_queues[victim], next))
+            {
+                run_job(own, next);
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    DWORD WINAPI worker_thread_proc(LPVOID param)
+    {
+        u32 const queue_index{ static_cast<u32>(reinterpret_cast<usize>(param)) };
+
+        G21_TRACE_THREAD("worker");
+
+        while (true)
+        {
+            WaitForSingleObject(g_worker_wake_events[queue_index], INFINITE);
+
+            // Keep looking for work until the parallel_for that woke us is done, unless it did not ask for us.
+            {
+                G21_TRACE_ZONE("jobs");
+                while (queue_index < static_cast<u32>(g_job_participants))
+                {
+                    if (!run_next_job(queue_index)) _mm_pause();
+                }
+            }
+
+            InterlockedIncrement(&g_job_workers_left);
+        }
+    }
+
+    void init_workers()
+    {
+        G21_TRACE_ZONE("init_workers");
+
+        SYSTEM_INFO system_info;
+        GetSystemInfo(&system_info);
+
+        g_worker_count = system_info.dwNumberOfProcessors;
+        if (g_worker_count > k_max_worker_count)
+        {
+            g_worker_count = k_max_worker_count;
+        }
+
+        for (u32 i{ 1 }; i < g_worker_count; ++i)
+        {
+            g_worker_wake_events[i] = CreateEventA(nullptr, FALSE, FALSE, nullptr);
+            CreateThread(nullptr, 0, worker_thread_proc, reinterpret_cast<LPVOID>(static_cast<usize>(i)), 0, nullptr);
+        }
+    }
+
+    // Calls 'function' over [begin, end) in ranges of at least 'grain' indices, spread over the workers, and returns
+    // once they are all done.
+    void parallel_for(u32 begin, u32 end, u32 grain, job_function function, void* context)
+    {
+        if (begin >= end) return;
+        if (grain == 0) grain = 1;
+
+        volatile long remaining{ static_cast<long>(end - begin) };
+
+        // Only wake up as many workers as the range can be split for, and always the same ones for the same count.
+        u32 const threads{ min(min(g_worker_count, g_job_thread_limit), ((end - begin) + (grain - 1)) / grain) };
+
+        g_job_workers_left = 0;
+        g_job_participants = static_cast<long>(threads);
+        for (u32 i{ 1 }; i < threads; ++i)
+        {
+            SetEvent(g_worker_wake_events[i]);
+        }
+
+        run_job(g_job_queues[0], job{ function, context, &remaining, begin, end, grain });
+        while (remaining != 0)
+        {
+            if (!run_next_job(0)) _mm_pause();
+        }
+
+        // Wait for the workers to leave, including any that only woke up after the work was done.
+        g_job_participants = 0;
+        while (g_job_workers_left != static_cast<long>(threads - 1))
+        {
+            _mm_pause();
+        }
+    }
+
+    // Calls 'body(range_begin, range_end)' over [begin, end), see above.
+    template<typename Body>
+    void parallel_for(u32 begin, u32 end, u32 grain, Body const& body)
+    {
+        job_function const function{ [](void* context, u32 range_begin, u32 range_end)
+        {
+            (*static_cast<Body const*>(context))(range_begin, range_end);
+        } };
+
+        parallel_for(begin, end, grain, function, const_cast<Body*>(&body));
+    }
+
+    // Runs 'job' once for every worker, for jobs that hand out their own work. The index only tells the calls apart.
+    void run_on_workers(void(*function)(u32 thread_index))
+    {
+        parallel_for(0, g_worker_count, 1, [function](u32 begin, u32 end)
+        {
+            for (u32 i{ begin }; i < end; ++i) function(i);
+        });
+    }
+
+#if G21_ENABLE_PARTICLES
+    // Particle pathfinding
+    // The particles follow a flow field towards the player, which is built in two levels. The coarse level is a search
+    // over the tiles of the world design: the open spans along the edges between two tiles are portals, and the
+    // distances between the portals of each tile are measured once at startup, so the distance from the player to
+    // every portal is found by a Dijkstra search over a couple of thousand nodes. The fine level is a per-pixel vector
+    // map, which is only kept for the tiles around the player and the tiles that have particles in them. It is found by
+    // a bit-parallel breadth-first search within the tile, seeded from its portals. Every other tile just points
+    // towards its best portal. This keeps both the cost of a refresh and the memory used in proportion to the number of
+    // tiles rather than the number of pixels.
+
+    constexpr u32 k_flow_tile_size   { k_sprite_size };
+    constexpr u32 k_flow_tile_columns{ k_game_world_design_width  };
+    constexpr u32 k_flow_tile_rows   { k_game_world_design_height };
+    constexpr u32 k_flow_tile_count  { k_flow_tile_columns * k_flow_tile_rows };
+    static_assert(k_flow_tile_size == 32, "the tile search keeps a row of a tile in a u32");
+    static_assert((k_flow_tile_columns == FLOW_TILE_COLUMNS) && (k_flow_tile_rows == FLOW_TILE_ROWS));
+
+    constexpr u32 k_flow_max_portal_count     { 2048 };
+    constexpr u32 k_flow_max_tile_portal_count{ 16 };
+    constexpr u32 k_flow_page_count           { 64 }; // The number of tiles that can have per-pixel vectors at once.
+    constexpr u16 k_flow_unreachable          { 0xFFFF };
+
+    using flow_tile_rows = u32[k_flow_tile_size];
+
+    struct flow_portal
+    {
+        u16 tiles[2];     // The left or top tile, then the right or bottom tile.
+        u8  side_by_side; // Whether the edge between the tiles is vertical.
+        u8  begin, end;   // The span of open pixels along the edge.
+    };
+
+    struct flow_tile_seed
+    {
+        flow_tile_rows pixels;
+        vec2<i8>       vector; // The direction the seed pixels point in.
+        u16            level;  // The level of the search at which the seed pixels are added.
+    };
+
+    flow_tile_rows g_flow_tile_open[k_flow_tile_count];
+    flow_portal    g_flow_portals[k_flow_max_portal_count];
+    u8             g_flow_portal_tile_index[k_flow_max_portal_count][2]; // Where the portal is in each tile's list.
+    u32            g_flow_portal_count;
+    u16            g_flow_tile_portals        [k_flow_tile_count][k_flow_max_tile_portal_count];
+    u8             g_flow_tile_portal_count   [k_flow_tile_count];
+    u16            g_flow_tile_portal_distance[k_flow_tile_count][k_flow_max_tile_portal_count][k_flow_max_tile_portal_count];
+
+    vec2<u16>      g_flow_target; // The border is solid, so the initial (0, 0) never matches the player.
+    u16            g_flow_portal_distance[k_flow_max_portal_count];
+    vec2<i8>       g_flow_tile_vector[k_flow_tile_count];
+    u32            g_flow_agent_tiles[(k_flow_tile_count + 31) / 32]; // The tiles that have particles in them.
+    u32            g_flow_searched_agent_tiles[(k_flow_tile_count + 31) / 32];
+
+    // The pages of per-pixel vectors. Both maps store the index plus one, so that zero means none.
+    vec2<i8>       g_flow_pages[k_flow_page_count][k_flow_tile_size][k_flow_tile_size];
+    u8             g_flow_tile_page[k_flow_tile_count];
+    u16            g_flow_page_tile[k_flow_page_count];
+    u32            g_flow_tile_signature[k_flow_tile_count]; // A hash of the seeds the page of the tile was made from.
+
+    // The tiles whose pages need to be refined, shared with the worker threads.
+    u16            g_flow_refine_tiles[k_flow_page_count];
+    flow_tile_seed g_flow_refine_seeds[k_flow_page_count][k_flow_max_tile_portal_count + 1];
+    u32            g_flow_refine_seed_count[k_flow_page_count];
+    u32            g_flow_refine_count;
+    volatile long  g_flow_refine_next;
+
+    // Tracks which tiles of the gradient map changed since the last upload.
+    bool           g_flow_tile_dirty[k_flow_tile_count];
+
+    // The neighbours of a pixel. A pixel that several frontier pixels reach at once points to the first of them in this
+    // order, so straight steps win over diagonal ones. The old queue-based search took whichever was queued first
+    // instead, so ties can point elsewhere than they used to, though never along a longer path.
+    constexpr vec2<i8> k_flow_neighbours[8]
+    {
+        vec2<i8>{  1,  0 },
+        vec2<i8>{  0,  1 },
+        vec2<i8>{ -1,  0 },
+        vec2<i8>{  0, -1 },
+        vec2<i8>{  1, -1 },
+        vec2<i8>{  1,  1 },
+        vec2<i8>{ -1,  1 },
+        vec2<i8>{ -1, -1 }
+    };
+
+    __forceinline u32 bit_scan_forward(u32 value)
+    {
+        DWORD index;
+        (void)_BitScanForward(&index, value);
+        return index;
+    }
+
+    __forceinline u32 get_flow_portal_side(u32 portal, u32 tile)
+    {
+        return (g_flow_portals[portal].tiles[0] == tile) ? 0 : 1;
+    }
+
+    __forceinline vec2<i8> get_flow_direction(i32 dx, i32 dy)
+    {
+        return vec2<i8>{ static_cast<i8>((dx > 0) - (dx < 0)), static_cast<i8>((dy > 0) - (dy < 0)) };
+    }
+
+    // Gets the pixels of a portal on one of its sides, relative to the tile on that side.
+    void get_flow_portal_pixels(u32 portal, u32 side, flow_tile_rows& pixels)
+    {
+        flow_portal const& p{ g_flow_portals[portal] };
+
+        for (u32 y{ 0 }; y < k_flow_tile_size; ++y) pixels[y] = 0;
+
+        if (p.side_by_side)
+        {
+            u32 const column_bit{ (side == 0) ? (1Ui32 << (k_flow_tile_size - 1)) : 1Ui32 };
+            for (u32 y{ p.begin }; y < p.end; ++y) pixels[y] = column_bit;
+        }
+        else
+        {
+            u32 const length{ static_cast<u32>(p.end - p.begin) };
+            pixels[(side == 0) ? (k_flow_tile_size - 1) : 0] = (length == 32) ? ~0Ui32 : (((1Ui32 << length) - 1) << p.begin);
+        }
+    }
+
+    // Gets the direction that leads from a tile through one of its portals.
+    __forceinline vec2<i8> get_flow_portal_vector(u32 portal, u32 side)
+    {
+        i8 const sign{ static_cast<i8>((side == 0) ? 1 : -1) };
+        return g_flow_portals[portal].side_by_side ? vec2<i8>{ sign, 0 } : vec2<i8>{ 0, sign };
+    }
+
+    __forceinline bool flow_tile_rows_intersect(flow_tile_rows const& a, flow_tile_rows const& b)
+    {
+        u32 any{ 0 };
+        for (u32 y{ 0 }; y < k_flow_tile_size; ++y) any |= a[y] & b[y];
+        return any != 0;
+    }
+
+    __forceinline void write_flow_vectors(vec2<i8>(&row)[k_flow_tile_size], u32 mask, vec2<i8> vector)
+    {
+        while (mask != 0)
+        {
+            row[bit_scan_forward(mask)] = vector;
+            mask &= (mask - 1);
+        }
+    }
+
+    // Runs a breadth-first search through the open pixels of a tile. Each row of the tile is a u32 bitmap, so a whole
+    // row of the next level is found with a handful of shifts and masks. The seeds are added at the level they ask for,
+    // which is how the distance beyond each portal is taken into account. If 'vectors' is given, each pixel reached gets
+    // a vector pointing to where it was reached from. 'on_level' gets the pixels reached at every level.
+    template<typename Fn>
+    void search_flow_tile(u32 tile, flow_tile_seed const* seeds, u32 seed_count, vec2<i8>(*vectors)[k_flow_tile_size], Fn&& on_level)
+    {
+        flow_tile_rows visited, frontier, reached;
+
+        // Pixels that are not open count as visited, so they are never entered.
+        for (u32 y{ 0 }; y < k_flow_tile_size; ++y)
+        {
+            visited [y] = ~g_flow_tile_open[tile][y];
+            frontier[y] = 0;
+        }
+
+        u16 last_seed_level{ 0 };
+        for (u32 i{ 0 }; i < seed_count; ++i)
+        {
+            last_seed_level = max(last_seed_level, seeds[i].level);
+        }
+
+        for (u16 level{ 0 };; ++level)
+        {
+            u32 any{ 0 };
+
+            for (u32 y{ 0 }; y < k_flow_tile_size; ++y)
+            {
+                u32 remaining{ ~visited[y] };
+                u32 row_reached{ 0 };
+
+                // Find the pixels that have a frontier pixel at an offset of -d.
+                for (vec2<i8> const d : k_flow_neighbours)
+                {
+                    i32 const src_y{ static_cast<i32>(y) - d.y };
+                    if ((src_y < 0) || (src_y >= static_cast<i32>(k_flow_tile_size))) continue;
+
+                    u32 const src{ frontier[src_y] };
+                    u32 const m{ ((d.x > 0) ? (src << 1) : ((d.x < 0) ? (src >> 1) : src)) & remaining };
+
+                    remaining   &= ~m;
+                    row_reached |=  m;
+
+                    if (vectors != nullptr)
+                    {
+                        write_flow_vectors(vectors[y], m, vec2<i8>{ static_cast<i8>(-d.x), static_cast<i8>(-d.y) });
+                    }
+                }
+
+                // Add the seeds that start at this level.
+                for (u32 i{ 0 }; i < seed_count; ++i)
+                {
+                    if (seeds[i].level != level) continue;
+
+                    u32 const m{ seeds[i].pixels[y] & remaining };
+
+                    remaining   &= ~m;
+                    row_reached |=  m;
+
+                    if (vectors != nullptr)
+                    {
+                        write_flow_vectors(vectors[y], m, seeds[i].vector);
+                    }
+                }
+
+                reached[y] = row_reached;
+                any       |= row_reached;
+            }
+
+            // Mark as visited and make it the next frontier.
+            for (u32 y{ 0 }; y < k_flow_tile_size; ++y)
+            {
+                visited [y] |= reached[y];
+                frontier[y]  = reached[y];
+            }
+
+            on_level(level, static_cast<flow_tile_rows const&>(reached));
+
+            // Check if we finished the flood fill.
+            if ((any == 0) && (level >= last_seed_level)) break;
+        }
+    }
+
+    void add_flow_portals(u32 tile_a, u32 tile_b, bool side_by_side, u32 open_edge)
+    {
+        // Every run of pixels that are open on both sides of the edge becomes a portal.
+        while (open_edge != 0)
+        {
+            u32 const begin{ bit_scan_forward(open_edge) };
+            u32 const after{ ~(open_edge >> begin) };
+            u32 const end  { (after == 0) ? 32 : (begin + bit_scan_forward(after)) };
+
+            u32 const length{ end - begin };
+            open_edge &= ~((length == 32) ? ~0Ui32 : (((1Ui32 << length) - 1) << begin));
+
+            if ((g_flow_portal_count == k_flow_max_portal_count)
+             || (g_flow_tile_portal_count[tile_a] == k_flow_max_tile_portal_count)
+             || (g_flow_tile_portal_count[tile_b] == k_flow_max_tile_portal_count))
+            {
+                G21_DEBUG_PRINT("#DEBUG: Out of flow field portals.\n");
+                continue;
+            }
+
+            u32 const portal{ g_flow_portal_count++ };
+            g_flow_portals[portal] = flow_portal{
+                { static_cast<u16>(tile_a), static_cast<u16>(tile_b) },
+                static_cast<u8>(side_by_side), static_cast<u8>(begin), static_cast<u8>(end)
+            };
+
+            g_flow_portal_tile_index[portal][0] = g_flow_tile_portal_count[tile_a];
+            g_flow_portal_tile_index[portal][1] = g_flow_tile_portal_count[tile_b];
+            g_flow_tile_portals[tile_a][g_flow_tile_portal_count[tile_a]++] = static_cast<u16>(portal);
+            g_flow_tile_portals[tile_b][g_flow_tile_portal_count[tile_b]++] = static_cast<u16>(portal);
+        }
+    }
+
+    void init_flow_field()
+    {
+        G21_TRACE_ZONE("init_flow_field");
+
+        // Gather the open pixels of each tile.
+        for (u32 tile{ 0 }; tile < k_flow_tile_count; ++tile)
+        {
+            u32 const tile_x{ (tile % k_flow_tile_columns) * k_flow_tile_size };
+            u32 const tile_y{ (tile / k_flow_tile_columns) * k_flow_tile_size };
+
+            for (u32 y{ 0 }; y < k_flow_tile_size; ++y)
+            {
+                u32 row{ 0 };
+                for (u32 x{ 0 }; x < k_flow_tile_size; ++x)
+                {
+                    if (!g_game_world_collision_map[tile_y + y][tile_x + x]) row |= 1Ui32 << x;
+                }
+                g_flow_tile_open[tile][y] = row;
+            }
+        }
+
+        // Find the portals between each tile and its right and bottom neighbours.
+        for (u32 tile{ 0 }; tile < k_flow_tile_count; ++tile)
+        {
+            if (((tile % k_flow_tile_columns) + 1) < k_flow_tile_columns)
+            {
+                u32 const right{ tile + 1 };
+
+                u32 open_edge{ 0 };
+                for (u32 y{ 0 }; y < k_flow_tile_size; ++y)
+                {
+                    open_edge |= ((g_flow_tile_open[tile][y] >> (k_flow_tile_size - 1)) & g_flow_tile_open[right][y] & 1) << y;
+                }
+
+                add_flow_portals(tile, right, true, open_edge);
+            }
+
+            if (((tile / k_flow_tile_columns) + 1) < k_flow_tile_rows)
+            {
+                u32 const below{ tile + k_flow_tile_columns };
+                add_flow_portals(tile, below, false, g_flow_tile_open[tile][k_flow_tile_size - 1] & g_flow_tile_open[below][0]);
+            }
+        }
+
+        // Measure the distances between the portals of each tile, by searching from each of them in turn.
+        for (u32 tile{ 0 }; tile < k_flow_tile_count; ++tile)
+        {
+            u32 const portal_count{ g_flow_tile_portal_count[tile] };
+
+            flow_tile_rows portal_pixels[k_flow_max_tile_portal_count];
+            for (u32 i{ 0 }; i < portal_count; ++i)
+            {
+                u32 const portal{ g_flow_tile_portals[tile][i] };
+                get_flow_portal_pixels(portal, get_flow_portal_side(portal, tile), portal_pixels[i]);
+            }
+
+            for (u32 i{ 0 }; i < portal_count; ++i)
+            {
+                u16 (&distances)[k_flow_max_tile_portal_count]{ g_flow_tile_portal_distance[tile][i] };
+                for (u32 j{ 0 }; j < portal_count; ++j) distances[j] = k_flow_unreachable;
+
+                flow_tile_seed seed;
+                __movsb(reinterpret_cast<u8*>(seed.pixels), reinterpret_cast<u8 const*>(portal_pixels[i]), sizeof(seed.pixels));
+                seed.vector = vec2<i8>{};
+                seed.level  = 0;
+
+                search_flow_tile(tile, &seed, 1, nullptr, [&](u16 level, flow_tile_rows const& reached)
+                {
+                    for (u32 j{ 0 }; j < portal_count; ++j)
+                    {
+                        if ((distances[j] == k_flow_unreachable) && flow_tile_rows_intersect(reached, portal_pixels[j]))
+                        {
+                            distances[j] = level;
+                        }
+                    }
+                });
+            }
+        }
+
+        G21_DEBUG_PRINT("#DEBUG: Flow field portals: ");
+        G21_DEBUG_PRINT(g_flow_portal_count);
+        G21_DEBUG_PRINT("\n");
+    }
+
+    void search_flow_portals(u32 target_tile, u16 const(&target_distances)[k_flow_max_tile_portal_count])
+    {
+        // A binary min-heap of the distance in the high bits and the portal in the low bits. Portals are not removed
+        // when their distance improves; the stale entries are skipped instead. Each portal is only expanded once, so
+        // the heap can never grow beyond this.
+        constexpr u32 portal_bits{ 11 };
+        static_assert((1Ui32 << portal_bits) == k_flow_max_portal_count);
+
+        static u32 heap[(k_flow_max_portal_count * 2 + 1) * k_flow_max_tile_portal_count];
+        u32 heap_size{ 0 };
+
+        auto const push = [&](u32 key)
+        {
+            u32 i{ heap_size++ };
+            while (i > 0)
+            {
+                u32 const parent{ (i - 1) / 2 };
+                if (heap[parent] <= key) break;
+                heap[i] = heap[parent];
+                i = parent;
+            }
+            heap[i] = key;
+        };
+
+        auto const pop = [&]() -> u32
+        {
+            u32 const top{ heap[0] };
+            u32 const key{ heap[--heap_size] };
+            u32 i{ 0 };
+            while (true)
+            {
+                u32 child{ (i * 2) + 1 };
+                if (child >= heap_size) break;
+                if (((child + 1) < heap_size) && (heap[child + 1] < heap[child])) ++child;
+                if (key <= heap[child]) break;
+                heap[i] = heap[child];
+                i = child;
+            }
+            heap[i] = key;
+            return top;
+        };
+
+        for (u32 portal{ 0 }; portal < g_flow_portal_count; ++portal)
+        {
+            g_flow_portal_distance[portal] = k_flow_unreachable;
+        }
+
+        // Start from the portals of the tile the target is in.
+        for (u32 i{ 0 }; i < g_flow_tile_portal_count[target_tile]; ++i)
+        {
+            if (target_distances[i] == k_flow_unreachable) continue;
+
+            u32 const portal{ g_flow_tile_portals[target_tile][i] };
+            g_flow_portal_distance[portal] = target_distances[i];
+            push((static_cast<u32>(target_distances[i]) << portal_bits) | portal);
+        }
+
+        while (heap_size != 0)
+        {
+            u32 const key     { pop() };
+            u32 const portal  { key & (k_flow_max_portal_count - 1) };
+            u32 const distance{ key >> portal_bits };
+
+            if (distance != g_flow_portal_distance[portal]) continue;
+
+            // Cross the portal into both tiles, and go on to every other portal of each.
+            for (u32 side{ 0 }; side < 2; ++side)
+            {
+                u32 const tile{ g_flow_portals[portal].tiles[side] };
+                u32 const i   { g_flow_portal_tile_index[portal][side] };
+
+                for (u32 j{ 0 }; j < g_flow_tile_portal_count[tile]; ++j)
+                {
+                    u16 const step{ g_flow_tile_portal_distance[tile][i][j] };
+                    if (step == k_flow_unreachable) continue;
+
+                    u32 const next    { g_flow_tile_portals[tile][j] };
+                    u32 const next_distance{ distance + 1 + step };
+                    if (next_distance < g_flow_portal_distance[next])
+                    {
+                        g_flow_portal_distance[next] = static_cast<u16>(next_distance);
+                        push((next_distance << portal_bits) | next);
+                    }
+                }
+            }
+        }
+    }
+
+    // Gets the seeds for refining a tile, along with a hash of them so we can tell whether they changed. Each portal is
+    // added at its distance relative to the closest one, which means pixels are led through the portal that is closest
+    // to the target counting the distance on both sides.
+    u32 get_flow_tile_seeds(u32 tile, flow_tile_seed(&seeds)[k_flow_max_tile_portal_count + 1], u32& signature)
+    {
+        u32 const target_tile{ ((g_flow_target.y / k_flow_tile_size) * k_flow_tile_columns) + (g_flow_target.x / k_flow_tile_size) };
+
+        u32 count{ 0 };
+        u32 closest{ k_flow_unreachable };
+        signature = 2166136261;
+
+        auto const hash = [&](u32 value)
+        {
+            signature = (signature ^ value) * 16777619;
+        };
+
+        if (tile == target_tile)
+        {
+            // The target itself is the first seed.
+            u32 const x{ g_flow_target.x % k_flow_tile_size };
+            u32 const y{ g_flow_target.y % k_flow_tile_size };
+
+            flow_tile_seed& seed{ seeds[count++] };
+            for (u32 i{ 0 }; i < k_flow_tile_size; ++i) seed.pixels[i] = 0;
+            seed.pixels[y] = 1Ui32 << x;
+            seed.vector    = vec2<i8>{};
+            seed.level     = 0;
+
+            closest = 0;
+            hash((y << 8) | x);
+        }
+        else
+        {
+            for (u32 i{ 0 }; i < g_flow_tile_portal_count[tile]; ++i)
+            {
+                closest = min(closest, static_cast<u32>(g_flow_portal_distance[g_flow_tile_portals[tile][i]]));
+            }
+        }
+
+        for (u32 i{ 0 }; i < g_flow_tile_portal_count[tile]; ++i)
+        {
+            u32 const portal  { g_flow_tile_portals[tile][i] };
+            u32 const distance{ g_flow_portal_distance[portal] };
+            if (distance == k_flow_unreachable) continue;
+
+            // A seed far enough behind the others would only ever reach pixels they cannot reach, which the tile
+            // search handles just as well with a level cap.
+            u32 const level{ min(distance - closest, 255Ui32) };
+
+            u32 const side{ get_flow_portal_side(portal, tile) };
+
+            flow_tile_seed& seed{ seeds[count++] };
+            get_flow_portal_pixels(portal, side, seed.pixels);
+            seed.vector = get_flow_portal_vector(portal, side);
+            seed.level  = static_cast<u16>(level);
+
+            hash((i << 8) | level);
+        }
+
+        return count;
+    }
+
+    // Gets the vector used for every pixel of a tile that has no page.
+    vec2<i8> get_flow_tile_vector(u32 tile)
+    {
+        u32 const target_tile{ ((g_flow_target.y / k_flow_tile_size) * k_flow_tile_columns) + (g_flow_target.x / k_flow_tile_size) };
+
+        // The tile centre is at 15.5, so work in half pixels.
+        constexpr i32 centre{ k_flow_tile_size - 1 };
+
+        if (tile == target_tile)
+        {
+            return get_flow_direction(
+                (static_cast<i32>(g_flow_target.x % k_flow_tile_size) * 2) - centre,
+                (static_cast<i32>(g_flow_target.y % k_flow_tile_size) * 2) - centre
+            );
+        }
+
+        // Point towards the middle of the closest portal.
+        u32 best{ k_flow_max_portal_count };
+        for (u32 i{ 0 }; i < g_flow_tile_portal_count[tile]; ++i)
+        {
+            u32 const portal{ g_flow_tile_portals[tile][i] };
+            if ((best == k_flow_max_portal_count) || (g_flow_portal_distance[portal] < g_flow_portal_distance[best]))
+            {
+                best = portal;
+            }
+        }
+
+        if ((best == k_flow_max_portal_count) || (g_flow_portal_distance[best] == k_flow_unreachable))
+        {
+            return vec2<i8>{};
+        }
+
+        flow_portal const& p{ g_flow_portals[best] };
+        i32 const along{ p.begin + p.end - 1 };
+        i32 const edge { (get_flow_portal_side(best, tile) == 0) ? (centre * 2) : 0 };
+
+        return p.side_by_side
+            ? get_flow_direction(edge - centre, along - centre)
+            : get_flow_direction(along - centre, edge - centre);
+    }
+
+    void refine_flow_tiles_job(u32)
+    {
+        while (true)
+        {
+            u32 const i{ static_cast<u32>(InterlockedIncrement(&g_flow_refine_next) - 1) };
+            if (i >= g_flow_refine_count) break;
+
+            u32 const tile{ g_flow_refine_tiles[i] };
+            vec2<i8>(&page)[k_flow_tile_size][k_flow_tile_size]{ g_flow_pages[g_flow_tile_page[tile] - 1] };
+
+            // Pixels cut off from every seed keep a zero vector.
+            __stosb(reinterpret_cast<u8*>(page), 0, sizeof(page));
+            search_flow_tile(tile, g_flow_refine_seeds[i], g_flow_refine_seed_count[i], page, [](u16, flow_tile_rows const&) {});
+
+            g_flow_tile_dirty[tile] = true;
+        }
+    }
+
+    bool update_particle_pathfinder_vector_map()
+    {
+        // Get the player's current position as an integer.
+        vec2<u16> const target{
+            static_cast<u16>(ifloor(g_sim.player.pos.x)),
+            static_cast<u16>(ifloor(g_sim.player.pos.y))
+        };
+
+        // The field only depends on the target and on which tiles have particles, so there may be nothing to do.
+        bool agents_moved{ false };
+        for (u32 i{ 0 }; i < countof(g_flow_agent_tiles); ++i)
+        {
+            if (g_flow_agent_tiles[i] != g_flow_searched_agent_tiles[i]) agents_moved = true;
+            g_flow_searched_agent_tiles[i] = g_flow_agent_tiles[i];
+        }
+
+        if ((target.x == g_flow_target.x) && (target.y == g_flow_target.y) && !agents_moved)
+        {
+            return false;
+        }
+
+        g_flow_target = target;
+
+        u32 const target_tx  { target.x / k_flow_tile_size };
+        u32 const target_ty  { target.y / k_flow_tile_size };
+        u32 const target_tile{ (target_ty * k_flow_tile_columns) + target_tx };
+
+        // Measure the distance from the target to the portals of its own tile, then search the rest of the tile graph.
+        {
+            u32 const portal_count{ g_flow_tile_portal_count[target_tile] };
+
+            u16 distances[k_flow_max_tile_portal_count];
+            flow_tile_rows portal_pixels[k_flow_max_tile_portal_count];
+            for (u32 i{ 0 }; i < portal_count; ++i)
+            {
+                u32 const portal{ g_flow_tile_portals[target_tile][i] };
+                get_flow_portal_pixels(portal, get_flow_portal_side(portal, target_tile), portal_pixels[i]);
+                distances[i] = k_flow_unreachable;
+            }
+
+            flow_tile_seed seed;
+            for (u32 y{ 0 }; y < k_flow_tile_size; ++y) seed.pixels[y] = 0;
+            seed.pixels[target.y % k_flow_tile_size] = 1Ui32 << (target.x % k_flow_tile_size);
+            seed.vector = vec2<i8>{};
+            seed.level  = 0;
+
+            search_flow_tile(target_tile, &seed, 1, nullptr, [&](u16 level, flow_tile_rows const& reached)
+            {
+                for (u32 i{ 0 }; i < portal_count; ++i)
+                {
+                    if ((distances[i] == k_flow_unreachable) && flow_tile_rows_intersect(reached, portal_pixels[i]))
+                    {
+                        distances[i] = level;
+                    }
+                }
+            });
+
+            search_flow_portals(target_tile, distances);
+        }
+
+        // Update the coarse vector of every tile. Only the tiles without a page actually use it.
+        for (u32 tile{ 0 }; tile < k_flow_tile_count; ++tile)
+        {
+            vec2<i8> const vector{ get_flow_tile_vector(tile) };
+            if ((vector.x != g_flow_tile_vector[tile].x) || (vector.y != g_flow_tile_vector[tile].y))
+            {
+                g_flow_tile_vector[tile] = vector;
+                if (g_flow_tile_page[tile] == 0) g_flow_tile_dirty[tile] = true;
+            }
+        }
+
+        // Decide which tiles get a page, starting with the ones around the target.
+        static bool wanted[k_flow_tile_count];
+        __stosb(reinterpret_cast<u8*>(wanted), 0, sizeof(wanted));
+        u32 wanted_count{ 0 };
+
+        auto const want = [&](u32 tile)
+        {
+            if (!wanted[tile] && (wanted_count < k_flow_page_count))
+            {
+                wanted[tile] = true;
+                ++wanted_count;
+            }
+        };
+
+        for (i32 dy{ -1 }; dy <= 1; ++dy)
+        {
+            for (i32 dx{ -1 }; dx <= 1; ++dx)
+            {
+                u32 const tx{ static_cast<u32>(static_cast<i32>(target_tx) + dx) };
+                u32 const ty{ static_cast<u32>(static_cast<i32>(target_ty) + dy) };
+                if ((tx < k_flow_tile_columns) && (ty < k_flow_tile_rows)) want((ty * k_flow_tile_columns) + tx);
+            }
+        }
+
+        for (u32 tile{ 0 }; tile < k_flow_tile_count; ++tile)
+        {
+            if ((g_flow_agent_tiles[tile / 32] >> (tile % 32)) & 1) want(tile);
+        }
+
+        // Take the pages back from tiles that are no longer wanted, which fall back to their coarse vector.
+        for (u32 page{ 0 }; page < k_flow_page_count; ++page)
+        {
+            u32 const owner{ g_flow_page_tile[page] };
+            if ((owner != 0) && !wanted[owner - 1])
+            {
+                g_flow_tile_page [owner - 1] = 0;
+                g_flow_tile_dirty[owner - 1] = true;
+                g_flow_page_tile[page] = 0;
+            }
+        }
+
+        // Give out the free pages, and queue every page whose seeds changed for refinement.
+        g_flow_refine_count = 0;
+        u32 free_page{ 0 };
+
+        for (u32 tile{ 0 }; tile < k_flow_tile_count; ++tile)
+        {
+            if (!wanted[tile]) continue;
+
+            bool const is_new{ g_flow_tile_page[tile] == 0 };
+            if (is_new)
+            {
+                while (g_flow_page_tile[free_page] != 0) ++free_page;
+                g_flow_page_tile[free_page] = static_cast<u16>(tile + 1);
+                g_flow_tile_page[tile]      = static_cast<u8> (free_page + 1);
+            }
+
+            u32 const i{ g_flow_refine_count };
+            u32 signature;
+            g_flow_refine_seed_count[i] = get_flow_tile_seeds(tile, g_flow_refine_seeds[i], signature);
+
+            if (is_new || (signature != g_flow_tile_signature[tile]))
+            {
+                g_flow_tile_signature[tile] = signature;
+                g_flow_refine_tiles[i] = static_cast<u16>(tile);
+                ++g_flow_refine_count;
+            }
+        }
+
+        // Refine the pages on all the worker threads.
+        if (g_flow_refine_count != 0)
+        {
+            g_flow_refine_next = 0;
+            run_on_workers(refine_flow_tiles_job);
+        }
+
+        // Return true if anything in the gradient map needs to be updated.
+        for (u32 tile{ 0 }; tile < k_flow_tile_count; ++tile)
+        {
+            if (g_flow_tile_dirty[tile]) return true;
+        }
+
+        return false;
+    }
+
+    // A texel of the map that drives the particles, mirroring the RGBA16I texture it is uploaded to. The first half is
+    // the pathfinding force. The second half carries the signed distance to the nearest surface and the surface normal,
+    // so that the particle update gets everything it needs for both steering and collision from a single texel fetch.
+    struct particle_force_texel
+    {
+        vec2<i16> force;    // 10.6 fixed-point.
+        i16       distance; // 8.8 fixed-point, clamped. Positive in open space, negative inside walls.
+        u16       normal;   // Two i8 in 2.6 fixed-point. The x component is in the low byte, y in the high byte.
+    };
+    static_assert(sizeof(particle_force_texel) == 8);
+
+    particle_force_texel g_gradient_map[k_world_height][k_world_width];
+
+    constexpr i16 clamp_to_i16(i32 value)
+    {
+        return static_cast<i16>((value > 32767) ? 32767 : ((value < -32768) ? -32768 : value));
+    }
+
+    void compute_particle_collision_map()
+    {
+        G21_TRACE_ZONE("compute_particle_collision_map");
+
+        // The distance and normal only depend on the world, so they are filled in once. The normal is the gradient
+        // of the distance field, which points away from the nearest surface. Since a distance field changes by about
+        // one unit per pixel, the central difference is already close to unit length and only needs clamping.
+
+        for (u32 y{ 1 }; y < k_world_height - 1; ++y)
+        {
+            for (u32 x{ 1 }; x < k_world_width - 1; ++x)
+            {
+                i32 const dx{ (g_game_world_distance_field[y][x + 1] - g_game_world_distance_field[y][x - 1]).raw() };
+                i32 const dy{ (g_game_world_distance_field[y + 1][x] - g_game_world_distance_field[y - 1][x]).raw() };
+
+                // Halve the central difference and go from 16 to 6 fractional bits.
+                auto const to_2_6 = [](i32 v) -> u16
+                {
+                    v >>= 11;
+                    if (v >  64) v =  64;
+                    if (v < -64) v = -64;
+                    return static_cast<u16>(static_cast<u8>(static_cast<i8>(v)));
+                };
+
+                g_gradient_map[y][x].distance = clamp_to_i16(g_game_world_distance_field[y][x].raw() >> 8);
+                g_gradient_map[y][x].normal   = static_cast<u16>(to_2_6(dx) | (to_2_6(dy) << 8));
+            }
+        }
+
+        // Make sure the whole map goes up with the first upload.
+        for (u32 tile{ 0 }; tile < k_flow_tile_count; ++tile)
+        {
+            g_flow_tile_dirty[tile] = true;
+        }
+    }
+
+    constexpr u32 k_gradient_map_tile_grain{ 16 }; // Tiles per job, a single one is too little work to hand out.
+
+    u16 g_gradient_map_tiles[k_flow_tile_count];
+
+    // The texels on the edge of the world have no neighbours to take the differences from, so they are skipped here,
+    // as they are in compute_particle_collision_map(). They keep the zero texel they start with: no force, no distance
+    // and no normal, so a particle that gets there coasts on until it leaves the map and update_particle_block()
+    // retires it.
+    void compute_gradient_map_tile(u32 tile)
+    {
+        u32 const tile_x{ (tile % k_flow_tile_columns) * k_flow_tile_size };
+        u32 const tile_y{ (tile / k_flow_tile_columns) * k_flow_tile_size };
+        u32 const page  { g_flow_tile_page[tile] };
+
+        for (u32 y{ tile_y }; y < tile_y + k_flow_tile_size; ++y)
+        {
+            if ((y == 0) || (y == (k_world_height - 1))) continue;
+
+            for (u32 x{ tile_x }; x < tile_x + k_flow_tile_size; ++x)
+            {
+                if ((x == 0) || (x == (k_world_width - 1))) continue;
+
+                fixed16_16 dx, dy;
+                if (g_game_world_collision_map[y][x])
+                {
+                    // Use the distance field for pushing the particle out.
+                    dx = (g_game_world_distance_field[y][x + 1] - g_game_world_distance_field[y][x - 1]) * 8;
+                    dy = (g_game_world_distance_field[y + 1][x] - g_game_world_distance_field[y - 1][x]) * 8;
+                }
+                else
+                {
+                    vec2<i8> const vector{
+                        (page != 0) ? g_flow_pages[page - 1][y - tile_y][x - tile_x] : g_flow_tile_vector[tile]
+                    };
+                    dx = fixed16_16{ static_cast<i16>(vector.x * 2) };
+                    dy = fixed16_16{ static_cast<i16>(vector.y * 2) };
+                }
+
+                fixed16_16 value_x = dx * 12;
+                fixed16_16 value_y = dy * 12;
+
+                value_x += fixed16_16{ static_cast<i16>(static_cast<i32>(static_cast<u32>(g_fractal_noise_texture[y - 1][x])) - static_cast<i32>(static_cast<u32>(g_fractal_noise_texture[y + 1][x]))) } * 1;
+                value_y += fixed16_16{ static_cast<i16>(static_cast<i32>(static_cast<u32>(g_fractal_noise_texture[y][x + 1])) - static_cast<i32>(static_cast<u32>(g_fractal_noise_texture[y][x - 1]))) } * 1;
+                //value.x += (g_game_world_distance_field[y][x + 1] - g_game_world_distance_field[y][x - 1]) * 2;
+                //value.y += (g_game_world_distance_field[y + 1][x] - g_game_world_distance_field[y - 1][x]) * 2;
+
+                g_gradient_map[y][x].force.x = clamp_to_i16(value_x.raw() >> 10);
+                g_gradient_map[y][x].force.y = clamp_to_i16(value_y.raw() >> 10);
+            }
+        }
+    }
+
+    void compute_gradient_map()
+    {
+        // Only the tiles where the flow field changed need to be recomputed, as the noise is static.
+        u32 count{ 0 };
+        for (u32 tile{ 0 }; tile < k_flow_tile_count; ++tile)
+        {
+            if (g_flow_tile_dirty[tile]) g_gradient_map_tiles[count++] = static_cast<u16>(tile);
+        }
+
+        parallel_for(0, count, k_gradient_map_tile_grain, [](u32 begin, u32 end)
+        {
+            for (u32 i{ begin }; i < end; ++i) compute_gradient_map_tile(g_gradient_map_tiles[i]);
+        });
+    }
+
+    void upload_gradient_map()
+    {
+        // Only the tiles that changed since the last upload are sent. They are packed into a pixel buffer object, and
+        // each is then copied into the texture from there. The tiles are sent whole, including the texels on the edge
+        // of the world, which compute_gradient_map_tile() leaves alone.
+
+        static u16 tiles[k_flow_tile_count];
+        u32 tile_count{ 0 };
+
+        for (u32 tile{ 0 }; tile < k_flow_tile_count; ++tile)
+        {
+            if (!g_flow_tile_dirty[tile]) continue;
+
+            g_flow_tile_dirty[tile] = false;
+            tiles[tile_count++] = static_cast<u16>(tile);
+        }
+
+        if (tile_count == 0) return;
+
+        constexpr usize row_size { k_flow_tile_size * sizeof(particle_force_texel) };
+        constexpr usize tile_size{ k_flow_tile_size * row_size };
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, g_gradient_map_pbo_id);
+
+        // Orphan the previous contents, so that we never have to wait for the copies from the last upload.
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, tile_count * tile_size, nullptr, GL_STREAM_DRAW);
+        u8* const staging{ static_cast<u8*>(glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY)) };
+
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_RECTANGLE, g_gradient_map_texture_id);
+
+        bool uploaded{ false };
+        if (staging != nullptr)
+        {
+            // Gather the dirty tiles into the pixel buffer.
+            for (u32 i{ 0 }; i < tile_count; ++i)
+            {
+                u32 const tile_x{ (tiles[i] % k_flow_tile_columns) * k_flow_tile_size };
+                u32 const tile_y{ (tiles[i] / k_flow_tile_columns) * k_flow_tile_size };
+
+                for (u32 y{ 0 }; y < k_flow_tile_size; ++y)
+                {
+                    __movsb(staging + (i * tile_size) + (y * row_size), reinterpret_cast<u8 const*>(&g_gradient_map[tile_y + y][tile_x]), row_size);
+                }
+            }
+
+            // The contents are lost if the buffer got corrupted while it was mapped, and the tiles are sent again below.
+            if (glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE)
+            {
+                // Copy each tile into the texture.
+                for (u32 i{ 0 }; i < tile_count; ++i)
+                {
+                    glTexSubImage2D(
+                        GL_TEXTURE_RECTANGLE, 0,
+                        (tiles[i] % k_flow_tile_columns) * k_flow_tile_size, (tiles[i] / k_flow_tile_columns) * k_flow_tile_size,
+                        k_flow_tile_size, k_flow_tile_size, GL_RGBA_INTEGER, GL_SHORT,
+                        reinterpret_cast<void const*>(i * tile_size)
+                    );
+                }
+                uploaded = true;
+            }
+        }
+
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        if (!uploaded)
+        {
+            // The buffer could not be used, so send the tiles straight from the map instead, and wait for the copies.
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(k_world_width));
+            for (u32 i{ 0 }; i < tile_count; ++i)
+            {
+                u32 const tile_x{ (tiles[i] % k_flow_tile_columns) * k_flow_tile_size };
+                u32 const tile_y{ (tiles[i] / k_flow_tile_columns) * k_flow_tile_size };
+
+                glTexSubImage2D(
+                    GL_TEXTURE_RECTANGLE, 0, tile_x, tile_y, k_flow_tile_size, k_flow_tile_size, GL_RGBA_INTEGER, GL_SHORT,
+                    &g_gradient_map[tile_y][tile_x]
+                );
+            }
+            glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        }
+
+        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+    }
+#endif
+
+    // Setup the background texture.
+    // When compute shaders are supported, the background is generated straight into its texture on the GPU, so neither
+    // the work nor the upload is done on the CPU. The version here is the fallback, and the reference for the shader.
+
+    // The background is grey, so only one channel is stored and the shader expands it.
+    using background_texture_data = u8[k_world_height][k_world_width];
+
+    void compute_background_texture(background_texture_data& background_texture)
+    {
+        constexpr u32 brick_width { 16 };
+        constexpr u32 brick_height{ brick_width / 2 };
+
+        for (u32 y{ 0 }; y < k_world_height; ++y)
+        {
+            u32 const bi_y{ y / brick_height };
+            u32 const bf_y{ y % brick_height };
+
+            u32 const offset_x{ ((bi_y & 1) == 1) ? (brick_width / 2) : 0 };
+
+            for (u32 x{ 0 }; x < k_world_width; ++x)
+            {
+                if (!g_game_world_collision_map[y][x])
+                {
+                    u32 const bi_x{ (x + offset_x) / brick_width  };
+                    u32 const bf_x{ (x + offset_x) % brick_width  };
+                
+                    if ((bf_x < 1) || (bf_y < 1))
+                    {
+                        background_texture[y][x] = static_cast<u8>(g_white_noise_texture[y][x] / 16);
+                    }
+                    else
+                    {
+                        u8 brick_color{ static_cast<u8>(40Ui8 + (g_white_noise_texture[bi_y][bi_x] / 3)) };
+                        brick_color  = static_cast<u8>(((static_cast<u16>(brick_color) << 2) - brick_color + g_fractal_noise_texture[y][x]) / 6);
+                        brick_color &= static_cast<u8>(~3Ui8);
+                        brick_color |= (g_white_noise_texture[y][x] & 1);
+
+                        background_texture[y][x] = brick_color;
+                    }
+                }
+                else
+                {
+#if 0
+                    // TODO: Combine some texture with this alpha
+                    i16 const asdf = ifloor(max(g_game_world_distance_field[y][x] + 15, fixed16_16{ 0 }) * 3);
+                    background_texture[y][x] = static_cast<u8>((asdf * asdf) / 8);
+#endif
+                }
+            }
+        }
+    }
+
+    void generate_background_texture()
+    {
+        // Pack the collision map into one bit per pixel for the shader.
+        static_assert((k_world_width % 32) == 0);
+        static u32 collision_bits[(k_world_width * k_world_height) / 32];
+
+        for (u32 y{ 0 }; y < k_world_height; ++y)
+        {
+            for (u32 x{ 0 }; x < k_world_width; ++x)
+            {
+                u32 const n{ (y * k_world_width) + x };
+                if (g_game_world_collision_map[y][x]) collision_bits[n / 32] |= 1Ui32 << (n % 32);
+            }
+        }
+
+        GLuint buffer_ids[2];
+        glGenBuffers(2, buffer_ids);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer_ids[0]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(collision_bits), collision_bits, GL_STATIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer_ids[1]);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(g_white_noise_texture), g_white_noise_texture, GL_STATIC_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+        glUseProgram(g_background_generator_program_id);
+
+        glUniform1i(0, k_world_width);                      // width
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, buffer_ids[0]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, buffer_ids[1]);
+        glBindImageTexture(0, g_background_texture_id, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R8UI);
+
+        static_assert(((k_world_width % 8) == 0) && ((k_world_height % 8) == 0));
+        glDispatchCompute(k_world_width / 8, k_world_height / 8, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+
+        glBindImageTexture(0, 0, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_R8UI);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
+
+        glUseProgram(0);
+
+        // The buffers are only released once the dispatch is done with them.
+        glDeleteBuffers(2, buffer_ids);
+    }
+
+    #ifdef _DEBUG
+    // Reads the generated background back and fails the run unless it matches the CPU reference exactly. This only
+    // needs a GL 4.3 driver, so it also runs on software renderers like llvmpipe.
+    void verify_background_texture()
+    {
+        static background_texture_data expected, actual;
+
+        compute_background_texture(expected);
+
+        glBindTexture(GL_TEXTURE_RECTANGLE, g_background_texture_id);
+        glGetTexImage(GL_TEXTURE_RECTANGLE, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, actual);
+        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+
+        u32 mismatches{ 0 };
+        for (u32 y{ 0 }; y < k_world_height; ++y)
+        {
+            for (u32 x{ 0 }; x < k_world_width; ++x)
+            {
+                if (actual[y][x] != expected[y][x]) ++mismatches;
+            }
+        }
+
+        if (mismatches != 0)
+        {
+            G21_DEBUG_PRINT("#DEBUG: Background texture mismatches: ");
+            G21_DEBUG_PRINT(mismatches);
+            G21_DEBUG_PRINT("\n");
+            fail_self_check("The background shader self-check failed.\n");
+        }
+    }
+    #endif
+
+    // The background as computed by the startup loader, when it cannot be generated on the GPU.
+    background_texture_data g_loaded_background_texture;
+
+    void init_background_texture()
+    {
+        G21_TRACE_ZONE("init_background_texture");
+
+        glGenTextures(1, &g_background_texture_id);
+        glBindTexture(GL_TEXTURE_RECTANGLE, g_background_texture_id);
+        glTexImage2D (GL_TEXTURE_RECTANGLE, 0, GL_R8UI, k_world_width, k_world_height, 0, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+
+        if (glDispatchCompute != nullptr)
+        {
+            generate_background_texture();
+
+            #ifdef _DEBUG
+            verify_background_texture();
+            #endif
+        }
+        else
+        {
+            glBindTexture  (GL_TEXTURE_RECTANGLE, g_background_texture_id);
+            glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, 0, 0, k_world_width, k_world_height, GL_RED_INTEGER, GL_UNSIGNED_BYTE, g_loaded_background_texture);
+            glBindTexture  (GL_TEXTURE_RECTANGLE, 0);
+        }
+    }
+
+    // Setup the lighting.
+    // The background is lit by a handful of point lights: the lantern carried by the player and the lights at the 'f'
+    // cells of the level design. A pixel gets the light of every light within its radius, scaled down by a soft
+    // shadow, which is found by sphere tracing the distance field from the pixel towards the light and keeping how
+    // close the ray came to a wall relative to how far along it was. Lights off screen are dropped, and the screen is split into tiles
+    // of 32x32 pixels that each keep a mask of the lights reaching into them, so a pixel only looks at the few lights
+    // that can affect it. The shading is done in k_background_render_fs_source, and the same integer operations are
+    // done on the CPU by update_light_reference(), which debug builds check the shader against and the benchmarks
+    // measure.
+
+    constexpr u32 k_max_light_count   { 32 };  // One bit per light in the tile masks.
+    constexpr u32 k_max_light_radius  { 160 }; // Keeps the squared distances within a fixed16_16.
+    constexpr u32 k_light_tile_size   { 32 };
+    constexpr u32 k_light_tile_columns{ camera::k_width  / k_light_tile_size };
+    constexpr u32 k_light_tile_rows   { camera::k_height / k_light_tile_size };
+    constexpr u32 k_light_tile_count  { k_light_tile_columns * k_light_tile_rows };
+    constexpr i32 k_light_ambient     { 80 };  // Out of 256, per channel.
+    constexpr i32 k_light_penumbra    { 64 };  // Sharpness of the shadows, in 1/16ths of a pixel per pixel travelled.
+    constexpr u32 k_light_max_steps   { 48 };
+    static_assert((k_light_tile_columns == 14) && (k_light_tile_rows == 8), "the render shader assumes 14x8 tiles");
+    static_assert((k_max_light_radius * k_max_light_radius) < 32768);
+
+    struct point_light
+    {
+        vec2<u16> pos;     // In world pixels.
+        u16       radius;  // In pixels.
+        u16       flicker; // How many pixels the radius wavers by.
+        u32       color;   // 0x00BBGGRR, the intensity of each channel out of 256.
+    };
+
+    // The layout of the shader storage buffer read by k_background_render_fs_source.
+    struct gpu_light
+    {
+        u32 pos;    // x | (y << 16)
+        u32 radius;
+        u32 color;
+        u32 unused;
+    };
+
+    struct light_buffer
+    {
+        u32       tile_masks[k_light_tile_count];
+        gpu_light lights[k_max_light_count];
+    };
+    static_assert((sizeof(light_buffer::tile_masks) % 16) == 0, "std430 aligns the lights to 16 bytes");
+
+    point_light  g_lights[k_max_light_count]; // The lantern comes first.
+    u32          g_light_count;
+    u32          g_light_frame;
+    light_buffer g_light_buffer;              // The visible lights of the current frame.
+
+    // The distance field in 1/16ths of a pixel, rounded down. This is what the shadows are traced through.
+    i16 g_light_distance_field[k_world_height][k_world_width];
+
+    void compute_light_distance_rows(u32 y_begin, u32 y_end)
+    {
+        // The distances are capped at 255 pixels, so they fit.
+        for (u32 y{ y_begin }; y < y_end; ++y)
+        {
+            for (u32 x{ 0 }; x < k_world_width; ++x)
+            {
+                g_light_distance_field[y][x] = static_cast<i16>(g_game_world_distance_field[y][x].raw() >> 12);
+            }
+        }
+    }
+
+#if G21_BENCHMARK
+    void compute_light_distance_field()
+    {
+        G21_TRACE_ZONE("compute_light_distance_field");
+
+        compute_light_distance_rows(0, k_world_height);
+    }
+#endif
+
+    void init_lights()
+    {
+        G21_TRACE_ZONE("init_lights");
+
+        g_lights[0] = point_light{ .radius = 128, .flicker = 2, .color = 0x00A0DCFF };
+        g_light_count = 1;
+
+        // Hang a light near the floor of every 'f' cell of the level design.
+        for (u32 y{ 0 }; y < k_game_world_design_height; ++y)
+        {
+            for (u32 x{ 0 }; x < k_game_world_design_width; ++x)
+            {
+                if ((k_game_world_design[(y * k_game_world_design_width) + x] == 'f') && (g_light_count < k_max_light_count))
+                {
+                    g_lights[g_light_count++] = point_light{
+                        .pos     = vec2<u16>{
+                            static_cast<u16>((x * k_sprite_size) + (k_sprite_size / 2)),
+                            static_cast<u16>((y * k_sprite_size) + (k_sprite_size - 13))
+                        },
+                        .radius  = 96,
+                        .flicker = 6,
+                        .color   = 0x0040A0FF
+                    };
+                }
+            }
+        }
+    }
+
+    void gather_visible_lights()
+    {
+        G21_TRACE_ZONE("gather_visible_lights");
+
+        ++g_light_frame;
+
+        // The lantern hangs in the middle of the player.
+        g_lights[0].pos = vec2<u16>{
+            static_cast<u16>(ifloor(g_snapshot->player.pos.x) + (player::k_width  / 2)),
+            static_cast<u16>(ifloor(g_snapshot->player.pos.y) + (player::k_height / 2))
+        };
+
+        __stosb(reinterpret_cast<u8*>(g_light_buffer.tile_masks), 0, sizeof(g_light_buffer.tile_masks));
+
+        u32 count{ 0 };
+        for (u32 i{ 0 }; i < g_light_count; ++i)
+        {
+            point_light const& light{ g_lights[i] };
+
+            // The radius wavers a little every few frames.
+            i32 const r{ light.radius - static_cast<i32>(hash_u32(((g_light_frame / 4) * k_max_light_count) + i) % (light.flicker + 1U)) };
+
+            // Drop the light if it does not reach the screen.
+            i32 const x{ static_cast<i32>(light.pos.x) - g_snapshot->camera.x };
+            i32 const y{ static_cast<i32>(light.pos.y) - g_snapshot->camera.y };
+            if (((x + r) <= 0) || ((y + r) <= 0) || ((x - r) >= camera::k_width) || ((y - r) >= camera::k_height)) continue;
+
+            // Add it to every tile within its radius.
+            i32 const tx0{ max(x - r, 0) / static_cast<i32>(k_light_tile_size) };
+            i32 const ty0{ max(y - r, 0) / static_cast<i32>(k_light_tile_size) };
+            i32 const tx1{ min(x + r, camera::k_width  - 1) / static_cast<i32>(k_light_tile_size) };
+            i32 const ty1{ min(y + r, camera::k_height - 1) / static_cast<i32>(k_light_tile_size) };
+
+            for (i32 ty{ ty0 }; ty <= ty1; ++ty)
+            {
+                i32 const top{ ty * static_cast<i32>(k_light_tile_size) };
+                i32 const dy { max(top - y, 0) + max(y - (top + static_cast<i32>(k_light_tile_size) - 1), 0) };
+
+                for (i32 tx{ tx0 }; tx <= tx1; ++tx)
+                {
+                    i32 const left{ tx * static_cast<i32>(k_light_tile_size) };
+                    i32 const dx  { max(left - x, 0) + max(x - (left + static_cast<i32>(k_light_tile_size) - 1), 0) };
+
+                    if (((dx * dx) + (dy * dy)) < (r * r))
+                    {
+                        g_light_buffer.tile_masks[(ty * k_light_tile_columns) + tx] |= 1Ui32 << count;
+                    }
+                }
+            }
+
+            g_light_buffer.lights[count++] = gpu_light{
+                .pos    = light.pos.x | (static_cast<u32>(light.pos.y) << 16),
+                .radius = static_cast<u32>(r),
+                .color  = light.color
+            };
+        }
+    }
+
+#if G21_BENCHMARK || defined(_DEBUG)
+    // Returns how much of the light gets through, out of 256.
+    i32 light_shadow(i32 x, i32 y, i32 dx, i32 dy, i32 len)
+    {
+        i32 const ax{ (dx < 0) ? -dx : dx };
+        i32 const ay{ (dy < 0) ? -dy : dy };
+        i32 const sx{ (dx > 0) - (dx < 0) };
+        i32 const sy{ (dy > 0) - (dy < 0) };
+
+        i32 k{ 256 };
+        for (i32 t{ 1 }, i{ 0 }; (t < len) && (i < static_cast<i32>(k_light_max_steps)); ++i)
+        {
+            // Round towards the pixel, the same way on both sides of it.
+            i32 const h{ g_light_distance_field[y + (sy * ((ay * t) / len))][x + (sx * ((ax * t) / len))] };
+            if (h <= 0) return 0;
+
+            k  = min(k, (h * k_light_penumbra) / t);
+            t += max(h >> 4, 1);
+        }
+
+        return k;
+    }
+
+    // Returns the lit colour of the pixel at (x, y) in the world as 0xFFBBGGRR, see k_background_render_fs_source.
+    u32 shade_light_pixel(light_buffer const& lights, u32 mask, i32 x, i32 y, u8 base)
+    {
+        i32 r{ k_light_ambient };
+        i32 g{ k_light_ambient };
+        i32 b{ k_light_ambient };
+
+        // Nothing to light in the walls.
+        if (base != 0)
+        {
+            while (mask != 0)
+            {
+                DWORD index;
+                (void)_BitScanForward(&index, mask);
+                mask &= mask - 1;
+
+                gpu_light const& light{ lights.lights[index] };
+
+                i32 const dx{ static_cast<i32>(light.pos & 0xFFFF) - x };
+                i32 const dy{ static_cast<i32>(light.pos >> 16) - y };
+                i32 const d2{ (dx * dx) + (dy * dy) };
+                i32 const r2{ static_cast<i32>(light.radius * light.radius) };
+                if (d2 >= r2) continue;
+
+                i32 const len{ ifloor(fixed16_16::sqrt(static_cast<u16>(d2))) };
+
+                i32 w{ ((r2 - d2) << 8) / r2 };
+                if (len > 0) w = (w * light_shadow(x, y, dx, dy, len)) >> 8;
+
+                r += (static_cast<i32>((light.color >>  0) & 0xFF) * w) >> 8;
+                g += (static_cast<i32>((light.color >>  8) & 0xFF) * w) >> 8;
+                b += (static_cast<i32>((light.color >> 16) & 0xFF) * w) >> 8;
+            }
+        }
+
+        return 0xFF000000Ui32
+            | (static_cast<u32>(min((r * base) >> 8, 255)) <<  0)
+            | (static_cast<u32>(min((g * base) >> 8, 255)) <<  8)
+            | (static_cast<u32>(min((b * base) >> 8, 255)) << 16);
+    }
+
+    // The CPU lighting. A frame is lit a tile at a time on all the worker threads, and update_light_reference() stops
+    // handing out tiles once its time is up, so the work can be spread over several frames. The lights and the camera
+    // are copied when the frame is begun, so the game can carry on in the meantime.
+
+    u32                            g_light_reference[camera::k_height][camera::k_width];
+    light_buffer                   g_light_reference_lights;
+    camera                         g_light_reference_camera;
+    background_texture_data const* g_light_reference_background;
+    volatile long                  g_light_reference_next_tile;
+    i64                            g_light_reference_deadline;
+
+    void begin_light_reference(background_texture_data const& background)
+    {
+        __movsb(reinterpret_cast<u8*>(&g_light_reference_lights), reinterpret_cast<u8 const*>(&g_light_buffer), sizeof(g_light_buffer));
+        g_light_reference_camera     = g_snapshot->camera;
+        g_light_reference_background = &background;
+        g_light_reference_next_tile  = 0;
+    }
+
+    void light_reference_job(u32)
+    {
+        while (true)
+        {
+            LARGE_INTEGER now;
+            QueryPerformanceCounter(&now);
+            if (now.QuadPart >= g_light_reference_deadline) break;
+
+            u32 const tile{ static_cast<u32>(InterlockedIncrement(&g_light_reference_next_tile) - 1) };
+            if (tile >= k_light_tile_count) break;
+
+            u32 const mask{ g_light_reference_lights.tile_masks[tile] };
+            u32 const sx0 { (tile % k_light_tile_columns) * k_light_tile_size };
+            u32 const sy0 { (tile / k_light_tile_columns) * k_light_tile_size };
+
+            for (u32 sy{ sy0 }; sy < (sy0 + k_light_tile_size); ++sy)
+            {
+                i32 const y{ static_cast<i32>(g_light_reference_camera.y + sy) };
+
+                for (u32 sx{ sx0 }; sx < (sx0 + k_light_tile_size); ++sx)
+                {
+                    i32 const x{ static_cast<i32>(g_light_reference_camera.x + sx) };
+
+                    g_light_reference[sy][sx] = shade_light_pixel(
+                        g_light_reference_lights, mask, x, y, (*g_light_reference_background)[y][x]
+                    );
+                }
+            }
+        }
+    }
+
+    // Lights tiles of the frame for up to 'budget' microseconds, or the rest of it if the budget is 0. Returns true
+    // once the frame is done.
+    bool update_light_reference(u32 budget)
+    {
+        G21_TRACE_ZONE("update_light_reference");
+
+        g_light_reference_deadline = 0x7FFFFFFFFFFFFFFFi64;
+        if (budget != 0)
+        {
+            LARGE_INTEGER now, frequency;
+            QueryPerformanceCounter(&now);
+            QueryPerformanceFrequency(&frequency);
+
+            u32 remainder;
+            g_light_reference_deadline = now.QuadPart
+                + _udiv64(__emulu(budget, static_cast<u32>(frequency.QuadPart)), 1'000'000Ui32, &remainder);
+        }
+
+        run_on_workers(light_reference_job);
+
+        return g_light_reference_next_tile >= static_cast<long>(k_light_tile_count);
+    }
+#endif
+
+    void init_light_textures()
+    {
+        G21_TRACE_ZONE("init_light_textures");
+
+        // Until the distance field has been streamed in, every pixel is taken to be far from the walls, which lights
+        // the scene without shadows.
+        for (u32 y{ 0 }; y < k_world_height; ++y)
+        {
+            for (u32 x{ 0 }; x < k_world_width; ++x)
+            {
+                g_light_distance_field[y][x] = static_cast<i16>(k_distance_field_reach * 16);
+            }
+        }
+
+        glGenTextures(1, &g_light_distance_texture_id);
+        glBindTexture(GL_TEXTURE_RECTANGLE, g_light_distance_texture_id);
+        glTexImage2D (GL_TEXTURE_RECTANGLE, 0, GL_R16I, k_world_width, k_world_height, 0, GL_RED_INTEGER, GL_SHORT, g_light_distance_field);
+        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+
+        glGenBuffers(1, &g_light_buffer_id);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_light_buffer_id);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(light_buffer), nullptr, GL_STREAM_DRAW);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    void upload_light_distance_rows(u32 y_begin, u32 y_end)
+    {
+        glBindTexture  (GL_TEXTURE_RECTANGLE, g_light_distance_texture_id);
+        glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, 0, y_begin, k_world_width, y_end - y_begin, GL_RED_INTEGER, GL_SHORT, g_light_distance_field[y_begin]);
+        glBindTexture  (GL_TEXTURE_RECTANGLE, 0);
+    }
+
+    // Binds the lights from the last gather_visible_lights() for k_background_render_fs_source.
+    void bind_visible_lights()
+    {
+        glBindBuffer   (GL_SHADER_STORAGE_BUFFER, g_light_buffer_id);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(g_light_buffer), &g_light_buffer);
+        glBindBuffer   (GL_SHADER_STORAGE_BUFFER, 0);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, g_light_buffer_id);
+        glActiveTexture(GL_TEXTURE1);
+        glBindTexture(GL_TEXTURE_RECTANGLE, g_light_distance_texture_id);
+    }
+
+    #ifdef _DEBUG
+    // How far a channel may be off, for the float conversions on the GPU, and how many pixels may be off by more.
+    constexpr i32 k_light_reference_tolerance     { 1 };
+    constexpr u32 k_light_reference_max_mismatches{ (camera::k_width * camera::k_height) / 1000 };
+
+    // Lights the first frame with the shader and on the CPU, and fails the run if the two differ by more than the
+    // tolerance. The target is read back as 8 bits per channel, which GL converts an RGBA16F target to by rounding. An
+    // sRGB target may be converted on the way in or out depending on the driver, so it is not checked.
+    void check_light_reference()
+    {
+        static background_texture_data background;
+        static u32                     row[camera::k_width * k_render_target_max_scale];
+
+        if (g_render_target_format == render_target_format::srgb8_alpha8)
+        {
+            G21_DEBUG_PRINT("#DEBUG: The lighting is not checked with an sRGB target.\n");
+            return;
+        }
+
+        acquire_snapshot();
+        compute_background_texture(background);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, g_framebuffer_id);
+        glViewport(0, 0, camera::k_width * g_render_target_scale, camera::k_height * g_render_target_scale);
+        glBlendFunc(GL_ONE, GL_ZERO);
+
+        gather_visible_lights();
+        bind_visible_lights();
+
+        glUseProgram(g_background_renderer_program_id);
+        glUniform4i(0, g_snapshot->camera.x, g_snapshot->camera.y, camera::k_width, camera::k_height);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_RECTANGLE, g_background_texture_id);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+
+        begin_light_reference(background);
+        while (!update_light_reference(0));
+
+        // The target is upside down, and each pixel of ours covers a block of g_render_target_scale² pixels.
+        u32 mismatches{ 0 };
+        for (u32 y{ 0 }; y < camera::k_height; ++y)
+        {
+            glReadPixels(
+                0, (camera::k_height - 1 - y) * g_render_target_scale, camera::k_width * g_render_target_scale, 1,
+                GL_RGBA, GL_UNSIGNED_BYTE, row
+            );
+
+            for (u32 x{ 0 }; x < camera::k_width; ++x)
+            {
+                u32 const actual  { row[x * g_render_target_scale] };
+                u32 const expected{ g_light_reference[y][x] };
+
+                for (u32 shift{ 0 }; shift < 24; shift += 8)
+                {
+                    i32 const difference{ static_cast<i32>((actual >> shift) & 0xFF) - static_cast<i32>((expected >> shift) & 0xFF) };
+                    if ((difference > k_light_reference_tolerance) || (difference < -k_light_reference_tolerance))
+                    {
+                        ++mismatches;
+                        break;
+                    }
+                }
+            }
+        }
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glUseProgram(0);
+
+        G21_DEBUG_PRINT("#DEBUG: Lighting mismatches: ");
+        G21_DEBUG_PRINT(mismatches);
+        G21_DEBUG_PRINT("\n");
+
+        if (mismatches > k_light_reference_max_mismatches) fail_self_check("The lighting self-check failed.\n");
+    }
+    #endif
+
+    // Setup the startup loader.
+    // The precompute runs on a thread of its own, which hands the heavy parts to the worker pool, while the main thread
+    // keeps pumping messages and draws a loading screen. The collision maps and the background come first, as the game
+    // cannot run without them. The distance field then comes in a band of rows at a time, starting from the band the
+    // player starts in and working outwards, and the main thread uploads the lighting of every band as it comes in.
+    // The game starts as soon as the bands around the player are in, and the rest keeps streaming in behind it.
+
+    enum class load_stage : u8
+    {
+        maps,           // The collision maps and the background are being computed.
+        distance_field, // The maps are done, and the distance field is being streamed in.
+        done
+    };
+
+    constexpr u32 k_load_band_height{ k_sprite_size };
+    constexpr u32 k_load_band_count { k_world_height / k_load_band_height };
+    constexpr u32 k_load_band_reach { (k_distance_field_reach + k_load_band_height - 1) / k_load_band_height };
+    constexpr u32 k_load_task_count { k_load_band_count * 2 }; // A horizontal and a vertical pass for every band.
+    static_assert(((k_world_height % k_load_band_height) == 0) && (k_load_band_count < 0x80));
+
+    HANDLE              g_loader_thread;
+    volatile load_stage g_load_stage;
+    u8                  g_load_tasks[k_load_task_count]; // A band, with the top bit set for the vertical pass.
+    bool                g_load_tasks_scheduled[k_load_band_count];
+    volatile long       g_load_next_task;
+    volatile bool       g_load_rows_x_done[k_load_band_count];
+    volatile bool       g_load_band_ready [k_load_band_count];
+    volatile long       g_load_band_count;               // The number of bands ready, for the loading screen.
+    bool                g_load_band_uploaded[k_load_band_count];
+    bool                g_load_finished;
+    bool                g_game_interactive;
+
+    // The times since init() was entered, in microseconds.
+    LARGE_INTEGER g_startup_begin;
+    u32           g_startup_first_frame;
+    u32           g_startup_interactive;
+    u32           g_startup_loaded;
+
+    void init_load_tasks(u32 first_band)
+    {
+        // Go outwards from the first band, alternating between below and above it. The vertical pass of a band needs
+        // the horizontal pass of every band within reach, so those are handed out ahead of it.
+        u32 count{ 0 };
+        for (u32 i{ 0 }; i < (k_load_band_count * 2); ++i)
+        {
+            i32 const band{ static_cast<i32>(first_band) + (((i & 1) == 0) ? static_cast<i32>(i / 2) : -static_cast<i32>((i + 1) / 2)) };
+            if ((band < 0) || (band >= static_cast<i32>(k_load_band_count))) continue;
+
+            u32 const reach_begin{ static_cast<u32>(max(band - static_cast<i32>(k_load_band_reach), 0)) };
+            u32 const reach_end  { min(static_cast<u32>(band) + k_load_band_reach + 1, k_load_band_count) };
+            for (u32 j{ reach_begin }; j < reach_end; ++j)
+            {
+                if (!g_load_tasks_scheduled[j])
+                {
+                    g_load_tasks_scheduled[j] = true;
+                    g_load_tasks[count++] = static_cast<u8>(j);
+                }
+            }
+
+            g_load_tasks[count++] = static_cast<u8>(band | 0x80);
+        }
+    }
+
+    void load_distance_field_job(u32)
+    {
+        while (true)
+        {
+            u32 const i{ static_cast<u32>(InterlockedIncrement(&g_load_next_task) - 1) };
+            if (i >= k_load_task_count) break;
+
+            u32 const band   { g_load_tasks[i] & 0x7FU };
+            u32 const y_begin{ band * k_load_band_height };
+            u32 const y_end  { y_begin + k_load_band_height };
+
+            if ((g_load_tasks[i] & 0x80) == 0)
+            {
+                G21_TRACE_ZONE("distance_field_rows_x");
+
+                compute_distance_field_rows_x(0, y_begin, y_end);
+                compute_distance_field_rows_x(1, y_begin, y_end);
+                g_load_rows_x_done[band] = true;
+            }
+            else
+            {
+                G21_TRACE_ZONE("distance_field_rows_y");
+
+                // The horizontal passes within reach were handed out before this one, so they are already underway.
+                u32 const reach_begin{ (band > k_load_band_reach) ? (band - k_load_band_reach) : 0 };
+                u32 const reach_end  { min(band + k_load_band_reach + 1, k_load_band_count) };
+                for (u32 j{ reach_begin }; j < reach_end; ++j)
+                {
+                    while (!g_load_rows_x_done[j]) _mm_pause();
+                }
+
+                compute_distance_field_rows_y(0, y_begin, y_end);
+                compute_distance_field_rows_y(1, y_begin, y_end);
+                compute_light_distance_rows(y_begin, y_end);
+
+                g_load_band_ready[band] = true;
+                InterlockedIncrement(&g_load_band_count);
+            }
+        }
+    }
+
+    // Besides the CPU background, the fractal noise is read by the particles, and by the reference the debug builds
+    // check the background shader against.
+    bool needs_cpu_fractal_noise()
+    {
+        #if G21_ENABLE_PARTICLES || defined(_DEBUG)
+        return true;
+        #else
+        return glDispatchCompute == nullptr;
+        #endif
+    }
+
+    DWORD WINAPI loader_thread_proc(LPVOID)
+    {
+        G21_TRACE_THREAD("loader");
+        G21_TRACE_ZONE("load");
+
+        G21_DEBUG_PRINT("#DEBUG: Computing textures.\n");
+
+        compute_game_world_collision_map();
+
+        compute_player_collision_map();
+
+        // The white noise goes into the background either way. The fractal noise is made on the GPU along with the
+        // background when it can be, see needs_cpu_fractal_noise().
+        compute_white_noise_texture();
+        if (needs_cpu_fractal_noise())
+        {
+            compute_fractal_noise_texture();
+        }
+
+        if (glDispatchCompute == nullptr)
+        {
+            compute_background_texture(g_loaded_background_texture);
+        }
+
+        g_load_stage = load_stage::distance_field;
+
+        run_on_workers(load_distance_field_job);
+
+#if G21_ENABLE_PARTICLES
+        init_flow_field();
+        compute_particle_collision_map();
+#endif
+
+        g_load_stage = load_stage::done;
+        return 0;
+    }
+
+    void start_loader()
+    {
+        init_load_tasks(static_cast<u32>(ifloor(g_sim.player.pos.y)) / k_load_band_height);
+
+        g_loader_thread = CreateThread(nullptr, 0, loader_thread_proc, nullptr, 0, nullptr);
+    }
+
+    u32 get_startup_time()
+    {
+        LARGE_INTEGER now, frequency;
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&frequency);
+
+        return ticks_to_microseconds(static_cast<u32>(now.QuadPart - g_startup_begin.QuadPart), static_cast<u32>(frequency.QuadPart));
+    }
+
+    void write_startup_report()
+    {
+        G21_DEBUG_PRINT("#DEBUG: First frame after ");
+        G21_DEBUG_PRINT(g_startup_first_frame);
+        G21_DEBUG_PRINT("us, interactive after ");
+        G21_DEBUG_PRINT(g_startup_interactive);
+        G21_DEBUG_PRINT("us, loaded after ");
+        G21_DEBUG_PRINT(g_startup_loaded);
+        G21_DEBUG_PRINT("us.\n");
+
+        if (!g_startup_report) return;
+
+        char report[128];
+        char* p{ append_text(report, "{\"unit\":\"us\",\"first_frame\":") };
+        p = append_u32 (p, g_startup_first_frame);
+        p = append_text(p, ",\"interactive\":");
+        p = append_u32 (p, g_startup_interactive);
+        p = append_text(p, ",\"loaded\":");
+        p = append_u32 (p, g_startup_loaded);
+        p = append_text(p, "}\n");
+
+        write_report_file("startup.json", report, p);
+    }
+
+    // Does the main thread's part of the loading, every tick. Returns true once the game can run.
+    bool update_loading()
+    {
+        if (g_load_finished && g_game_interactive) return true;
+
+        G21_TRACE_ZONE("update_loading");
+
+        load_stage const stage{ g_load_stage };
+
+        // The background can be made as soon as the maps are in.
+        if ((stage != load_stage::maps) && (g_background_texture_id == 0))
+        {
+            init_background_texture();
+        }
+
+        // Upload the lighting of the bands that have come in.
+        for (u32 band{ 0 }; band < k_load_band_count; ++band)
+        {
+            if (g_load_band_ready[band] && !g_load_band_uploaded[band])
+            {
+                g_load_band_uploaded[band] = true;
+                upload_light_distance_rows(band * k_load_band_height, (band + 1) * k_load_band_height);
+
+                // The band may be lighting what is on screen already.
+                g_frame_dirty = true;
+            }
+        }
+
+        if ((stage == load_stage::done) && !g_load_finished)
+        {
+            WaitForSingleObject(g_loader_thread, INFINITE);
+            CloseHandle(g_loader_thread);
+
+            g_load_finished  = true;
+            g_startup_loaded = get_startup_time();
+
+            #ifdef _DEBUG
+            check_light_reference();
+            #endif
+        }
+
+        if (!g_game_interactive)
+        {
+            bool ready{ g_background_texture_id != 0 };
+
+            // The particles need the flow field from the first tick.
+            #if G21_ENABLE_PARTICLES
+            ready = ready && g_load_finished;
+            #endif
+
+            // The first frames see at most a screen above or below the player, and the lights reach a bit further.
+            i32 const centre     { ifloor(g_sim.player.pos.y) + (player::k_height / 2) };
+            i32 const reach      { camera::k_height + static_cast<i32>(k_max_light_radius) };
+            u32 const band_begin { static_cast<u32>(max(centre - reach, 0)) / k_load_band_height };
+            u32 const band_end   { static_cast<u32>(min(centre + reach, static_cast<i32>(k_world_height) - 1)) / k_load_band_height };
+            for (u32 band{ band_begin }; band <= band_end; ++band)
+            {
+                ready = ready && g_load_band_uploaded[band];
+            }
+
+            if (ready)
+            {
+                g_game_interactive    = true;
+                g_startup_interactive = get_startup_time();
+            }
+        }
+
+        // Report once both are known, whichever comes last.
+        if (g_load_finished && g_game_interactive)
+        {
+            write_startup_report();
+        }
+
+        return g_game_interactive;
+    }
+
+    // Idle frames.
+    // A frame is only drawn and presented when something on screen has changed since the last one that was. All the
+    // state a frame is drawn from gets gathered into a frame_inputs every tick and compared with what went into the
+    // last presented frame. Changes that do not show up in that state, such as the window being uncovered, set
+    // g_frame_dirty instead. When a tick draws nothing, the loop sleeps until the next one rather than spinning.
+
+    struct frame_inputs
+    {
+        vec2<fixed16_16> player_pos;
+        vec4<u16>        viewport;
+        struct camera    camera;
+        u32              input_events;
+        u8               player_facing;
+        u8               render_target_scale;
+        light_buffer     lights;
+    };
+
+    static_assert((sizeof(frame_inputs) % sizeof(u32)) == 0);
+
+    // Globals, so that any padding stays zero and the two can be compared word by word.
+    frame_inputs g_current_frame;
+    frame_inputs g_presented_frame;
+
+    HANDLE g_idle_timer;
+
+    bool frame_inputs_changed()
+    {
+        u32 const* const current  { reinterpret_cast<u32 const*>(&g_current_frame) };
+        u32 const* const presented{ reinterpret_cast<u32 const*>(&g_presented_frame) };
+
+        for (u32 i{ 0 }; i < (sizeof(frame_inputs) / sizeof(u32)); ++i)
+        {
+            if (current[i] != presented[i]) return true;
+        }
+
+        return false;
+    }
+
+    // Gathers what the frame will be drawn from. Returns false if it would look the same as the last one presented.
+    bool begin_frame()
+    {
+        G21_TRACE_ZONE("begin_frame");
+
+        if (!acquire_snapshot()) return false;
+
+        gather_visible_lights();
+
+        g_current_frame.player_pos          = g_snapshot->player.pos;
+        g_current_frame.viewport            = g_viewport;
+        g_current_frame.camera              = g_snapshot->camera;
+        g_current_frame.input_events        = g_snapshot->input_events; // So that every input taken in is measured.
+        g_current_frame.player_facing       = g_snapshot->player.facing;
+        g_current_frame.render_target_scale = g_render_target_scale;
+        __movsb(reinterpret_cast<u8*>(&g_current_frame.lights), reinterpret_cast<u8 const*>(&g_light_buffer), sizeof(light_buffer));
+
+        bool dirty{ !g_idle_skip || g_frame_dirty || g_render_target_dirty || frame_inputs_changed() };
+
+        // The particles move on their own for as long as there are any.
+        #if G21_ENABLE_PARTICLES
+        dirty = dirty || (g_active_particles > 0);
+        #endif
+
+        if (!dirty) return false;
+
+        g_frame_dirty = false;
+        __movsb(reinterpret_cast<u8*>(&g_presented_frame), reinterpret_cast<u8 const*>(&g_current_frame), sizeof(frame_inputs));
+
+        return true;
+    }
+
+    // Even a high resolution timer can wake up late, so whatever has to happen on time sleeps until this long before,
+    // in microseconds, and spins the rest.
+    constexpr u32 k_timer_spin_time{ 1000 };
+
+    HANDLE create_high_resolution_timer()
+    {
+        return CreateWaitableTimerExA(nullptr, nullptr, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    }
+
+    // Sleeps on the timer for the given time, or until a message arrives if wake_on_message is set.
+    void wait_on_timer(HANDLE timer, u32 microseconds, bool wake_on_message)
+    {
+        // Relative times are negative, in units of 100ns.
+        LARGE_INTEGER due;
+        due.QuadPart = -static_cast<LONGLONG>(__emulu(microseconds, 10));
+
+        if (!SetWaitableTimer(timer, &due, 0, nullptr, nullptr, FALSE)) return;
+
+        if (wake_on_message)
+        {
+            MsgWaitForMultipleObjects(1, &timer, FALSE, INFINITE, QS_ALLINPUT);
+        }
+        else
+        {
+            WaitForSingleObject(timer, INFINITE);
+        }
+    }
+
+    void init_idle_timer()
+    {
+        // Only a high resolution timer can wake us up in time for the next tick. Without one we keep spinning.
+        g_idle_timer = create_high_resolution_timer();
+
+        if (g_idle_timer == nullptr)
+        {
+            G21_DEBUG_PRINT("#DEBUG: No high resolution timer, idle frames will spin.\n");
+        }
+    }
+
+    // Sleeps for the given time, or until a message arrives.
+    void wait_idle(u32 microseconds)
+    {
+        if (g_idle_timer == nullptr) return;
+
+        G21_TRACE_ZONE("wait_idle");
+
+        wait_on_timer(g_idle_timer, microseconds, true);
+    }
+
+    // The idle benchmark.
+    // Once the game is interactive, the next k_idle_benchmark_ticks ticks are left to run without input. The CPU time
+    // the process used over them and the number of frames presented are written to idle_benchmark.json, as stand-ins
+    // for the power drawn while idle. Run it with and without --no-idle-skip to compare.
+
+    constexpr u32 k_idle_benchmark_ticks{ 600 };
+
+    u32 g_idle_benchmark_tick;
+    u32 g_idle_benchmark_frames;
+    u64 g_idle_benchmark_cpu_begin;
+    u64 g_idle_benchmark_time_begin;
+
+    // In units of 100ns.
+    u64 get_process_cpu_time()
+    {
+        FILETIME creation, exit, kernel, user;
+        GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user);
+
+        u64 const kernel_time{ (static_cast<u64>(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime };
+        u64 const user_time  { (static_cast<u64>(user.dwHighDateTime)   << 32) | user.dwLowDateTime };
+
+        return kernel_time + user_time;
+    }
+
+    void update_idle_benchmark(bool presented)
+    {
+        if (!g_idle_benchmark) return;
+
+        LARGE_INTEGER now, frequency;
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&frequency);
+
+        if (g_idle_benchmark_tick++ == 0)
+        {
+            g_idle_benchmark_cpu_begin  = get_process_cpu_time();
+            g_idle_benchmark_time_begin = static_cast<u64>(now.QuadPart);
+            return;
+        }
+
+        if (presented) ++g_idle_benchmark_frames;
+
+        if (g_idle_benchmark_tick <= k_idle_benchmark_ticks) return;
+
+        u32 remainder;
+        u32 const cpu_ms { _udiv64(get_process_cpu_time() - g_idle_benchmark_cpu_begin, 10'000, &remainder) };
+        u32 const wall_ms{ ticks_to_microseconds(static_cast<u32>(static_cast<u64>(now.QuadPart) - g_idle_benchmark_time_begin), static_cast<u32>(frequency.QuadPart)) / 1000 };
+
+        char report[192];
+        char* p{ append_text(report, "{\"idle_skip\":") };
+        p = append_text(p, g_idle_skip ? "true" : "false");
+        p = append_text(p, ",\"ticks\":");
+        p = append_u32 (p, k_idle_benchmark_ticks);
+        p = append_text(p, ",\"frames_presented\":");
+        p = append_u32 (p, g_idle_benchmark_frames);
+        p = append_text(p, ",\"wall_ms\":");
+        p = append_u32 (p, wall_ms);
+        p = append_text(p, ",\"cpu_ms\":");
+        p = append_u32 (p, cpu_ms);
+        p = append_text(p, ",\"cpu_percent\":");
+        p = append_u32 (p, (cpu_ms * 100) / max(wall_ms, 1U));
+        p = append_text(p, "}\n");
+
+        G21_DEBUG_PRINT("#DEBUG: Idle benchmark: ");
+        G21_DEBUG_PRINT(g_idle_benchmark_frames);
+        G21_DEBUG_PRINT(" frames presented, ");
+        G21_DEBUG_PRINT(cpu_ms);
+        G21_DEBUG_PRINT("ms of CPU time in ");
+        G21_DEBUG_PRINT(wall_ms);
+        G21_DEBUG_PRINT("ms.\n");
+
+        write_report_file("idle_benchmark.json", report, p);
+
+        write_exit_reports();
+        ExitProcess(0);
+    }
+
+    // A tick that comes in more than half a tick late counts as late. The one after it catches up early.
+    u32 count_late_ticks(u32 const* intervals, u32 count)
+    {
+        u32 late{ 0 };
+        for (u32 i{ 0 }; i < count; ++i)
+        {
+            if (intervals[i] > ((1'000'000 * 3) / (60 * 2))) ++late;
+        }
+        return late;
+    }
+
+    // Appends the spread of the sorted tick intervals to a JSON report.
+    char* append_tick_intervals(char* p, u32 const* sorted, u32 count, u32 late)
+    {
+        p = append_text(p, "\"tick_interval\":{\"min\":");
+        p = append_u32 (p, get_percentile(sorted, count, 0));
+        p = append_text(p, ",\"p50\":");
+        p = append_u32 (p, get_percentile(sorted, count, 50));
+        p = append_text(p, ",\"p99\":");
+        p = append_u32 (p, get_percentile(sorted, count, 99));
+        p = append_text(p, ",\"max\":");
+        p = append_u32 (p, get_percentile(sorted, count, 100));
+        p = append_text(p, "},\"late_ticks\":");
+        return append_u32(p, late);
+    }
+
+    // The message stress test.
+    // Once the game is interactive, a thread posts messages to the window as fast as it can for k_message_stress_ticks
+    // ticks. Most are mouse moves, which get coalesced, and every eighth is a WM_NULL, which has to go through the
+    // window procedure. The time between the ticks is written to message_stress.json along with the message counts,
+    // and should stay at the tick length whatever the flood.
+
+    constexpr u32 k_message_stress_ticks{ 600 };
+
+    HANDLE        g_message_flood_thread;
+    volatile bool g_message_flood_done;
+    u32           g_message_flood_posted;
+    u32           g_message_flood_dropped; // Posts that failed because the queue was full.
+    u32           g_messages_handled;
+    u32           g_mouse_moves_coalesced;
+
+    u32 g_message_stress_tick;
+    u64 g_message_stress_last_tick;
+    u32 g_message_stress_intervals[k_message_stress_ticks]; // In microseconds.
+
+    DWORD WINAPI message_flood_thread_proc(LPVOID)
+    {
+        G21_TRACE_THREAD("message_flood");
+
+        for (u32 i{ 0 }; !g_message_flood_done; ++i)
+        {
+            UINT   const message{ ((i % 8) == 7) ? WM_NULL : WM_MOUSEMOVE };
+            LPARAM const pos    { MAKELPARAM(i % camera::k_width, i % camera::k_height) };
+
+            if (PostMessageA(g_hWnd, message, 0, pos))
+            {
+                ++g_message_flood_posted;
+            }
+            else
+            {
+                ++g_message_flood_dropped;
+                _mm_pause();
+            }
+        }
+
+        return 0;
+    }
+
+    void update_message_stress()
+    {
+        if (!g_message_stress) return;
+
+        LARGE_INTEGER now, frequency;
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&frequency);
+
+        if (g_message_stress_tick++ == 0)
+        {
+            g_message_flood_thread = CreateThread(nullptr, 0, message_flood_thread_proc, nullptr, 0, nullptr);
+        }
+        else
+        {
+            g_message_stress_intervals[g_message_stress_tick - 2] = ticks_to_microseconds(
+                static_cast<u32>(static_cast<u64>(now.QuadPart) - g_message_stress_last_tick),
+                static_cast<u32>(frequency.QuadPart)
+            );
+        }
+
+        g_message_stress_last_tick = static_cast<u64>(now.QuadPart);
+        if (g_message_stress_tick <= k_message_stress_ticks) return;
+
+        g_message_flood_done = true;
+        WaitForSingleObject(g_message_flood_thread, INFINITE);
+        CloseHandle(g_message_flood_thread);
+
+        u32* const intervals{ g_message_stress_intervals };
+        u32  const count    { k_message_stress_ticks };
+        u32  const late     { count_late_ticks(intervals, count) };
+
+        sort_samples(intervals, count);
+
+        char report[320];
+        char* p{ append_text(report, "{\"unit\":\"us\",\"ticks\":") };
+        p = append_u32 (p, k_message_stress_ticks);
+        p = append_text(p, ",\"messages_posted\":");
+        p = append_u32 (p, g_message_flood_posted);
+        p = append_text(p, ",\"messages_dropped\":");
+        p = append_u32 (p, g_message_flood_dropped);
+        p = append_text(p, ",\"messages_handled\":");
+        p = append_u32 (p, g_messages_handled);
+        p = append_text(p, ",\"mouse_moves_coalesced\":");
+        p = append_u32 (p, g_mouse_moves_coalesced);
+        p = append_text(p, ",");
+        p = append_tick_intervals(p, intervals, count, late);
+        p = append_text(p, "}\n");
+
+        G21_DEBUG_PRINT("#DEBUG: Message stress: ");
+        G21_DEBUG_PRINT(g_message_flood_posted);
+        G21_DEBUG_PRINT(" messages posted, tick interval p50/p99/max: ");
+        G21_DEBUG_PRINT(get_percentile(intervals, count, 50));
+        G21_DEBUG_PRINT("/");
+        G21_DEBUG_PRINT(get_percentile(intervals, count, 99));
+        G21_DEBUG_PRINT("/");
+        G21_DEBUG_PRINT(get_percentile(intervals, count, 100));
+        G21_DEBUG_PRINT("us, ");
+        G21_DEBUG_PRINT(late);
+        G21_DEBUG_PRINT(" late ticks.\n");
+
+        write_report_file("message_stress.json", report, p);
+
+        write_exit_reports();
+        ExitProcess(0);
+    }
+
+    // The tick jitter test.
+    // Once the game is interactive, the time between k_tick_jitter_ticks ticks is measured on whichever thread runs
+    // the simulation, and written to tick_jitter.json. With --render-load, every frame spins for a while before it is
+    // presented, which holds back the ticks when they share the thread with the renderer, but should not touch them
+    // with --sim-thread.
+
+    constexpr u32 k_tick_jitter_ticks{ 600 };
+
+    u32 g_tick_jitter_tick;
+    u64 g_tick_jitter_last_tick;
+    u32 g_tick_jitter_intervals[k_tick_jitter_ticks]; // In microseconds.
+
+    // Spins for the given time, to stand in for a heavy frame.
+    void busy_wait(u32 microseconds)
+    {
+        LARGE_INTEGER start, now, frequency;
+        QueryPerformanceCounter(&start);
+        QueryPerformanceFrequency(&frequency);
+
+        do
+        {
+            _mm_pause();
+            QueryPerformanceCounter(&now);
+        }
+        while (ticks_to_microseconds(static_cast<u32>(now.QuadPart - start.QuadPart), static_cast<u32>(frequency.QuadPart)) < microseconds);
+    }
+
+    // Called at the start of every tick, on the simulation thread if there is one.
+    void update_tick_jitter()
+    {
+        if (!g_tick_jitter || (g_tick_jitter_tick > k_tick_jitter_ticks)) return;
+
+        LARGE_INTEGER now, frequency;
+        QueryPerformanceCounter(&now);
+        QueryPerformanceFrequency(&frequency);
+
+        if (g_tick_jitter_tick++ != 0)
+        {
+            g_tick_jitter_intervals[g_tick_jitter_tick - 2] = ticks_to_microseconds(
+                static_cast<u32>(static_cast<u64>(now.QuadPart) - g_tick_jitter_last_tick),
+                static_cast<u32>(frequency.QuadPart)
+            );
+        }
+
+        g_tick_jitter_last_tick = static_cast<u64>(now.QuadPart);
+        if (g_tick_jitter_tick <= k_tick_jitter_ticks) return;
+
+        u32* const intervals{ g_tick_jitter_intervals };
+        u32  const count    { k_tick_jitter_ticks };
+        u32  const late     { count_late_ticks(intervals, count) };
+
+        sort_samples(intervals, count);
+
+        char report[256];
+        char* p{ append_text(report, "{\"unit\":\"us\",\"ticks\":") };
+        p = append_u32 (p, k_tick_jitter_ticks);
+        p = append_text(p, ",\"sim_thread\":");
+        p = append_text(p, g_split_simulation ? "true" : "false");
+        p = append_text(p, ",\"render_load_ms\":");
+        p = append_u32 (p, g_render_load);
+        p = append_text(p, ",");
+        p = append_tick_intervals(p, intervals, count, late);
+        p = append_text(p, "}\n");
+
+        G21_DEBUG_PRINT("#DEBUG: Tick jitter: tick interval p50/p99/max: ");
+        G21_DEBUG_PRINT(get_percentile(intervals, count, 50));
+        G21_DEBUG_PRINT("/");
+        G21_DEBUG_PRINT(get_percentile(intervals, count, 99));
+        G21_DEBUG_PRINT("/");
+        G21_DEBUG_PRINT(get_percentile(intervals, count, 100));
+        G21_DEBUG_PRINT("us, ");
+        G21_DEBUG_PRINT(late);
+        G21_DEBUG_PRINT(" late ticks.\n");
+
+        write_report_file("tick_jitter.json", report, p);
+
+        // This may be the simulation thread, so leave the exit reports to the window procedure.
+        PostMessageA(g_hWnd, WM_CLOSE, 0, 0);
+    }
+
+    // Initialization.
+
+    __forceinline void init()
+    {
+        QueryPerformanceCounter(&g_startup_begin);
+
+        G21_DEBUG_PRINT("#DEBUG: Initializing.\n");
+
+        #if G21_ENABLE_TRACE
+        init_trace();
+        #endif
+        G21_TRACE_ZONE("init");
+
+        parse_command_line();
+
+        init_fixed_math();
+
+        init_window();
+        init_gl(); 
+        init_latency();
+
+        // The precompute carries on in the background, see update_loading().
+        init_workers();
+        init_light_textures();
+        start_loader();
+
+        init_lights();
+        init_sprite_grid();
+        publish_snapshot();
+        init_idle_timer();
+
+#if G21_ENABLE_ROLLBACK
+        init_rollback();
+#endif
+    }
+
+#if G21_ENABLE_PARTICLES
+    // The particle storage used when compute shaders are unavailable. This mirrors the particle and index buffers, and
+    // gets uploaded to them every tick so that rendering works the same either way.
+    cs_particle g_cpu_particles[k_max_particle_count];
+    GLuint      g_cpu_particle_indices[k_max_particle_count];
+
+    void emit_particles()
+    {
+        if (glDispatchCompute == nullptr)
+        {
+            // We have no trigonometry on the CPU, so take the initial velocities from the white noise texture instead.
+            constexpr u32 noise_size{ k_white_noise_texture_width * k_white_noise_texture_height };
+            u8 const* const noise{ &g_white_noise_texture[0][0] };
+
+            for (u32 i{ 0 }; i < g_particle_count; ++i)
+            {
+                u32 const n{ (i * 2) % noise_size };
+
+                cs_particle p;
+                p.old_pos = vec2<fixed16_16>{ fixed16_16{ 200 }, fixed16_16{ 400 } };
+                p.cur_pos = p.old_pos;
+                p.cur_pos.x.raw() += (static_cast<i32>(static_cast<u32>(noise[n + 0])) - 128) * 1562;
+                p.cur_pos.y.raw() += (static_cast<i32>(static_cast<u32>(noise[n + 1])) - 128) * 1562;
+                p.life = i / 20 + 50;
+
+                g_cpu_particles[i] = p;
+            }
+
+            return;
+        }
+
+        glUseProgram(g_compute_particle_emitter_program_id);
+
+        glUniform1i(0, g_particle_count);                   // particle_count
+        glUniform2i(1, 200 << 16, 400 << 16);               // emit_location
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, g_particle_buffer_id);
+
+        glDispatchCompute((g_particle_count + (LOCAL_SIZE_X - 1)) / LOCAL_SIZE_X, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+
+        glUseProgram(0);
+    }
+#endif
+
+    void update_camera()
+    {
+        // Calculate where we would like the center of the camera to be.
+
+        u16 const desired_center_x{ static_cast<u16>(static_cast<u16>(ifloor(g_sim.player.pos.x)) + (player::k_width  / 2Ui16)) };
+        u16 const desired_center_y{ static_cast<u16>(static_cast<u16>(ifloor(g_sim.player.pos.y)) + (player::k_height / 2Ui16)) };
+
+        // Adjust so it doesn't go beyond the edges.
+
+        i16 camera_left = static_cast<i16>(static_cast<i16>(desired_center_x) - static_cast<i16>(camera::k_width / 2Ui16));
+        if (camera_left < 0)
+        {
+            camera_left = 0;
+        }
+        else if (static_cast<u16>(camera_left) > (k_world_width - camera::k_width))
+        {
+            camera_left = static_cast<i16>(k_world_width - camera::k_width);
+        }
+
+        i16 camera_top = static_cast<i16>(static_cast<i16>(desired_center_y) - static_cast<i16>(camera::k_height / 2Ui16));
+        if (camera_top < 0)
+        {
+            camera_top = 0;
+        }
+        else if (static_cast<u16>(camera_top) > (k_world_height - camera::k_height))
+        {
+            camera_top = static_cast<i16>(k_world_height - camera::k_height);
+        }
+
+        // Save the origin (top-left corner).
+        g_sim.camera.x = static_cast<u16>(camera_left);
+        g_sim.camera.y = static_cast<u16>(camera_top);
+    }
+
+    // Collision detection.
+
+    void collision_sweep_test()
+    {
+        G21_TRACE_ZONE("collision_sweep_test");
+
+        // Get current pixel position.
+        i16 const start_x{ ifloor(g_sim.player.pos.x) };
+        i16 const start_y{ ifloor(g_sim.player.pos.y) };
+
+        // Calculate the desired next pixel position.
+        i16 const end_x{ ifloor(g_sim.player.pos.x + g_sim.player.vel.x) };
+        i16 const end_y{ ifloor(g_sim.player.pos.y + g_sim.player.vel.y) };
+
+        // Exit early if no visible movement.
+        if ((end_x == start_x) && (end_y == start_y)) return;
+
+        // Get the difference between start and end position.
+        i16 diff_x = end_x - start_x;
+        i16 diff_y = end_y - start_y;
+
+        // Calculate the step directions on each axis and the absolutes of the differences.
+        i16 step_x = 1;
+        if (diff_x < 0)
+        {
+            diff_x = -diff_x;
+            step_x = -1;
+        }
+        i16 step_y = 1;
+        if (diff_y < 0)
+        {
+            diff_y = -diff_y;
+            step_y = -1;
+        }
+
+        // Setup flags to track whether a collision occured on the x and/or y axis.
+        bool collide_x{ false };
+        bool collide_y{ false };
+
+        // Walk along the player collision map and check for collisions and handle them
+        u16 x = start_x, y = start_y;
+        for (u16 ix{ 0 }, iy{ 0 }; (ix < static_cast<u16>(diff_x)) || (iy < static_cast<u16>(diff_y));)
+        {
+            // Check if we want to take a step on the x-axis.
+            if ((((ix << 1) | 1Ui16) * static_cast<u16>(diff_y)) < (((iy << 1) | 1Ui16) * static_cast<u16>(diff_x)))
+            {
+                // Advance.
+                x += step_x;
+                ++ix;
+
+                // Check for collision.
+                if (g_player_collision_map[y][x])
+                {
+                    // Save that a collision occurred on the x-axis.
+                    collide_x = true;
+
+                    // Step back.
+                    x -= step_x;
+
+                    // Check if flying.
+                    if (g_sim.player.flying)
+                    {
+                        // Reverse x direction and reduce speed by half.
+                        step_x = -step_x;
+                        g_sim.player.vel.x = -g_sim.player.vel.x / 2;
+                    }
+                    else
+                    {
+                        // Stop stepping along the x-axis and set horizontal velocity to 0.
+                        diff_x = ix;
+                        g_sim.player.vel.x = fixed16_16{ 0 };
+                    }
+                }
+
+                // Check if we will be flying.
+                if (!g_sim.player.flying && !g_player_collision_map[y + 1][x])
+                {
+                    //Update the state to flying
+                    g_sim.player.flying  = true;
+                    g_sim.player.sliding = false;
+                }
+            }
+            // We want to take a step on the y-axis.
+            else
+            {
+                // Advance.
+                y += step_y;
+                ++iy;
+
+                // Check for collision.
+                if (g_player_collision_map[y][x])
+                {
+                    // Save that a collision occurred on the y-axis.
+                    collide_y = true;
+
+                    // Check if we're moving up.
+                    if (step_y < 0)
+                    {
+                        // Step backwards.
+                        y += 1;
+
+                        // Stop stepping along the y-axis and set vertical velocity to 0.
+                        diff_y = iy;
+                        g_sim.player.vel.y = fixed16_16{ 0 };
+                    }
+                    else
+                    {
+                        // We are not flying anymore, unless sliding causes us to fall off an edge.
+                        g_sim.player.flying = false;
+
+                        // Check if it's possible to slide left (We only slide off edges if we are already sliding).
+                        if (!g_player_collision_map[y][x - 1] && (g_player_collision_map[y + 1][x - 1] || g_sim.player.sliding))
+                        {
+                            // Although technically not a collision on the x-axis, we are adjusting the coordinate so
+                            // pretend that a collision occurred on the x-axis.
+                            collide_x = true;
+
+                            // Move to the left.
+                            x -= 1;
+                            ++ix;
+
+                            // Check if we will be flying.
+                            if (!g_player_collision_map[y + 1][x])
+                            {
+                                // Add some horizontal velocity as we fly off.
+                                g_sim.player.vel.x = -g_sim.player.vel.y / 2;
+
+                                // Update the state to flying.
+                                g_sim.player.flying  = true;
+                                g_sim.player.sliding = false;
+                            }
+                            else
+                            {
+                                // Update the state to sliding.
+                                g_sim.player.sliding = true;
+                            }
+                        }
+                        // Check if it's possible to slide right (We only slide off edges if we are already sliding).
+                        else if (!g_player_collision_map[y][x + 1] && (g_player_collision_map[y + 1][x + 1] || g_sim.player.sliding))
+                        {
+                            // Although technically not a collision on the x-axis, we are adjusting the coordinate so
+                            // pretend that a collision occurred on the x-axis.
+                            collide_x = true;
+
+                            // Move to the right.
+                            x += 1;
+                            ++ix;
+
+                            // Check if we will be flying.
+                            if (!g_player_collision_map[y + 1][x])
+                            {
+                                // Add some horizontal velocity as we fly off.
+                                g_sim.player.vel.x = g_sim.player.vel.y / 2;
+
+                                // Update the state to flying.
+                                g_sim.player.flying  = true;
+                                g_sim.player.sliding = false;
+                            }
+                            else
+                            {
+                                // Update the state to sliding.
+                                g_sim.player.sliding = true;
+                            }
+                        }
+                        // We have landed on something flat.
+                        else
+                        {
+                            // Step back.
+                            y -= step_y;
+
+                            // Stop both vertical and horizontal movement.
+                            g_sim.player.vel.x = fixed16_16{ 0 };
+                            g_sim.player.vel.y = fixed16_16{ 0 };
+
+                            // We are not sliding anymore.
+                            g_sim.player.sliding = false;
+
+                            // Exit the loop.
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Check if a collision occurred on the x-axis.
+        if (collide_x)
+        {
+            // Save the adjusted x coordinate.
+            g_sim.player.pos.x = fixed16_16{ static_cast<i16>(x) };
+        }
+        else
+        {
+            // Updated based on velocity without truncating.
+            g_sim.player.pos.x += g_sim.player.vel.x;
+        }
+
+        // Check if a collision occured on the y-axis.
+        if (collide_y)
+        {
+            // Save the adjusted y coordinate.
+            g_sim.player.pos.y = fixed16_16{ static_cast<i16>(y) };
+        }
+        else
+        {
+            // Updated based on velocity without truncating.
+            g_sim.player.pos.y += g_sim.player.vel.y;
+        }
+    }
+
+
+
+    void pre_render_update()
+    {
+        G21_TRACE_ZONE("pre_render_update");
+
+#if G21_ENABLE_PARTICLES
+        // TODO: Remove.
+        if (g_sim.input.Space)
+        {
+            g_particle_init = true;
+        }
+#endif
+
+        // Check if player is holding the A button and not the D button.
+        if (g_sim.input.A && !g_sim.input.D)
+        {
+            g_sim.player.facing = 1;
+        }
+        // Check if the player is holding the D button and not the A button.
+        else if (!g_sim.input.A && g_sim.input.D)
+        {
+            g_sim.player.facing = 0;
+        }
+        // Otherwise we keep the current facing direction.
+
+        // Check that the player is not flying (jumping/falling) or sliding.
+        if (!g_sim.player.flying && !g_sim.player.sliding)
+        {
+            // Zero out any previous movement.
+            g_sim.player.vel.x = fixed16_16{ 0 };
+            g_sim.player.vel.y = fixed16_16{ 0 };
+
+            // Charge the jump for as long as the jump key (W) was held this tick, which is a fraction of the tick if it
+            // went down or up during it. The charge is in k_input_subticks.
+            // TODO: Different animation for charging
+            g_sim.jump_charge = static_cast<i16>(min(g_sim.jump_charge + g_sim.input.W_held, 35 * k_input_subticks));
+
+            // Check that the player is not holding the jump key (W).
+            if (!g_sim.input.W)
+            {
+                // Check if the player released the jump key.
+                if (g_sim.jump_charge > 0)
+                {
+                    if (g_sim.jump_charge > (8 * k_input_subticks)) g_sim.jump_charge -= 8 * k_input_subticks;
+                    else g_sim.jump_charge = 0;
+
+                    // The charge in ticks. The subticks are a power of two and both factors of each product are
+                    // positive, so rounding the products down gives the same as dividing the integer products.
+                    fixed16_16 const charge{ fixed16_16::from_raw(static_cast<i32>(g_sim.jump_charge) * (65536 / k_input_subticks)) };
+
+                    i16 const vel = ifloor(k_jump_speed + mul(k_jump_speed_per_charge, charge));
+                    g_sim.player.vel.x = ((k_jump_x - mul(k_jump_x_per_charge, charge)) * vel) * (static_cast<i16>(static_cast<i8>(g_sim.input.D) - static_cast<i8>(g_sim.input.A)));
+                    g_sim.player.vel.y = -(k_jump_y + mul(k_jump_y_per_charge, charge)) * vel;
+
+                    g_sim.player.flying = true;
+
+                    // Reset the jump charge.
+                    g_sim.jump_charge = 0;
+                }
+                else
+                {
+                    //Add horizontal movement if the player holds exclusively the left (A) key or the right (D) key
+                    g_sim.player.vel.x += fixed16_16{ static_cast<i16>(static_cast<i8>(g_sim.input.D) - static_cast<i8>(g_sim.input.A)) * 2 };
+                }
+            }
+        }
+        // Player is flying (jumping/falling).
+        else
+        {
+            // Apply gravity.
+            g_sim.player.vel.y += k_gravity;
+        }
+
+        // Apply drag.
+        g_sim.player.vel.y = (g_sim.player.vel.y * 99) / 100;
+
+        // Apply some maximum fall speed.
+        if (g_sim.player.vel.y > fixed16_16{ 7 })
+        {
+            g_sim.player.vel.y = fixed16_16{ 7 };
+        }
+
+        // Move the player and perform collision tests. This returns early when the player does not move a pixel.
+        collision_sweep_test();
+
+        // Move the camera to follow the player.
+        update_camera();
+
+#if G21_ENABLE_PARTICLES
+        //  TODO: Move/Change this.
+        if (g_particle_init)
+        {
+            emit_particles();
+            g_particle_init = false;
+        }
+#endif
+    }
+
+#if G21_ENABLE_ROLLBACK
+    // Rollback.
+    // The player is driven by input that arrives over a UDP socket, the way a remote player's would. The socket sends
+    // to itself over the loopback interface, and every packet is held back for g_rollback_latency ticks to stand in
+    // for the network. Until the input for a tick arrives, it is predicted to be the latest input that did. When a
+    // prediction turns out to be wrong, the state is restored from the snapshot taken before that tick and every tick
+    // since is simulated again.
 
-        // Delete the old context.
-        wglMakeCurrent(g_hDC, 0);
-        wglDeleteContext(hGLRC);
+    void simulate_rollback_tick(u32 tick)
+    {
+        u32 const slot{ tick % k_rollback_history };
 
-        // Prepare the attributes for our debug context.
-        constexpr int attribs[]
+        // Predict the input unless it is already known. The keys are predicted to stay as they were, without the
+        // release and the partial hold that may have come with them.
+        if (g_rollback_input_ticks[slot] != (tick + 1))
         {
-            WGL_CONTEXT_MAJOR_VERSION_ARB, 4,
-            WGL_CONTEXT_MINOR_VERSION_ARB, 3,
-            WGL_CONTEXT_PROFILE_MASK_ARB,  WGL_CONTEXT_CORE_PROFILE_BIT_ARB,
-            WGL_CONTEXT_FLAGS_ARB, WGL_CONTEXT_DEBUG_BIT_ARB,
-            0
-        };
+            input_state& input{ g_rollback_inputs[slot] };
 
-        // Create the debug OpenGL context.
-        wglMakeCurrent(g_hDC, wglCreateContextAttribsARB(g_hDC, 0, attribs));
-        #endif
+            input        = g_rollback_prediction;
+            input.LMB    = false;
+            input.W_held = static_cast<u16>(input.W ? k_input_subticks : 0);
+        }
+
+        save_sim_state(g_rollback_snapshots[slot]);
+
+        g_sim.input = g_rollback_inputs[slot];
+        pre_render_update();
     }
 
-    void render_sprite_atlas() 
+    // Takes in the input confirmed for a tick, and moves rollback_from back to it if it was mispredicted.
+    void confirm_rollback_input(rollback_packet const& packet, u32 tick, u32& rollback_from)
     {
-        static alignas(u32) vec4<u8> sprite_atlas[4][16][16];
+        // Anything from before the history or too far ahead cannot be used.
+        if (((packet.tick + k_rollback_max_ticks) < tick) || (packet.tick >= (tick + k_rollback_history - k_rollback_max_ticks)))
+        {
+            return;
+        }
 
-        for (u8 i{ 0 }; i < 4; ++i)
+        u32 const slot{ packet.tick % k_rollback_history };
+        if ((packet.tick < tick) && !(g_rollback_inputs[slot] == packet.input))
         {
-            for (u8 y{ 0 }; y < 16; ++y)
-            {
-                for (u8 x{ 0 }; x < 8; ++x)
-                {
-                    u8 const idx0{ static_cast<u8>(k_player_sprite[i][y][x] & 0x0F) };
-                    u8 const idx1{ static_cast<u8>(k_player_sprite[i][y][x] >> 4)   };
+            rollback_from = min(rollback_from, packet.tick);
+        }
 
-                    sprite_atlas[i][y][x * 2 + 0] = k_sprite_palette[idx0];
-                    sprite_atlas[i][y][x * 2 + 1] = k_sprite_palette[idx1];
-                }
-            }
+        g_rollback_inputs     [slot] = packet.input;
+        g_rollback_input_ticks[slot] = packet.tick + 1;
+
+        if ((packet.tick + 1) > g_rollback_prediction_tick)
+        {
+            g_rollback_prediction      = packet.input;
+            g_rollback_prediction_tick = packet.tick + 1;
         }
+    }
 
-        glGenTextures(1, &g_sprites_texture_array_id);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D_ARRAY, g_sprites_texture_array_id);
-        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8UI, 16, 16, 4 /* sprite count */, 0, GL_RGBA_INTEGER,
-            GL_UNSIGNED_BYTE, sprite_atlas);
+    // Simulates the next tick, after going back to rollback_from and simulating up to it again if that is earlier.
+    void advance_rollback(u32 rollback_from)
+    {
+        u32 const tick{ g_rollback_tick };
 
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        if (rollback_from < tick)
+        {
+            #ifdef _DEBUG
+            LARGE_INTEGER start, end, frequency;
+            QueryPerformanceCounter(&start);
+            #endif
+
+            // Go back to the mispredicted tick and simulate up to the present again.
+            restore_sim_state(g_rollback_snapshots[rollback_from % k_rollback_history]);
+            for (u32 t{ rollback_from }; t < tick; ++t)
+            {
+                simulate_rollback_tick(t);
+            }
 
-        glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+            #ifdef _DEBUG
+            QueryPerformanceCounter(&end);
+            QueryPerformanceFrequency(&frequency);
+
+            G21_DEBUG_PRINT("#DEBUG: Rolled back ");
+            G21_DEBUG_PRINT(tick - rollback_from);
+            G21_DEBUG_PRINT(" ticks in ");
+            G21_DEBUG_PRINT(ticks_to_microseconds(
+                static_cast<u32>(end.QuadPart - start.QuadPart),
+                static_cast<u32>(frequency.QuadPart)
+            ));
+            G21_DEBUG_PRINT("us.\n");
+            #endif
+        }
+
+        simulate_rollback_tick(tick);
+        g_rollback_tick = tick + 1;
     }
 
-    __forceinline void init_sprite_atlas()
+    void update_rollback()
     {
-        render_sprite_atlas();
-
-        glGenBuffers(1, &g_sprites_vertex_buffer_id);
-        glBindBuffer(GL_ARRAY_BUFFER, g_sprites_vertex_buffer_id);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(g_sprites_vertex_buffer_storage), nullptr, GL_DYNAMIC_DRAW);
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        u32 const tick{ g_rollback_tick };
 
-        glGenBuffers(1, &g_sprites_index_buffer_id);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_sprites_index_buffer_id);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, k_sprites_max_index_count * sizeof(GLuint), nullptr, GL_STATIC_DRAW);
-            
-        void* const sprites_index_buffer_map{ glMapBuffer(GL_ELEMENT_ARRAY_BUFFER, GL_WRITE_ONLY) };
+        // Send the local input once it has been held back long enough.
+        g_rollback_outbox[tick % k_rollback_history] = rollback_packet{ tick, g_input };
+        if (tick >= g_rollback_latency)
+        {
+            rollback_packet const& packet{ g_rollback_outbox[(tick - g_rollback_latency) % k_rollback_history] };
+            g_winsock.sendto(g_rollback_socket, reinterpret_cast<char const*>(&packet), sizeof(packet), 0,
+                reinterpret_cast<sockaddr const*>(&g_rollback_address), sizeof(g_rollback_address));
+        }
 
-        // Since we only render squares, we can already fill out the index buffer so we never need to touch it again.
+        // Take in whatever has arrived, and find the earliest tick that was mispredicted.
+        u32 rollback_from{ tick };
 
-        // Alias the pointer so that we can easily write out the values.
-        GLuint* p{ static_cast<GLuint*>(sprites_index_buffer_map) };
-        for (usize i{ 0 }; i < k_sprites_max_quad_count; ++i)
+        rollback_packet packet;
+        while (g_winsock.recv(g_rollback_socket, reinterpret_cast<char*>(&packet), sizeof(packet), 0) == static_cast<int>(sizeof(packet)))
         {
-            // Tell OpenGL how four vertices combine to form two triangles.
-            p[i * 6 + 0] = static_cast<GLuint>(i * 4 + 0); // Triangle one.
-            p[i * 6 + 1] = static_cast<GLuint>(i * 4 + 1); //
-            p[i * 6 + 2] = static_cast<GLuint>(i * 4 + 2); //
-            p[i * 6 + 3] = static_cast<GLuint>(i * 4 + 1); // Triangle two.
-            p[i * 6 + 4] = static_cast<GLuint>(i * 4 + 3); //
-            p[i * 6 + 5] = static_cast<GLuint>(i * 4 + 2); //
+            confirm_rollback_input(packet, tick, rollback_from);
         }
 
-        // Release the map so that OpenGL can transfer the data to the GPU.
-        glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+        advance_rollback(rollback_from);
+    }
+#endif
 
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    // Advances the simulation by one tick.
+    void simulate_tick()
+    {
+        update_tick_jitter();
+
+#if G21_ENABLE_ROLLBACK
+        if (g_rollback_socket != INVALID_SOCKET)
+        {
+            update_rollback();
+            return;
+        }
+#endif
+
+        g_sim.input = g_input;
+        pre_render_update();
     }
 
-    __forceinline void init_framebuffer()
+#if !G21_ENABLE_PARTICLES
+    // The simulation thread.
+    // With --sim-thread the ticks are run on a thread of their own, which keeps its own clock, and the GL thread only
+    // draws the newest snapshot, so a slow frame can no longer hold back a tick. It is left out with the particles,
+    // which are updated with OpenGL as part of the tick.
+
+    HANDLE g_sim_thread;
+    HANDLE g_sim_timer;
+
+    DWORD WINAPI sim_thread_proc(LPVOID)
     {
-        // Generate a texture object which will be bound to the framebuffer.
-        glGenTextures(1, &g_framebuffer_texture_id);
-        glBindTexture(GL_TEXTURE_2D, g_framebuffer_texture_id);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, camera::k_width, camera::k_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, 0);
-        glBindTexture(GL_TEXTURE_2D, 0);
+        G21_TRACE_THREAD("simulation");
 
-        // Generate the framebuffer object.
-        glGenFramebuffers(1, &g_framebuffer_id);
-        glBindFramebuffer(GL_FRAMEBUFFER, g_framebuffer_id);
-        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, g_framebuffer_texture_id, 0);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+
+        u64 const clock_frequency{ static_cast<u64>(frequency.QuadPart) };
+
+        u64 acc{ 0 };
+        LARGE_INTEGER old_time, new_time;
+        QueryPerformanceCounter(&old_time);
+
+        while (true)
+        {
+            QueryPerformanceCounter(&new_time);
+            acc += u64_multiply_by_60(static_cast<u64>(new_time.QuadPart - old_time.QuadPart));
+            old_time = new_time;
+
+            if (acc >= clock_frequency)
+            {
+                acc -= clock_frequency;
+
+                update_input();
+                simulate_tick();
+                publish_snapshot();
+                continue;
+            }
+
+            // Sleep until shortly before the next tick is due, then spin the rest.
+            u32 const until_tick{ ticks_to_microseconds(static_cast<u32>(clock_frequency - acc) / 60, static_cast<u32>(clock_frequency)) };
+            if ((g_sim_timer != nullptr) && (until_tick > k_timer_spin_time))
+            {
+                wait_on_timer(g_sim_timer, until_tick - k_timer_spin_time, false);
+            }
+            else
+            {
+                _mm_pause();
+            }
+        }
     }
 
-    void init_gl()
+    // Called once the game is interactive. From then on the GL thread must not touch g_sim.
+    void start_sim_thread()
     {
-        G21_DEBUG_PRINT("#DEBUG: Initializing OpenGL.\n");
+        g_sim_timer  = create_high_resolution_timer();
+        g_sim_thread = CreateThread(nullptr, 0, sim_thread_proc, nullptr, 0, nullptr);
 
-        // Initialize the OpenGL context.
-        init_gl_context();
+        // Keep the ticks ahead of the workers and the renderer.
+        SetThreadPriority(g_sim_thread, THREAD_PRIORITY_ABOVE_NORMAL);
+    }
+#endif
 
-        // Load just the functions we need.
-        load_gl_functions();
+#if G21_ENABLE_PARTICLES
+    // Particle simulation.
 
-        // Enable V-Sync.
-        wglSwapIntervalEXT(1);
+    // The CPU update is split into blocks of particles for the workers. Every block lists its living particles at its
+    // own place in the index buffer, and the lists are moved together once all blocks are done.
+    constexpr u32 k_particle_block_size { 4096 };
+    constexpr u32 k_particle_block_count{ (k_max_particle_count + (k_particle_block_size - 1)) / k_particle_block_size };
+    constexpr u32 k_particle_block_grain{ 4 };
 
-        #ifdef _DEBUG
-        // If in debug mode, activate debug output from the OpenGL driver.
-        glEnable(GL_DEBUG_OUTPUT);
-        glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
-        reinterpret_cast<PFNGLDEBUGMESSAGECALLBACKPROC>(
-            wglGetProcAddress("glDebugMessageCallback")
-        )(gl_debug_callback, nullptr);
-        reinterpret_cast<PFNGLDEBUGMESSAGECONTROLPROC>(
-            wglGetProcAddress("glDebugMessageControl")
-        )(GL_DONT_CARE, GL_DONT_CARE, GL_DONT_CARE, 0, nullptr, true);
-        #endif
+    u32 g_particle_block_alive[k_particle_block_count];
 
-        G21_DEBUG_PRINT("#DEBUG: Creating OpenGL buffers.\n");
+    void update_particle_block(u32 block)
+    {
+        // This is the same update as k_particle_update_cs_source, in fixed-point.
 
-        // Generate the framebuffer used for rendering at a fixed internal resolution.
-        init_framebuffer();
+        u32 const begin{ block * k_particle_block_size };
+        u32 const end  { min(begin + k_particle_block_size, g_particle_count) };
 
-#if 0
-        // Generate the buffers used by the compute shader.
+        u32 alive{ begin };
 
-        glGenBuffers(1, &g_particle_buffer_id);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_particle_buffer_id);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(cs_particle) * k_max_particle_count, nullptr, GL_STATIC_DRAW);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, g_particle_buffer_id);
+        for (u32 i{ begin }; i < end; ++i)
+        {
+            cs_particle& p{ g_cpu_particles[i] };
 
-        GLuint index_buffer_id;
-        glGenBuffers(1, &g_index_buffer_id);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_index_buffer_id);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint) * k_max_particle_count, nullptr, GL_STATIC_DRAW);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, g_index_buffer_id);
+            if (p.life == 0) continue;
 
-        glGenBuffers(1, &g_atomic_counter_buffer_id);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_atomic_counter_buffer_id);
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, g_atomic_counter_buffer_id);
+            g_cpu_particle_indices[alive++] = i;
+            --p.life;
 
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
-#endif
+            // Unlike texelFetch, nothing saves us from reading outside the map, so retire any particle that escaped.
+            u32 const x{ static_cast<u32>(static_cast<i32>(ifloor(p.cur_pos.x))) };
+            u32 const y{ static_cast<u32>(static_cast<i32>(ifloor(p.cur_pos.y))) };
+            if ((x >= k_world_width) || (y >= k_world_height))
+            {
+                p.life = 0;
+                continue;
+            }
 
-        // Generate and bind the Vertex Array Object.
-        glGenVertexArrays(1, &g_vao);
-        glBindVertexArray(g_vao);
+            // The only read from the map: the force, the signed distance and the surface normal.
+            particle_force_texel const t{ g_gradient_map[y][x] };
 
-        // Enable the vertex position attribute.
-        glEnableVertexAttribArray(0);
+            // Apply drag (matching PARTICLE_DRAG) to the implied velocity and add the force.
+            vec2<fixed16_16> v{ p.cur_pos - p.old_pos };
+            v.x = (v.x * 94) / 100;
+            v.y = (v.y * 94) / 100;
+            v.x.raw() += static_cast<i32>(t.force.x) * 8;
+            v.y.raw() += static_cast<i32>(t.force.y) * 8;
 
-        // Initialize the sprite atlas.
-        init_sprite_atlas();
+            // A step shorter than the distance to the nearest surface can never hit anything. Otherwise we reflect
+            // the part of the step going into the surface, and push the particle out if it is inside.
+            i32 const r{ static_cast<i32>(t.distance) * 256 };
+            if ((r < 0) || ((__emul(v.x.raw(), v.x.raw()) + __emul(v.y.raw(), v.y.raw())) > __emul(r, r)))
+            {
+                // Go from 6 to 14 fractional bits.
+                i32 const nx{ static_cast<i8>(static_cast<u8>(t.normal     )) * 256 };
+                i32 const ny{ static_cast<i8>(static_cast<u8>(t.normal >> 8)) * 256 };
 
-#if 0
-        // Bind the particle buffer SSBO as the vertex array buffer.
-        glBindBuffer(GL_ARRAY_BUFFER, g_particle_buffer_id);
-        glVertexAttribIPointer(0, 2, GL_INT, sizeof(cs_particle), nullptr);
+                i32 const vn{ static_cast<i32>(__ll_rshift(__emul(v.x.raw(), nx) + __emul(v.y.raw(), ny), 14)) };
+                if (vn < 0)
+                {
+                    // Scale by one plus the restitution (matching PARTICLE_RESTITUTION).
+                    i32 const k{ vn + (vn >> 1) };
+                    v.x.raw() -= static_cast<i32>(__ll_rshift(__emul(nx, k), 14));
+                    v.y.raw() -= static_cast<i32>(__ll_rshift(__emul(ny, k), 14));
+                }
+                if (r < 0)
+                {
+                    v.x.raw() -= static_cast<i32>(__ll_rshift(__emul(nx, r), 14));
+                    v.y.raw() -= static_cast<i32>(__ll_rshift(__emul(ny, r), 14));
+                }
+            }
 
-        // Bind the "alive" particle index array.
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer_id);
+            p.old_pos = p.cur_pos;
+            p.cur_pos = p.cur_pos + v;
 
-        // Generate the texture used for particle pathfinding.
-        glGenTextures(1, &g_gradient_map_texture_id);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_RECTANGLE, g_gradient_map_texture_id);
-        glTexImage2D(GL_TEXTURE_RECTANGLE, 0, GL_RGB32I, k_world_width, k_world_height, 0, GL_RGB_INTEGER, GL_INT, nullptr);
-        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
-#endif
+            // Tell the pathfinder which tile we are in.
+            u32 const tx{ static_cast<u32>(static_cast<i32>(ifloor(p.cur_pos.x))) / k_flow_tile_size };
+            u32 const ty{ static_cast<u32>(static_cast<i32>(ifloor(p.cur_pos.y))) / k_flow_tile_size };
+            if ((tx < k_flow_tile_columns) && (ty < k_flow_tile_rows))
+            {
+                u32 const tile{ (ty * k_flow_tile_columns) + tx };
+                u32 const bit { 1Ui32 << (tile % 32) };
 
-        // Load the shaders.
-        load_shaders();
+                // Most particles share their tile with many others, so only go for the atomic if the bit is missing.
+                if ((g_flow_agent_tiles[tile / 32] & bit) == 0)
+                {
+                    InterlockedOr(reinterpret_cast<volatile long*>(&g_flow_agent_tiles[tile / 32]), static_cast<long>(bit));
+                }
+            }
+        }
 
-        // Enable blending.
-        glEnable(GL_BLEND);
+        g_particle_block_alive[block] = alive - begin;
     }
 
-    void push_sprite(vec2<fixed16_16> pos, vec2<u8> size, u16 sprite_texture_index)
+    void simulate_particles_cpu()
     {
-        // Top left corner.
-        *(g_sprites_vertex_buffer_storage_ptr++) =
-        {
-            pos, sprite_texture_index
-        };
+        for (u32& word : g_flow_agent_tiles) word = 0;
 
-        // Bottom left corner.
-        *(g_sprites_vertex_buffer_storage_ptr++) =
+        u32 const block_count{ (g_particle_count + (k_particle_block_size - 1)) / k_particle_block_size };
+        parallel_for(0, block_count, k_particle_block_grain, [](u32 begin, u32 end)
         {
-            pos + vec2<fixed16_16>{ {}, fixed16_16{ size.y } }, sprite_texture_index
-        };
+            for (u32 block{ begin }; block < end; ++block) update_particle_block(block);
+        });
 
-        // Top right corner.
-        *(g_sprites_vertex_buffer_storage_ptr++) =
+        // Move the lists together. This is the only serial part, and only copies the indices.
+        u32 alive{ 0 };
+        for (u32 block{ 0 }; block < block_count; ++block)
         {
-            pos + vec2<fixed16_16>{ fixed16_16{ size.x }, {} }, sprite_texture_index
-        };
+            u32 const first{ block * k_particle_block_size };
+            u32 const count{ g_particle_block_alive[block] };
 
-        // Bottom right corner.
-        *(g_sprites_vertex_buffer_storage_ptr++) =
-        {
-            pos + vec2<fixed16_16>{ fixed16_16{ size.x }, fixed16_16{ size.y } }, sprite_texture_index
-        };
+            if (alive != first)
+            {
+                __movsb(reinterpret_cast<u8*>(&g_cpu_particle_indices[alive]), reinterpret_cast<u8 const*>(&g_cpu_particle_indices[first]), count * sizeof(GLuint));
+            }
+            alive += count;
+        }
+
+        g_active_particles = alive;
     }
 
-    void render_sprites()
+    void update_particles_cpu()
     {
-        // Count sprites to render.
-        auto* const sprites_vertex_buffer_begin = g_sprites_vertex_buffer_storage;
-        usize const count{ static_cast<usize>(g_sprites_vertex_buffer_storage_ptr - sprites_vertex_buffer_begin) / 4U };
+        simulate_particles_cpu();
 
-        glUseProgram(g_sprite_render_program_id);
-
-        glUniform4i(0, g_camera.x, g_camera.y, camera::k_width, camera::k_height);
+        // Upload the results into the buffers used for rendering.
+        glBindBuffer(GL_ARRAY_BUFFER, g_particle_buffer_id);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, g_particle_count * sizeof(cs_particle), g_cpu_particles);
+        glBindBuffer(GL_ARRAY_BUFFER, g_index_buffer_id);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, g_active_particles * sizeof(GLuint), g_cpu_particle_indices);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D_ARRAY, g_sprites_texture_array_id);
+    void update_particles()
+    {
+        // Per particle and tick, the update reads and writes one 24 byte particle, writes one 4 byte index and fetches
+        // one 8 byte texel, so 1M particles move roughly 60MB per tick (about 3.6GB/s at 60Hz) on either path. The
+        // CPU path additionally uploads the particle and index buffers every tick. Debug builds print the measured
+        // cost in post_render_update().
 
-        // Orphan the old vertex buffer.
-        glBindBuffer(GL_ARRAY_BUFFER, g_sprites_vertex_buffer_id);
-        glBufferData(GL_ARRAY_BUFFER, sizeof(g_sprites_vertex_buffer_storage), nullptr, GL_DYNAMIC_DRAW);
+        if (glDispatchCompute == nullptr)
+        {
+            update_particles_cpu();
+            return;
+        }
 
-        // Transfer the new vertices into a new vertex buffer.
-        glBufferSubData(GL_ARRAY_BUFFER, 0, count * k_sprites_vertices_per_quad * sizeof(sprite_vertex), sprites_vertex_buffer_begin);
+        glUseProgram(g_compute_particle_updater_program_id);
 
-        // Draw the quads.
-        glVertexAttribIPointer(0, 3, GL_INT, sizeof(sprite_vertex), nullptr);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_sprites_index_buffer_id);
-        glDrawElements(GL_TRIANGLES, static_cast<GLsizei>(count * k_sprites_indices_per_quad), GL_UNSIGNED_INT, nullptr);
+        glUniform1i(0, g_particle_count);
 
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
-        glUseProgram(0);
+        // Take in the live count and which tiles had particles in them, for the pathfinder, from the update on the last
+        // tick. Reading them straight from the buffers the update writes would wait for the GPU to finish it, so they
+        // come from the copy made after it instead, if that is done. Otherwise the last ones taken in are kept. A wait
+        // that failed leaves the fence alone, to be dropped with the copy on the next tick.
+        particle_readback& last{ g_particle_readbacks[g_particle_readback_next ^ 1] };
+        GLenum const status{ (last.fence != nullptr) ? glClientWaitSync(last.fence, 0, 0) : GL_WAIT_FAILED };
+        if ((status == GL_ALREADY_SIGNALED) || (status == GL_CONDITION_SATISFIED))
+        {
+            glBindBuffer      (GL_COPY_READ_BUFFER, last.buffer);
+            glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(GLuint), &g_active_particles);
+            glGetBufferSubData(GL_COPY_READ_BUFFER, sizeof(GLuint), sizeof(g_flow_agent_tiles), g_flow_agent_tiles);
+            glBindBuffer      (GL_COPY_READ_BUFFER, 0);
 
-        // Reset pointer.
-        g_sprites_vertex_buffer_storage_ptr = g_sprites_vertex_buffer_storage;
-    }
+            glDeleteSync(last.fence);
+            last.fence = nullptr;
+        }
 
-    // Setup the game world distance field.
-    
-    void compute_game_world_distance_field(bool inverse)
-    {
-        static u32 sedt_x[k_world_height][k_world_width]; 
-        
-        // Perform the horizontal pass.
-        {
-            for (u32 y{ 0 }; y < k_world_height; ++y)
-            {
-                for (u32 x{ 0 }; x < k_world_width; ++x)
-                {
-                    // Check for solid block.
-                    if (g_game_world_collision_map[y][x] != inverse)
-                    {
-                        // Store a distance of 0.
-                        sedt_x[y][x] = 0;
-                    }
-                    else
-                    {
-                        // Start with an initial squared minimum distance equal to the squared width of the world.
-                        u32 min{ k_world_width * k_world_width };
+        // Start over.
+        static constexpr particle_draw_command new_command{ 0, 1, 0, 0, 0 };
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_atomic_counter_buffer_id);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(particle_draw_command), nullptr, GL_DYNAMIC_DRAW);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(particle_draw_command), &new_command);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_flow_agent_buffer_id);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-                        // Go through the columns.
-                        for (u32 i{ 0 }; i < k_world_width; ++i)
-                        {
-                            // Check for solid block.
-                            if (g_game_world_collision_map[y][i] != inverse)
-                            {
-                                // Calculate the squared distance.
-                                i32 const dx { static_cast<i32>(x) - static_cast<i32>(i) };
-                                u32 const dx2{ static_cast<u32>(dx * dx) };
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, g_particle_buffer_id); 
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, g_index_buffer_id);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, g_atomic_counter_buffer_id);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, g_flow_agent_buffer_id);
 
-                                // Keep the smallest distance.
-                                if (dx2 < min) min = dx2;
-                            }
-                        }
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_RECTANGLE, g_gradient_map_texture_id);
 
-                        // Store the smallest distance.
-                        sedt_x[y][x] = min;
-                    }
-                }
-            }
-        }
+        glDispatchCompute((g_particle_count + (LOCAL_SIZE_X - 1)) / LOCAL_SIZE_X, 1, 1);
+        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_ELEMENT_ARRAY_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
 
-        // Perform the vertical pass plus calculating square roots.
-        {
-            for (u32 y{ 0 }; y < k_world_height; ++y)
-            {
-                for (u32 x{ 0 }; x < k_world_width; ++x)
-                {
-                    // Get the minimum on the x axis.
-                    u32 min{ sedt_x[y][x] };
+        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
 
-                    // Check for solid block.
-                    if (min == 0)
-                    {
-                        // The map is default initialized to 0, so we don't need to store 0 here.
-                    }
-                    else
-                    {
-                        // Go through the rows.
-                        for (u32 i{ 0 }; i < k_world_height; ++i)
-                        {
-                            // Calculate the squared distance.
-                            i32 const dy { static_cast<i32>(y) - static_cast<i32>(i) };
-                            u32 const dx2{ sedt_x[i][x] };
+        // Copy the results for the next tick to read back. A copy that was never read back is dropped.
+        particle_readback& next{ g_particle_readbacks[g_particle_readback_next] };
+        if (next.fence != nullptr) glDeleteSync(next.fence);
 
-                            // Calculate the squared length of the hypotenuse.
-                            u32 const hyp{ dx2 + static_cast<u32>(dy * dy) };
+        glBindBuffer       (GL_COPY_WRITE_BUFFER, next.buffer);
+        glBindBuffer       (GL_COPY_READ_BUFFER, g_atomic_counter_buffer_id);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, sizeof(GLuint));
+        glBindBuffer       (GL_COPY_READ_BUFFER, g_flow_agent_buffer_id);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, sizeof(GLuint), sizeof(g_flow_agent_tiles));
+        glBindBuffer       (GL_COPY_READ_BUFFER, 0);
+        glBindBuffer       (GL_COPY_WRITE_BUFFER, 0);
 
-                            // Keep the smallest hypotenuse.
-                            if (hyp < min) min = hyp;
-                        }
+        next.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        g_particle_readback_next ^= 1;
 
-                        // Calculate the distance (we cap the squared distance at 65535, as higher numbers are not
-                        // supported).
-                        fixed16_16 const dist{
-                            fixed16_16::sqrt(static_cast<u16>((min < 65535) ? min : 65535))
-                        };
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, 0);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, 0);
 
-                        // Store the signed distance.
-                        g_game_world_distance_field[y][x] = (inverse ? -dist : dist);
-                    }
-                }
-            }
-        }
+        glUseProgram(0);
     }
 
-    // Setup noise textures.
-
-    void compute_white_noise_texture()
+    void post_render_update()
     {
-        // This noise is probably far higher quality than it needs to be, but whatever, now it's written.
+        G21_TRACE_ZONE("post_render_update");
 
-        // Initialize our state. These constants represent the first 128 bits in the initial hash value of SHA256.
-        u32 state[4]
+        // There is no need to worry about making sure this map uses the most recent data.
+        // It's more important that we don't delay the rendering.
+        if (update_particle_pathfinder_vector_map())
         {
-            0x6A09E667Ui32,
-            0xBB67AE85Ui32,
-            0x3C6EF372Ui32,
-            0xA54FF53AUi32
-        };
-
-        // Setup a pointer so we can write 4 bytes at a time.
-        static_assert(k_white_noise_texture_width % 4 == 0);
-        u32* ptr{ reinterpret_cast<u32*>(&g_white_noise_texture[0][0]) };
+            compute_gradient_map();
+            upload_gradient_map ();
+        }
 
-        // Go through every pixel and generate a value using xoshiro128** 1.1 (Written this way for optimal code size).
-        // (https://xoshiro.di.unimi.it/xoshiro128starstar.c)
-        for (u32 n{ 0 }; n != (k_white_noise_texture_width * k_white_noise_texture_height); n += 4, ++ptr)
-        {
-            u32 const rand{ _rotl(state[1] * 5, 7) * 9 };
+        #ifdef _DEBUG
+        LARGE_INTEGER start, end, frequency;
+        QueryPerformanceCounter(&start);
+        #endif
 
-            u32 const t{ state[1] << 9 };
-            state[2] ^= state[0];
-            state[3] ^= state[1];
-            state[1] ^= state[2];
-            state[0] ^= state[3];
-            state[2] ^= t;
-            state[3]  = _rotl(state[3], 11);
+        update_particles();
 
-            *ptr = rand;
+        #ifdef _DEBUG
+        // Wait for the GPU, so that the measurement includes the compute shader. Fine for a debug build.
+        glFinish();
+        QueryPerformanceCounter(&end);
+        QueryPerformanceFrequency(&frequency);
+
+        // Report the per-tick cost of the particle update once a second.
+        static u32 tick;
+        if (++tick == 60)
+        {
+            tick = 0;
+
+            G21_DEBUG_PRINT("#DEBUG: Particle update took ");
+            G21_DEBUG_PRINT(ticks_to_microseconds(
+                static_cast<u32>(end.QuadPart - start.QuadPart),
+                static_cast<u32>(frequency.QuadPart)
+            ));
+            G21_DEBUG_PRINT("us for ");
+            G21_DEBUG_PRINT(g_particle_count);
+            G21_DEBUG_PRINT(" particles.\n");
         }
+        #endif
     }
 
-    void compute_fractal_noise_texture()
+    __forceinline void render_particles()
     {
-        // Sample the white noise texture multiple times at various scales and blend together.
-
-        for (u32 y{ 0 }; y < k_fractal_noise_texture_height; ++y)
+        // Check if there are any particles to render. On the GPU the count read back is a tick old, so only the
+        // particle count is checked there, and the draw takes the live count from the update.
+        bool const on_gpu{ glDispatchCompute != nullptr };
+        if (on_gpu ? (g_particle_count > 0) : (g_active_particles > 0))
         {
-            for (u32 x{ 0 }; x < k_fractal_noise_texture_width; ++x)
-            {
-                u8 sum{ 0 };
-
-                for (u8 i{ 0 }; i < 4U; ++i)
-                {
-                    u8 const scale{ 4U - i };
-                    u8 const f{ 1U << scale };
+            glUseProgram(g_render_program_id);
 
-                    u32 const y_i{ y >> scale };
-                    u32 const y_f{ y & (f - 1) };
+            glUniform4i(0, g_snapshot->camera.x, g_snapshot->camera.y, camera::k_width, camera::k_height);
 
-                    u32 const x_i{ x >> scale };
-                    u32 const x_f{ x & (f - 1) };
+            glBindBuffer(GL_ARRAY_BUFFER, g_particle_buffer_id);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer_id);
 
-                    u32 const tmp_sum
-                        = (g_white_noise_texture[y_i + 0Ui32][x_i + 0Ui32] * (f - y_f) * (f - x_f))
-                        + (g_white_noise_texture[y_i + 0Ui32][x_i + 1Ui32] * (f - y_f) * (    x_f))
-                        + (g_white_noise_texture[y_i + 1Ui32][x_i + 0Ui32] * (    y_f) * (f - x_f))
-                        + (g_white_noise_texture[y_i + 1Ui32][x_i + 1Ui32] * (    y_f) * (    x_f));
+            glVertexAttribIPointer(0, 2, GL_INT, sizeof(cs_particle), nullptr);
 
-                    sum += static_cast<u8>(tmp_sum >> (scale * 2U)) >> (i + 1U);
-                }
-                
-                g_fractal_noise_texture[y][x] = sum;
+            if (on_gpu)
+            {
+                glBindBuffer          (GL_DRAW_INDIRECT_BUFFER, g_atomic_counter_buffer_id);
+                glDrawElementsIndirect(GL_POINTS, GL_UNSIGNED_INT, nullptr);
+                glBindBuffer          (GL_DRAW_INDIRECT_BUFFER, 0);
             }
+            else
+            {
+                glDrawElements(GL_POINTS, g_active_particles, GL_UNSIGNED_INT, nullptr);
+            }
+
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+            glUseProgram(0);
         }
     }
+#endif
 
-#if 0
-    // Particle pathfinding
+    // Rendering.
 
-    namespace detail
+    __forceinline void render_background()
     {
-        u8 g_pathfinder_vector_map_visited_flags[k_world_height][k_world_width];
-    };
+        bind_visible_lights();
 
-    constinit vec2<fixed16_16> g_particle_pathfinder_vector_map[k_world_height][k_world_width];
+        glUseProgram(g_background_renderer_program_id);
+        
+        glUniform4i(0, g_snapshot->camera.x, g_snapshot->camera.y, camera::k_width, camera::k_height);
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_RECTANGLE, g_background_texture_id);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+    }
 
-    __forceinline void init_particle_pathfinder_vector_map()
+    __forceinline void render_framebuffer()
     {
-        for (u16 y{ 0 }; y < k_world_height; ++y)
-        {
-            for (u16 x{ 0 }; x < k_world_width; ++x)
-            {
-                // Check if this pixel is not traversable.
-                if (g_game_world_collision_map[y][x])
-                {
-                    // Use the distance field to store the appropriate gradient for pushing the particle out.
-
-                    auto const left  = (x > 0)                     ? g_game_world_distance_field[y][x - 1] : g_game_world_distance_field[y][x];
-                    auto const right = (x < (k_world_width  - 1U)) ? g_game_world_distance_field[y][x + 1] : g_game_world_distance_field[y][x];
-                    auto const up    = (y > 0)                     ? g_game_world_distance_field[y - 1][x] : g_game_world_distance_field[y][x];
-                    auto const down  = (y < (k_world_height - 1U)) ? g_game_world_distance_field[y + 1][x] : g_game_world_distance_field[y][x];
+        glViewport(g_viewport.x, g_viewport.y, g_viewport.z, g_viewport.w);
 
-                    g_particle_pathfinder_vector_map[y][x].x = (right - left) * 4;
-                    g_particle_pathfinder_vector_map[y][x].y = ( down -   up) * 4;
+        glUseProgram(g_upscaler_program_id);
 
-                    detail::g_pathfinder_vector_map_visited_flags[y][x] = 0b11;
-                }
-            }
-        }
+        glActiveTexture(GL_TEXTURE0);
+        glBindTexture(GL_TEXTURE_2D, g_framebuffer_texture_id);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
     }
 
-    bool update_particle_pathfinder_vector_map()
+    // Returns false if nothing changed and the frame was skipped.
+    bool render()
     {
-        // Could make the frontier array smaller by making it a circular deque,
-        // but the size would then need to be tuned to avoid overflow.
-        // It's only 2MB anyway.
+        G21_TRACE_ZONE("render");
 
-        static vec2<u16>  frontier[k_world_width * k_world_height]; 
-        static u32        frontier_tail, frontier_head;
-        static u8         cur_visited_flag;
+        if (!begin_frame()) return false;
 
-        // Initialization.
-        if (frontier_tail == 0)
+        // The target follows the viewport, which may have changed.
+        if (g_render_target_dirty)
         {
-            // Get the player's current position as an integer.
-            u16 const start_x{ static_cast<u16>(ifloor(g_player.pos.x)) };
-            u16 const start_y{ static_cast<u16>(ifloor(g_player.pos.y)) };
-
-            // Flip between using the first or second bit to check if a pixel has already been visited.
-            cur_visited_flag = 1Ui8 + (cur_visited_flag & 1Ui8);
+            g_render_target_dirty = false;
+            init_render_target();
+        }
 
-            // Insert the player's current position at the start of the frontier.
-            frontier[0]   = vec2<u16>{ start_x, start_y };
-            frontier_head = 1;
+        // Bind the framebuffer we use to render to our internal resolution.
+        glBindFramebuffer(GL_FRAMEBUFFER, g_framebuffer_id);
+        glViewport(0, 0, camera::k_width * g_render_target_scale, camera::k_height * g_render_target_scale);
 
-            // Update the visited map.
-            detail::g_pathfinder_vector_map_visited_flags[start_y][start_x] = cur_visited_flag;
+        // With an sRGB target, the values written are encoded and reading them back in the upscale decodes them again,
+        // so the result is the same but blending happens in linear space.
+        if (g_render_target_format == render_target_format::srgb8_alpha8)
+        {
+            glEnable(GL_FRAMEBUFFER_SRGB);
         }
 
-        // Setup the step counter, which limits the number of steps we perform per frame.
-        constexpr u32 step_limit{ 0x1'0000 };
-        u32 steps{ 0 };
+        // Render the background.
+        G21_GPU_PASS_BEGIN(background);
+        glBlendFunc(GL_ONE, GL_ZERO);
+        render_background();
+        G21_GPU_PASS_END(background);
 
-        // Loop until we finished the flood fill (or abort due to step limit).
-        do
+        // Render the sprites.
+        G21_GPU_PASS_BEGIN(sprites);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+        for (u32 i{ 0 }; i < g_snapshot->sprite_count; ++i)
         {
-            // Save the current head, as it gets modified when we add new nodes to the frontier.
-            u32 const old_frontier_head{ frontier_head };
+            indexed_sprite const& sprite{ g_snapshot->sprites[i] };
+            add_dynamic_sprite(sprite.entry.pos, sprite.entry.size, sprite.entry.sprite_texture_index, sprite.layer, sprite.depth);
+        }
+        gather_visible_sprites(g_snapshot->camera);
 
-            // Go through new nodes in the frontier.
-            do
-            {
-                // Get the current node and advance the tail.
-                auto const cur = frontier[frontier_tail++];
+        render_sprites(g_snapshot->camera);
+        G21_GPU_PASS_END(sprites);
 
-                // Go through the 8 neighbors (bounds checking is not performed as the map has a border).
-                for (u8 i{ 0 }; i < 8; ++i)
-                {
-                    constexpr vec2<i16> d[8]
-                    { 
-                        vec2<i16>{  1,  0 },
-                        vec2<i16>{  0,  1 },
-                        vec2<i16>{ -1,  0 },
-                        vec2<i16>{  0, -1 },
-                        vec2<i16>{  1, -1 },
-                        vec2<i16>{  1,  1 },
-                        vec2<i16>{ -1,  1 },
-                        vec2<i16>{ -1, -1 }
-                    };
+        // Unbind the framebuffer, in preparation for upscaling the image to the target resolution.
+        glDisable(GL_FRAMEBUFFER_SRGB);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
 
-                    // Compute the x and y coordinates of the neighbor.
-                    u16 const next_x{ static_cast<u16>(static_cast<i16>(cur.x) + d[i].x) };
-                    u16 const next_y{ static_cast<u16>(static_cast<i16>(cur.y) + d[i].y) };
+        // Upscale by rendering our framebuffer to the default framebuffer.
+        G21_GPU_PASS_BEGIN(framebuffer);
+        render_framebuffer();
+        G21_GPU_PASS_END(framebuffer);
 
-                    // Check if traversable and not already visited (non-traversable pixels always fail the visited check).
-                    if ((detail::g_pathfinder_vector_map_visited_flags[next_y][next_x] & cur_visited_flag) == 0)
-                    {
-                        // Make the vector map at the neighbour point towards the current node.
-                        g_particle_pathfinder_vector_map[next_y][next_x] = vec2<fixed16_16>{
-                            fixed16_16{ -d[i].x },
-                            fixed16_16{ -d[i].y }
-                        };
+#if G21_ENABLE_PARTICLES
+        // Render the particles at full resolution.
+        G21_GPU_PASS_BEGIN(particles);
+        glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+        render_particles();
+        G21_GPU_PASS_END(particles);
+#endif
 
-                        // Mark as visited.
-                        detail::g_pathfinder_vector_map_visited_flags[next_y][next_x] = cur_visited_flag;
+        // Stand in for a heavy frame, see update_tick_jitter().
+        if (g_render_load != 0) busy_wait(g_render_load * 1000);
 
-                        // Add to the frontier, advancing the head.
-                        frontier[frontier_head++] = vec2<u16>{ next_x, next_y };
-                    }
-                }
+        // Present.
+        SwapBuffers(g_hDC);
+        //glFinish();
 
-                // Increment the step counter.
-                ++steps;
-            } while (frontier_tail != old_frontier_head);
-        } while ((steps < step_limit) && (frontier_tail != frontier_head));
+        submit_frame(g_snapshot->input_events);
 
-        // Check if we finished.
-        if (frontier_tail == frontier_head)
-        {
-            // Reset.
-            frontier_tail = 0;
+        if (g_startup_first_frame == 0) g_startup_first_frame = get_startup_time();
 
-            // Return true to indicate the distance map is complete.
-            return true;
-        }
+        #if G21_ENABLE_GPU_PROFILER
+        collect_gpu_profiler_frame();
+        #endif
 
-        // Return false to indicate that the distance map is incomplete.
-        return false;
+        return true;
     }
 
-    constinit vec3<fixed16_16> g_gradient_map[k_world_height][k_world_width];
-
-    void compute_gradient_map()
+    void render_loading_screen()
     {
-        for (u32 y{ 1 }; y < k_world_height - 1; ++y)
-        {
-            for (u32 x{ 1 }; x < k_world_width - 1; ++x)
-            {
-                fixed16_16 const dx{ g_particle_pathfinder_vector_map[y][x].x * 2 };
-                fixed16_16 const dy{ g_particle_pathfinder_vector_map[y][x].y * 2 };
+        G21_TRACE_ZONE("render_loading_screen");
 
-                fixed16_16 value_x = dx * 12;
-                fixed16_16 value_y = dy * 12;
+        // One step for the maps and one for every band of the distance field.
+        i32 const done{ (g_load_stage == load_stage::maps) ? 0 : (1 + static_cast<i32>(g_load_band_count)) };
 
-                value_x += fixed16_16{ static_cast<i16>(static_cast<i32>(static_cast<u32>(g_fractal_noise_texture[y - 1][x])) - static_cast<i32>(static_cast<u32>(g_fractal_noise_texture[y + 1][x]))) } * 1;
-                value_y += fixed16_16{ static_cast<i16>(static_cast<i32>(static_cast<u32>(g_fractal_noise_texture[y][x + 1])) - static_cast<i32>(static_cast<u32>(g_fractal_noise_texture[y][x - 1]))) } * 1;
-                //value.x += (g_game_world_distance_field[y][x + 1] - g_game_world_distance_field[y][x - 1]) * 2;
-                //value.y += (g_game_world_distance_field[y + 1][x] - g_game_world_distance_field[y - 1][x]) * 2;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(g_viewport.x, g_viewport.y, g_viewport.z, g_viewport.w);
+        glBlendFunc(GL_ONE, GL_ZERO);
 
-                g_gradient_map[y][x].x = value_x;
-                g_gradient_map[y][x].y = value_y;
-            }
-        }
-    }
+        glUseProgram(g_loading_screen_program_id);
+        glUniform2i(0, done, 1 + k_load_band_count);
+        glDrawArrays(GL_TRIANGLES, 0, 3);
+        glUseProgram(0);
 
-    void upload_gradient_map()
-    {
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_RECTANGLE, g_gradient_map_texture_id);
-        glTexSubImage2D(GL_TEXTURE_RECTANGLE, 0, 0, 0, k_world_width, k_world_height, GL_RGB_INTEGER, GL_INT, g_gradient_map);
-        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+        SwapBuffers(g_hDC);
+
+        // Nothing runs the simulation yet, so the input taken in so far is all there is.
+        submit_frame(g_input_events_recorded);
+
+        if (g_startup_first_frame == 0) g_startup_first_frame = get_startup_time();
     }
-#endif
 
-    // Setup the background texture.
+    // Game loop.
 
-    void compute_background_texture()
-    {
-        static vec3<u8> background_texture[k_world_height][k_world_width];
+    constexpr u32 k_max_messages_per_pump{ 64 };
 
-        constexpr u32 brick_width { 16 };
-        constexpr u32 brick_height{ brick_width / 2 };
+    // Handles the waiting window messages, but no more than k_max_messages_per_pump of them, so that a flood of
+    // messages cannot hold back the ticks. Returns true if the queue was emptied.
+    bool pump_messages()
+    {
+        G21_TRACE_ZONE("messages");
 
-        for (u32 y{ 0 }; y < k_world_height; ++y)
+        MSG msg;
+        for (u32 i{ 0 }; i < k_max_messages_per_pump; ++i)
         {
-            u32 const bi_y{ y / brick_height };
-            u32 const bf_y{ y % brick_height };
+            if (PeekMessageA(&msg, nullptr, 0, 0, PM_REMOVE) == 0) return true;
 
-            u32 const offset_x{ ((bi_y & 1) == 1) ? (brick_width / 2) : 0 };
+            ++g_messages_handled;
 
-            for (u32 x{ 0 }; x < k_world_width; ++x)
+            // Only the latest cursor position matters, so the mouse moves just overwrite it, without going through
+            // the window procedure.
+            if ((msg.message == WM_MOUSEMOVE) && (msg.hwnd == g_hWnd))
             {
-                if (!g_game_world_collision_map[y][x])
-                {
-                    u32 const bi_x{ (x + offset_x) / brick_width  };
-                    u32 const bf_x{ (x + offset_x) % brick_width  };
-                
-                    if ((bf_x < 1) || (bf_y < 1))
-                    {
-                        background_texture[y][x] = vec3<u8>{ static_cast<u8>(g_white_noise_texture[y][x] / 16) };
-                    }
-                    else
-                    {
-                        u8 brick_color{ static_cast<u8>(40Ui8 + (g_white_noise_texture[bi_y][bi_x] / 3)) };
-                        brick_color  = static_cast<u8>(((static_cast<u16>(brick_color) << 2) - brick_color + g_fractal_noise_texture[y][x]) / 6);
-                        brick_color &= static_cast<u8>(~3Ui8);
-                        brick_color |= (g_white_noise_texture[y][x] & 1);
-
-                        background_texture[y][x] = vec3<u8>{ brick_color };
-                    }
-                }
-                else
-                {
-#if 0
-                    // TODO: Combine some texture with this alpha
-                    i16 const asdf = ifloor(max(g_game_world_distance_field[y][x] + 15, fixed16_16{ 0 }) * 3);
-                    background_texture[y][x].x = static_cast<u8>((asdf * asdf) / 8);
-#endif
-                }
+                g_cursor = MAKEPOINTS(msg.lParam);
+                ++g_mouse_moves_coalesced;
+                continue;
             }
+
+            // Handle the message.
+            TranslateMessage(&msg);
+            DispatchMessageA(&msg);
         }
 
-        glGenTextures(1, &g_background_texture_id);
-        glBindTexture(GL_TEXTURE_RECTANGLE, g_background_texture_id);
-        glTexImage2D (GL_TEXTURE_RECTANGLE, 0, GL_RGB8UI, k_world_width, k_world_height, 0, GL_RGB_INTEGER, GL_UNSIGNED_BYTE, background_texture);
-        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+        return false;
     }
 
-    // Initialization.
-
-    __forceinline void init()
+    __declspec(noreturn, noinline) void loop()
     {
-        G21_DEBUG_PRINT("#DEBUG: Initializing.\n");
+        G21_DEBUG_PRINT("#DEBUG: Entering main loop.\n");
 
-        init_window();
-        init_gl(); 
+        // Pin the thread to core #2.
+        SetThreadAffinityMask(GetCurrentThread(), 2);
 
-        // This is hack to display the "Loading. . ." message.
+        // Get the frequency of the counter we use to measure the elapsed time.
+        auto const clock_frequency{ []() -> u64
         {
-            MSG msg;
-            while (PeekMessageA(&msg, nullptr, 0, 0, PM_REMOVE) != 0)
-            {
-                TranslateMessage(&msg);
-                DispatchMessageA(&msg);
-            }
-        }
-
-        G21_DEBUG_PRINT("#DEBUG: Computing textures.\n");
-
-        compute_game_world_collision_map();
-
-        compute_player_collision_map();
+            LARGE_INTEGER result;
+            QueryPerformanceFrequency(&result);
+            return static_cast<u64>(result.QuadPart);
+        }() };
+        
+        // Initialize our clock.
+        u64 acc{ 0 };
+        LARGE_INTEGER old_time, new_time;
+        QueryPerformanceCounter(&old_time);
 
-        compute_game_world_distance_field(0);
-        compute_game_world_distance_field(1);
+        // Set when the last tick did not draw anything, so we can sleep until the next.
+        bool idle{ false };
 
-#if 0
-        init_particle_pathfinder_vector_map();
-#endif
+        // Loop until window is closed (the event handler calls ExitProcess).
+        while (true)
+        {
+            // Handle the window messages that have come in, then run a tick if one is due whether they are all handled
+            // or not.
+            bool const drained{ pump_messages() };
 
-        compute_white_noise_texture();
-        compute_fractal_noise_texture();
+            // Get the elapsed time.
+            QueryPerformanceCounter(&new_time);
+            acc += u64_multiply_by_60(static_cast<u64>(new_time.QuadPart - old_time.QuadPart));
+            old_time = new_time;
 
-        compute_background_texture();
-    }
+            // Measure the frames that have finished since.
+            complete_frames(false);
 
-#if 0
-    void emit_particles()
-    {
-        glUseProgram(g_compute_particle_emitter_program_id);
+            // Check if enough time has passed for 1 frame, and with late latching, if the vblank is close enough.
+            if ((acc >= clock_frequency) && latch_tick(static_cast<u64>(new_time.QuadPart)))
+            {
+                acc -= clock_frequency;
 
-        glUniform1i(0, g_particle_count);                   // particle_count
-        glUniform2i(1, 200 << 16, 400 << 16);               // emit_location
+                // Take in the input even while loading, so that the key event queue never fills up. Once the
+                // simulation has a thread of its own, it does this itself.
+                if (!g_split_simulation || !g_game_interactive) update_input();
 
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, g_particle_buffer_id);
+                if (update_loading())
+                {
+#if !G21_ENABLE_PARTICLES
+                    if (g_split_simulation)
+                    {
+                        if (g_sim_thread == nullptr) start_sim_thread();
+                    }
+                    else
+#endif
+                    {
+                        simulate_tick();
+                        publish_snapshot();
+                    }
 
-        glDispatchCompute((g_particle_count + (LOCAL_SIZE_X - 1)) / LOCAL_SIZE_X, 1, 1);
-        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+                    idle = !render();
 
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
+#if G21_ENABLE_PARTICLES
+                    post_render_update();
+#endif
 
-        glUseProgram(0);
+                    update_idle_benchmark(!idle);
+                    update_message_stress();
+                }
+                else
+                {
+                    render_loading_screen();
+                }
+            }
+            else if (drained && (g_latch_time != 0))
+            {
+                // Sleep until shortly before the latch, handling messages as they come, then spin the rest.
+                u32 const until_latch{ ticks_to_microseconds(static_cast<u32>(g_latch_time - static_cast<u64>(new_time.QuadPart)), static_cast<u32>(clock_frequency)) };
+                if (until_latch > k_timer_spin_time)
+                {
+                    wait_idle(until_latch - k_timer_spin_time);
+                }
+            }
+            else if (drained && idle && (g_frames_finished == g_frames_submitted))
+            {
+                // Nothing changed on the last tick, so sleep until the next one is due or a message comes in.
+                wait_idle(ticks_to_microseconds(static_cast<u32>(clock_frequency - acc) / 60, static_cast<u32>(clock_frequency)));
+            }
+            
+            // Yield the rest of our CPU timeslice.
+            //Sleep(0);
+        }
     }
-#endif
 
-    void update_camera()
-    {
-        // Calculate where we would like the center of the camera to be.
+    // SetProcessDPIAware.
 
-        u16 const desired_center_x{ static_cast<u16>(static_cast<u16>(ifloor(g_player.pos.x)) + (player::k_width  / 2Ui16)) };
-        u16 const desired_center_y{ static_cast<u16>(static_cast<u16>(ifloor(g_player.pos.y)) + (player::k_height / 2Ui16)) };
+    __forceinline void set_process_dpi_aware()
+    {
+        G21_DEBUG_PRINT("#DEBUG: Checking for SetProcessDPIAware.\n");
 
-        // Adjust so it doesn't go beyond the edges.
+        // Load the user32 dll.
+        HMODULE const user32_dll{ LoadLibraryA("user32.dll") };
 
-        i16 camera_left = static_cast<i16>(static_cast<i16>(desired_center_x) - static_cast<i16>(camera::k_width / 2Ui16));
-        if (camera_left < 0)
-        {
-            camera_left = 0;
-        }
-        else if (static_cast<u16>(camera_left) > (k_world_width - camera::k_width))
+        #ifdef _DEBUG
+        // Might as well test it in debug mode.
+        if (user32_dll == nullptr)
         {
-            camera_left = static_cast<i16>(k_world_width - camera::k_width);
+            G21_DEBUG_PRINT("#DEBUG: user32.dll is missing???\n");
+            __fastfail(FAST_FAIL_FATAL_APP_EXIT);
         }
+        #else
+        // This really shouldn't be null. Silence the analyser in release mode.
+        __analysis_assume(user32_dll != nullptr);
+        #endif
 
-        i16 camera_top = static_cast<i16>(static_cast<i16>(desired_center_y) - static_cast<i16>(camera::k_height / 2Ui16));
-        if (camera_top < 0)
+        // Check for the presence of SetProcessDPIAware.
+        auto const proc = reinterpret_cast<BOOL(*)()>(GetProcAddress(user32_dll, "SetProcessDPIAware"));
+        if (proc)
         {
-            camera_top = 0;
+            // Call it.
+            G21_DEBUG_PRINT("#DEBUG: Invoking SetProcessDPIAware.\n");
+            proc();
         }
-        else if (static_cast<u16>(camera_top) > (k_world_height - camera::k_height))
+        else
         {
-            camera_top = static_cast<i16>(k_world_height - camera::k_height);
+            G21_DEBUG_PRINT("#DEBUG: SetProcessDPIAware not found, ignoring.\n");
         }
 
-        // Save the origin (top-left corner).
-        g_camera.x = static_cast<u16>(camera_left);
-        g_camera.y = static_cast<u16>(camera_top);
+        //FreeLibrary(user32_dll);
     }
 
-    // Collision detection.
+#if G21_BENCHMARK
+    // Benchmarks.
+    // Every case is run a few times to warm up, then timed over k_benchmark_sample_count samples of 'iterations' calls
+    // each. The median and the median absolute deviation of the samples are reported, as they hold up against the odd
+    // sample disturbed by the rest of the system far better than the mean and standard deviation. The results go to the
+    // console and to benchmark.json, to be compared against a baseline. Cases with a budget fail the run when their
+    // median goes over it.
+
+    constexpr u32 k_benchmark_sample_count       { 31 };
+    constexpr u32 k_benchmark_warmup_count       { 3 };
+    constexpr u32 k_benchmark_trajectory_count   { 1024 };
+    constexpr u32 k_benchmark_sprite_count       { 10'000 };
+    constexpr u32 k_benchmark_sprite_stress_count{ 100'000 };
+    constexpr u32 k_benchmark_vector_count       { 4096 };
+    constexpr u32 k_benchmark_ray_count          { 1024 };
+    constexpr u32 k_benchmark_trace_zone_count   { 1000 };
+
+    // The collision raycasts are to manage 1M rays per second on one core, that is 1us per ray.
+    constexpr u32 k_benchmark_raycast_budget{ k_benchmark_ray_count * 1000 };
+
+    // The scale the batch operations are measured with, which keeps the vectors from growing between samples.
+    constexpr fixed16_16 k_benchmark_scale{ fixed16_16::from_ratio(99, 100) };
+
+    struct benchmark_case
+    {
+        char const* name;
+        void      (*run)();
+        u32         iterations;
+        u32         budget; // In nanoseconds, or 0 for none.
+        void      (*reset)();   // Run untimed before every sample, or nullptr for none.
+        u32         threads;    // The job threads to run on, or 0 for all of them. Skipped if there are fewer workers.
+    };
 
-    void collision_sweep_test()
+    struct benchmark_trajectory
     {
-        // Get current pixel position.
-        i16 const start_x{ ifloor(g_player.pos.x) };
-        i16 const start_y{ ifloor(g_player.pos.y) };
+        vec2<fixed16_16> pos;
+        vec2<fixed16_16> vel;
+    };
 
-        // Calculate the desired next pixel position.
-        i16 const end_x{ ifloor(g_player.pos.x + g_player.vel.x) };
-        i16 const end_y{ ifloor(g_player.pos.y + g_player.vel.y) };
+    benchmark_trajectory    g_benchmark_trajectories[k_benchmark_trajectory_count];
+    background_texture_data g_benchmark_background_texture;
+    vec2<fixed16_16>        g_benchmark_vectors[k_benchmark_vector_count];
+    vec2<fixed16_16>        g_benchmark_deltas [k_benchmark_vector_count];
+    vec2<fixed16_16>        g_benchmark_expected[k_benchmark_vector_count];
+    benchmark_trajectory    g_benchmark_rays[k_benchmark_ray_count]; // Unit directions rather than velocities.
+    ray                     g_benchmark_collision_rays[k_benchmark_ray_count];
+    ray_hit                 g_benchmark_collision_hits[k_benchmark_ray_count];
+    u32                     g_benchmark_sink; // Keeps the query results from being optimized away.
+
+    void init_benchmark_trajectories()
+    {
+        // Start anywhere in the player collision map, solid or not, and move up to 16 pixels along each axis.
+        for (u32 i{ 0 }; i < k_benchmark_trajectory_count; ++i)
+        {
+            u32 const h0{ hash_u32(i * 2 + 0) };
+            u32 const h1{ hash_u32(i * 2 + 1) };
+
+            g_benchmark_trajectories[i] = benchmark_trajectory{
+                vec2<fixed16_16>{
+                    fixed16_16{ static_cast<i16>(16 + ((h0 & 0xFFFF) % (k_player_collision_map_width  - 32))) },
+                    fixed16_16{ static_cast<i16>(16 + ((h0 >> 16)    % (k_player_collision_map_height - 32))) }
+                },
+                vec2<fixed16_16>{
+                    fixed16_16{ static_cast<i16>(static_cast<i32>(h1 & 31) - 16) },
+                    fixed16_16{ static_cast<i16>(static_cast<i32>((h1 >> 8) & 31) - 16) }
+                }
+            };
+        }
+    }
 
-        // Exit early if no visible movement.
-        if ((end_x == start_x) && (end_y == start_y)) return;
+    void init_benchmark_rays()
+    {
+        // Start anywhere in the world, and go in any direction.
+        for (u32 i{ 0 }; i < k_benchmark_ray_count; ++i)
+        {
+            u32 const h0{ hash_u32(0x10000 + (i * 2) + 0) };
+            u32 const h1{ hash_u32(0x10000 + (i * 2) + 1) };
 
-        // Get the difference between start and end position.
-        i16 diff_x = end_x - start_x;
-        i16 diff_y = end_y - start_y;
+            vec2<fixed16_16> dir{
+                fixed16_16{ static_cast<i16>(static_cast<i32>(h1 & 127) - 64) },
+                fixed16_16{ static_cast<i16>(static_cast<i32>((h1 >> 8) & 127) - 64) }
+            };
+            if ((dir.x == fixed16_16{ 0 }) && (dir.y == fixed16_16{ 0 })) dir.x = fixed16_16{ 1 };
+
+            g_benchmark_rays[i] = benchmark_trajectory{
+                vec2<fixed16_16>{
+                    fixed16_16{ static_cast<i16>((h0 & 0xFFFF) % k_world_width) },
+                    fixed16_16{ static_cast<i16>((h0 >> 16)    % k_world_height) }
+                },
+                dir * rsqrt(dot(dir, dir))
+            };
 
-        // Calculate the step directions on each axis and the absolutes of the differences.
-        i16 step_x = 1;
-        if (diff_x < 0)
-        {
-            diff_x = -diff_x;
-            step_x = -1;
+            g_benchmark_collision_rays[i] = ray{ g_benchmark_rays[i].pos, g_benchmark_rays[i].vel, fixed16_16{ 512 } };
         }
-        i16 step_y = 1;
-        if (diff_y < 0)
+    }
+
+    template<u32 TopLevel>
+    void benchmark_sdf_raycasts()
+    {
+        for (benchmark_trajectory const& ray : g_benchmark_rays)
         {
-            diff_y = -diff_y;
-            step_y = -1;
+            sdf_ray_hit hit;
+            if (sdf_raycast<TopLevel>(ray.pos, ray.vel, fixed16_16{ 512 }, hit)) g_benchmark_sink += hit.distance.raw();
         }
+    }
 
-        // Setup flags to track whether a collision occured on the x and/or y axis.
-        bool collide_x{ false };
-        bool collide_y{ false };
+    bool verify_raycasts()
+    {
+        // The 8-wide version must match the scalar one exactly.
+        if (!g_cpu_has_avx2) return true;
 
-        // Walk along the player collision map and check for collisions and handle them
-        u16 x = start_x, y = start_y;
-        for (u16 ix{ 0 }, iy{ 0 }; (ix < static_cast<u16>(diff_x)) || (iy < static_cast<u16>(diff_y));)
+        for (u32 i{ 0 }; i < k_benchmark_ray_count; i += 8)
         {
-            // Check if we want to take a step on the x-axis.
-            if ((((ix << 1) | 1Ui16) * static_cast<u16>(diff_y)) < (((iy << 1) | 1Ui16) * static_cast<u16>(diff_x)))
-            {
-                // Advance.
-                x += step_x;
-                ++ix;
+            u32 const mask{ raycast_8_avx2(g_benchmark_collision_rays + i, g_benchmark_collision_hits + i) };
 
-                // Check for collision.
-                if (g_player_collision_map[y][x])
-                {
-                    // Save that a collision occurred on the x-axis.
-                    collide_x = true;
+            for (u32 j{ 0 }; j < 8; ++j)
+            {
+                ray_hit expected;
+                bool const hit{ raycast(g_benchmark_collision_rays[i + j], expected) };
+                if (hit != ((mask & (1Ui32 << j)) != 0)) return false;
+                if (!hit) continue;
+
+                ray_hit const& actual{ g_benchmark_collision_hits[i + j] };
+                if ((actual.distance != expected.distance) ||
+                    (actual.normal.x != expected.normal.x) || (actual.normal.y != expected.normal.y)) return false;
+            }
+        }
 
-                    // Step back.
-                    x -= step_x;
+        return true;
+    }
 
-                    // Check if flying.
-                    if (g_player.flying)
+    bool verify_sdf_queries()
+    {
+        for (benchmark_trajectory const& ray : g_benchmark_rays)
+        {
+            // The pyramid march must stop in the same pixel as the full resolution one, as both visit every pixel the
+            // ray passes through near surfaces.
+            sdf_ray_hit full, pyramid;
+            bool const full_hit   { sdf_raycast<0>(ray.pos, ray.vel, fixed16_16{ 512 }, full) };
+            bool const pyramid_hit{ sdf_raycast(ray.pos, ray.vel, fixed16_16{ 512 }, pyramid) };
+            if (full_hit != pyramid_hit) return false;
+            if (full_hit && ((ifloor(full.pos.x) != ifloor(pyramid.pos.x)) || (ifloor(full.pos.y) != ifloor(pyramid.pos.y)))) return false;
+
+            // Go through every pixel around the ray's origin for the nearest solid pixel and the smallest distance.
+            i32 const x{ ifloor(ray.pos.x) };
+            i32 const y{ ifloor(ray.pos.y) };
+            vec4<i32> const region{ x - 32, y - 32, x + 32, y + 32 };
+
+            u32 nearest_d2{ (64 * 64) + 1 };
+            i32 clearance { 0x7FFF };
+            for (i32 py{ max(y - 64, 0) }; py <= min(y + 64, static_cast<i32>(k_world_height) - 1); ++py)
+            {
+                for (i32 px{ max(x - 64, 0) }; px <= min(x + 64, static_cast<i32>(k_world_width) - 1); ++px)
+                {
+                    if (g_game_world_collision_map[py][px])
                     {
-                        // Reverse x direction and reduce speed by half.
-                        step_x = -step_x;
-                        g_player.vel.x = -g_player.vel.x / 2;
+                        nearest_d2 = min(nearest_d2, static_cast<u32>(((px - x) * (px - x)) + ((py - y) * (py - y))));
                     }
-                    else
+
+                    if ((px >= region.x) && (px < region.z) && (py >= region.y) && (py < region.w))
                     {
-                        // Stop stepping along the x-axis and set horizontal velocity to 0.
-                        diff_x = ix;
-                        g_player.vel.x = fixed16_16{ 0 };
+                        clearance = min(clearance, static_cast<i32>(ifloor(g_game_world_distance_field[py][px])));
                     }
                 }
-
-                // Check if we will be flying.
-                if (!g_player.flying && !g_player_collision_map[y + 1][x])
-                {
-                    //Update the state to flying
-                    g_player.flying  = true;
-                    g_player.sliding = false;
-                }
             }
-            // We want to take a step on the y-axis.
-            else
+
+            // Ties may find a different pixel, but never one further away.
+            vec2<u16> surface;
+            bool const found{ sdf_nearest_surface(ray.pos, 64, surface) };
+            if (found != (nearest_d2 <= (64 * 64))) return false;
+            if (found)
             {
-                // Advance.
-                y += step_y;
-                ++iy;
+                i32 const dx{ static_cast<i32>(surface.x) - x };
+                i32 const dy{ static_cast<i32>(surface.y) - y };
+                if (!g_game_world_collision_map[surface.y][surface.x] || (static_cast<u32>((dx * dx) + (dy * dy)) != nearest_d2)) return false;
+            }
 
-                // Check for collision.
-                if (g_player_collision_map[y][x])
-                {
-                    // Save that a collision occurred on the y-axis.
-                    collide_y = true;
+            if (sdf_region_clearance(region) != clearance) return false;
+        }
 
-                    // Check if we're moving up.
-                    if (step_y < 0)
-                    {
-                        // Step backwards.
-                        y += 1;
+        return true;
+    }
 
-                        // Stop stepping along the y-axis and set vertical velocity to 0.
-                        diff_y = iy;
-                        g_player.vel.y = fixed16_16{ 0 };
-                    }
-                    else
-                    {
-                        // We are not flying anymore, unless sliding causes us to fall off an edge.
-                        g_player.flying = false;
+    // Whether 'result' is 'numerator / denominator' rounded the given way.
+    bool is_rounded_quotient(i64 numerator, i32 denominator, i32 result, fixed_rounding rounding)
+    {
+        i64 const error    { numerator - __emul(result, denominator) };
+        i64 const magnitude{ (denominator < 0) ? -static_cast<i64>(denominator) : static_cast<i64>(denominator) };
+        i64 const twice    { (error < 0) ? -(error + error) : (error + error) };
 
-                        // Check if it's possible to slide left (We only slide off edges if we are already sliding).
-                        if (!g_player_collision_map[y][x - 1] && (g_player_collision_map[y + 1][x - 1] || g_player.sliding))
-                        {
-                            // Although technically not a collision on the x-axis, we are adjusting the coordinate so
-                            // pretend that a collision occurred on the x-axis.
-                            collide_x = true;
+        switch (rounding)
+        {
+        case fixed_rounding::floor:
+            // Short of the next step, on the side of the divisor.
+            return (twice < (magnitude + magnitude)) && ((error == 0) || ((error < 0) == (denominator < 0)));
 
-                            // Move to the left.
-                            x -= 1;
-                            ++ix;
+        case fixed_rounding::zero:
+            // Short of the next step, on the side of the dividend.
+            return (twice < (magnitude + magnitude)) && ((error == 0) || ((error < 0) == (numerator < 0)));
 
-                            // Check if we will be flying.
-                            if (!g_player_collision_map[y + 1][x])
-                            {
-                                // Add some horizontal velocity as we fly off.
-                                g_player.vel.x = -g_player.vel.y / 2;
+        case fixed_rounding::nearest:
+            // Within half a step, and ties go away from zero, which leaves the error on the other side of the dividend.
+            return (twice < magnitude) || ((twice == magnitude) && ((error < 0) != (numerator < 0)));
+        }
 
-                                // Update the state to flying.
-                                g_player.flying  = true;
-                                g_player.sliding = false;
-                            }
-                            else
-                            {
-                                // Update the state to sliding.
-                                g_player.sliding = true;
-                            }
-                        }
-                        // Check if it's possible to slide right (We only slide off edges if we are already sliding).
-                        else if (!g_player_collision_map[y][x + 1] && (g_player_collision_map[y + 1][x + 1] || g_player.sliding))
-                        {
-                            // Although technically not a collision on the x-axis, we are adjusting the coordinate so
-                            // pretend that a collision occurred on the x-axis.
-                            collide_x = true;
+        return false;
+    }
 
-                            // Move to the right.
-                            x += 1;
-                            ++ix;
+    template<fixed_rounding Rounding>
+    bool verify_fixed_mul_div(fixed16_16 x, fixed16_16 y)
+    {
+        // The raw product is the exact one over 2¹⁶.
+        if (!is_rounded_quotient(__emul(x.raw(), y.raw()), 1 << 16, mul<Rounding>(x, y).raw(), Rounding)) return false;
 
-                            // Check if we will be flying.
-                            if (!g_player_collision_map[y + 1][x])
-                            {
-                                // Add some horizontal velocity as we fly off.
-                                g_player.vel.x = g_player.vel.y / 2;
+        // The raw quotient is the dividend times 2¹⁶ over the divisor. It must fit in 32 bits, that is |x| must be below
+        // |y| times 2¹⁵.
+        i64 const dividend{ static_cast<i64>(__ll_lshift(x.raw(), 16)) };
+        i64 const limit   { static_cast<i64>(__ll_lshift((y.raw() < 0) ? -static_cast<i64>(y.raw()) : y.raw(), 31)) };
+        if ((y.raw() == 0) || (dividend >= limit) || (dividend <= -limit)) return true;
 
-                                // Update the state to flying.
-                                g_player.flying  = true;
-                                g_player.sliding = false;
-                            }
-                            else
-                            {
-                                // Update the state to sliding.
-                                g_player.sliding = true;
-                            }
-                        }
-                        // We have landed on something flat.
-                        else
-                        {
-                            // Step back.
-                            y -= step_y;
+        return is_rounded_quotient(dividend, y.raw(), div<Rounding>(x, y).raw(), Rounding);
+    }
 
-                            // Stop both vertical and horizontal movement.
-                            g_player.vel.x = fixed16_16{ 0 };
-                            g_player.vel.y = fixed16_16{ 0 };
+    // The raw result 'r' of the raw value 'v' satisfies r² * v <= 2⁴⁸ < (r + 1)² * v. This is checked against the
+    // rounded down quotient of 2⁴⁸ and 'v' instead, which is the same test without going over 64 bits.
+    bool verify_fixed_rsqrt(u32 value)
+    {
+        u32 remainder;
+        u32 const high{ _udiv64(1Ui64 << 16, value, &remainder) };
+        u32 const low { _udiv64(static_cast<u64>(remainder) << 32, value, &remainder) };
+        u64 const quotient{ (static_cast<u64>(high) << 32) | low };
 
-                            // We are not sliding anymore.
-                            g_player.sliding = false;
+        u32 const r{ static_cast<u32>(rsqrt(fixed16_16::from_raw(static_cast<i32>(value))).raw()) };
+        return (__emulu(r, r) <= quotient) && (__emulu(r + 1, r + 1) > quotient);
+    }
 
-                            // Exit the loop.
-                            break;
-                        }
-                    }
-                }
-            }
+    bool verify_fixed_math()
+    {
+        // The other operands of the binary operations: the edge cases, and values of every magnitude.
+        i32 operands[48]{ 1, -1, 2, -2, 0x7FFF, -0x8000, 0xFFFF, 0x10000, -0x10000, 0x18000, -0x18000, 0x7FFFFFFF, -0x7FFFFFFF - 1 };
+        for (u32 i{ 13 }; i < countof(operands); ++i)
+        {
+            operands[i] = static_cast<i32>(hash_u32(i)) >> (i % 31);
         }
 
-        // Check if a collision occurred on the x-axis.
-        if (collide_x)
+        // The square root of whole numbers over its whole domain. The integer root 's' of 'n' satisfies
+        // s² <= n < (s + 1)².
+        for (u32 i{ 0 }; i <= 0xFFFF; ++i)
         {
-            // Save the adjusted x coordinate.
-            g_player.pos.x = fixed16_16{ static_cast<i16>(x) };
+            u64 const n{ static_cast<u64>(i) << 32 };
+            u32 const s{ static_cast<u32>(fixed16_16::sqrt(static_cast<u16>(i)).raw()) };
+            if ((__emulu(s, s) > n) || (__emulu(s + 1, s + 1) <= n)) return false;
         }
-        else
+
+        // The square root of fixed-point values over every fraction and whole number, then in steps over the rest.
+        if ((sqrt(fixed16_16{ 0 }).raw() != 0) || (sqrt(fixed16_16{ -1 }).raw() != 0)) return false;
+        for (u32 i{ 1 }; i < 0x80000000Ui32; i += (i <= 0xFFFF) ? 1 : 4'099)
         {
-            // Updated based on velocity without truncating.
-            g_player.pos.x += g_player.vel.x;
+            u64 const n{ static_cast<u64>(i) << 16 };
+            u32 const s{ static_cast<u32>(sqrt(fixed16_16::from_raw(static_cast<i32>(i))).raw()) };
+            if ((__emulu(s, s) > n) || (__emulu(s + 1, s + 1) <= n)) return false;
         }
 
-        // Check if a collision occured on the y-axis.
-        if (collide_y)
+        // The reciprocal of the square root over every fraction and every whole number. The rest of the range is too
+        // large to go through in a reasonable time, so we step through it with an odd stride, which keeps the low bits
+        // from repeating the same few patterns.
+        if (rsqrt(fixed16_16{ 0 }).raw() != 0x7FFFFFFF) return false;
+        for (u32 i{ 1 }; i <= 0xFFFF; ++i)
         {
-            // Save the adjusted y coordinate.
-            g_player.pos.y = fixed16_16{ static_cast<i16>(y) };
+            if (!verify_fixed_rsqrt(i) || !verify_fixed_rsqrt(i << 15)) return false;
         }
-        else
+        for (u32 i{ 0x10001 }; i < 0x80000000Ui32; i += 4'099)
         {
-            // Updated based on velocity without truncating.
-            g_player.pos.y += g_player.vel.y;
+            if (!verify_fixed_rsqrt(i)) return false;
         }
-    }
 
-
-
-    void pre_render_update()
-    {
-        static i16 jump_charge;
-
-#if 0
-        // TODO: Remove.
-        if (g_input.Space)
+        // Multiplication and division in every rounding mode, for every 16-bit raw value against every operand, both
+        // ways round.
+        for (u32 i{ 0 }; i <= 0xFFFF; ++i)
         {
-            g_particle_init = true;
-        }
-#endif
+            fixed16_16 const x{ fixed16_16::from_raw(static_cast<i16>(i)) };
 
-        // Check if player is holding the A button and not the D button.
-        if (g_input.A && !g_input.D)
-        {
-            g_player.facing = 1;
-        }
-        // Check if the player is holding the D button and not the A button.
-        else if (!g_input.A && g_input.D)
-        {
-            g_player.facing = 0;
+            for (i32 const operand : operands)
+            {
+                fixed16_16 const y{ fixed16_16::from_raw(operand) };
+
+                if (!verify_fixed_mul_div<fixed_rounding::floor  >(x, y) || !verify_fixed_mul_div<fixed_rounding::floor  >(y, x)) return false;
+                if (!verify_fixed_mul_div<fixed_rounding::nearest>(x, y) || !verify_fixed_mul_div<fixed_rounding::nearest>(y, x)) return false;
+                if (!verify_fixed_mul_div<fixed_rounding::zero   >(x, y) || !verify_fixed_mul_div<fixed_rounding::zero   >(y, x)) return false;
+            }
         }
-        // Otherwise we keep the current facing direction.
 
-        // Check that the player is not flying (jumping/falling) or sliding.
-        if (!g_player.flying && !g_player.sliding)
+        // Interpolation for every 't' from 0 to 1 between pairs of the operands, kept small enough that 'b - a' does not
+        // wrap. The step from 'a' is the exact one rounded to nearest, and both ends are hit exactly.
+        for (u32 a{ 0 }; a < countof(operands); ++a)
         {
-            // Zero out any previous movement.
-            g_player.vel.x = fixed16_16{ 0 };
-            g_player.vel.y = fixed16_16{ 0 };
+            fixed16_16 const from{ fixed16_16::from_raw(operands[a] >> 2) };
+            fixed16_16 const to  { fixed16_16::from_raw(operands[countof(operands) - 1 - a] >> 2) };
 
-            // Check that the player is not holding the jump key (W).
-            if (!g_input.W)
+            for (i32 t{ 0 }; t <= 0x10000; ++t)
             {
-                // Check if the player released the jump key.
-                if (jump_charge > 0)
-                {
-                    if (jump_charge > 8) jump_charge -= 8;
-                    else jump_charge = 0;
+                fixed16_16 const step{ lerp(from, to, fixed16_16::from_raw(t)) - from };
+                if (!is_rounded_quotient(__emul((to - from).raw(), t), 1 << 16, step.raw(), fixed_rounding::nearest)) return false;
+            }
 
-                    i16 const vel = ifloor(fixed16_16{ 6i16 } + ((fixed16_16{ 4045i16 } / 32767i16) * jump_charge));
-                    g_player.vel.x = (((fixed16_16{ 21063i16 } / 32767i16) - ((fixed16_16{ 375i16 } / 32767i16) * jump_charge)) * vel) * (static_cast<i16>(static_cast<i8>(g_input.D) - static_cast<i8>(g_input.A)));
-                    g_player.vel.y = -((fixed16_16{ 25101i16 } / 32767i16) + ((fixed16_16{ 191i16 } / 32767i16) * jump_charge)) * vel;
+            if ((lerp(from, to, fixed16_16{ 0 }) != from) || (lerp(from, to, fixed16_16{ 1 }) != to)) return false;
+        }
 
-                    g_player.flying = true;
+        // The vector versions must match the scalar one bit for bit, including when the products wrap around.
+        fixed16_16 const scales[]{
+            fixed16_16{ 0 }, fixed16_16{ 1 }, fixed16_16{ -1 }, fixed16_16::from_ratio(1, 2), fixed16_16::from_ratio(-99, 100),
+            fixed16_16::from_raw(1), fixed16_16::from_raw(-1), fixed16_16::from_raw(0x7FFFFFFF), fixed16_16::from_raw(-0x7FFFFFFF - 1)
+        };
+        for (fixed16_16 const scale : scales)
+        {
+            for (u32 i{ 0 }; i < k_benchmark_vector_count; ++i)
+            {
+                g_benchmark_vectors[i].x.raw() = static_cast<i32>(hash_u32(i * 2 + 0));
+                g_benchmark_vectors[i].y.raw() = static_cast<i32>(hash_u32(i * 2 + 1));
+                g_benchmark_deltas [i]         = g_benchmark_vectors[k_benchmark_vector_count - 1 - i];
+            }
 
-                    // Reset the jump charge.
-                    jump_charge = 0;
-                }
-                else
+            // An odd count, to cover the scalar tail as well.
+            u32 const count{ k_benchmark_vector_count - 3 };
+            vec2_scale_fn      const scale_fns[]     { scale_vec2_array_sse2,      scale_vec2_array_avx2 };
+            vec2_add_scaled_fn const add_scaled_fns[]{ add_scaled_vec2_array_sse2, add_scaled_vec2_array_avx2 };
+
+            for (u32 f{ 0 }; f < (g_cpu_has_avx2 ? 2Ui32 : 1Ui32); ++f)
+            {
+                __movsb(reinterpret_cast<u8*>(g_benchmark_expected), reinterpret_cast<u8 const*>(g_benchmark_deltas), sizeof(g_benchmark_expected));
+                scale_vec2_array_scalar(g_benchmark_expected, count, scale);
+                scale_fns[f](g_benchmark_deltas, count, scale);
+                for (u32 i{ 0 }; i < k_benchmark_vector_count; ++i)
                 {
-                    //Add horizontal movement if the player holds exclusively the left (A) key or the right (D) key
-                    g_player.vel.x += fixed16_16{ static_cast<i16>(static_cast<i8>(g_input.D) - static_cast<i8>(g_input.A)) * 2 };
+                    if ((g_benchmark_expected[i].x != g_benchmark_deltas[i].x) || (g_benchmark_expected[i].y != g_benchmark_deltas[i].y)) return false;
                 }
-            }
-            else
-            {
-                // TODO: Different animation for charging
 
-                ++jump_charge;
-                if (jump_charge > 35)
+                __movsb(reinterpret_cast<u8*>(g_benchmark_expected), reinterpret_cast<u8 const*>(g_benchmark_vectors), sizeof(g_benchmark_expected));
+                add_scaled_vec2_array_scalar(g_benchmark_expected, g_benchmark_deltas, count, scale);
+                add_scaled_fns[f](g_benchmark_vectors, g_benchmark_deltas, count, scale);
+                for (u32 i{ 0 }; i < k_benchmark_vector_count; ++i)
                 {
-                    jump_charge = 35;
+                    if ((g_benchmark_expected[i].x != g_benchmark_vectors[i].x) || (g_benchmark_expected[i].y != g_benchmark_vectors[i].y)) return false;
                 }
             }
         }
-        // Player is flying (jumping/falling).
-        else
-        {
-            // Apply gravity.
-            g_player.vel.y += k_gravity;
-        }
-
-        // Apply drag.
-        g_player.vel.y.raw() = (g_player.vel.y.raw() * 99) / 100;
-
-        // Apply some maximum fall speed.
-        if (g_player.vel.y > fixed16_16{ 7 })
-        {
-            g_player.vel.y = fixed16_16{ 7 };
-        }
 
-        // Move the player and perform collision tests.
-        collision_sweep_test();
+        return true;
+    }
 
-        // Move the camera to follow the player.
-        update_camera();
+#if G21_ENABLE_ROLLBACK
+    sim_state g_benchmark_rollback_start;
 
-#if 0
-        //  TODO: Move/Change this.
-        if (g_particle_init)
+    // The worst correction rollback allows for, every tick from k_rollback_max_ticks back simulated again.
+    void benchmark_rollback()
+    {
+        restore_sim_state(g_benchmark_rollback_start);
+        for (u32 t{ 0 }; t < k_rollback_max_ticks; ++t)
         {
-            emit_particles();
-            g_particle_init = false;
+            simulate_rollback_tick(t);
         }
-#endif
     }
 
-#if 0
-    // Particle simulation.
+    // The rollback self-check plays the same inputs twice from g_benchmark_rollback_start: once straight through, and
+    // once arriving as late as rollback allows, with every misprediction rolled back. Both have to end in the same
+    // state, byte for byte.
+    constexpr u32 k_rollback_check_ticks{ 600 };
 
-    void update_particles()
+    input_state get_rollback_check_input(u32 tick)
     {
-        glUseProgram(g_compute_particle_updater_program_id);
+        // No keys for the last few ticks, so that the predictions for the ticks still unconfirmed at the end are right.
+        input_state input{};
+        if ((tick + k_rollback_max_ticks) >= k_rollback_check_ticks) return input;
+
+        // Change the keys every few ticks, more often than rollback can hide.
+        u32 const h{ hash_u32(tick / 5) };
+        input.W      = (h & 1) != 0;
+        input.A      = (h & 2) != 0;
+        input.D      = (h & 4) != 0;
+        input.S      = (h & 8) != 0;
+        input.Space  = (h & 16) != 0;
+        input.W_held = static_cast<u16>(input.W ? ((h >> 8) % (k_input_subticks + 1)) : 0);
+        return input;
+    }
 
-        glUniform1i(0, g_particle_count);
-        
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, g_atomic_counter_buffer_id);
-        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &g_active_particles);
-        GLuint new_counter{ 0 };
-        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), nullptr, GL_DYNAMIC_DRAW);
-        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &new_counter);
-        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    bool verify_rollback()
+    {
+        restore_sim_state(g_benchmark_rollback_start);
+        for (u32 t{ 0 }; t < k_rollback_check_ticks; ++t)
+        {
+            g_sim.input = get_rollback_check_input(t);
+            pre_render_update();
+        }
 
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, g_particle_buffer_id); 
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, g_index_buffer_id);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, g_atomic_counter_buffer_id);
+        sim_state expected;
+        save_sim_state(expected);
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_RECTANGLE, g_gradient_map_texture_id);
+        restore_sim_state(g_benchmark_rollback_start);
+        __stosb(reinterpret_cast<u8*>(g_rollback_input_ticks), 0, sizeof(g_rollback_input_ticks));
+        g_rollback_tick            = 0;
+        g_rollback_prediction      = input_state{};
+        g_rollback_prediction_tick = 0;
 
-        glDispatchCompute((g_particle_count + (LOCAL_SIZE_X - 1)) / LOCAL_SIZE_X, 1, 1);
-        glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT);
+        constexpr u32 latency{ k_rollback_max_ticks - 1 };
 
-        glBindTexture(GL_TEXTURE_RECTANGLE, 0);
+        u32 rollbacks{ 0 };
+        for (u32 t{ 0 }; t < k_rollback_check_ticks; ++t)
+        {
+            u32 rollback_from{ t };
+            if (t >= latency)
+            {
+                confirm_rollback_input(rollback_packet{ t - latency, get_rollback_check_input(t - latency) }, t, rollback_from);
+            }
 
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, 0);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, 0);
-        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, 0);
+            if (rollback_from < t) ++rollbacks;
+            advance_rollback(rollback_from);
+        }
 
-        glUseProgram(0);
+        u8 const* const a{ reinterpret_cast<u8 const*>(&expected) };
+        u8 const* const b{ reinterpret_cast<u8 const*>(&g_sim) };
+        for (u32 i{ 0 }; i < sizeof(sim_state); ++i)
+        {
+            if (a[i] != b[i]) return false;
+        }
+
+        // A check that never rolled back would pass without testing anything.
+        return rollbacks != 0;
     }
+#endif
 
-    void post_render_update()
+    // Pushes 'count' sprites spread over every layer and depth, then sorts them and builds their vertices.
+    void benchmark_sprite_batch(u32 count)
     {
-        // There is no need to worry about making sure this map uses the most recent data.
-        // It's more important that we don't delay the rendering.
-        if (update_particle_pathfinder_vector_map())
+        for (u32 i{ 0 }; i < count; ++i)
         {
-            compute_gradient_map();
-            upload_gradient_map ();
+            u32 const h{ hash_u32(i) };
+            vec2<fixed16_16> const pos{ fixed16_16{ static_cast<i16>(h & 511) }, fixed16_16{ static_cast<i16>((h >> 9) & 255) } };
+
+            push_sprite(pos, vec2<u8>{ 16, 16 }, static_cast<u16>(h & 3), static_cast<sprite_layer>((h >> 17) & 3), static_cast<u16>(h >> 19));
         }
 
-        update_particles();
+        build_sprite_vertices();
+        g_sprites_count = 0;
     }
 
-    __forceinline void render_particles()
+#if G21_ENABLE_PARTICLES
+    void benchmark_gradient_map()
+    {
+        for (bool& dirty : g_flow_tile_dirty) dirty = true;
+
+        compute_gradient_map();
+    }
+
+    // The particles as emitted, so that every sample updates the same ones.
+    cs_particle g_benchmark_particles[k_max_particle_count];
+
+    void reset_benchmark_particles()
+    {
+        __movsb(reinterpret_cast<u8*>(g_cpu_particles), reinterpret_cast<u8 const*>(g_benchmark_particles), sizeof(g_cpu_particles));
+    }
+#endif
+
+    constexpr benchmark_case k_benchmark_cases[]
     {
-        // Check if there are any particles to render.
-        if (g_active_particles > 0)
+        // The precompute steps, in the order they depend on each other.
+        benchmark_case{ "compute_game_world_collision_map",    []() { compute_game_world_collision_map(); },     1 },
+        benchmark_case{ "compute_collision_tile_map",          []() { compute_collision_tile_map(); },           1 },
+        benchmark_case{ "compute_player_collision_map",        []() { compute_player_collision_map(); },         1 },
+        benchmark_case{ "compute_game_world_distance_field_0", []() { compute_game_world_distance_field(0); },    1 },
+        benchmark_case{ "compute_game_world_distance_field_1", []() { compute_game_world_distance_field(1); },    1 },
+        benchmark_case{ "build_distance_field_pyramid",        []() { build_distance_field_pyramid(); },         1 },
+        benchmark_case{ "compute_light_distance_field",        []() { compute_light_distance_field(); },         1 },
+        benchmark_case{ "compute_white_noise_texture",         []() { compute_white_noise_texture(); },          1 },
+        benchmark_case{ "compute_fractal_noise_texture",       []() { compute_fractal_noise_texture(); },        1 },
+        benchmark_case{ "compute_background_texture",          []() { compute_background_texture(g_benchmark_background_texture); }, 1 },
+
+        // The per-tick work, the times are per pass over all k_benchmark_trajectory_count trajectories and per batch of
+        // k_benchmark_sprite_count sprites respectively.
+        benchmark_case{ "collision_sweep_test", []()
         {
-            glUseProgram(g_render_program_id);
+            for (benchmark_trajectory const& trajectory : g_benchmark_trajectories)
+            {
+                g_sim.player.pos    = trajectory.pos;
+                g_sim.player.vel    = trajectory.vel;
+                g_sim.player.flying = true;
+                collision_sweep_test();
+            }
+        }, 16 },
+        benchmark_case{ "sprite_batch_10000", []() { benchmark_sprite_batch(k_benchmark_sprite_count); }, 16 },
 
-            glUniform4i(0, g_camera.x, g_camera.y, camera::k_width, camera::k_height);
+        // The sprite stress test, the batcher has to take 100k sprites a frame. Sorting them and building their
+        // vertices gets a quarter of the 16.7ms.
+        benchmark_case{ "sprite_batch_100000", []() { benchmark_sprite_batch(k_benchmark_sprite_stress_count); }, 4, 4'166'666 },
 
-            glBindBuffer(GL_ARRAY_BUFFER, g_particle_buffer_id);
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_index_buffer_id);
+        // The distance field queries, the times are per batch of k_benchmark_ray_count queries.
+        benchmark_case{ "sdf_raycast_full_resolution", []() { benchmark_sdf_raycasts<0>(); }, 4 },
+        benchmark_case{ "sdf_raycast_pyramid",         []() { benchmark_sdf_raycasts<k_sdf_pyramid_level_count - 1>(); }, 4 },
+        benchmark_case{ "sdf_nearest_surface_64", []()
+        {
+            for (benchmark_trajectory const& ray : g_benchmark_rays)
+            {
+                vec2<u16> surface;
+                if (sdf_nearest_surface(ray.pos, 64, surface)) g_benchmark_sink += surface.x;
+            }
+        }, 4 },
+        benchmark_case{ "sdf_region_clearance_64x64", []()
+        {
+            for (benchmark_trajectory const& ray : g_benchmark_rays)
+            {
+                i32 const x{ ifloor(ray.pos.x) };
+                i32 const y{ ifloor(ray.pos.y) };
+                g_benchmark_sink += static_cast<u32>(sdf_region_clearance(vec4<i32>{ x - 32, y - 32, x + 32, y + 32 }));
+            }
+        }, 4 },
 
-            glVertexAttribIPointer(0, 2, GL_INT, sizeof(cs_particle), nullptr);
+        // The collision raycasts, the times are per batch of k_benchmark_ray_count rays.
+        benchmark_case{ "raycast", []()
+        {
+            for (u32 i{ 0 }; i < k_benchmark_ray_count; ++i)
+            {
+                (void)raycast(g_benchmark_collision_rays[i], g_benchmark_collision_hits[i]);
+            }
+        }, 4, k_benchmark_raycast_budget },
+        benchmark_case{ "raycast_8", []()
+        {
+            for (u32 i{ 0 }; i < k_benchmark_ray_count; i += 8)
+            {
+                g_benchmark_sink += raycast_8(g_benchmark_collision_rays + i, g_benchmark_collision_hits + i);
+            }
+        }, 4, k_benchmark_raycast_budget },
 
-            glDrawElements(GL_POINTS, g_active_particles, GL_UNSIGNED_INT, nullptr);
+        // The lighting of the first frame on the CPU, in one go and in slices of a millisecond.
+        benchmark_case{ "gather_visible_lights", []() { gather_visible_lights(); }, 64 },
+        benchmark_case{ "light_reference_frame", []()
+        {
+            begin_light_reference(g_benchmark_background_texture);
+            while (!update_light_reference(0));
+        }, 1 },
+        benchmark_case{ "light_reference_frame_1ms_slices", []()
+        {
+            begin_light_reference(g_benchmark_background_texture);
+            while (!update_light_reference(1000));
+        }, 1 },
 
-            glBindBuffer(GL_ARRAY_BUFFER, 0);
-            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        // The fixed-point batch operations, the last one being the fastest the CPU has.
+        benchmark_case{ "add_scaled_vec2_4096_scalar", []()
+        {
+            add_scaled_vec2_array_scalar(g_benchmark_vectors, g_benchmark_deltas, k_benchmark_vector_count, k_benchmark_scale);
+        }, 64 },
+        benchmark_case{ "add_scaled_vec2_4096_sse2", []()
+        {
+            add_scaled_vec2_array_sse2(g_benchmark_vectors, g_benchmark_deltas, k_benchmark_vector_count, k_benchmark_scale);
+        }, 64 },
+        benchmark_case{ "add_scaled_vec2_4096_best", []()
+        {
+            (g_cpu_has_avx2 ? add_scaled_vec2_array_avx2 : add_scaled_vec2_array_sse2)(g_benchmark_vectors, g_benchmark_deltas, k_benchmark_vector_count, k_benchmark_scale);
+        }, 64 },
 
-            glUseProgram(0);
-        }
-    }
+#if G21_ENABLE_TRACE
+        // Empty trace zones, the time is per batch of k_benchmark_trace_zone_count zones. A zone is to cost under 20ns.
+        benchmark_case{ "trace_zone_1000", []()
+        {
+            for (u32 i{ 0 }; i < k_benchmark_trace_zone_count; ++i)
+            {
+                G21_TRACE_ZONE("benchmark");
+            }
+        }, 16, k_benchmark_trace_zone_count * 20 },
 #endif
 
-    // Rendering.
+#if G21_ENABLE_ROLLBACK
+        // A full rollback comes on top of the tick and the frame it happens in, so it only gets 100us of the 16.7ms.
+        benchmark_case{ "rollback_resimulate_8", []() { benchmark_rollback(); }, 16, 100'000 },
+#endif
 
-    __forceinline void render_background()
-    {
-        glUseProgram(g_background_renderer_program_id);
-        
-        glUniform4i(0, g_camera.x, g_camera.y, camera::k_width, camera::k_height);
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_RECTANGLE, g_background_texture_id);
-        glDrawArrays(GL_TRIANGLES, 0, 3);
-    }
+#if G21_ENABLE_PARTICLES
+        // The per-tick particle work on the job system, limited to 1 to 8 threads to show the scaling, leaving out the
+        // counts the machine does not have. The gradient map is recomputed in full, and every sample updates the
+        // particles as they were first emitted.
+        benchmark_case{ "emit_particles_cpu",       []() { emit_particles(); },                1 },
+        benchmark_case{ "compute_gradient_map_1",   []() { benchmark_gradient_map(); },        1, 0, nullptr,                   1 },
+        benchmark_case{ "compute_gradient_map_2",   []() { benchmark_gradient_map(); },        1, 0, nullptr,                   2 },
+        benchmark_case{ "compute_gradient_map_4",   []() { benchmark_gradient_map(); },        1, 0, nullptr,                   4 },
+        benchmark_case{ "compute_gradient_map_8",   []() { benchmark_gradient_map(); },        1, 0, nullptr,                   8 },
+        benchmark_case{ "simulate_particles_cpu_1", []() { simulate_particles_cpu(); },        1, 0, reset_benchmark_particles, 1 },
+        benchmark_case{ "simulate_particles_cpu_2", []() { simulate_particles_cpu(); },        1, 0, reset_benchmark_particles, 2 },
+        benchmark_case{ "simulate_particles_cpu_4", []() { simulate_particles_cpu(); },        1, 0, reset_benchmark_particles, 4 },
+        benchmark_case{ "simulate_particles_cpu_8", []() { simulate_particles_cpu(); },        1, 0, reset_benchmark_particles, 8 },
+
+        // The CPU update of all k_max_particle_count particles on every thread there is, which has to fit in a tick at
+        // 60Hz to keep up. The upload to the GPU that follows it in update_particles_cpu() is left out, as the
+        // benchmarks run without OpenGL.
+        benchmark_case{ "update_particles_cpu_1m",  []() { simulate_particles_cpu(); },        1, 16'666'666, reset_benchmark_particles },
+#endif
+    };
 
-    __forceinline void render_framebuffer()
+    u32 median_of(u32* values, u32 count)
     {
-        glViewport(g_viewport.x, g_viewport.y, g_viewport.z, g_viewport.w);
+        // Insertion sort, there are only a few samples.
+        for (u32 i{ 1 }; i < count; ++i)
+        {
+            u32 const value{ values[i] };
 
-        glUseProgram(g_upscaler_program_id);
+            u32 j{ i };
+            for (; (j > 0) && (values[j - 1] > value); --j)
+            {
+                values[j] = values[j - 1];
+            }
+            values[j] = value;
+        }
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, g_framebuffer_texture_id);
-        glDrawArrays(GL_TRIANGLES, 0, 3);
+        return values[count / 2];
     }
 
-    void render()
+    __declspec(noreturn) void run_benchmarks()
     {
-        // Bind the framebuffer we use to render to our internal fixed resolution.
-        glBindFramebuffer(GL_FRAMEBUFFER, g_framebuffer_id);
-        glViewport(0, 0, camera::k_width, camera::k_height);
+        static char output[8192];
 
-        // Render the background.
-        glBlendFunc(GL_ONE, GL_ZERO);
-        render_background();
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
 
-        // Render the sprites.
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        push_sprite(vec2<fixed16_16>{ g_player.pos.x - 2, g_player.pos.y - 15 }, vec2<u8>{ 16, 16 }, 1);
-        push_sprite(vec2<fixed16_16>{ g_player.pos.x - 2, g_player.pos.y +  1 }, vec2<u8>{ 16, 16 }, (g_player.facing ? 3 : 2));
-        render_sprites();
+        // Before the workers start, so that they register. The zones are recorded but never written out.
+        #if G21_ENABLE_TRACE
+        init_trace();
+        #endif
 
-        // Unbind the framebuffer, in preparation for upscaling the image to the target resolution.
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        init_sprite_storage();
+        init_benchmark_trajectories();
+        init_fixed_math();
+        init_benchmark_rays();
+        init_workers();
+        init_lights();
 
-        // Upscale by rendering our framebuffer to the default framebuffer.
-        render_framebuffer();
+        if (!verify_fixed_math()) fail_self_check("The fixed-point self-check failed.\n");
 
-#if 0
-        // Render the particles at full resolution.
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-        render_particles();
-#endif
+        compute_game_world_collision_map();
+        compute_collision_tile_map();
+        if (!verify_raycasts()) fail_self_check("The raycast self-check failed.\n");
 
-        // Present.
-        SwapBuffers(g_hDC);
-        //glFinish();
-    }
+        compute_game_world_distance_field(false);
+        compute_game_world_distance_field(true);
+        build_distance_field_pyramid();
+        if (!verify_sdf_queries()) fail_self_check("The distance field query self-check failed.\n");
 
-    // Game loop.
+        #if G21_ENABLE_ROLLBACK
+        compute_player_collision_map();
+        save_sim_state(g_benchmark_rollback_start);
+        if (!verify_rollback()) fail_self_check("The rollback self-check failed.\n");
+        #endif
 
-    __declspec(noreturn, noinline) void loop()
-    {
-        G21_DEBUG_PRINT("#DEBUG: Entering main loop.\n");
+        #if G21_ENABLE_PARTICLES
+        // Set up the particles and the flow field the way the game has them after the first tick: the emitter spreads
+        // the particles out with the white noise, and the field gets pages around the player and wherever the particles
+        // are, which is what the gradient map works through.
+        compute_white_noise_texture();
+        compute_fractal_noise_texture();
+        init_flow_field();
+        compute_particle_collision_map();
 
-        // Pin the thread to core #2.
-        SetThreadAffinityMask(GetCurrentThread(), 2);
+        emit_particles();
+        __movsb(reinterpret_cast<u8*>(g_benchmark_particles), reinterpret_cast<u8 const*>(g_cpu_particles), sizeof(g_benchmark_particles));
 
-        // Get the frequency of the counter we use to measure the elapsed time.
-        auto const clock_frequency{ []() -> u64
-        {
-            LARGE_INTEGER result;
-            QueryPerformanceFrequency(&result);
-            return static_cast<u64>(result.QuadPart);
-        }() };
-        
-        // Initialize our clock.
-        u64 acc{ 0 };
-        LARGE_INTEGER old_time, new_time;
-        QueryPerformanceCounter(&old_time);
+        simulate_particles_cpu();
+        update_particle_pathfinder_vector_map();
+        compute_gradient_map();
+        reset_benchmark_particles();
+        #endif
 
-        // Loop until window is closed (the event handler calls ExitProcess).
-        while (true)
+        bool over_budget  { false };
+        u32  single_thread{ 0 }; // The median of the last case run on one thread, to compare the next ones against.
+
+        char* p{ append_text(output, g_cpu_has_avx2 ? "{\"unit\":\"ns\",\"simd\":\"avx2\"" : "{\"unit\":\"ns\",\"simd\":\"sse2\"") };
+        p = append_text(p, ",\"workers\":");
+        p = append_u32 (p, g_worker_count);
+        p = append_text(p, ",\"cases\":[");
+        for (u32 c{ 0 }; c < countof(k_benchmark_cases); ++c)
         {
-            // Check if there are any window messages to handle.
-            if (MSG msg; PeekMessageA(&msg, nullptr, 0, 0, PM_REMOVE) != 0)
+            benchmark_case const& bench{ k_benchmark_cases[c] };
+
+            p = append_text(p, (c == 0) ? "\n" : ",\n");
+            p = append_text(p, "{\"name\":\"");
+            p = append_text(p, bench.name);
+
+            // A case asking for more threads than there are workers would only repeat the largest one under its name.
+            if (bench.threads > g_worker_count)
             {
-                // Handle the message.
-                TranslateMessage(&msg);
-                DispatchMessageA(&msg);
+                p = append_text(p, "\",\"skipped\":true}");
+                continue;
             }
-            else
+
+            g_job_thread_limit = (bench.threads != 0) ? bench.threads : k_max_worker_count;
+
+            for (u32 i{ 0 }; i < k_benchmark_warmup_count; ++i)
             {
-                // Get the elapsed time.
-                QueryPerformanceCounter(&new_time);
-                acc += u64_multiply_by_60(static_cast<u64>(new_time.QuadPart - old_time.QuadPart));
-                old_time = new_time;
+                if (bench.reset != nullptr) bench.reset();
+                bench.run();
+            }
 
-                // Check if enough time has passed for 1 frame.
-                if (acc >= clock_frequency)
-                {
-                    acc -= clock_frequency;
+            // Time the samples, in nanoseconds per iteration.
+            u32 samples[k_benchmark_sample_count];
+            for (u32& sample : samples)
+            {
+                if (bench.reset != nullptr) bench.reset();
 
-                    pre_render_update();
+                LARGE_INTEGER start, end;
+                QueryPerformanceCounter(&start);
 
-                    render();
+                for (u32 i{ 0 }; i < bench.iterations; ++i) bench.run();
 
-                    //post_render_update();
-                }
-                
-                // Yield the rest of our CPU timeslice.
-                //Sleep(0);
+                QueryPerformanceCounter(&end);
+
+                u32 const ns{ ticks_to_nanoseconds(static_cast<u32>(end.QuadPart - start.QuadPart), static_cast<u32>(frequency.QuadPart)) };
+                sample = ns / bench.iterations;
             }
-        }
-    }
 
-    // SetProcessDPIAware.
+            u32 const median{ median_of(samples, k_benchmark_sample_count) };
+            u32 const min   { samples[0] };
 
-    __forceinline void set_process_dpi_aware()
-    {
-        G21_DEBUG_PRINT("#DEBUG: Checking for SetProcessDPIAware.\n");
+            // The median absolute deviation, as a measure of the noise.
+            for (u32& sample : samples)
+            {
+                sample = (sample > median) ? (sample - median) : (median - sample);
+            }
+            u32 const mad{ median_of(samples, k_benchmark_sample_count) };
 
-        // Load the user32 dll.
-        HMODULE const user32_dll{ LoadLibraryA("user32.dll") };
+            g_job_thread_limit = k_max_worker_count;
 
-        #ifdef _DEBUG
-        // Might as well test it in debug mode.
-        if (user32_dll == nullptr)
-        {
-            G21_DEBUG_PRINT("#DEBUG: user32.dll is missing???\n");
-            __fastfail(FAST_FAIL_FATAL_APP_EXIT);
-        }
-        #else
-        // This really shouldn't be null. Silence the analyser in release mode.
-        __analysis_assume(user32_dll != nullptr);
-        #endif
+            if ((bench.budget != 0) && (median > bench.budget)) over_budget = true;
 
-        // Check for the presence of SetProcessDPIAware.
-        auto const proc = reinterpret_cast<BOOL(*)()>(GetProcAddress(user32_dll, "SetProcessDPIAware"));
-        if (proc)
-        {
-            // Call it.
-            G21_DEBUG_PRINT("#DEBUG: Invoking SetProcessDPIAware.\n");
-            proc();
-        }
-        else
-        {
-            G21_DEBUG_PRINT("#DEBUG: SetProcessDPIAware not found, ignoring.\n");
+            p = append_text(p, "\",\"iterations\":");
+            p = append_u32 (p, bench.iterations);
+            p = append_text(p, ",\"samples\":");
+            p = append_u32 (p, k_benchmark_sample_count);
+            p = append_text(p, ",\"median\":");
+            p = append_u32 (p, median);
+            p = append_text(p, ",\"mad\":");
+            p = append_u32 (p, mad);
+            p = append_text(p, ",\"min\":");
+            p = append_u32 (p, min);
+
+            // The scaling, as how many times faster than on one thread, in thousandths.
+            if (bench.threads == 1)
+            {
+                single_thread = median;
+            }
+            else if ((bench.threads > 1) && (single_thread != 0) && (median != 0))
+            {
+                // Saturate rather than let the quotient overflow 32 bits.
+                u64 const scaled{ __emulu(single_thread, 1000) };
+                u32       remainder;
+
+                p = append_text(p, ",\"speedup_permille\":");
+                p = append_u32 (p, ((scaled >> 32) >= median) ? 0xFFFFFFFFUi32 : _udiv64(scaled, median, &remainder));
+            }
+
+            p = append_text(p, "}");
         }
+        p = append_text(p, "\n]}\n");
 
-        //FreeLibrary(user32_dll);
+        DWORD written;
+        WriteFile(GetStdHandle(STD_OUTPUT_HANDLE), output, static_cast<DWORD>(p - output), &written, nullptr);
+
+        write_report_file("benchmark.json", output, p);
+
+        if (over_budget) fail_self_check("A benchmark went over its budget.\n");
+
+        ExitProcess(0);
     }
+#endif
 }
 
 // Our program entry-point.
@@ -3060,3 +9590,15 @@ extern "C" __declspec(noreturn) void __cdecl _main()
     // Run the game loop (Does not return).
     loop();
 }
+
+#if G21_BENCHMARK
+// The entry-point of the benchmarks, see build.bat. The game is built along with them, so that everything it uses is
+// still referenced, but the linker leaves it out of the executable.
+extern "C" __declspec(noreturn) void __cdecl _benchmark_main()
+{
+    G21_DEBUG_INIT;
+
+    // Time the precompute and per-tick functions and exit (Does not return).
+    run_benchmarks();
+}
+#endif